@@ -0,0 +1,164 @@
+/* A microbenchmark of the crc32c that is used for header and data digests.
+ * It checks every implementation of the library that this cpu supports
+ * against a plain bytewise table lookup, and prints the throughput of each
+ * for the sizes of a header, a block and a few data segments.
+ *
+ * The library has a slicing by eight table lookup and uses the crc32
+ * instructions of the cpu where they are available, SSE4.2 on x86 and the
+ * CRC extension on ARMv8. Those are static, so lib/crc32c.c is built in
+ * here instead of linking the library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "../lib/crc32c.c"
+
+#define BUFFER_SIZE	(1024 * 1024)
+/* how many bytes to digest for every measurement */
+#define TOTAL_BYTES	(256 * 1024 * 1024)
+
+static uint32_t bytewise_table[256];
+
+static void
+bytewise_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++) {
+			crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+		}
+		bytewise_table[i] = crc;
+	}
+}
+
+static uint32_t
+bytewise_update(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	while (len-- > 0) {
+		crc = (crc >> 8) ^ bytewise_table[(crc ^ *buf++) & 0xff];
+	}
+	return crc;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct impl {
+	const char *name;
+	uint32_t (*update)(uint32_t crc, const unsigned char *buf, size_t len);
+	/* the bytewise one is slow, digest less with it */
+	size_t divisor;
+};
+
+int main(int argc _U_, char *argv[] _U_)
+{
+	struct impl impls[4];
+	size_t sizes[] = { 48, 512, 4096, 65536, BUFFER_SIZE };
+	unsigned char *buf;
+	volatile uint32_t sink = 0;
+	size_t total, off, len;
+	double start;
+	unsigned int i, j, k, count = 0;
+
+	buf = malloc(BUFFER_SIZE + 16);
+	if (buf == NULL) {
+		printf("failed to allocate buffer\n");
+		exit(10);
+	}
+	srand(1);
+	for (i = 0; i < BUFFER_SIZE + 16; i++) {
+		buf[i] = rand();
+	}
+	bytewise_init();
+
+	/* sets up the tables of crc32c_sw and picks what the library uses */
+	pthread_once(&crc32c_once, crc32c_init);
+
+	impls[count].name    = "bytewise";
+	impls[count].update  = bytewise_update;
+	impls[count].divisor = 8;
+	count++;
+	impls[count].name    = "sw";
+	impls[count].update  = crc32c_sw;
+	impls[count].divisor = 1;
+	count++;
+#ifdef HAVE_CRC32C_SSE42
+	if (__builtin_cpu_supports("sse4.2")) {
+		impls[count].name    = "sse42";
+		impls[count].update  = crc32c_sse42;
+		impls[count].divisor = 1;
+		count++;
+	}
+#endif
+#ifdef HAVE_CRC32C_ARMV8
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		impls[count].name    = "armv8";
+		impls[count].update  = crc32c_armv8;
+		impls[count].divisor = 1;
+		count++;
+	}
+#endif
+
+	/* the check value of the crc32c from rfc3720 */
+	if (crc32c((char *)"123456789", 9) != 0xe3069283) {
+		printf("crc32c of \"123456789\" is %08lx, expected e3069283\n",
+		       crc32c((char *)"123456789", 9));
+		exit(10);
+	}
+	/* and every implementation the same as the table lookup at
+	 * unaligned offsets
+	 */
+	for (k = 0; k < 10000; k++) {
+		off = rand() % 16;
+		len = rand() % 5000;
+		for (j = 1; j < count; j++) {
+			if (impls[j].update(0xffffffff, buf + off, len)
+			    != bytewise_update(0xffffffff, buf + off, len)) {
+				printf("crc32c %s mismatch at offset %zu "
+				       "length %zu\n", impls[j].name, off, len);
+				exit(10);
+			}
+		}
+	}
+	for (j = 1; j < count; j++) {
+		if (impls[j].update == crc32c_impl) {
+			printf("the library uses %s\n", impls[j].name);
+		}
+	}
+
+	printf("%-9s", "bytes");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		printf(" %10zu", sizes[i]);
+	}
+	printf("   (GB/s)\n");
+
+	for (j = 0; j < count; j++) {
+		printf("%-9s", impls[j].name);
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			total = 0;
+			start = now();
+			while (total < TOTAL_BYTES / impls[j].divisor) {
+				sink ^= impls[j].update(0xffffffff, buf,
+							sizes[i]);
+				total += sizes[i];
+			}
+			printf(" %10.2f", total / (now() - start) / 1e9);
+		}
+		printf("\n");
+	}
+
+	free(buf);
+	return 0;
+}
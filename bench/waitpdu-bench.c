@@ -0,0 +1,163 @@
+/* A microbenchmark of finding the pdu a reply from the target is for.
+ * The pdus that wait for a reply are kept in a hash table by ITT. This
+ * keeps queue depth commands in flight, completes them in random order
+ * the way a target does, and prints the cost of the lookup and of putting
+ * the pdu of the next command in its place. For comparison it does the
+ * same with a list that is walked from the head.
+ * No target is needed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "slist.h"
+
+#define ITERATIONS	1000000
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* cheap enough not to drown the lookup */
+static uint32_t
+next_random(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static struct iscsi_pdu *
+new_pdu(struct iscsi_context *iscsi)
+{
+	struct iscsi_pdu *pdu;
+
+	pdu = iscsi_allocate_pdu(iscsi, ISCSI_PDU_NOP_OUT, ISCSI_PDU_NOP_IN);
+	if (pdu == NULL) {
+		printf("failed to allocate pdu\n");
+		exit(10);
+	}
+	return pdu;
+}
+
+static double
+run_hash(struct iscsi_context *iscsi, struct iscsi_pdu **inflight, int qd)
+{
+	struct iscsi_pdu *pdu;
+	uint32_t state = 1;
+	double start;
+	int i, k;
+
+	for (k = 0; k < qd; k++) {
+		inflight[k] = new_pdu(iscsi);
+		iscsi_waitpdu_add(iscsi, inflight[k]);
+	}
+
+	start = now();
+	for (i = 0; i < ITERATIONS; i++) {
+		k = next_random(&state) % qd;
+		pdu = iscsi_find_waitpdu(iscsi, inflight[k]->itt);
+		if (pdu != inflight[k]) {
+			printf("itt %08x not found\n", inflight[k]->itt);
+			exit(10);
+		}
+		iscsi_waitpdu_remove(iscsi, pdu);
+		iscsi_free_pdu(iscsi, pdu);
+
+		inflight[k] = new_pdu(iscsi);
+		iscsi_waitpdu_add(iscsi, inflight[k]);
+	}
+	start = now() - start;
+
+	for (k = 0; k < qd; k++) {
+		iscsi_waitpdu_remove(iscsi, inflight[k]);
+		iscsi_free_pdu(iscsi, inflight[k]);
+	}
+
+	return start;
+}
+
+static double
+run_list(struct iscsi_context *iscsi, struct iscsi_pdu **inflight, int qd)
+{
+	struct iscsi_pdu *list = NULL, *list_tail = NULL, *pdu;
+	uint32_t state = 1, itt;
+	double start;
+	int i, k;
+
+	for (k = 0; k < qd; k++) {
+		inflight[k] = new_pdu(iscsi);
+		DLIST_ADD_END(&list, &list_tail, inflight[k]);
+	}
+
+	start = now();
+	for (i = 0; i < ITERATIONS; i++) {
+		k = next_random(&state) % qd;
+		itt = inflight[k]->itt;
+		for (pdu = list; pdu != NULL; pdu = pdu->next) {
+			if (pdu->itt == itt) {
+				break;
+			}
+		}
+		if (pdu != inflight[k]) {
+			printf("itt %08x not found\n", itt);
+			exit(10);
+		}
+		DLIST_REMOVE(&list, &list_tail, pdu);
+		iscsi_free_pdu(iscsi, pdu);
+
+		inflight[k] = new_pdu(iscsi);
+		DLIST_ADD_END(&list, &list_tail, inflight[k]);
+	}
+	start = now() - start;
+
+	while ((pdu = list) != NULL) {
+		DLIST_REMOVE(&list, &list_tail, pdu);
+		iscsi_free_pdu(iscsi, pdu);
+	}
+
+	return start;
+}
+
+int main(int argc _U_, char *argv[] _U_)
+{
+	int qds[] = { 1, 4, 16, 64, 256, 1024 };
+	struct iscsi_context *iscsi;
+	struct iscsi_pdu **inflight;
+	unsigned int q;
+	double hash, list;
+
+	iscsi = iscsi_create_context("iqn.2010-01.example:waitpdu-bench");
+	if (iscsi == NULL) {
+		printf("failed to create context\n");
+		exit(10);
+	}
+	inflight = malloc(sizeof(struct iscsi_pdu *)
+			  * qds[sizeof(qds) / sizeof(qds[0]) - 1]);
+	if (inflight == NULL) {
+		printf("failed to allocate pdu array\n");
+		exit(10);
+	}
+
+	printf("%-8s %12s %12s   (ns per reply)\n", "depth", "hash", "list");
+	for (q = 0; q < sizeof(qds) / sizeof(qds[0]); q++) {
+		hash = run_hash(iscsi, inflight, qds[q]);
+		list = run_list(iscsi, inflight, qds[q]);
+		printf("%-8d %12.1f %12.1f\n", qds[q],
+		       hash * 1e9 / ITERATIONS, list * 1e9 / ITERATIONS);
+	}
+
+	free(inflight);
+	iscsi_destroy_context(iscsi);
+	return 0;
+}
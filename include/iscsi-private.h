@@ -16,31 +16,141 @@
 */
 
 #include <stdint.h>
+#include <sys/types.h>
 
 #ifndef discard_const
 #define discard_const(ptr) ((void *)((intptr_t)(ptr)))
 #endif
 
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
 #define ISCSI_RAW_HEADER_SIZE			48
 #define ISCSI_DIGEST_SIZE			 4
 
+#define ISCSI_RX_BUFFER_SIZE		(256*1024)
+/* payloads at least this large are read straight into their destination */
+#define ISCSI_RX_DIRECT_SIZE		(32*1024)
+
+#define ISCSI_TX_BATCH_BYTES		(256*1024)
+#define ISCSI_TX_BATCH_IOV		64
+
+#define ISCSI_PDU_CACHE_SIZE		128
+
+/* defaults from rfc3720 for when the target does not say otherwise */
+#define ISCSI_DEFAULT_MAX_RECV_DATA_SEGMENT_LENGTH	8192
+#define ISCSI_DEFAULT_FIRST_BURST_LENGTH		65536
+#define ISCSI_DEFAULT_MAX_BURST_LENGTH			262144
+#define ISCSI_DEFAULT_MAX_OUTSTANDING_R2T		1
+#define ISCSI_DEFAULT_MAX_CONNECTIONS			1
+
+/* how many times to reconnect and log in again after the connection fails */
+#define ISCSI_DEFAULT_RECONNECT_RETRIES		3
+/* milliseconds to wait before the second attempt, each one after that
+ * waits twice as long up to ISCSI_MAX_RECONNECT_INTERVAL
+ */
+#define ISCSI_DEFAULT_RECONNECT_INTERVAL	1000
+#define ISCSI_MAX_RECONNECT_INTERVAL		60000
+/* how many unit attentions a command sent again after a reconnect hides */
+#define ISCSI_REISSUE_MAX_RETRIES		3
+
+/* command timeouts are rounded up to this many milliseconds */
+#define ISCSI_TIMER_TICK_MS		10
+#define ISCSI_TIMER_LEVELS		4
+#define ISCSI_TIMER_SLOT_BITS		6
+#define ISCSI_TIMER_SLOTS		(1 << ISCSI_TIMER_SLOT_BITS)
+
+/* what we offer unless the application says otherwise */
+#define ISCSI_OFFER_MAX_RECV_DATA_SEGMENT_LENGTH	262144
+#define ISCSI_OFFER_FIRST_BURST_LENGTH			262144
+#define ISCSI_OFFER_MAX_BURST_LENGTH			262144
+#define ISCSI_OFFER_MAX_OUTSTANDING_R2T			16
+#define ISCSI_OFFER_MAX_CONNECTIONS			16
+
+/* what fits in the cdb and parameter list of unmap and writesame16 */
+#define ISCSI_UNMAP_MAX_DESCRIPTORS		((0xffff - 8) / 16)
+#define ISCSI_UNMAP_MAX_LBA_COUNT		0xffffffff
+#define ISCSI_WRITE_SAME_MAX_LENGTH		0xffffffff
+
+/* range of the segment and burst length keys */
+#define ISCSI_MIN_DATA_LENGTH				512
+#define ISCSI_MAX_DATA_LENGTH				16777215
+
 #define ISCSI_HEADER_SIZE (ISCSI_RAW_HEADER_SIZE	\
   + (iscsi->header_digest == ISCSI_HEADER_DIGEST_NONE?0:ISCSI_DIGEST_SIZE))
 
 
 struct iscsi_in_pdu {
-	struct iscsi_in_pdu *next;
+	struct iscsi_in_pdu *next, *prev;
 
 	long long hdr_pos;
 	unsigned char hdr[ISCSI_RAW_HEADER_SIZE + ISCSI_DIGEST_SIZE];
 
 	long long data_pos;
 	unsigned char *data;
+
+	/* DATA-IN payload is read straight into the buffers of this task */
+	struct scsi_task *task;
+	unsigned char pad[4];
+
+	/* crc32c of the data segment, computed as it is received */
+	uint32_t data_crc;
+	int digest_pos;
+	unsigned char data_digest[ISCSI_DIGEST_SIZE];
 };
 void iscsi_free_iscsi_in_pdu(struct iscsi_in_pdu *in);
 void iscsi_free_iscsi_inqueue(struct iscsi_in_pdu *inqueue);
 
+/*
+ * A timer wheel with ISCSI_TIMER_LEVELS levels of ISCSI_TIMER_SLOTS slots.
+ * A timer sits in level 0 when it is due within ISCSI_TIMER_SLOTS ticks, in
+ * level 1 when within ISCSI_TIMER_SLOTS^2 ticks and so on, and is moved
+ * down a level as its time comes closer. Adding and removing a timer is
+ * O(1), and so is finding the next tick that needs attention, through the
+ * bitmap of the slots that are in use on each level.
+ */
+struct iscsi_timer {
+	struct iscsi_timer *next, *prev;
+	uint64_t expires;
+	/* where in the wheel the timer is, level is -1 if it is not */
+	int level;
+	int slot;
+};
+
+struct iscsi_timer_wheel {
+	/* the tick the wheel has been run up to */
+	uint64_t now;
+	int count;
+	uint64_t in_use[ISCSI_TIMER_LEVELS];
+	struct iscsi_timer *slots[ISCSI_TIMER_LEVELS][ISCSI_TIMER_SLOTS];
+	struct iscsi_timer *slots_tail[ISCSI_TIMER_LEVELS][ISCSI_TIMER_SLOTS];
+};
+
+/*
+ * The block limits of a lun, read from its block limits vpd page the first
+ * time it is unmapped or written the same to. Requests that come in while
+ * the page is being read wait for it.
+ */
+struct iscsi_range_cbdata;
+struct iscsi_lun_limits {
+	struct iscsi_lun_limits *next;
+	int lun;
+	int fetched;
+	uint32_t unmap_max_lba_count;
+	uint32_t unmap_max_descriptors;
+	uint32_t write_same_max_length;
+	struct iscsi_range_cbdata *waiting;
+	struct iscsi_range_cbdata *waiting_tail;
+};
+
+/* the context that holds the session wide state for a connection */
+#define ISCSI_SESSION(iscsi) ((iscsi)->leader != NULL ? (iscsi)->leader : (iscsi))
+
 struct iscsi_context {
+	/* the contexts of the same iscsi_loop */
+	struct iscsi_context *prev, *next;
+
 	const char *initiator_name;
 	const char *target_name;
 	const char *alias;
@@ -50,11 +160,36 @@ struct iscsi_context {
 
 	enum iscsi_session_type session_type;
 	unsigned char isid[6];
+	uint16_t tsih;
+	uint16_t cid;
 	uint32_t itt;
 	uint32_t cmdsn;
+	uint32_t expcmdsn;
+	uint32_t maxcmdsn;
 	uint32_t statsn;
 	enum iscsi_header_digest want_header_digest;
 	enum iscsi_header_digest header_digest;
+	enum iscsi_data_digest want_data_digest;
+	enum iscsi_data_digest data_digest;
+	/* the digests negotiated so far, in use once the login completes */
+	enum iscsi_header_digest login_header_digest;
+	enum iscsi_data_digest login_data_digest;
+
+	/* operational parameters we offer at login */
+	int initiator_max_recv_data_segment_length;
+	int want_first_burst_length;
+	int want_max_burst_length;
+	int want_max_outstanding_r2t;
+	enum iscsi_initial_r2t want_initial_r2t;
+	enum iscsi_immediate_data want_immediate_data;
+
+	/* operational parameters from the login negotiation */
+	int target_max_recv_data_segment_length;
+	int first_burst_length;
+	int max_burst_length;
+	int max_outstanding_r2t;
+	enum iscsi_initial_r2t initial_r2t;
+	enum iscsi_immediate_data immediate_data;
 
 	char *error_string;
 
@@ -77,11 +212,115 @@ struct iscsi_context {
 	iscsi_command_cb socket_status_cb;
 	void *connect_data;
 
+	/* where we connected to, to come back if the connection fails */
+	char *portal;
+	int reconnect_max_retries;
+	int reconnect_retries;
+	int reconnect_interval;
+	int is_reconnecting;
+	/* in the timer wheel while we wait for the next attempt */
+	struct iscsi_timer reconnect_timer;
+	/* the callback of the application while we reconnect */
+	iscsi_command_cb reconnect_status_cb;
+	void *reconnect_data;
+	/* commands that are sent again once logged in on the new connection */
+	struct iscsi_pdu *reconnect_cmds;
+	struct iscsi_pdu *reconnect_cmds_tail;
+
 	struct iscsi_pdu *outqueue;
-	struct iscsi_pdu *waitpdu;
+	struct iscsi_pdu *outqueue_tail;
+
+	/* With multiple connections per session, the context of the leading
+	 * connection holds the session wide state: itt, cmdsn, the cmdsn
+	 * window and the command backlog. It also holds the list of all
+	 * connections, itself included. Other connections point to it with
+	 * leader.
+	 */
+	struct iscsi_context *leader;
+	struct iscsi_context *connections;
+	struct iscsi_context *next_connection;
+	uint16_t next_cid;
+	int max_connections;
+
+	/* commands sent on this connection that have not completed */
+	int cmds_in_flight;
+	uint64_t bytes_in_flight;
+
+	/* commands waiting for the target to open the cmdsn window */
+	struct iscsi_pdu *cmd_backlog;
+	struct iscsi_pdu *cmd_backlog_tail;
+	int cmd_backlog_count;
+
+	/* target block limits that unmap and writesame are split by, set
+	 * by the application for every lun, or else fetched for each lun
+	 */
+	int block_limits_set;
+	uint32_t unmap_max_lba_count;
+	uint32_t unmap_max_descriptors;
+	uint32_t write_same_max_length;
+	struct iscsi_lun_limits *lun_limits;
+
+	/* limits for coalescing the outqueue into a single sendmsg() */
+	int tx_batch_bytes;
+	int tx_batch_iov;
+	struct iovec *tx_iov;
+	unsigned long long tx_pdus;
+	unsigned long long tx_syscalls;
+
+	/* pdus waiting for a reply, hashed by itt */
+	struct iscsi_pdu **waitpdu;
+	uint32_t waitpdu_size;
+	uint32_t waitpdu_count;
+
+	/* data read from the socket but not yet parsed into incoming */
+	unsigned char *rxbuf;
+	int rxbuf_pos;
+	int rxbuf_len;
+
+	/* freed pdus kept for reuse */
+	struct iscsi_pdu *free_pdus;
+	int free_pdu_count;
+	int free_pdu_max;
 
 	struct iscsi_in_pdu *incoming;
 	struct iscsi_in_pdu *inqueue;
+	struct iscsi_in_pdu *inqueue_tail;
+
+	/* the event loop that services this context, the socket and the
+	 * events it is registered with there
+	 */
+	struct iscsi_loop *loop;
+	int loop_fd;
+	uint32_t loop_events;
+	iscsi_command_cb loop_cb;
+	void *loop_data;
+	/* in the timer wheel of the loop at the first tick a command of the
+	 * session may time out, level is -1 if none can
+	 */
+	struct iscsi_timer loop_timer;
+
+	/* service the connection through io_uring where it is available */
+	int want_uring;
+	struct iscsi_uring *uring;
+
+	/* command timeouts, the wheel of the session is in the leader */
+	int timeout;
+	enum iscsi_timeout_action timeout_action;
+	struct iscsi_timer_wheel *timers;
+	/* a command on this connection timed out, drop the connection */
+	int timed_out;
+
+	/* commands submitted by other threads, only the leader has one */
+	struct iscsi_submit_queue *submit_queue;
+};
+
+/* a list that any thread can push onto and the service thread takes, see
+ * lib/submit.c
+ */
+struct iscsi_submission;
+struct iscsi_submit_queue {
+	struct iscsi_submission *head;
+	int fd;
 };
 
 #define ISCSI_PDU_IMMEDIATE		       0x40
@@ -118,24 +357,48 @@ struct iscsi_context {
 enum iscsi_opcode {
 	ISCSI_PDU_NOP_OUT         = 0x00,
 	ISCSI_PDU_SCSI_REQUEST    = 0x01,
+	ISCSI_PDU_SCSI_TASK_MANAGEMENT_REQUEST = 0x02,
 	ISCSI_PDU_LOGIN_REQUEST   = 0x03,
 	ISCSI_PDU_TEXT_REQUEST    = 0x04,
+	ISCSI_PDU_DATA_OUT        = 0x05,
 	ISCSI_PDU_LOGOUT_REQUEST  = 0x06,
 	ISCSI_PDU_NOP_IN          = 0x20,
 	ISCSI_PDU_SCSI_RESPONSE   = 0x21,
+	ISCSI_PDU_SCSI_TASK_MANAGEMENT_RESPONSE = 0x22,
 	ISCSI_PDU_LOGIN_RESPONSE  = 0x23,
 	ISCSI_PDU_TEXT_RESPONSE   = 0x24,
 	ISCSI_PDU_DATA_IN         = 0x25,
-	ISCSI_PDU_LOGOUT_RESPONSE = 0x26
+	ISCSI_PDU_LOGOUT_RESPONSE = 0x26,
+	ISCSI_PDU_R2T             = 0x31,
+	ISCSI_PDU_NO_PDU          = 0xff
+};
+
+struct iscsi_scsi_cbdata {
+	struct iscsi_scsi_cbdata *prev, *next;
+	iscsi_command_cb          callback;
+	void                     *private_data;
+	struct scsi_task         *task;
 };
 
 struct iscsi_pdu {
-	struct iscsi_pdu *next;
+	struct iscsi_pdu *next, *prev;
+	struct iscsi_pdu *hash_next;
+
+	/* the header is sent first, then outdata which holds only the data */
+	unsigned char hdr[ISCSI_RAW_HEADER_SIZE + ISCSI_DIGEST_SIZE];
+	int hdr_size;
 
 	uint32_t itt;
 	uint32_t cmdsn;
 	enum iscsi_opcode response_opcode;
 
+#define ISCSI_PDU_DELETE_WHEN_SENT	0x00000001
+/* a command counted in cmds_in_flight and bytes_in_flight */
+#define ISCSI_PDU_IN_FLIGHT		0x00000002
+/* a command that has timed out, it is failed instead of sent again */
+#define ISCSI_PDU_TIMED_OUT		0x00000004
+	uint32_t flags;
+
 	iscsi_command_cb callback;
 	void *private_data;
 
@@ -143,7 +406,34 @@ struct iscsi_pdu {
 	struct iscsi_data outdata;
 	struct iscsi_data indata;
 
+	/* payload that is sent straight from the data-out buffers of a task,
+	 * following outdata on the wire.
+	 */
+	struct scsi_task *payload_task;
+	int payload_offset;
+	int payload_len;
+
+	/* running crc32c of the data added to outdata */
+	uint32_t data_crc;
+	int data_crc_len;
+	unsigned char data_digest[ISCSI_DIGEST_SIZE];
+	int data_digest_size;
+
+	/* a DATA-OUT pdu points to the command it carries data for, and the
+	 * command counts how many of them are still in the outqueue.
+	 */
+	struct iscsi_pdu *cmd_pdu;
+	int dataout_count;
+
 	struct iscsi_scsi_cbdata *scsi_cbdata;
+	/* storage for scsi_cbdata, so a command is a single allocation */
+	struct iscsi_scsi_cbdata cbdata;
+
+	/* the connection the pdu was queued on, NULL while a command waits
+	 * in the backlog or for a reconnect
+	 */
+	struct iscsi_context *conn;
+	struct iscsi_timer timer;
 };
 
 void iscsi_free_scsi_cbdata(struct iscsi_scsi_cbdata *scsi_cbdata);
@@ -151,7 +441,12 @@ void iscsi_free_scsi_cbdata(struct iscsi_scsi_cbdata *scsi_cbdata);
 struct iscsi_pdu *iscsi_allocate_pdu(struct iscsi_context *iscsi,
 				     enum iscsi_opcode opcode,
 				     enum iscsi_opcode response_opcode);
+struct iscsi_pdu *iscsi_allocate_pdu_with_itt_flags(struct iscsi_context *iscsi,
+				     enum iscsi_opcode opcode,
+				     enum iscsi_opcode response_opcode,
+				     uint32_t itt, uint32_t flags);
 void iscsi_free_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+void iscsi_free_pdu_cache(struct iscsi_context *iscsi);
 void iscsi_pdu_set_pduflags(struct iscsi_pdu *pdu, unsigned char flags);
 void iscsi_pdu_set_immediate(struct iscsi_pdu *pdu);
 void iscsi_pdu_set_ttt(struct iscsi_pdu *pdu, uint32_t ttt);
@@ -159,16 +454,77 @@ void iscsi_pdu_set_cmdsn(struct iscsi_pdu *pdu, uint32_t cmdsn);
 void iscsi_pdu_set_lun(struct iscsi_pdu *pdu, uint32_t lun);
 void iscsi_pdu_set_expstatsn(struct iscsi_pdu *pdu, uint32_t expstatsnsn);
 void iscsi_pdu_set_expxferlen(struct iscsi_pdu *pdu, uint32_t expxferlen);
+void iscsi_pdu_set_datasn(struct iscsi_pdu *pdu, uint32_t datasn);
+void iscsi_pdu_set_bufferoffset(struct iscsi_pdu *pdu, uint32_t bufferoffset);
 int iscsi_pdu_add_data(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 		       unsigned char *dptr, int dsize);
+struct scsi_task;
+int iscsi_pdu_add_task_payload(struct iscsi_context *iscsi,
+			       struct iscsi_pdu *pdu, struct scsi_task *task,
+			       int offset, int len);
 int iscsi_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+int iscsi_cancel_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+void iscsi_update_cmdsn_window(struct iscsi_context *iscsi,
+			       struct iscsi_in_pdu *in);
+void iscsi_send_cmd_backlog(struct iscsi_context *iscsi);
+int iscsi_scsi_command_reissue(struct iscsi_context *iscsi,
+			       struct iscsi_pdu *pdu);
+struct scsi_inquiry_block_limits;
+void iscsi_apply_block_limits(const struct scsi_inquiry_block_limits *bl,
+			      uint32_t *unmap_max_lba_count,
+			      uint32_t *unmap_max_descriptors,
+			      uint32_t *write_same_max_length);
+void iscsi_free_lun_limits(struct iscsi_context *iscsi);
+int iscsi_reconnect(struct iscsi_context *iscsi);
+void iscsi_reconnect_timer_expired(struct iscsi_context *iscsi);
+void iscsi_loop_update(struct iscsi_context *iscsi, int rearm);
+int iscsi_uring_start(struct iscsi_context *iscsi);
+void iscsi_uring_stop(struct iscsi_context *iscsi, int fd);
+int iscsi_uring_get_fd(struct iscsi_context *iscsi);
+int iscsi_uring_which_events(struct iscsi_context *iscsi);
+int iscsi_uring_service(struct iscsi_context *iscsi);
+int iscsi_outqueue_gather(struct iscsi_context *iscsi, struct iovec *iov,
+			  int max_iov, ssize_t max_bytes, ssize_t *bytes);
+void iscsi_outqueue_written(struct iscsi_context *iscsi, ssize_t count);
+int iscsi_process_received(struct iscsi_context *iscsi,
+			   const unsigned char *data, ssize_t len);
+void iscsi_incoming_release_task(struct iscsi_context *iscsi,
+				 struct scsi_task *task);
+
+uint64_t iscsi_time_ms(void);
+void iscsi_timer_add(struct iscsi_timer_wheel *wheel, struct iscsi_timer *timer,
+		     uint64_t expires);
+void iscsi_timer_remove(struct iscsi_timer_wheel *wheel,
+			struct iscsi_timer *timer);
+struct iscsi_timer *iscsi_timer_expire_next(struct iscsi_timer_wheel *wheel,
+					    uint64_t now);
+uint64_t iscsi_timer_next_tick(struct iscsi_timer_wheel *wheel);
+int iscsi_timeout_arm(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		      int timeout);
+void iscsi_timeout_arm_at(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+			  uint64_t expires);
+void iscsi_timeout_disarm(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+int iscsi_timeout_arm_reconnect(struct iscsi_context *iscsi, int delay);
+void iscsi_timeout_run(struct iscsi_context *iscsi);
+void iscsi_timeout_connection_lost(struct iscsi_context *iscsi);
+void iscsi_loop_timer_armed(struct iscsi_context *iscsi, uint64_t expires);
+void iscsi_loop_watch_submit_queue(struct iscsi_context *iscsi, int watch);
 int iscsi_add_data(struct iscsi_context *iscsi, struct iscsi_data *data,
 		   unsigned char *dptr, int dsize, int pdualignment);
 
-struct scsi_task;
 void iscsi_pdu_set_cdb(struct iscsi_pdu *pdu, struct scsi_task *task);
 
 int iscsi_get_pdu_data_size(const unsigned char *hdr);
+void iscsi_waitpdu_add(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+void iscsi_waitpdu_remove(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+struct iscsi_pdu *iscsi_find_waitpdu(struct iscsi_context *iscsi,
+				     uint32_t itt);
+struct iscsi_pdu *iscsi_first_waitpdu(struct iscsi_context *iscsi);
+void iscsi_terminate_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+			 int status);
+struct iscsi_pdu *iscsi_task_pdu(struct scsi_task *task);
+struct scsi_task *iscsi_get_data_in_task(struct iscsi_context *iscsi,
+					 struct iscsi_in_pdu *in);
 int iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in);
 
 int iscsi_process_login_reply(struct iscsi_context *iscsi,
@@ -187,13 +543,19 @@ int iscsi_process_scsi_data_in(struct iscsi_context *iscsi,
 			       struct iscsi_pdu *pdu,
 			       struct iscsi_in_pdu *in,
 			       int *is_finished);
+int iscsi_process_r2t(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		      struct iscsi_in_pdu *in);
 int iscsi_process_nop_out_reply(struct iscsi_context *iscsi,
 				struct iscsi_pdu *pdu,
 				struct iscsi_in_pdu *in);
+int iscsi_process_task_mgmt_reply(struct iscsi_context *iscsi,
+				  struct iscsi_pdu *pdu,
+				  struct iscsi_in_pdu *in);
 
 void iscsi_set_error(struct iscsi_context *iscsi, const char *error_string,
 		     ...);
 
 unsigned long crc32c(char *buf, int len);
+uint32_t crc32c_update(uint32_t crc, const unsigned char *buf, size_t len);
 
 void iscsi_cbdata_steal_scsi_task(struct scsi_task *task);
@@ -15,8 +15,11 @@
    along with this program; if not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdint.h>
+
 struct iscsi_context;
 struct sockaddr;
+struct iovec;
 
 struct iscsi_url {
        const char *portal;
@@ -34,6 +37,8 @@ const char *iscsi_get_error(struct iscsi_context *iscsi);
 
 /*
  * Returns the file descriptor that libiscsi uses.
+ * The descriptor changes when the library reconnects to the target, so ask
+ * for it again after every call to iscsi_service().
  */
 int iscsi_get_fd(struct iscsi_context *iscsi);
 
@@ -45,9 +50,20 @@ int iscsi_which_events(struct iscsi_context *iscsi);
 /*
  * Called to process the events when events become available for the iscsi
  * file descriptor.
+ * When commands can time out, see iscsi_set_timeout(), it must also be
+ * called when iscsi_next_timeout_ms() has passed, with revents 0 if there
+ * were no events.
  */
 int iscsi_service(struct iscsi_context *iscsi, int revents);
 
+/*
+ * Returns how many milliseconds may pass before iscsi_service() must be
+ * called to act on a command of the session that times out, for use as the
+ * timeout of poll(). 0 if one has timed out already and -1 if no command
+ * can time out.
+ */
+int iscsi_next_timeout_ms(struct iscsi_context *iscsi);
+
 
 
 /*
@@ -71,6 +87,29 @@ struct iscsi_context *iscsi_create_context(const char *initiator_name);
  */
 int iscsi_destroy_context(struct iscsi_context *iscsi);
 
+/*
+ * Create a context for an additional connection to the session of iscsi.
+ * The session must be a normal session that is logged in, and the target
+ * must have agreed to more connections during login (MaxConnections).
+ *
+ * The new context has the names, isid and tsih of the session. Connect and
+ * log it in with iscsi_connect_*() and iscsi_login_*() and service its file
+ * descriptor like any other context. Once it is logged in, SCSI commands
+ * issued on any connection of the session are spread over all logged in
+ * connections, picking the one with the least data in flight.
+ * The callback of a command may be invoked with the context of the
+ * connection it was sent on.
+ *
+ * Destroying the context closes only this connection, destroying the
+ * context of the leading connection destroys all connections of the
+ * session.
+ *
+ * Returns:
+ *  the new context on success
+ *  NULL on error
+ */
+struct iscsi_context *iscsi_create_connection(struct iscsi_context *iscsi);
+
 /*
  * Set an optional alias name to identify with when connecting to the target
  *
@@ -136,6 +175,280 @@ enum iscsi_header_digest {
 int iscsi_set_header_digest(struct iscsi_context *iscsi,
 			    enum iscsi_header_digest header_digest);
 
+/*
+ * Types of data digest we support. Default is NONE
+ */
+enum iscsi_data_digest {
+	ISCSI_DATA_DIGEST_NONE        = 0,
+	ISCSI_DATA_DIGEST_NONE_CRC32C = 1,
+	ISCSI_DATA_DIGEST_CRC32C_NONE = 2,
+	ISCSI_DATA_DIGEST_CRC32C      = 3
+};
+
+/*
+ * Set the desired data digest for a scsi context.
+ * Data digest can only be set/changed while the iscsi context is not
+ * logged in to a target.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_set_data_digest(struct iscsi_context *iscsi,
+			  enum iscsi_data_digest data_digest);
+
+/*
+ * Set the largest data segment we are prepared to receive in a single pdu.
+ * The target uses this to size its DATA-IN pdus. Valid values are
+ * 512 to 16777215, the default is 262144.
+ * This can only be set/changed while the iscsi context is not logged in
+ * to a target.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_set_max_recv_data_segment_length(struct iscsi_context *iscsi,
+					   int len);
+
+/*
+ * Set the FirstBurstLength to offer, the amount of unsolicited write data
+ * that may be sent along with a command. Valid values are 512 to 16777215,
+ * the default is 262144. The offer is never larger than MaxBurstLength.
+ * This can only be set/changed while the iscsi context is not logged in
+ * to a target.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_set_first_burst_length(struct iscsi_context *iscsi, int len);
+
+/*
+ * Set the MaxBurstLength to offer, the largest amount of write data the
+ * target may ask for with a single R2T. Valid values are 512 to 16777215,
+ * the default is 262144.
+ * This can only be set/changed while the iscsi context is not logged in
+ * to a target.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_set_max_burst_length(struct iscsi_context *iscsi, int len);
+
+/*
+ * Set the MaxOutstandingR2T to offer, how many R2Ts the target may have
+ * outstanding for a single command. Valid values are 1 to 65535, the
+ * default is 16.
+ * This can only be set/changed while the iscsi context is not logged in
+ * to a target.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_set_max_outstanding_r2t(struct iscsi_context *iscsi, int count);
+
+enum iscsi_initial_r2t {
+	ISCSI_INITIAL_R2T_NO  = 0,
+	ISCSI_INITIAL_R2T_YES = 1
+};
+
+/*
+ * Set whether we ask for InitialR2T. With InitialR2T=No the first burst of
+ * a write may be sent without waiting for an R2T. The default is YES.
+ * This can only be set/changed while the iscsi context is not logged in
+ * to a target.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_set_initial_r2t(struct iscsi_context *iscsi,
+			  enum iscsi_initial_r2t initial_r2t);
+
+enum iscsi_immediate_data {
+	ISCSI_IMMEDIATE_DATA_NO  = 0,
+	ISCSI_IMMEDIATE_DATA_YES = 1
+};
+
+/*
+ * Set whether we offer ImmediateData, write data carried in the command
+ * pdu itself. The default is YES.
+ * This can only be set/changed while the iscsi context is not logged in
+ * to a target.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_set_immediate_data(struct iscsi_context *iscsi,
+			     enum iscsi_immediate_data immediate_data);
+
+/*
+ * Set how much of the queue of outgoing pdus may be coalesced into a single
+ * sendmsg() call: at most max_bytes bytes spread over at most max_iov
+ * buffers. The default is 256kb in 64 buffers.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_set_tx_batch(struct iscsi_context *iscsi, int max_bytes,
+		       int max_iov);
+
+/*
+ * Returns the number of pdus that have been written to the socket and the
+ * number of sendmsg() calls that were used to write them.
+ */
+void iscsi_get_tx_stats(struct iscsi_context *iscsi, unsigned long long *pdus,
+			unsigned long long *syscalls);
+
+/*
+ * Service the connection through io_uring instead of read() and write().
+ * Replies are received by a multishot recv into buffers the kernel picks,
+ * and the outgoing pdus are sent in chains of linked sends, so a busy
+ * connection needs a single io_uring_enter() per iscsi_service() call.
+ * It takes effect when the next connection is established. Where the
+ * kernel does not support it, the connection silently stays on read() and
+ * write().
+ *
+ * While the ring is in use, iscsi_get_fd() returns the fd of the ring, which
+ * is polled for iscsi_which_events() like the socket is. The tx stats count
+ * the chains of sends instead of sendmsg() calls.
+ *
+ * Returns:
+ *  0: success
+ * <0: error, libiscsi was built without io_uring
+ */
+int iscsi_set_io_uring(struct iscsi_context *iscsi, int enable);
+
+/*
+ * Returns 1 if the connection is serviced through io_uring, 0 if through
+ * read() and write().
+ */
+int iscsi_get_io_uring(struct iscsi_context *iscsi);
+
+/*
+ * Returns how many more commands the target currently allows us to send,
+ * as given by the MaxCmdSN in its last response. Commands submitted beyond
+ * this are held back by the library until the target opens the window.
+ */
+int iscsi_get_cmdsn_window(struct iscsi_context *iscsi);
+
+/*
+ * Returns the number of commands that are held back waiting for the
+ * cmdsn window to open.
+ */
+int iscsi_get_backlog_length(struct iscsi_context *iscsi);
+
+/*
+ * Set the limits that iscsi_unmap_async() and iscsi_writesame*_async()
+ * split large requests by, for every lun, from a block limits vpd page as
+ * returned by scsi_datain_unmarshall() for
+ * SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS.
+ * Unless this is called the library reads the block limits vpd page of
+ * each lun itself, before the first of these requests to the lun is sent.
+ * Requests to a lun that does not have the page are only split where they
+ * would not fit in the cdb or the parameter list.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+struct scsi_inquiry_block_limits;
+int iscsi_set_block_limits(struct iscsi_context *iscsi,
+			   const struct scsi_inquiry_block_limits *bl);
+
+/*
+ * Set how many freed pdus are kept for reuse instead of being returned to
+ * malloc, and preallocate that many so that a burst of up to count
+ * commands does not touch the allocator. The default is 128.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_set_pdu_cache_size(struct iscsi_context *iscsi, int count);
+
+/*
+ * Set how many times to connect and log in again, to the same portal with
+ * the same isid, when the connection of a logged in session fails. Commands
+ * that were queued or in flight are held meanwhile and sent again once
+ * logged in, they only fail if every attempt fails. The callback given to
+ * iscsi_connect_async() or iscsi_full_connect_async() is invoked the second
+ * time only then.
+ * Sessions with more than one connection are not reconnected.
+ * The default is 3, 0 disables reconnecting.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_set_reconnect_max_retries(struct iscsi_context *iscsi, int count);
+
+/*
+ * Set how many milliseconds to wait after the first attempt to reconnect
+ * fails before the next one. The wait doubles for every attempt after that,
+ * up to a minute. The first attempt is made as soon as the connection fails.
+ * The wait is part of iscsi_next_timeout_ms(), iscsi_service() must be
+ * called when it has passed even though there is no socket to poll then.
+ * The default is 1000.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_set_reconnect_interval(struct iscsi_context *iscsi, int interval_ms);
+
+/*
+ * Set how many milliseconds a command may take before it times out, counted
+ * from when it is issued. Login, logout, text and nop requests are timed
+ * from when they are queued. scsi_task->timeout overrides this for a task
+ * given to iscsi_scsi_command_async(), for the other commands the timeout
+ * is the one set when they are issued.
+ * Timeouts are rounded up to 10 milliseconds. The default is 0, commands
+ * do not time out.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_set_timeout(struct iscsi_context *iscsi, int timeout_ms);
+
+enum iscsi_timeout_action {
+	/* the callback is invoked with SCSI_STATUS_TIMEOUT and any reply
+	 * that still arrives is dropped
+	 */
+	ISCSI_TIMEOUT_FAIL       = 0,
+	/* the task is aborted with a task management request and the
+	 * callback is invoked with SCSI_STATUS_TIMEOUT once the target
+	 * confirms. If it does not, the connection is dropped
+	 */
+	ISCSI_TIMEOUT_ABORT_TASK = 1,
+	/* the connection is dropped and reconnected, commands that timed out
+	 * are not sent again but fail with SCSI_STATUS_TIMEOUT
+	 */
+	ISCSI_TIMEOUT_RECONNECT  = 2
+};
+
+/*
+ * Set what happens to a SCSI command that has been sent and times out.
+ * The default is ISCSI_TIMEOUT_FAIL.
+ * Whatever the action, a command that times out before it is sent fails
+ * right away, and a command that times out while it can not be written,
+ * or a login, logout, text or nop request that times out, drops the
+ * connection as ISCSI_TIMEOUT_RECONNECT does. If the connection can not be
+ * recovered, it is closed and iscsi_service() fails.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_set_timeout_action(struct iscsi_context *iscsi,
+			     enum iscsi_timeout_action action);
+
 /*
  * Specify the username and password to use for chap authentication
  */
@@ -153,7 +466,8 @@ enum scsi_status {
 	SCSI_STATUS_GOOD            = 0,
 	SCSI_STATUS_CHECK_CONDITION = 2,
 	SCSI_STATUS_CANCELLED       = 0x0f000000,
-	SCSI_STATUS_ERROR           = 0x0f000001
+	SCSI_STATUS_ERROR           = 0x0f000001,
+	SCSI_STATUS_TIMEOUT         = 0x0f000002
 };
 
 
@@ -184,10 +498,16 @@ typedef void (*iscsi_command_cb)(struct iscsi_context *iscsi, int status,
  *
  *    ISCSI_STATUS_ERROR    : Either failed to establish the connection, or
  *                            an already established connection has failed
- *                            with an error.
+ *                            with an error. When the session is reconnected,
+ *                            see iscsi_set_reconnect_max_retries(), this is
+ *                            only once every attempt has failed. After an
+ *                            ISCSI_STATUS_ERROR the callback is not invoked
+ *                            again.
  *
  * The callback will NOT be invoked if the session is explicitely torn down
  * through a call to iscsi_disconnect() or iscsi_destroy_context().
+ * The synchronous variant has no callback to invoke a second time, a
+ * connection that fails later is reported by iscsi_service() only.
  */
 int iscsi_connect_async(struct iscsi_context *iscsi, const char *portal,
 			iscsi_command_cb cb, void *private_data);
@@ -223,10 +543,16 @@ int iscsi_connect_sync(struct iscsi_context *iscsi, const char *portal);
  *
  *    ISCSI_STATUS_ERROR    : Either failed to establish the connection, or
  *                            an already established connection has failed
- *                            with an error.
+ *                            with an error. When the session is reconnected,
+ *                            see iscsi_set_reconnect_max_retries(), this is
+ *                            only once every attempt has failed. After an
+ *                            ISCSI_STATUS_ERROR the callback is not invoked
+ *                            again.
  *
  * The callback will NOT be invoked if the session is explicitely torn down
  * through a call to iscsi_disconnect() or iscsi_destroy_context().
+ * The synchronous variant has no callback to invoke a second time, a
+ * connection that fails later is reported by iscsi_service() only.
  */
 int iscsi_full_connect_async(struct iscsi_context *iscsi, const char *portal,
 			     int lun, iscsi_command_cb cb, void *private_data);
@@ -357,6 +683,63 @@ int iscsi_nop_out_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 			unsigned char *data, int len, void *private_data);
 
 
+enum iscsi_task_mgmt_funcs {
+	ISCSI_TM_ABORT_TASK        = 0x01,
+	ISCSI_TM_ABORT_TASK_SET    = 0x02,
+	ISCSI_TM_CLEAR_ACA         = 0x03,
+	ISCSI_TM_CLEAR_TASK_SET    = 0x04,
+	ISCSI_TM_LUN_RESET         = 0x05,
+	ISCSI_TM_TARGET_WARM_RESET = 0x06,
+	ISCSI_TM_TARGET_COLD_RESET = 0x07,
+	ISCSI_TM_TASK_REASSIGN     = 0x08
+};
+
+enum iscsi_task_mgmt_response {
+	ISCSI_TMR_FUNC_COMPLETE                 = 0,
+	ISCSI_TMR_TASK_DOES_NOT_EXIST           = 1,
+	ISCSI_TMR_LUN_DOES_NOT_EXIST            = 2,
+	ISCSI_TMR_TASK_STILL_ALLEGIANT          = 3,
+	ISCSI_TMR_TASK_ALLEGIANCE_REASSIGNMENT_UNSUPPORTED = 4,
+	ISCSI_TMR_TMF_NOT_SUPPORTED             = 5,
+	ISCSI_TMR_FUNC_AUTHORIZATION_FAILED     = 6,
+	ISCSI_TMR_FUNC_REJECTED                 = 255
+};
+
+/*
+ * Asynchronous call to send a task management request for lun, ritt and
+ * rcmdsn are the itt and cmdsn of the task it refers to.
+ * Commands that the target aborts complete with SCSI_STATUS_CANCELLED when
+ * the reply arrives, or with SCSI_STATUS_TIMEOUT if they had timed out.
+ *
+ * Returns:
+ *  0 if the call was initiated and the request will be sent. Result will
+ *    be reported through the callback function.
+ * <0 if there was an error. The callback function will not be invoked.
+ *
+ * Callback parameters :
+ * status can be either of :
+ *    ISCSI_STATUS_GOOD     : The target replied. Command_data is a pointer
+ *                            to an uint32_t holding the response, an
+ *                            enum iscsi_task_mgmt_response.
+ *    ISCSI_STATUS_TIMEOUT  : The target did not reply in time.
+ *                            Command_data is NULL.
+ *    ISCSI_STATUS_CANCELLED: The request was aborted. Command_data is NULL.
+ */
+int iscsi_task_mgmt_async(struct iscsi_context *iscsi, int lun,
+			  enum iscsi_task_mgmt_funcs function,
+			  uint32_t ritt, uint32_t rcmdsn,
+			  iscsi_command_cb cb, void *private_data);
+
+/*
+ * Asynchronous call to abort a task that has been sent to the target, as
+ * iscsi_task_mgmt_async() with ISCSI_TM_ABORT_TASK.
+ */
+struct scsi_task;
+int iscsi_task_mgmt_abort_task_async(struct iscsi_context *iscsi,
+				     struct scsi_task *task,
+				     iscsi_command_cb cb, void *private_data);
+
+
 /* These are the possible status values for the callbacks for scsi commands.
  * The content of command_data depends on the status type.
  *
@@ -374,6 +757,9 @@ int iscsi_nop_out_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
  *   NULL.
  *
  *   ISCSI_STATUS_ERROR the command failed. Command_data is NULL.
+ *
+ *   ISCSI_STATUS_TIMEOUT the command timed out, see iscsi_set_timeout().
+ *   Command_data contains the struct scsi_task.
  */
 
 
@@ -403,6 +789,8 @@ int iscsi_inquiry_async(struct iscsi_context *iscsi, int lun, int evpd,
 int iscsi_readcapacity10_async(struct iscsi_context *iscsi, int lun, int lba,
 			       int pmi, iscsi_command_cb cb,
 			       void *private_data);
+int iscsi_readcapacity16_async(struct iscsi_context *iscsi, int lun,
+			       iscsi_command_cb cb, void *private_data);
 int iscsi_synchronizecache10_async(struct iscsi_context *iscsi, int lun,
 				   int lba, int num_blocks, int syncnv,
 				   int immed, iscsi_command_cb cb,
@@ -411,10 +799,109 @@ int iscsi_synchronizecache10_async(struct iscsi_context *iscsi, int lun,
 int iscsi_read10_async(struct iscsi_context *iscsi, int lun, int lba,
 		       int datalen, int blocksize, iscsi_command_cb cb,
 		       void *private_data);
+/*
+ * Same as iscsi_read10_async() but DATA-IN is read straight from the
+ * socket into the buffers described by iov, and task->datain is left empty.
+ * The buffers must remain valid until the callback has been invoked.
+ */
+int iscsi_read10_iov_async(struct iscsi_context *iscsi, int lun, int lba,
+		       struct iovec *iov, int niov, int blocksize,
+		       iscsi_command_cb cb, void *private_data);
 int iscsi_write10_async(struct iscsi_context *iscsi, int lun,
 			unsigned char *data, int datalen, int lba, int fua,
 			int fuanv, int blocksize, iscsi_command_cb cb,
 			void *private_data);
+/*
+ * Same as iscsi_write10_async() but the data is sent straight from the
+ * buffers described by iov instead of being copied into the pdu.
+ * The buffers must remain valid and unmodified until the callback has
+ * been invoked.
+ */
+int iscsi_write10_iov_async(struct iscsi_context *iscsi, int lun,
+			struct iovec *iov, int niov, int lba, int fua,
+			int fuanv, int blocksize, iscsi_command_cb cb,
+			void *private_data);
+/*
+ * READ16 and WRITE16 take a 64 bit lba and a 32 bit block count, for
+ * luns larger than 2TB and transfers of more than 65535 blocks.
+ */
+int iscsi_read16_async(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		       int datalen, int blocksize, iscsi_command_cb cb,
+		       void *private_data);
+int iscsi_read16_iov_async(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		       struct iovec *iov, int niov, int blocksize,
+		       iscsi_command_cb cb, void *private_data);
+int iscsi_write16_async(struct iscsi_context *iscsi, int lun,
+			unsigned char *data, int datalen, uint64_t lba,
+			int fua, int fuanv, int blocksize,
+			iscsi_command_cb cb, void *private_data);
+int iscsi_write16_iov_async(struct iscsi_context *iscsi, int lun,
+			struct iovec *iov, int niov, uint64_t lba, int fua,
+			int fuanv, int blocksize, iscsi_command_cb cb,
+			void *private_data);
+/*
+ * COMPARE AND WRITE: atomically compare the datalen bytes from lba with
+ * verify_data and, only if they match, replace them with write_data.
+ * Both buffers are copied. On a miscompare the callback is invoked with
+ * SCSI_STATUS_CHECK_CONDITION, task->sense.key is SCSI_SENSE_MISCOMPARE
+ * and, if task->sense.info_valid is set, task->sense.information holds
+ * the byte offset of the first difference.
+ */
+int iscsi_compareandwrite_async(struct iscsi_context *iscsi, int lun,
+				unsigned char *verify_data,
+				unsigned char *write_data, int datalen,
+				uint64_t lba, int fua, int blocksize,
+				iscsi_command_cb cb, void *private_data);
+/*
+ * EXTENDED COPY num_segments segments of blocks between the luns described
+ * by targets, as a copy offloaded to the target. The lun the command is
+ * sent to acts as the copy manager and must be able to reach all of the
+ * targets. The descriptors are copied into the command.
+ * Use RECEIVE COPY RESULTS with SCSI_COPY_RESULTS_OPERATING_PARAMETERS to
+ * find out how many segments and blocks the copy manager accepts.
+ */
+struct scsi_copy_target;
+struct scsi_copy_segment;
+int iscsi_extended_copy_async(struct iscsi_context *iscsi, int lun,
+			      int list_id, struct scsi_copy_target *targets,
+			      int num_targets,
+			      struct scsi_copy_segment *segments,
+			      int num_segments, iscsi_command_cb cb,
+			      void *private_data);
+int iscsi_receive_copy_results_async(struct iscsi_context *iscsi, int lun,
+				     int sa, int list_id, int alloc_len,
+				     iscsi_command_cb cb, void *private_data);
+int iscsi_report_target_port_groups_async(struct iscsi_context *iscsi,
+					  int lun, int alloc_len,
+					  iscsi_command_cb cb,
+					  void *private_data);
+/*
+ * UNMAP the list_len ranges in list. The list is copied and may be
+ * freed once the call returns. Lists larger than the block limits of the
+ * lun, see iscsi_set_block_limits(), are sent as a sequence of UNMAP
+ * commands and the callback is invoked once, with the task of the last
+ * command, or of the first one that did not complete with
+ * SCSI_STATUS_GOOD.
+ */
+struct unmap_list;
+int iscsi_unmap_async(struct iscsi_context *iscsi, int lun, int anchor,
+		      struct unmap_list *list, int list_len,
+		      iscsi_command_cb cb, void *private_data);
+/*
+ * WRITESAME10/16 the datalen byte logical block in data to num_blocks
+ * blocks from lba. If data is NULL a block of zeroes is written.
+ * With unmap set the target may deallocate the blocks instead of writing
+ * them. Like iscsi_unmap_async(), ranges larger than the target allows
+ * are split into several commands with a single callback.
+ */
+int iscsi_writesame10_async(struct iscsi_context *iscsi, int lun,
+			    unsigned char *data, int datalen, int lba,
+			    int num_blocks, int anchor, int unmap,
+			    iscsi_command_cb cb, void *private_data);
+int iscsi_writesame16_async(struct iscsi_context *iscsi, int lun,
+			    unsigned char *data, int datalen, uint64_t lba,
+			    uint64_t num_blocks, int anchor, int unmap,
+			    iscsi_command_cb cb, void *private_data);
 int iscsi_modesense6_async(struct iscsi_context *iscsi, int lun, int dbd,
 			   int pc, int page_code, int sub_page_code,
 			   unsigned char alloc_len, iscsi_command_cb cb,
@@ -445,9 +932,409 @@ struct scsi_task *
 iscsi_readcapacity10_sync(struct iscsi_context *iscsi, int lun, int lba,
 			  int pmi);
 
+struct scsi_task *
+iscsi_readcapacity16_sync(struct iscsi_context *iscsi, int lun);
+
 struct scsi_task *
 iscsi_synchronizecache10_sync(struct iscsi_context *iscsi, int lun, int lba,
 			      int num_blocks, int syncnv, int immed);
 
+struct scsi_task *
+iscsi_compareandwrite_sync(struct iscsi_context *iscsi, int lun,
+			   unsigned char *verify_data,
+			   unsigned char *write_data, int datalen,
+			   uint64_t lba, int fua, int blocksize);
+
+struct scsi_task *
+iscsi_extended_copy_sync(struct iscsi_context *iscsi, int lun, int list_id,
+			 struct scsi_copy_target *targets, int num_targets,
+			 struct scsi_copy_segment *segments,
+			 int num_segments);
+
+struct scsi_task *
+iscsi_receive_copy_results_sync(struct iscsi_context *iscsi, int lun, int sa,
+				int list_id, int alloc_len);
+
+struct scsi_task *
+iscsi_report_target_port_groups_sync(struct iscsi_context *iscsi, int lun,
+				     int alloc_len);
+
+struct scsi_task *
+iscsi_unmap_sync(struct iscsi_context *iscsi, int lun, int anchor,
+		 struct unmap_list *list, int list_len);
+
+struct scsi_task *
+iscsi_writesame10_sync(struct iscsi_context *iscsi, int lun,
+		       unsigned char *data, int datalen, int lba,
+		       int num_blocks, int anchor, int unmap);
+
+struct scsi_task *
+iscsi_writesame16_sync(struct iscsi_context *iscsi, int lun,
+		       unsigned char *data, int datalen, uint64_t lba,
+		       uint64_t num_blocks, int anchor, int unmap);
+
+struct scsi_task *
+iscsi_read16_sync(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		  int datalen, int blocksize);
+
+struct scsi_task *
+iscsi_write16_sync(struct iscsi_context *iscsi, int lun, unsigned char *data,
+		   int datalen, uint64_t lba, int fua, int fuanv,
+		   int blocksize);
+
 int
 iscsi_set_isid_random(struct iscsi_context *iscsi, int rnd);
+
+
+/*
+ * Event loop
+ *
+ * An alternative to polling the descriptor of every context by hand, for
+ * applications that drive many contexts from one thread. The loop keeps
+ * the sockets of its contexts in one epoll set and only services the
+ * contexts that have events, so the cost of a pass through the loop
+ * follows the number of busy contexts, not the number of contexts.
+ * Contexts can be added before they are connected, and stay in the loop
+ * when they reconnect.
+ * Only available where epoll is, iscsi_loop_create() fails elsewhere.
+ */
+struct iscsi_loop;
+
+/*
+ * Returns:
+ *  the loop on success
+ *  NULL on error
+ */
+struct iscsi_loop *iscsi_loop_create(void);
+
+/*
+ * Free the loop. Contexts that are still in it are removed, not destroyed.
+ */
+void iscsi_loop_destroy(struct iscsi_loop *loop);
+
+/*
+ * Add a context to the loop. If servicing the context fails, it is removed
+ * from the loop and the callback is invoked with SCSI_STATUS_ERROR.
+ * A context that is destroyed leaves the loop by itself.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_loop_add(struct iscsi_loop *loop, struct iscsi_context *iscsi,
+		   iscsi_command_cb cb, void *private_data);
+
+/*
+ * Returns:
+ *  0: success
+ * <0: error, the context was not in this loop
+ */
+int iscsi_loop_remove(struct iscsi_loop *loop, struct iscsi_context *iscsi);
+
+/*
+ * Wait up to timeout_ms milliseconds, or forever if it is -1, for events
+ * and call iscsi_service() for each context that has any, and for each
+ * context whose commands have timed out. Commands that other threads have
+ * submitted are sent, see iscsi_scsi_command_submit(). The wait is cut short for the
+ * latter, for the commands of a session with more than one connection
+ * this needs the context of the leading connection in the loop.
+ * A wait that is interrupted by a signal is resumed.
+ *
+ * Returns:
+ * >=0: the number of contexts that were serviced
+ *  <0: error, see errno
+ */
+int iscsi_loop_run_once(struct iscsi_loop *loop, int timeout_ms);
+
+int iscsi_loop_get_num_contexts(struct iscsi_loop *loop);
+
+
+/*
+ * Submitting from other threads
+ *
+ * A context must only be used from the thread that services it, the one
+ * calling iscsi_service(). This also goes for iscsi_get_error(). The
+ * exception is iscsi_scsi_command_submit(), which any thread may call once
+ * the session has a submit queue. It puts the command on a queue without
+ * locks and wakes up the service thread through an eventfd, which sends
+ * everything that has been submitted at once.
+ * The completion is delivered on the service thread, or on the thread that
+ * services the completion queue given with the command.
+ * Only available where eventfd is.
+ */
+struct iscsi_completion_queue;
+
+/*
+ * Give the session a submit queue, or with enable 0 take it away. Commands
+ * that are still in the queue then are completed with
+ * SCSI_STATUS_CANCELLED. The queue must be set up before other threads
+ * submit to it, and no thread may submit while it is taken away or the
+ * context is destroyed.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_set_submit_queue(struct iscsi_context *iscsi, int enable);
+
+/*
+ * Returns the eventfd of the submit queue, -1 if the session has none.
+ * When it is readable, call iscsi_service_submissions(). A context in an
+ * iscsi_loop and the synchronous calls poll it by themselves.
+ */
+int iscsi_get_submit_fd(struct iscsi_context *iscsi);
+
+/*
+ * Send the commands that have been submitted. Called on the service thread.
+ *
+ * Returns:
+ * >=0: the number of commands taken from the queue
+ *  <0: error, the session has no submit queue
+ */
+int iscsi_service_submissions(struct iscsi_context *iscsi);
+
+/*
+ * Same as iscsi_scsi_command_async() but safe to call from any thread.
+ * Commands that fail to be sent are completed with SCSI_STATUS_ERROR.
+ * The data buffer must remain valid until the callback has been invoked.
+ *
+ * If cq is NULL, the callback is invoked on the service thread, else on
+ * the thread that calls iscsi_completion_queue_service() for cq. The
+ * context it is passed must not be used there, other than for
+ * iscsi_scsi_command_submit(). The task is freed when the callback
+ * returns, as for iscsi_scsi_command_async().
+ *
+ * Returns:
+ *  0: success, the callback will be invoked
+ * <0: error, see errno. The task has been freed.
+ */
+struct scsi_task;
+int iscsi_scsi_command_submit(struct iscsi_context *iscsi, int lun,
+			      struct scsi_task *task, iscsi_command_cb cb,
+			      struct iscsi_data *data, void *private_data,
+			      struct iscsi_completion_queue *cq);
+
+/*
+ * A completion queue belongs to the thread that services it.
+ *
+ * Returns:
+ *  the completion queue on success
+ *  NULL on error, see errno
+ */
+struct iscsi_completion_queue *iscsi_create_completion_queue(void);
+
+/*
+ * Completions that have not been serviced are freed without invoking
+ * their callbacks. No command submitted with the queue may be outstanding.
+ */
+void iscsi_destroy_completion_queue(struct iscsi_completion_queue *cq);
+
+/*
+ * Returns the eventfd of the completion queue. When it is readable, call
+ * iscsi_completion_queue_service().
+ */
+int iscsi_completion_queue_get_fd(struct iscsi_completion_queue *cq);
+
+/*
+ * Invoke the callbacks of the commands that have completed.
+ *
+ * Returns the number of callbacks that were invoked.
+ */
+int iscsi_completion_queue_service(struct iscsi_completion_queue *cq);
+
+
+/*
+ * Multipath
+ *
+ * A multipath object logs in to the same lun of a target through several
+ * portals, one session per portal, and sends each command on one of them.
+ * If the lun reports target port groups (the TPGS field of the standard
+ * inquiry data), paths in the ACTIVE/OPTIMIZED state are used before
+ * ACTIVE/NON-OPTIMIZED ones, and ports in standby or unavailable state
+ * only as a last resort. The states are read with REPORT TARGET PORT GROUPS
+ * when a portal is added, and again in the background when a command
+ * completes with sense data saying that they have changed.
+ *
+ * Commands on a path that fails, or that are rejected because of the
+ * asymmetric access state of the port, are sent again on another path.
+ * The failed path is not used until iscsi_mpath_reinstate_sync() manages
+ * to log it in again.
+ *
+ * Each path has its own file descriptor. Poll all of them, with
+ * iscsi_mpath_next_timeout_ms() as the timeout, and call
+ * iscsi_mpath_service() for those that have events. When the timeout has
+ * passed call it for every path, with revents 0 for those without events.
+ */
+struct iscsi_mpath;
+
+enum iscsi_mpath_policy {
+	ISCSI_MPATH_ROUND_ROBIN       = 0,
+	ISCSI_MPATH_LEAST_QUEUE_DEPTH = 1
+};
+
+/*
+ * Create a multipath object for lun of target_name. No paths are
+ * connected until portals are added.
+ *
+ * Returns:
+ *  the object on success
+ *  NULL on error
+ */
+struct iscsi_mpath *iscsi_mpath_create(const char *initiator_name,
+				       const char *target_name, int lun);
+
+/*
+ * Log out of all paths and free the object. Callbacks for commands in
+ * flight are invoked with SCSI_STATUS_ERROR.
+ */
+void iscsi_mpath_destroy(struct iscsi_mpath *mp);
+
+const char *iscsi_mpath_get_error(struct iscsi_mpath *mp);
+
+/*
+ * How to spread commands over paths in the same asymmetric access state.
+ * The default is ISCSI_MPATH_ROUND_ROBIN.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_mpath_set_policy(struct iscsi_mpath *mp,
+			   enum iscsi_mpath_policy policy);
+
+/*
+ * Connect and log in to the target through portal, and add it as a path.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_mpath_add_portal_sync(struct iscsi_mpath *mp, const char *portal);
+
+/*
+ * Try to log in again on the paths that have failed.
+ *
+ * Returns the number of usable paths.
+ */
+int iscsi_mpath_reinstate_sync(struct iscsi_mpath *mp);
+
+/*
+ * Read the asymmetric access state of all paths from the target.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_mpath_update_alua_sync(struct iscsi_mpath *mp);
+
+/*
+ * Paths are numbered from 0 to iscsi_mpath_get_num_paths() - 1, in the
+ * order their portals were added. A failed path has fd -1.
+ */
+int iscsi_mpath_get_num_paths(struct iscsi_mpath *mp);
+int iscsi_mpath_get_fd(struct iscsi_mpath *mp, int path);
+int iscsi_mpath_which_events(struct iscsi_mpath *mp, int path);
+
+/*
+ * The earliest iscsi_next_timeout_ms() of the paths, -1 if no command on
+ * any of them can time out.
+ */
+int iscsi_mpath_next_timeout_ms(struct iscsi_mpath *mp);
+
+/*
+ * Process the events of a path. A path that fails is torn down and its
+ * commands are sent again on the other paths.
+ *
+ * Returns:
+ *  0: success
+ * <0: no usable path is left
+ */
+int iscsi_mpath_service(struct iscsi_mpath *mp, int path, int revents);
+
+/*
+ * Send task to the lun on the best path. The task and its data are kept
+ * until the command completes, so that it can be sent again on another
+ * path. The callback gets the context of the path that completed the
+ * command, and the task is freed when the callback returns.
+ * If the call fails, the task has been freed and the callback will not be
+ * invoked.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_mpath_scsi_command_async(struct iscsi_mpath *mp,
+				   struct scsi_task *task,
+				   struct iscsi_data *data,
+				   iscsi_command_cb cb, void *private_data);
+
+struct scsi_task *
+iscsi_mpath_scsi_command_sync(struct iscsi_mpath *mp, struct scsi_task *task,
+			      struct iscsi_data *data);
+
+
+/*
+ * Session pool
+ *
+ * A pool logs in to the same lun several times, one session per cpu by
+ * default, each with an isid of its own. Every session is serviced by a
+ * thread of its own, and a command goes to the session of the cpu it is
+ * submitted on, so the commands of one lun are processed on as many cores
+ * as there are sessions and submitting takes no locks. Where the platform
+ * allows, the thread of a session is kept on the cpus that submit to it.
+ *
+ * A session that fails and can not be recovered is no longer used, its
+ * commands go to the other sessions of the pool.
+ */
+struct iscsi_pool;
+
+/*
+ * Create a pool of num_sessions sessions to lun of target_name, or of one
+ * session per cpu if num_sessions is 0. Nothing is connected until
+ * iscsi_pool_connect_sync() is called.
+ *
+ * Returns:
+ *  the pool on success
+ *  NULL on error
+ */
+struct iscsi_pool *iscsi_pool_create(const char *initiator_name,
+				     const char *target_name, int lun,
+				     int num_sessions);
+
+/*
+ * Stop the threads, log out of all sessions and free the pool. Commands
+ * still in flight complete on the calling thread or through their
+ * completion queue, with SCSI_STATUS_CANCELLED if the target has not
+ * answered them before the logout. No thread may submit meanwhile.
+ */
+void iscsi_pool_destroy(struct iscsi_pool *pool);
+
+const char *iscsi_pool_get_error(struct iscsi_pool *pool);
+
+/*
+ * Log all sessions in through portal and start their threads. If one of
+ * them fails, all are logged out again.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_pool_connect_sync(struct iscsi_pool *pool, const char *portal);
+
+int iscsi_pool_get_num_sessions(struct iscsi_pool *pool);
+
+/*
+ * Send task to the lun on the session of the calling cpu, as
+ * iscsi_scsi_command_submit() does. Safe to call from any thread once the
+ * pool is connected.
+ * If cq is NULL, the callback is invoked on the thread of the session.
+ *
+ * Returns:
+ *  0: success, the callback will be invoked
+ * <0: error, see errno. The task has been freed.
+ */
+int iscsi_pool_scsi_command_submit(struct iscsi_pool *pool,
+				   struct scsi_task *task,
+				   struct iscsi_data *data,
+				   iscsi_command_cb cb, void *private_data,
+				   struct iscsi_completion_queue *cq);
@@ -25,7 +25,25 @@ enum scsi_opcode {
 	SCSI_OPCODE_READ10             = 0x28,
 	SCSI_OPCODE_WRITE10            = 0x2A,
 	SCSI_OPCODE_SYNCHRONIZECACHE10 = 0x35,
-	SCSI_OPCODE_REPORTLUNS         = 0xA0
+	SCSI_OPCODE_WRITE_SAME10       = 0x41,
+	SCSI_OPCODE_UNMAP              = 0x42,
+	SCSI_OPCODE_EXTENDED_COPY      = 0x83,
+	SCSI_OPCODE_RECEIVE_COPY_RESULTS = 0x84,
+	SCSI_OPCODE_READ16             = 0x88,
+	SCSI_OPCODE_COMPARE_AND_WRITE  = 0x89,
+	SCSI_OPCODE_WRITE16            = 0x8A,
+	SCSI_OPCODE_WRITE_SAME16       = 0x93,
+	SCSI_OPCODE_SERVICE_ACTION_IN  = 0x9E,
+	SCSI_OPCODE_REPORTLUNS         = 0xA0,
+	SCSI_OPCODE_MAINTENANCE_IN     = 0xA3
+};
+
+enum scsi_service_action_in {
+	SCSI_READCAPACITY16            = 0x10
+};
+
+enum scsi_maintenance_in {
+	SCSI_REPORT_TARGET_PORT_GROUPS = 0x0A
 };
 
 /* sense keys */
@@ -50,9 +68,14 @@ enum scsi_sense_key {
 const char *scsi_sense_key_str(int key);
 
 /* ascq */
+#define SCSI_SENSE_ASCQ_ASYMMETRIC_ACCESS_TRANSITION	0x040a
+#define SCSI_SENSE_ASCQ_TARGET_PORT_IN_STANDBY		0x040b
+#define SCSI_SENSE_ASCQ_TARGET_PORT_IN_UNAVAILABLE	0x040c
+#define SCSI_SENSE_ASCQ_MISCOMPARE_DURING_VERIFY	0x1d00
 #define SCSI_SENSE_ASCQ_INVALID_FIELD_IN_CDB		0x2400
 #define SCSI_SENSE_ASCQ_LOGICAL_UNIT_NOT_SUPPORTED	0x2500
 #define SCSI_SENSE_ASCQ_BUS_RESET			0x2900
+#define SCSI_SENSE_ASCQ_ASYMMETRIC_ACCESS_STATE_CHANGED	0x2a06
 
 const char *scsi_sense_ascq_str(int ascq);
 
@@ -85,8 +108,17 @@ struct scsi_sense {
 	unsigned char       error_type;
 	enum scsi_sense_key key;
 	int                 ascq;
+	/* the INFORMATION field, e.g. the byte offset of a miscompare */
+	int                 info_valid;
+	uint64_t            information;
 };
 
+/*
+ * Fill in sense from len bytes of fixed or descriptor format sense data.
+ */
+void scsi_parse_sense_data(struct scsi_sense *sense, const unsigned char *sb,
+			int len);
+
 struct scsi_data {
 	int            size;
 	unsigned char *data;
@@ -97,6 +129,12 @@ struct scsi_allocated_memory {
 	void                         *ptr;
 };
 
+struct scsi_data_buffer {
+	struct scsi_data_buffer *next;
+	int                      len;
+	unsigned char           *data;
+};
+
 struct scsi_task {
 	int status;
 
@@ -115,6 +153,16 @@ struct scsi_task {
 	struct scsi_data datain;
 	struct scsi_allocated_memory *mem;
 
+	/* application buffers that DATA-IN is placed straight into */
+	struct scsi_data_buffer *in_buffers;
+	/* application buffers that DATA-OUT is sent straight from */
+	struct scsi_data_buffer *out_buffers;
+
+	/* milliseconds the task may take, 0 for the timeout of the context
+	 * and -1 for none
+	 */
+	int timeout;
+
 	void *ptr;
 };
 
@@ -122,6 +170,60 @@ void scsi_free_scsi_task(struct scsi_task *task);
 void scsi_set_task_private_ptr(struct scsi_task *task, void *ptr);
 void *scsi_get_task_private_ptr(struct scsi_task *task);
 
+/*
+ * Add a buffer that DATA-IN for this task should be read into.
+ * Buffers are filled in the order they were added and the application
+ * must keep them valid until the task has completed.
+ * When a task has data-in buffers, task->datain is not used for the
+ * payload.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int scsi_task_add_data_in_buffer(struct scsi_task *task, int len,
+			unsigned char *buf);
+
+/*
+ * Returns a pointer to the data-in buffer location for offset pos of the
+ * transfer, and in available the number of contiguous bytes from there.
+ * Returns NULL if pos is negative or beyond the buffers added to the task.
+ */
+unsigned char *scsi_task_get_data_in_buffer(struct scsi_task *task, int pos,
+			int *available);
+
+/*
+ * Add a buffer that DATA-OUT for this task should be sent from.
+ * Buffers are sent in the order they were added and are referenced, not
+ * copied, so the application must keep them valid and unmodified until
+ * the task has completed.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int scsi_task_add_data_out_buffer(struct scsi_task *task, int len,
+			unsigned char *buf);
+
+/*
+ * Add a copy of buf as a DATA-OUT buffer for this task. The copy is freed
+ * together with the task.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int scsi_task_copy_data_out_buffer(struct scsi_task *task, int len,
+			const unsigned char *buf);
+
+/*
+ * Returns a pointer to the data-out buffer location for offset pos of the
+ * transfer, and in available the number of contiguous bytes from there.
+ * Returns NULL if pos is negative or beyond the buffers added to the task.
+ */
+unsigned char *scsi_task_get_data_out_buffer(struct scsi_task *task, int pos,
+			int *available);
+
 /*
  * TESTUNITREADY
  */
@@ -151,6 +253,22 @@ struct scsi_readcapacity10 {
 };
 struct scsi_task *scsi_cdb_readcapacity10(int lba, int pmi);
 
+/*
+ * READCAPACITY16
+ */
+struct scsi_readcapacity16 {
+	uint64_t returned_lba;
+	uint32_t block_length;
+	uint8_t  p_type;
+	uint8_t  prot_en;
+	uint8_t  p_i_exp;
+	uint8_t  lbppbe;
+	uint8_t  lbpme;
+	uint8_t  lbprz;
+	uint16_t lalba;
+};
+struct scsi_task *scsi_cdb_readcapacity16(void);
+
 
 /*
  * INQUIRY
@@ -239,6 +357,7 @@ enum scsi_inquiry_pagecode {
 	SCSI_INQUIRY_PAGECODE_SUPPORTED_VPD_PAGES          = 0x00,
 	SCSI_INQUIRY_PAGECODE_UNIT_SERIAL_NUMBER           = 0x80,
 	SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION        = 0x83,
+	SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS                 = 0xB0,
 	SCSI_INQUIRY_PAGECODE_BLOCK_DEVICE_CHARACTERISTICS = 0xB1
 };
 
@@ -261,6 +380,26 @@ struct scsi_inquiry_block_device_characteristics {
 	int medium_rotation_rate;
 };
 
+/*
+ * A count of 0 means the target did not report a limit for that field.
+ */
+struct scsi_inquiry_block_limits {
+	enum scsi_inquiry_peripheral_qualifier periperal_qualifier;
+	enum scsi_inquiry_peripheral_device_type periperal_device_type;
+	enum scsi_inquiry_pagecode pagecode;
+
+	int max_compare_and_write_length;
+	int optimal_transfer_length_granularity;
+	uint32_t max_transfer_length;
+	uint32_t optimal_transfer_length;
+	uint32_t max_unmap_lba_count;
+	uint32_t max_unmap_block_descriptor_count;
+	uint32_t optimal_unmap_granularity;
+	int ugavalid;
+	uint32_t unmap_granularity_alignment;
+	uint64_t max_write_same_length;
+};
+
 struct scsi_task *scsi_cdb_inquiry(int evpd, int page_code, int alloc_len);
 
 struct scsi_inquiry_unit_serial_number {
@@ -335,6 +474,42 @@ struct scsi_inquiry_device_identification {
 	struct scsi_inquiry_device_designator *designators;
 };
 
+/*
+ * REPORT TARGET PORT GROUPS
+ * The asymmetric access state of each target port group of the lun, and
+ * the relative target port identifiers that belong to each group. The
+ * group a port belongs to is reported in the TARGET_PORT_GROUP designator
+ * of the device identification page of that port.
+ */
+enum scsi_alua_state {
+	SCSI_ALUA_ACTIVE_OPTIMIZED    = 0x00,
+	SCSI_ALUA_ACTIVE_NONOPTIMIZED = 0x01,
+	SCSI_ALUA_STANDBY             = 0x02,
+	SCSI_ALUA_UNAVAILABLE         = 0x03,
+	SCSI_ALUA_LBA_DEPENDENT       = 0x04,
+	SCSI_ALUA_OFFLINE             = 0x0e,
+	SCSI_ALUA_TRANSITIONING       = 0x0f
+};
+
+const char *scsi_alua_state_to_str(int state);
+
+struct scsi_target_port_group {
+	int pref;
+	enum scsi_alua_state alua_state;
+	int supported_states;
+	uint16_t port_group;
+	int status_code;
+	int num_ports;
+	uint16_t *ports;
+};
+
+struct scsi_report_target_port_groups {
+	int num_groups;
+	struct scsi_target_port_group *groups;
+};
+
+struct scsi_task *scsi_cdb_report_target_port_groups(int alloc_len);
+
 /*
  * MODESENSE6
  */
@@ -364,6 +539,111 @@ void *scsi_datain_unmarshall(struct scsi_task *task);
 struct scsi_task *scsi_cdb_read10(int lba, int xferlen, int blocksize);
 struct scsi_task *scsi_cdb_write10(int lba, int xferlen, int fua, int fuanv,
 			int blocksize);
+struct scsi_task *scsi_cdb_read16(uint64_t lba, int xferlen, int blocksize);
+struct scsi_task *scsi_cdb_write16(uint64_t lba, int xferlen, int fua,
+			int fuanv, int blocksize);
 
 struct scsi_task *scsi_cdb_synchronizecache10(int lba, int num_blocks,
 			int syncnv, int immed);
+
+/*
+ * COMPARE AND WRITE
+ * xferlen is the size of the whole DATA-OUT, the blocks to verify
+ * followed by as many blocks to write if they match.
+ * A miscompare completes with a MISCOMPARE sense key and the byte offset
+ * of the first difference in sense.information.
+ */
+struct scsi_task *scsi_cdb_compareandwrite(uint64_t lba, int xferlen,
+			int blocksize, int wrprotect, int dpo, int fua,
+			int group);
+
+/*
+ * EXTENDED COPY (LID1)
+ * Copies blocks between the luns described by the copy target descriptors,
+ * without the data passing through the initiator. Each segment copies
+ * num_blocks blocks between the targets at src_index and dst_index of the
+ * targets array.
+ */
+struct scsi_copy_target {
+	/* a logical unit designator from the device identification page */
+	struct scsi_inquiry_device_designator *designator;
+	int block_length;
+};
+
+struct scsi_copy_segment {
+	int src_index;
+	int dst_index;
+	int num_blocks;
+	uint64_t src_lba;
+	uint64_t dst_lba;
+};
+
+/* the descriptor type codes for the descriptors above */
+#define SCSI_COPY_SEGMENT_BLOCK_TO_BLOCK	0x02
+#define SCSI_COPY_TARGET_IDENTIFICATION		0xe4
+
+struct scsi_task *scsi_cdb_extended_copy(int list_id,
+			struct scsi_copy_target *targets, int num_targets,
+			struct scsi_copy_segment *segments, int num_segments);
+
+/*
+ * RECEIVE COPY RESULTS
+ */
+enum scsi_copy_results_sa {
+	SCSI_COPY_RESULTS_COPY_STATUS          = 0x00,
+	SCSI_COPY_RESULTS_OPERATING_PARAMETERS = 0x03
+};
+
+struct scsi_copy_results_copy_status {
+	int hdd;
+	int copy_manager_status;
+	int segments_processed;
+	int transfer_count_units;
+	uint32_t transfer_count;
+};
+
+struct scsi_copy_results_op_params {
+	int snlid;
+	int max_target_desc_count;
+	int max_segment_desc_count;
+	uint32_t max_desc_list_length;
+	uint32_t max_segment_length;
+	uint32_t max_inline_data_length;
+	uint32_t held_data_limit;
+	uint32_t max_stream_device_transfer_size;
+	int total_concurrent_copies;
+	int max_concurrent_copies;
+	int data_segment_granularity;
+	int inline_data_granularity;
+	int held_data_granularity;
+	int num_desc_type_codes;
+	unsigned char *desc_type_codes;
+};
+
+struct scsi_task *scsi_cdb_receive_copy_results(enum scsi_copy_results_sa sa,
+			int list_id, int alloc_len);
+
+/*
+ * UNMAP
+ * The block descriptor parameter list is built from list and sent as
+ * DATA-OUT together with the cdb.
+ */
+struct unmap_list {
+	uint64_t lba;
+	uint32_t num;
+};
+
+struct scsi_task *scsi_cdb_unmap(int anchor, int group,
+			struct unmap_list *list, int list_len);
+
+/*
+ * WRITESAME10/16
+ * datalen is the size of the single logical block of DATA-OUT that is
+ * replicated over num_blocks blocks. With unmap set the target may
+ * deallocate the blocks instead, if the data is all zero.
+ */
+struct scsi_task *scsi_cdb_writesame10(int wrprotect, int anchor, int unmap,
+			int lba, int group, int num_blocks, int datalen);
+struct scsi_task *scsi_cdb_writesame16(int wrprotect, int anchor, int unmap,
+			uint64_t lba, int group, uint32_t num_blocks,
+			int datalen);
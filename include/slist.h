@@ -46,6 +46,35 @@
 	   (*list) = head;					\
 	}
 
+/*
+ * Doubly linked lists that also track their tail, so that adding to the
+ * end and removing any item are O(1). Items need both a next and a prev
+ * pointer.
+ */
+#define DLIST_ADD_END(list, tail, item)				\
+	do {							\
+		(item)->next = NULL;				\
+		(item)->prev = (*tail);				\
+		if ((*tail) == NULL) {				\
+			(*list) = (item);			\
+		} else {					\
+			(*tail)->next = (item);			\
+		}						\
+		(*tail) = (item);				\
+	} while (0)
 
-
-
+#define DLIST_REMOVE(list, tail, item)				\
+	do {							\
+		if ((item)->prev == NULL) {			\
+			(*list) = (item)->next;			\
+		} else {					\
+			(item)->prev->next = (item)->next;	\
+		}						\
+		if ((item)->next == NULL) {			\
+			(*tail) = (item)->prev;			\
+		} else {					\
+			(item)->next->prev = (item)->prev;	\
+		}						\
+		(item)->next = NULL;				\
+		(item)->prev = NULL;				\
+	} while (0)
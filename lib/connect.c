@@ -16,10 +16,12 @@
 */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
 #include "scsi-lowlevel.h"
+#include "slist.h"
 
 struct connect_task {
 	iscsi_command_cb cb;
@@ -27,6 +29,28 @@ struct connect_task {
 	int lun;
 };
 
+/*
+ * The full connect is done and the connect_task goes away. Once connected,
+ * a failure of the connection, after any attempts to reconnect, is the
+ * second invocation of the callback of the application that iscsi.h
+ * promises. A connect that failed has nothing more to report.
+ */
+static void
+iscsi_connect_task_done(struct iscsi_context *iscsi, struct connect_task *ct,
+			int status)
+{
+	if (status == SCSI_STATUS_GOOD) {
+		iscsi->socket_status_cb = ct->cb;
+		iscsi->connect_data     = ct->private_data;
+	} else {
+		iscsi->socket_status_cb = NULL;
+		iscsi->connect_data     = NULL;
+	}
+
+	ct->cb(iscsi, status, NULL, ct->private_data);
+	free(ct);
+}
+
 static void
 iscsi_testunitready_cb(struct iscsi_context *iscsi, int status,
 		       void *command_data, void *private_data)
@@ -47,17 +71,15 @@ iscsi_testunitready_cb(struct iscsi_context *iscsi, int status,
 						      ct) != 0) {
 				iscsi_set_error(iscsi, "iscsi_testunitready "
 						"failed.");
-				ct->cb(iscsi, SCSI_STATUS_ERROR, NULL,
-				       ct->private_data);
-				free(ct);
+				iscsi_connect_task_done(iscsi, ct,
+							SCSI_STATUS_ERROR);
 			}
 			return;
 		}
 	}
 
-	ct->cb(iscsi, status?SCSI_STATUS_ERROR:SCSI_STATUS_GOOD, NULL,
-	       ct->private_data);
-	free(ct);
+	iscsi_connect_task_done(iscsi, ct,
+				status?SCSI_STATUS_ERROR:SCSI_STATUS_GOOD);
 }
 
 static void
@@ -69,16 +91,14 @@ iscsi_login_cb(struct iscsi_context *iscsi, int status, void *command_data _U_,
 	if (status != 0) {
 		iscsi_set_error(iscsi, "Failed to login to iSCSI target. "
 				"%s", iscsi_get_error(iscsi));
-		ct->cb(iscsi, SCSI_STATUS_ERROR, NULL, ct->private_data);
-		free(ct);
+		iscsi_connect_task_done(iscsi, ct, SCSI_STATUS_ERROR);
 		return;
 	}
 
 	if (iscsi_testunitready_async(iscsi, ct->lun,
 				      iscsi_testunitready_cb, ct) != 0) {
 		iscsi_set_error(iscsi, "iscsi_testunitready_async failed.");
-		ct->cb(iscsi, SCSI_STATUS_ERROR, NULL, ct->private_data);
-		free(ct);
+		iscsi_connect_task_done(iscsi, ct, SCSI_STATUS_ERROR);
 	}
 }
 
@@ -91,15 +111,13 @@ iscsi_connect_cb(struct iscsi_context *iscsi, int status, void *command_data _U_
 	if (status != 0) {
 		iscsi_set_error(iscsi, "Failed to connect to iSCSI socket. "
 				"%s", iscsi_get_error(iscsi));
-		ct->cb(iscsi, SCSI_STATUS_ERROR, NULL, ct->private_data);
-		free(ct);
+		iscsi_connect_task_done(iscsi, ct, SCSI_STATUS_ERROR);
 		return;
 	}
 
 	if (iscsi_login_async(iscsi, iscsi_login_cb, ct) != 0) {
 		iscsi_set_error(iscsi, "iscsi_login_async failed.");
-		ct->cb(iscsi, SCSI_STATUS_ERROR, NULL, ct->private_data);
-		free(ct);
+		iscsi_connect_task_done(iscsi, ct, SCSI_STATUS_ERROR);
 	}
 }
 
@@ -125,3 +143,345 @@ iscsi_full_connect_async(struct iscsi_context *iscsi, const char *portal,
 	}
 	return 0;
 }
+
+int
+iscsi_set_reconnect_max_retries(struct iscsi_context *iscsi, int count)
+{
+	if (count < 0) {
+		iscsi_set_error(iscsi, "invalid reconnect retry count %d",
+				count);
+		return -1;
+	}
+
+	iscsi->reconnect_max_retries = count;
+
+	return 0;
+}
+
+int
+iscsi_set_reconnect_interval(struct iscsi_context *iscsi, int interval)
+{
+	if (interval < 0) {
+		iscsi_set_error(iscsi, "invalid reconnect interval %d",
+				interval);
+		return -1;
+	}
+
+	iscsi->reconnect_interval = interval;
+
+	return 0;
+}
+
+/*
+ * Only a normal session on a single connection is recovered, logging in
+ * again with the same isid and tsih 0 makes the target reinstate it.
+ */
+static int
+iscsi_can_reconnect(struct iscsi_context *iscsi)
+{
+	return iscsi->reconnect_max_retries > 0
+		&& iscsi->portal != NULL
+		&& iscsi->is_loggedin
+		&& iscsi->session_type == ISCSI_SESSION_NORMAL
+		&& iscsi->leader == NULL
+		&& iscsi->next_connection == NULL;
+}
+
+static int
+iscsi_cmdsn_compare(const void *p1, const void *p2)
+{
+	const struct iscsi_pdu *pdu1 = *(struct iscsi_pdu * const *)p1;
+	const struct iscsi_pdu *pdu2 = *(struct iscsi_pdu * const *)p2;
+
+	return (int32_t)(pdu1->cmdsn - pdu2->cmdsn);
+}
+
+/*
+ * Take every pdu off the old connection. SCSI commands are held to be sent
+ * again, in the order of their cmdsn, unless they have timed out. DATA-OUT
+ * is sent again in reply to the R2Ts of the new connection and anything
+ * else fails.
+ */
+static void
+iscsi_reconnect_hold_commands(struct iscsi_context *iscsi)
+{
+	struct iscsi_pdu *pdu, *next, **cmds;
+	struct iscsi_pdu *failed = NULL, *failed_tail = NULL;
+	int i, count;
+
+	for (pdu = iscsi->outqueue; pdu != NULL; pdu = next) {
+		next = pdu->next;
+		if (pdu->cmd_pdu != NULL) {
+			DLIST_REMOVE(&iscsi->outqueue, &iscsi->outqueue_tail,
+				     pdu);
+			iscsi_free_pdu(iscsi, pdu);
+		}
+	}
+
+	count = iscsi->waitpdu_count;
+	for (pdu = iscsi->outqueue; pdu != NULL; pdu = pdu->next) {
+		count++;
+	}
+	cmds = malloc(sizeof(struct iscsi_pdu *) * (count + 1));
+
+	count = 0;
+	while ((pdu = iscsi_first_waitpdu(iscsi)) != NULL
+	       || (pdu = iscsi->outqueue) != NULL) {
+		if (pdu == iscsi->outqueue) {
+			DLIST_REMOVE(&iscsi->outqueue, &iscsi->outqueue_tail,
+				     pdu);
+		} else {
+			iscsi_waitpdu_remove(iscsi, pdu);
+		}
+
+		if (pdu->scsi_cbdata != NULL
+		    && (pdu->flags & ISCSI_PDU_TIMED_OUT)) {
+			/* it had its chance, it is not sent again */
+			pdu->callback(iscsi, SCSI_STATUS_TIMEOUT,
+				      pdu->scsi_cbdata->task,
+				      pdu->private_data);
+			iscsi_free_pdu(iscsi, pdu);
+			continue;
+		}
+		if (pdu->scsi_cbdata != NULL) {
+			pdu->conn = NULL;
+			if (cmds != NULL) {
+				cmds[count++] = pdu;
+			} else {
+				DLIST_ADD_END(&iscsi->reconnect_cmds,
+					      &iscsi->reconnect_cmds_tail, pdu);
+			}
+			continue;
+		}
+		/* the login of an attempt to reconnect that failed and the
+		 * rest of a DATA-OUT that was cut loose from its command have
+		 * no one to tell, a nop, task management, logout or text
+		 * request fails once the commands are in place
+		 */
+		if ((pdu->hdr[0] & 0x3f) == ISCSI_PDU_LOGIN_REQUEST
+		    || (pdu->flags & ISCSI_PDU_DELETE_WHEN_SENT)) {
+			iscsi_free_pdu(iscsi, pdu);
+			continue;
+		}
+		DLIST_ADD_END(&failed, &failed_tail, pdu);
+	}
+
+	if (cmds != NULL) {
+		qsort(cmds, count, sizeof(struct iscsi_pdu *),
+		      iscsi_cmdsn_compare);
+		for (i = 0; i < count; i++) {
+			DLIST_ADD_END(&iscsi->reconnect_cmds,
+				      &iscsi->reconnect_cmds_tail, cmds[i]);
+		}
+		free(cmds);
+	}
+
+	/* followed by those that were still waiting for the cmdsn window */
+	while ((pdu = iscsi->cmd_backlog) != NULL) {
+		DLIST_REMOVE(&iscsi->cmd_backlog, &iscsi->cmd_backlog_tail,
+			     pdu);
+		DLIST_ADD_END(&iscsi->reconnect_cmds,
+			      &iscsi->reconnect_cmds_tail, pdu);
+	}
+	iscsi->cmd_backlog_count = 0;
+
+	while ((pdu = failed) != NULL) {
+		DLIST_REMOVE(&failed, &failed_tail, pdu);
+		if (pdu->callback != NULL) {
+			pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
+				      pdu->private_data);
+		}
+		iscsi_free_pdu(iscsi, pdu);
+	}
+}
+
+/*
+ * Forget everything about the old connection and the old login.
+ */
+static void
+iscsi_reconnect_reset(struct iscsi_context *iscsi)
+{
+	if (iscsi->fd != -1) {
+		iscsi_disconnect(iscsi);
+	}
+	if (iscsi->incoming != NULL) {
+		iscsi_free_iscsi_in_pdu(iscsi->incoming);
+		iscsi->incoming = NULL;
+	}
+	if (iscsi->inqueue != NULL) {
+		iscsi_free_iscsi_inqueue(iscsi->inqueue);
+		iscsi->inqueue      = NULL;
+		iscsi->inqueue_tail = NULL;
+	}
+
+	/* callbacks of the commands that fail can not send anything new on
+	 * the connection that is gone
+	 */
+	iscsi->is_loggedin = 0;
+	iscsi_reconnect_hold_commands(iscsi);
+
+	/* a timeout that gave up on the old connection is dealt with */
+	iscsi->timed_out      = 0;
+	iscsi->tsih           = 0;
+	iscsi->login_attempts = 0;
+	iscsi->current_phase  = ISCSI_PDU_LOGIN_CSG_SECNEG;
+	iscsi->next_phase     = ISCSI_PDU_LOGIN_NSG_OPNEG;
+	iscsi->secneg_phase   = ISCSI_LOGIN_SECNEG_PHASE_OFFER_CHAP;
+
+	iscsi->header_digest       = ISCSI_HEADER_DIGEST_NONE;
+	iscsi->data_digest         = ISCSI_DATA_DIGEST_NONE;
+	iscsi->login_header_digest = ISCSI_HEADER_DIGEST_NONE;
+	iscsi->login_data_digest   = ISCSI_DATA_DIGEST_NONE;
+
+	iscsi->target_max_recv_data_segment_length =
+		ISCSI_DEFAULT_MAX_RECV_DATA_SEGMENT_LENGTH;
+	iscsi->first_burst_length  = ISCSI_DEFAULT_FIRST_BURST_LENGTH;
+	iscsi->max_burst_length    = ISCSI_DEFAULT_MAX_BURST_LENGTH;
+	iscsi->max_outstanding_r2t = ISCSI_DEFAULT_MAX_OUTSTANDING_R2T;
+	iscsi->initial_r2t         = ISCSI_INITIAL_R2T_YES;
+	iscsi->immediate_data      = ISCSI_IMMEDIATE_DATA_YES;
+	iscsi->max_connections     = ISCSI_DEFAULT_MAX_CONNECTIONS;
+}
+
+/*
+ * Out of retries. Every held command fails and the application gets its
+ * callback back.
+ */
+static void
+iscsi_reconnect_give_up(struct iscsi_context *iscsi)
+{
+	struct iscsi_pdu *pdu;
+	char *error;
+
+	iscsi->is_reconnecting  = 0;
+	iscsi->socket_status_cb = iscsi->reconnect_status_cb;
+	iscsi->connect_data     = iscsi->reconnect_data;
+
+	error = iscsi_get_error(iscsi) != NULL
+		? strdup(iscsi_get_error(iscsi)) : NULL;
+	while ((pdu = iscsi->reconnect_cmds) != NULL) {
+		DLIST_REMOVE(&iscsi->reconnect_cmds,
+			     &iscsi->reconnect_cmds_tail, pdu);
+		pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
+			      pdu->private_data);
+		iscsi_free_pdu(iscsi, pdu);
+	}
+	iscsi_set_error(iscsi, "Failed to reconnect after %d attempts: %s",
+			iscsi->reconnect_retries,
+			error != NULL ? error : "");
+	free(error);
+}
+
+static void
+iscsi_reconnect_login_cb(struct iscsi_context *iscsi, int status,
+			 void *command_data _U_, void *private_data _U_)
+{
+	struct iscsi_pdu *cmds, *cmds_tail, *pdu;
+
+	if (status != 0) {
+		/* iscsi_service() starts the next attempt once it is done
+		 * with the socket
+		 */
+		iscsi_disconnect(iscsi);
+		return;
+	}
+
+	iscsi->is_reconnecting  = 0;
+	iscsi->socket_status_cb = iscsi->reconnect_status_cb;
+	iscsi->connect_data     = iscsi->reconnect_data;
+
+	cmds      = iscsi->reconnect_cmds;
+	cmds_tail = iscsi->reconnect_cmds_tail;
+	iscsi->reconnect_cmds      = NULL;
+	iscsi->reconnect_cmds_tail = NULL;
+	while ((pdu = cmds) != NULL) {
+		DLIST_REMOVE(&cmds, &cmds_tail, pdu);
+		iscsi_scsi_command_reissue(iscsi, pdu);
+	}
+}
+
+static void
+iscsi_reconnect_connect_cb(struct iscsi_context *iscsi, int status,
+			   void *command_data _U_, void *private_data _U_)
+{
+	if (status != 0
+	    || iscsi_login_async(iscsi, iscsi_reconnect_login_cb, NULL) != 0) {
+		iscsi_disconnect(iscsi);
+	}
+}
+
+static int
+iscsi_reconnect_attempt(struct iscsi_context *iscsi)
+{
+	iscsi->reconnect_retries++;
+
+	return iscsi_connect_async(iscsi, iscsi->portal,
+				   iscsi_reconnect_connect_cb, NULL);
+}
+
+/*
+ * The wait before the next attempt has passed. If the connect fails right
+ * away iscsi_service() finds the socket closed and schedules the one after.
+ */
+void
+iscsi_reconnect_timer_expired(struct iscsi_context *iscsi)
+{
+	iscsi_reconnect_attempt(iscsi);
+}
+
+/*
+ * How long to wait before the next attempt, twice as long as before the
+ * last one.
+ */
+static int
+iscsi_reconnect_delay(struct iscsi_context *iscsi)
+{
+	int delay = iscsi->reconnect_interval;
+	int i;
+
+	for (i = 1; i < iscsi->reconnect_retries
+		    && delay <= ISCSI_MAX_RECONNECT_INTERVAL / 2; i++) {
+		delay *= 2;
+	}
+
+	return delay;
+}
+
+/*
+ * The connection has failed, or an attempt to recover it has. The first
+ * attempt to connect and log in again is made straight away, the others
+ * wait in the timer wheel for their turn while there are retries left.
+ * Returns 0 while a reconnect is under way and -1 if the connection is
+ * lost, any commands that were held have then been failed.
+ */
+int
+iscsi_reconnect(struct iscsi_context *iscsi)
+{
+	if (iscsi->is_reconnecting == 0) {
+		if (!iscsi_can_reconnect(iscsi)) {
+			return -1;
+		}
+		iscsi->is_reconnecting     = 1;
+		iscsi->reconnect_retries   = 0;
+		iscsi->reconnect_status_cb = iscsi->socket_status_cb;
+		iscsi->reconnect_data      = iscsi->connect_data;
+
+		iscsi_reconnect_reset(iscsi);
+		if (iscsi_reconnect_attempt(iscsi) == 0) {
+			return 0;
+		}
+	} else if (iscsi->reconnect_timer.level != -1) {
+		/* the next attempt is waiting for its time */
+		return 0;
+	}
+
+	iscsi_reconnect_reset(iscsi);
+	if (iscsi->reconnect_retries < iscsi->reconnect_max_retries
+	    && iscsi_timeout_arm_reconnect(iscsi,
+					   iscsi_reconnect_delay(iscsi)) == 0) {
+		return 0;
+	}
+
+	iscsi_reconnect_give_up(iscsi);
+	return -1;
+}
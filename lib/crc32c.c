@@ -14,6 +14,14 @@
    You should have received a copy of the GNU Lesser General Public License
    along with this program; if not, see <http://www.gnu.org/licenses/>.
 */
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__aarch64__) && defined(HAVE_SYS_AUXV_H)
+#include <sys/auxv.h>
+#endif
 #include "iscsi.h"
 #include "iscsi-private.h"
 
@@ -104,12 +112,172 @@ static unsigned long crctable[256] = {
  0xBE2DA0A5L, 0x4C4623A6L, 0x5F16D052L, 0xAD7D5351L
 };
 
-unsigned long crc32c(char *buf, int len)
+/*
+ * Slicing-by-8: eight tables derived from crctable so that eight bytes are
+ * folded into the crc per step instead of one.
+ */
+static uint32_t crctable8[8][256];
+
+static void
+crc32c_init_tables(void)
+{
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crctable8[0][i] = crctable[i];
+	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++) {
+			crctable8[j][i] = (crctable8[j - 1][i] >> 8)
+				^ crctable[crctable8[j - 1][i] & 0xff];
+		}
+	}
+}
+
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+#ifndef WORDS_BIGENDIAN
+	while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+		crc = (crc >> 8) ^ crctable8[0][(crc ^ *buf++) & 0xff];
+		len--;
+	}
+	while (len >= 8) {
+		uint32_t lo, hi;
+
+		memcpy(&lo, buf, 4);
+		memcpy(&hi, buf + 4, 4);
+		lo ^= crc;
+		crc = crctable8[7][lo & 0xff]
+			^ crctable8[6][(lo >> 8) & 0xff]
+			^ crctable8[5][(lo >> 16) & 0xff]
+			^ crctable8[4][lo >> 24]
+			^ crctable8[3][hi & 0xff]
+			^ crctable8[2][(hi >> 8) & 0xff]
+			^ crctable8[1][(hi >> 16) & 0xff]
+			^ crctable8[0][hi >> 24];
+		buf += 8;
+		len -= 8;
+	}
+#endif
+	while (len-- > 0) {
+		crc = (crc >> 8) ^ crctable8[0][(crc ^ *buf++) & 0xff];
+	}
+	return crc;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_CRC32C_SSE42 1
+
+/* the SSE4.2 crc32 instruction implements exactly this polynomial */
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+		crc = __builtin_ia32_crc32qi(crc, *buf++);
+		len--;
+	}
+#ifdef __x86_64__
+	{
+		uint64_t crc64 = crc;
+
+		while (len >= 8) {
+			uint64_t v;
+
+			memcpy(&v, buf, 8);
+			crc64 = __builtin_ia32_crc32di(crc64, v);
+			buf += 8;
+			len -= 8;
+		}
+		crc = (uint32_t)crc64;
+	}
+#endif
+	while (len >= 4) {
+		uint32_t v;
+
+		memcpy(&v, buf, 4);
+		crc = __builtin_ia32_crc32si(crc, v);
+		buf += 4;
+		len -= 4;
+	}
+	while (len-- > 0) {
+		crc = __builtin_ia32_crc32qi(crc, *buf++);
+	}
+	return crc;
+}
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && defined(HAVE_SYS_AUXV_H)
+#define HAVE_CRC32C_ARMV8 1
+
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+
+__attribute__((target("+crc")))
+static uint32_t
+crc32c_armv8(uint32_t crc, const unsigned char *buf, size_t len)
 {
-	unsigned long crc = 0xffffffff;
+	while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+		crc = __builtin_aarch64_crc32cb(crc, *buf++);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, buf, 8);
+		crc = __builtin_aarch64_crc32cx(crc, v);
+		buf += 8;
+		len -= 8;
+	}
 	while (len-- > 0) {
-		crc = (crc>>8) ^ crctable[(crc ^ (*buf++)) & 0xFF];
+		crc = __builtin_aarch64_crc32cb(crc, *buf++);
 	}
-	return crc^0xffffffff;
+	return crc;
 }
+#endif
 
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *buf,
+			       size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Build the tables and pick the fastest implementation this cpu supports
+ * the first time a crc is computed. Contexts on different threads may get
+ * there at the same time, so this runs once through pthread_once.
+ */
+static void
+crc32c_init(void)
+{
+	crc32c_init_tables();
+	crc32c_impl = crc32c_sw;
+
+#ifdef HAVE_CRC32C_SSE42
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_impl = crc32c_sse42;
+	}
+#endif
+#ifdef HAVE_CRC32C_ARMV8
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		crc32c_impl = crc32c_armv8;
+	}
+#endif
+}
+
+/*
+ * Continue a crc32c over more data. Start with crc 0xffffffff and xor
+ * the final value with 0xffffffff.
+ */
+uint32_t crc32c_update(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_impl(crc, buf, len);
+}
+
+unsigned long crc32c(char *buf, int len)
+{
+	return crc32c_update(0xffffffff, (unsigned char *)buf, len)
+		^ 0xffffffff;
+}
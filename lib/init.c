@@ -22,11 +22,13 @@
 #include <strings.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <time.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
+#include "scsi-lowlevel.h"
 #include "slist.h"
 
 
@@ -49,6 +51,31 @@ iscsi_create_context(const char *initiator_name)
 	}
 
 	iscsi->fd = -1;
+	iscsi->loop_fd = -1;
+
+	iscsi->tx_batch_bytes = ISCSI_TX_BATCH_BYTES;
+	iscsi->tx_batch_iov   = ISCSI_TX_BATCH_IOV;
+	iscsi->free_pdu_max   = ISCSI_PDU_CACHE_SIZE;
+
+	iscsi->initiator_max_recv_data_segment_length =
+		ISCSI_OFFER_MAX_RECV_DATA_SEGMENT_LENGTH;
+	iscsi->want_first_burst_length  = ISCSI_OFFER_FIRST_BURST_LENGTH;
+	iscsi->want_max_burst_length    = ISCSI_OFFER_MAX_BURST_LENGTH;
+	iscsi->want_max_outstanding_r2t = ISCSI_OFFER_MAX_OUTSTANDING_R2T;
+	iscsi->want_initial_r2t         = ISCSI_INITIAL_R2T_YES;
+	iscsi->want_immediate_data      = ISCSI_IMMEDIATE_DATA_YES;
+
+	iscsi->target_max_recv_data_segment_length =
+		ISCSI_DEFAULT_MAX_RECV_DATA_SEGMENT_LENGTH;
+	iscsi->first_burst_length  = ISCSI_DEFAULT_FIRST_BURST_LENGTH;
+	iscsi->max_burst_length    = ISCSI_DEFAULT_MAX_BURST_LENGTH;
+	iscsi->max_outstanding_r2t = ISCSI_DEFAULT_MAX_OUTSTANDING_R2T;
+	iscsi->initial_r2t         = ISCSI_INITIAL_R2T_YES;
+	iscsi->immediate_data      = ISCSI_IMMEDIATE_DATA_YES;
+
+	iscsi->unmap_max_lba_count   = ISCSI_UNMAP_MAX_LBA_COUNT;
+	iscsi->unmap_max_descriptors = ISCSI_UNMAP_MAX_DESCRIPTORS;
+	iscsi->write_same_max_length = ISCSI_WRITE_SAME_MAX_LENGTH;
 
 	/* initialize to a "random" isid */
 	iscsi_set_isid_random(iscsi, getpid() ^ time(NULL));
@@ -58,15 +85,111 @@ iscsi_create_context(const char *initiator_name)
 	iscsi->next_phase    = ISCSI_PDU_LOGIN_NSG_OPNEG;
 	iscsi->secneg_phase  = ISCSI_LOGIN_SECNEG_PHASE_OFFER_CHAP;
 
+	/* this is the leading connection of its session */
+	iscsi->connections     = iscsi;
+	iscsi->next_cid        = 1;
+	iscsi->max_connections = ISCSI_DEFAULT_MAX_CONNECTIONS;
+
+	iscsi->reconnect_max_retries = ISCSI_DEFAULT_RECONNECT_RETRIES;
+	iscsi->reconnect_interval    = ISCSI_DEFAULT_RECONNECT_INTERVAL;
+	iscsi->reconnect_timer.level = -1;
+
 	return iscsi;
 }
 
+static char *
+iscsi_strdup_or_null(const char *str)
+{
+	return str != NULL ? strdup(str) : NULL;
+}
+
+struct iscsi_context *
+iscsi_create_connection(struct iscsi_context *iscsi)
+{
+	struct iscsi_context *session = ISCSI_SESSION(iscsi);
+	struct iscsi_context *conn, *last;
+	int count;
+
+	if (!session->is_loggedin || session->tsih == 0) {
+		iscsi_set_error(iscsi, "Trying to add a connection to a session "
+				"that is not logged in.");
+		return NULL;
+	}
+	if (session->session_type != ISCSI_SESSION_NORMAL) {
+		iscsi_set_error(iscsi, "Only normal sessions can have more "
+				"than one connection.");
+		return NULL;
+	}
+
+	count = 0;
+	for (last = session->connections; last->next_connection;
+	     last = last->next_connection) {
+		count++;
+	}
+	if (count + 1 >= session->max_connections) {
+		iscsi_set_error(iscsi, "The target allows at most %d "
+				"connections in this session.",
+				session->max_connections);
+		return NULL;
+	}
+
+	conn = iscsi_create_context(session->initiator_name);
+	if (conn == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"connection context.");
+		return NULL;
+	}
+
+	conn->target_name = iscsi_strdup_or_null(session->target_name);
+	conn->alias       = iscsi_strdup_or_null(session->alias);
+	conn->user        = iscsi_strdup_or_null(session->user);
+	conn->passwd      = iscsi_strdup_or_null(session->passwd);
+	if ((session->target_name && conn->target_name == NULL)
+	    || (session->alias && conn->alias == NULL)
+	    || (session->user && conn->user == NULL)
+	    || (session->passwd && conn->passwd == NULL)) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to copy names "
+				"to the connection context.");
+		iscsi_destroy_context(conn);
+		return NULL;
+	}
+
+	conn->session_type = session->session_type;
+	memcpy(conn->isid, session->isid, sizeof(conn->isid));
+	conn->tsih = session->tsih;
+
+	/* connection wide parameters are negotiated again at login */
+	conn->want_header_digest = session->want_header_digest;
+	conn->want_data_digest   = session->want_data_digest;
+	conn->initiator_max_recv_data_segment_length =
+		session->initiator_max_recv_data_segment_length;
+
+	/* session wide parameters are only negotiated by the leader */
+	conn->first_burst_length  = session->first_burst_length;
+	conn->max_burst_length    = session->max_burst_length;
+	conn->max_outstanding_r2t = session->max_outstanding_r2t;
+	conn->initial_r2t         = session->initial_r2t;
+	conn->immediate_data      = session->immediate_data;
+
+	conn->tx_batch_bytes = session->tx_batch_bytes;
+	conn->tx_batch_iov   = session->tx_batch_iov;
+	conn->want_uring     = session->want_uring;
+
+	conn->connections = NULL;
+	conn->leader      = session;
+	conn->cid         = session->next_cid++;
+	last->next_connection = conn;
+
+	return conn;
+}
+
 int
 iscsi_set_isid_random(struct iscsi_context *iscsi, int rnd)
 {
+	/* the random format has 24 bits for the number */
 	iscsi->isid[0] = 0x80;
-	iscsi->isid[1] = rnd&0xff;
-	iscsi->isid[2] = rnd&0xff;
+	iscsi->isid[1] = (rnd>>16)&0xff;
+	iscsi->isid[2] = (rnd>>8)&0xff;
 	iscsi->isid[3] = rnd&0xff;
 	iscsi->isid[4] = 0;
 	iscsi->isid[5] = 0;
@@ -122,22 +245,74 @@ iscsi_destroy_context(struct iscsi_context *iscsi)
 		return 0;
 	}
 
+	if (iscsi->loop != NULL) {
+		iscsi_loop_remove(iscsi->loop, iscsi);
+	}
+
+	if (iscsi->leader != NULL) {
+		struct iscsi_context **c;
+
+		for (c = &iscsi->leader->connections; *c;
+		     c = &(*c)->next_connection) {
+			if (*c == iscsi) {
+				*c = iscsi->next_connection;
+				break;
+			}
+		}
+	} else {
+		/* the session goes away with its leading connection */
+		while (iscsi->next_connection != NULL) {
+			iscsi_destroy_context(iscsi->next_connection);
+		}
+	}
+
+	/* only the leader has one, commands that are still in it are
+	 * cancelled
+	 */
+	if (iscsi->submit_queue != NULL) {
+		iscsi_set_submit_queue(iscsi, 0);
+	}
+
 	if (iscsi->fd != -1) {
 		iscsi_disconnect(iscsi);
 	}
 
-	while ((pdu = iscsi->outqueue)) {
-		SLIST_REMOVE(&iscsi->outqueue, pdu);
+	while ((pdu = iscsi->reconnect_cmds)) {
+		DLIST_REMOVE(&iscsi->reconnect_cmds,
+			     &iscsi->reconnect_cmds_tail, pdu);
 		pdu->callback(iscsi, SCSI_STATUS_CANCELLED, NULL,
 			      pdu->private_data);
 		iscsi_free_pdu(iscsi, pdu);
 	}
-	while ((pdu = iscsi->waitpdu)) {
-		SLIST_REMOVE(&iscsi->waitpdu, pdu);
+	while ((pdu = iscsi->cmd_backlog)) {
+		DLIST_REMOVE(&iscsi->cmd_backlog, &iscsi->cmd_backlog_tail,
+			     pdu);
 		pdu->callback(iscsi, SCSI_STATUS_CANCELLED, NULL,
 			      pdu->private_data);
 		iscsi_free_pdu(iscsi, pdu);
 	}
+	iscsi->cmd_backlog_count = 0;
+	while ((pdu = iscsi->outqueue)) {
+		DLIST_REMOVE(&iscsi->outqueue, &iscsi->outqueue_tail, pdu);
+		if (!(pdu->flags & ISCSI_PDU_DELETE_WHEN_SENT)) {
+			pdu->callback(iscsi, SCSI_STATUS_CANCELLED, NULL,
+				      pdu->private_data);
+		}
+		iscsi_free_pdu(iscsi, pdu);
+	}
+	while ((pdu = iscsi_first_waitpdu(iscsi))) {
+		iscsi_waitpdu_remove(iscsi, pdu);
+		pdu->callback(iscsi, SCSI_STATUS_CANCELLED, NULL,
+			      pdu->private_data);
+		iscsi_free_pdu(iscsi, pdu);
+	}
+	free(iscsi->waitpdu);
+	iscsi->waitpdu = NULL;
+	iscsi_free_pdu_cache(iscsi);
+	iscsi_free_lun_limits(iscsi);
+
+	free(iscsi->timers);
+	iscsi->timers = NULL;
 
 	free(discard_const(iscsi->initiator_name));
 	iscsi->initiator_name = NULL;
@@ -148,12 +323,20 @@ iscsi_destroy_context(struct iscsi_context *iscsi)
 	free(discard_const(iscsi->alias));
 	iscsi->alias = NULL;
 
+	free(iscsi->portal);
+	iscsi->portal = NULL;
+
 	if (iscsi->incoming != NULL) {
 		iscsi_free_iscsi_in_pdu(iscsi->incoming);
 	}
 	if (iscsi->inqueue != NULL) {
 		iscsi_free_iscsi_inqueue(iscsi->inqueue);
 	}
+	free(iscsi->rxbuf);
+	iscsi->rxbuf = NULL;
+
+	free(iscsi->tx_iov);
+	iscsi->tx_iov = NULL;
 
 	free(iscsi->error_string);
 	iscsi->error_string = NULL;
@@ -215,6 +398,190 @@ iscsi_set_header_digest(struct iscsi_context *iscsi,
 	return 0;
 }
 
+int
+iscsi_set_data_digest(struct iscsi_context *iscsi,
+		      enum iscsi_data_digest data_digest)
+{
+	if (iscsi->is_loggedin) {
+		iscsi_set_error(iscsi, "trying to set data digest while "
+				"logged in");
+		return -1;
+	}
+
+	iscsi->want_data_digest = data_digest;
+
+	return 0;
+}
+
+int
+iscsi_set_max_recv_data_segment_length(struct iscsi_context *iscsi, int len)
+{
+	if (iscsi->is_loggedin) {
+		iscsi_set_error(iscsi, "trying to set MaxRecvDataSegmentLength "
+				"while logged in");
+		return -1;
+	}
+	if (len < ISCSI_MIN_DATA_LENGTH || len > ISCSI_MAX_DATA_LENGTH) {
+		iscsi_set_error(iscsi, "invalid MaxRecvDataSegmentLength %d",
+				len);
+		return -1;
+	}
+
+	iscsi->initiator_max_recv_data_segment_length = len;
+
+	return 0;
+}
+
+int
+iscsi_set_first_burst_length(struct iscsi_context *iscsi, int len)
+{
+	if (iscsi->is_loggedin) {
+		iscsi_set_error(iscsi, "trying to set FirstBurstLength while "
+				"logged in");
+		return -1;
+	}
+	if (len < ISCSI_MIN_DATA_LENGTH || len > ISCSI_MAX_DATA_LENGTH) {
+		iscsi_set_error(iscsi, "invalid FirstBurstLength %d", len);
+		return -1;
+	}
+
+	iscsi->want_first_burst_length = len;
+
+	return 0;
+}
+
+int
+iscsi_set_max_burst_length(struct iscsi_context *iscsi, int len)
+{
+	if (iscsi->is_loggedin) {
+		iscsi_set_error(iscsi, "trying to set MaxBurstLength while "
+				"logged in");
+		return -1;
+	}
+	if (len < ISCSI_MIN_DATA_LENGTH || len > ISCSI_MAX_DATA_LENGTH) {
+		iscsi_set_error(iscsi, "invalid MaxBurstLength %d", len);
+		return -1;
+	}
+
+	iscsi->want_max_burst_length = len;
+
+	return 0;
+}
+
+int
+iscsi_set_max_outstanding_r2t(struct iscsi_context *iscsi, int count)
+{
+	if (iscsi->is_loggedin) {
+		iscsi_set_error(iscsi, "trying to set MaxOutstandingR2T while "
+				"logged in");
+		return -1;
+	}
+	if (count < 1 || count > 65535) {
+		iscsi_set_error(iscsi, "invalid MaxOutstandingR2T %d", count);
+		return -1;
+	}
+
+	iscsi->want_max_outstanding_r2t = count;
+
+	return 0;
+}
+
+int
+iscsi_set_initial_r2t(struct iscsi_context *iscsi,
+		      enum iscsi_initial_r2t initial_r2t)
+{
+	if (iscsi->is_loggedin) {
+		iscsi_set_error(iscsi, "trying to set InitialR2T while "
+				"logged in");
+		return -1;
+	}
+
+	iscsi->want_initial_r2t = initial_r2t;
+
+	return 0;
+}
+
+int
+iscsi_set_immediate_data(struct iscsi_context *iscsi,
+			 enum iscsi_immediate_data immediate_data)
+{
+	if (iscsi->is_loggedin) {
+		iscsi_set_error(iscsi, "trying to set ImmediateData while "
+				"logged in");
+		return -1;
+	}
+
+	iscsi->want_immediate_data = immediate_data;
+
+	return 0;
+}
+
+int
+iscsi_set_tx_batch(struct iscsi_context *iscsi, int max_bytes, int max_iov)
+{
+	if (max_bytes <= 0 || max_iov <= 0 || max_iov > IOV_MAX) {
+		iscsi_set_error(iscsi, "invalid transmit batch limits "
+				"bytes:%d iov:%d", max_bytes, max_iov);
+		return -1;
+	}
+
+	iscsi->tx_batch_bytes = max_bytes;
+	if (iscsi->tx_batch_iov != max_iov) {
+		free(iscsi->tx_iov);
+		iscsi->tx_iov = NULL;
+		iscsi->tx_batch_iov = max_iov;
+	}
+
+	return 0;
+}
+
+void
+iscsi_get_tx_stats(struct iscsi_context *iscsi, unsigned long long *pdus,
+		   unsigned long long *syscalls)
+{
+	*pdus     = iscsi->tx_pdus;
+	*syscalls = iscsi->tx_syscalls;
+}
+
+int
+iscsi_get_cmdsn_window(struct iscsi_context *iscsi)
+{
+	int32_t window;
+
+	iscsi = ISCSI_SESSION(iscsi);
+	window = (int32_t)(iscsi->maxcmdsn - iscsi->cmdsn) + 1;
+	if (window < 0) {
+		return 0;
+	}
+
+	return window;
+}
+
+int
+iscsi_get_backlog_length(struct iscsi_context *iscsi)
+{
+	return ISCSI_SESSION(iscsi)->cmd_backlog_count;
+}
+
+int
+iscsi_set_block_limits(struct iscsi_context *iscsi,
+		       const struct scsi_inquiry_block_limits *bl)
+{
+	struct iscsi_context *session = ISCSI_SESSION(iscsi);
+
+	if (bl == NULL) {
+		iscsi_set_error(iscsi, "no block limits given");
+		return -1;
+	}
+
+	iscsi_apply_block_limits(bl, &session->unmap_max_lba_count,
+				 &session->unmap_max_descriptors,
+				 &session->write_same_max_length);
+	session->block_limits_set = 1;
+
+	return 0;
+}
+
 int
 iscsi_is_logged_in(struct iscsi_context *iscsi)
 {
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
@@ -118,11 +119,16 @@ iscsi_login_add_sessiontype(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 {
 	char *str;
 
-	/* We only send TargetName during opneg or the first leg of secneg */
+	/* We only send SessionType during opneg or the first leg of secneg
+	 * of the leading connection
+	 */
 	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
 	&& iscsi->secneg_phase != ISCSI_LOGIN_SECNEG_PHASE_OFFER_CHAP) {
 		return 0;
 	}
+	if (iscsi->leader != NULL) {
+		return 0;
+	}
 
 	switch (iscsi->session_type) {
 	case ISCSI_SESSION_DISCOVERY:
@@ -168,6 +174,9 @@ iscsi_login_add_headerdigest(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 	case ISCSI_HEADER_DIGEST_CRC32C:
 		str = (char *)"HeaderDigest=CRC32C";
 		break;
+	default:
+		iscsi_set_error(iscsi, "invalid header digest value");
+		return -1;
 	}
 
 	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
@@ -189,7 +198,24 @@ iscsi_login_add_datadigest(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 		return 0;
 	}
 
-	str = (char *)"DataDigest=None";
+	switch (iscsi->want_data_digest) {
+	case ISCSI_DATA_DIGEST_NONE:
+		str = (char *)"DataDigest=None";
+		break;
+	case ISCSI_DATA_DIGEST_NONE_CRC32C:
+		str = (char *)"DataDigest=None,CRC32C";
+		break;
+	case ISCSI_DATA_DIGEST_CRC32C_NONE:
+		str = (char *)"DataDigest=CRC32C,None";
+		break;
+	case ISCSI_DATA_DIGEST_CRC32C:
+		str = (char *)"DataDigest=CRC32C";
+		break;
+	default:
+		iscsi_set_error(iscsi, "invalid data digest value");
+		return -1;
+	}
+
 	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
 	    != 0) {
 		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
@@ -204,12 +230,17 @@ iscsi_login_add_initialr2t(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 {
 	char *str;
 
-	/* We only send InitialR2T during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	/* We only send InitialR2T during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	|| iscsi->leader != NULL) {
 		return 0;
 	}
 
-	str = (char *)"InitialR2T=Yes";
+	if (iscsi->want_initial_r2t == ISCSI_INITIAL_R2T_NO) {
+		str = (char *)"InitialR2T=No";
+	} else {
+		str = (char *)"InitialR2T=Yes";
+	}
 	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
 	    != 0) {
 		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
@@ -224,12 +255,17 @@ iscsi_login_add_immediatedata(struct iscsi_context *iscsi, struct iscsi_pdu *pdu
 {
 	char *str;
 
-	/* We only send ImmediateData during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	/* We only send ImmediateData during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	|| iscsi->leader != NULL) {
 		return 0;
 	}
 
-	str = (char *)"ImmediateData=Yes";
+	if (iscsi->want_immediate_data == ISCSI_IMMEDIATE_DATA_NO) {
+		str = (char *)"ImmediateData=No";
+	} else {
+		str = (char *)"ImmediateData=Yes";
+	}
 	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
 	    != 0) {
 		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
@@ -242,14 +278,15 @@ iscsi_login_add_immediatedata(struct iscsi_context *iscsi, struct iscsi_pdu *pdu
 static int
 iscsi_login_add_maxburstlength(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 {
-	char *str;
+	char str[64];
 
-	/* We only send MaxBurstLength during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	/* We only send MaxBurstLength during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	|| iscsi->leader != NULL) {
 		return 0;
 	}
 
-	str = (char *)"MaxBurstLength=262144";
+	snprintf(str, sizeof(str), "MaxBurstLength=%d", iscsi->want_max_burst_length);
 	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
 	    != 0) {
 		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
@@ -262,14 +299,22 @@ iscsi_login_add_maxburstlength(struct iscsi_context *iscsi, struct iscsi_pdu *pd
 static int
 iscsi_login_add_firstburstlength(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 {
-	char *str;
+	char str[64];
+	int first_burst;
 
-	/* We only send FirstBurstLength during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	/* We only send FirstBurstLength during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	|| iscsi->leader != NULL) {
 		return 0;
 	}
 
-	str = (char *)"FirstBurstLength=262144";
+	/* the first burst may not be larger than a burst */
+	first_burst = iscsi->want_first_burst_length;
+	if (first_burst > iscsi->want_max_burst_length) {
+		first_burst = iscsi->want_max_burst_length;
+	}
+
+	snprintf(str, sizeof(str), "FirstBurstLength=%d", first_burst);
 	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
 	    != 0) {
 		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
@@ -282,14 +327,35 @@ iscsi_login_add_firstburstlength(struct iscsi_context *iscsi, struct iscsi_pdu *
 static int
 iscsi_login_add_maxrecvdatasegmentlength(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 {
-	char *str;
+	char str[64];
 
 	/* We only send MaxRecvDataSegmentLength during opneg */
 	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
 		return 0;
 	}
 
-	str = (char *)"MaxRecvDataSegmentLength=262144";
+	snprintf(str, sizeof(str), "MaxRecvDataSegmentLength=%d", iscsi->initiator_max_recv_data_segment_length);
+	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
+	    != 0) {
+		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+iscsi_login_add_maxoutstandingr2t(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	char str[64];
+
+	/* We only send MaxOutstandingR2T during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	|| iscsi->leader != NULL) {
+		return 0;
+	}
+
+	snprintf(str, sizeof(str), "MaxOutstandingR2T=%d", iscsi->want_max_outstanding_r2t);
 	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
 	    != 0) {
 		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
@@ -304,8 +370,9 @@ iscsi_login_add_datapduinorder(struct iscsi_context *iscsi, struct iscsi_pdu *pd
 {
 	char *str;
 
-	/* We only send DataPduInOrder during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	/* We only send DataPduInOrder during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	|| iscsi->leader != NULL) {
 		return 0;
 	}
 
@@ -324,8 +391,9 @@ iscsi_login_add_datasequenceinorder(struct iscsi_context *iscsi, struct iscsi_pd
 {
 	char *str;
 
-	/* We only send DataSequenceInOrder during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	/* We only send DataSequenceInOrder during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	|| iscsi->leader != NULL) {
 		return 0;
 	}
 
@@ -339,6 +407,30 @@ iscsi_login_add_datasequenceinorder(struct iscsi_context *iscsi, struct iscsi_pd
 	return 0;
 }
 
+static int
+iscsi_login_add_maxconnections(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	char str[64];
+
+	/* We only send MaxConnections during opneg of the leading connection
+	 * of a normal session
+	 */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	|| iscsi->leader != NULL
+	|| iscsi->session_type != ISCSI_SESSION_NORMAL) {
+		return 0;
+	}
+
+	snprintf(str, sizeof(str), "MaxConnections=%d", ISCSI_OFFER_MAX_CONNECTIONS);
+	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
+	    != 0) {
+		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int
 iscsi_login_add_authmethod(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 {
@@ -524,6 +616,12 @@ iscsi_login_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 	/* login request */
 	iscsi_pdu_set_immediate(pdu);
 
+	/* cmdsn is not increased if Immediate delivery, a connection that
+	 * joins a session continues from where the session is
+	 */
+	iscsi_pdu_set_cmdsn(pdu, ISCSI_SESSION(iscsi)->cmdsn);
+	pdu->cmdsn = ISCSI_SESSION(iscsi)->cmdsn;
+
 	if (iscsi->user == NULL) {
 		iscsi->current_phase = ISCSI_PDU_LOGIN_CSG_OPNEG;
 	}
@@ -648,6 +746,12 @@ iscsi_login_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 		return -1;
 	}
 
+	/* max outstanding r2t */
+	if (iscsi_login_add_maxoutstandingr2t(iscsi, pdu) != 0) {
+		iscsi_free_pdu(iscsi, pdu);
+		return -1;
+	}
+
 	/* data pdu in order */
 	if (iscsi_login_add_datapduinorder(iscsi, pdu) != 0) {
 		iscsi_free_pdu(iscsi, pdu);
@@ -660,6 +764,12 @@ iscsi_login_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 		return -1;
 	}
 
+	/* max connections */
+	if (iscsi_login_add_maxconnections(iscsi, pdu) != 0) {
+		iscsi_free_pdu(iscsi, pdu);
+		return -1;
+	}
+
 
 	pdu->callback     = cb;
 	pdu->private_data = private_data;
@@ -698,6 +808,37 @@ static const char *login_error_str(int status)
 	return "Unknown login error";
 }
 
+/*
+ * Parse the value of the numerical login key in key=value, whose key is
+ * keylen bytes including the '='. The value is a decimal or 0x prefixed
+ * hexadecimal number that RFC3720 limits to min..max for the key.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+static int
+iscsi_login_number(struct iscsi_context *iscsi, const char *pair, int keylen,
+		   long min, long max, long *value)
+{
+	const char *str = pair + keylen;
+	char *end;
+	int base = 10;
+
+	if (!strncmp(str, "0x", 2) || !strncmp(str, "0X", 2)) {
+		base = 16;
+	}
+	errno = 0;
+	*value = strtol(str, &end, base);
+	if (errno != 0 || end == str || *end != '\0' || *str == '-'
+	    || *str == '+' || *value < min || *value > max) {
+		iscsi_set_error(iscsi, "Invalid login key %s, the value "
+				"must be %ld to %ld", pair, min, max);
+		return -1;
+	}
+
+	return 0;
+}
 
 int
 iscsi_process_login_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
@@ -716,7 +857,7 @@ iscsi_process_login_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 		return 0;
 	}
 
-	iscsi->statsn = ntohs(*(uint16_t *)&in->hdr[24]);
+	iscsi->statsn = ntohl(*(uint32_t *)&in->hdr[24]);
 
 	/* XXX here we should parse the data returned in case the target
 	 * renegotiated some some parameters.
@@ -726,6 +867,7 @@ iscsi_process_login_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 
 	while (size > 0) {
 		int len;
+		long value;
 
 		len = strlen((char *)ptr);
 
@@ -742,16 +884,110 @@ iscsi_process_login_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 		}
 
 		/* parse the strings */
+		/* digests are only used once the login has completed */
 		if (!strncmp((char *)ptr, "HeaderDigest=", 13)) {
 			if (!strcmp((char *)ptr + 13, "CRC32C")) {
-				iscsi->header_digest
+				iscsi->login_header_digest
 				  = ISCSI_HEADER_DIGEST_CRC32C;
 			} else {
-				iscsi->header_digest
+				iscsi->login_header_digest
 				  = ISCSI_HEADER_DIGEST_NONE;
 			}
 		}
 
+		if (!strncmp((char *)ptr, "DataDigest=", 11)) {
+			if (!strcmp((char *)ptr + 11, "CRC32C")) {
+				iscsi->login_data_digest
+				  = ISCSI_DATA_DIGEST_CRC32C;
+			} else {
+				iscsi->login_data_digest
+				  = ISCSI_DATA_DIGEST_NONE;
+			}
+		}
+
+		/* declarative, this is what we may send in one pdu */
+		if (!strncmp((char *)ptr, "MaxRecvDataSegmentLength=", 25)) {
+			if (iscsi_login_number(iscsi, (char *)ptr, 25,
+					       ISCSI_MIN_DATA_LENGTH,
+					       ISCSI_MAX_DATA_LENGTH, &value) != 0) {
+				pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
+					      pdu->private_data);
+				return -1;
+			}
+			iscsi->target_max_recv_data_segment_length
+			  = value;
+		}
+
+		/* numerical keys negotiate to the smaller of the values */
+		if (!strncmp((char *)ptr, "FirstBurstLength=", 17)) {
+			if (iscsi_login_number(iscsi, (char *)ptr, 17,
+					       ISCSI_MIN_DATA_LENGTH,
+					       ISCSI_MAX_DATA_LENGTH, &value) != 0) {
+				pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
+					      pdu->private_data);
+				return -1;
+			}
+			iscsi->first_burst_length =
+			  MIN(value, iscsi->want_first_burst_length);
+		}
+
+		if (!strncmp((char *)ptr, "MaxBurstLength=", 15)) {
+			if (iscsi_login_number(iscsi, (char *)ptr, 15,
+					       ISCSI_MIN_DATA_LENGTH,
+					       ISCSI_MAX_DATA_LENGTH, &value) != 0) {
+				pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
+					      pdu->private_data);
+				return -1;
+			}
+			iscsi->max_burst_length =
+			  MIN(value, iscsi->want_max_burst_length);
+		}
+
+		if (!strncmp((char *)ptr, "MaxOutstandingR2T=", 18)) {
+			if (iscsi_login_number(iscsi, (char *)ptr, 18,
+					       1, 65535, &value) != 0) {
+				pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
+					      pdu->private_data);
+				return -1;
+			}
+			iscsi->max_outstanding_r2t =
+			  MIN(value, iscsi->want_max_outstanding_r2t);
+		}
+
+		/* InitialR2T is Yes if either side wants it */
+		if (!strncmp((char *)ptr, "InitialR2T=", 11)) {
+			if (!strcmp((char *)ptr + 11, "No")
+			    && iscsi->want_initial_r2t == ISCSI_INITIAL_R2T_NO) {
+				iscsi->initial_r2t = ISCSI_INITIAL_R2T_NO;
+			} else {
+				iscsi->initial_r2t = ISCSI_INITIAL_R2T_YES;
+			}
+		}
+
+		/* ImmediateData is Yes only if both sides want it */
+		if (!strncmp((char *)ptr, "ImmediateData=", 14)) {
+			if (!strcmp((char *)ptr + 14, "Yes")
+			    && iscsi->want_immediate_data
+			    == ISCSI_IMMEDIATE_DATA_YES) {
+				iscsi->immediate_data
+				  = ISCSI_IMMEDIATE_DATA_YES;
+			} else {
+				iscsi->immediate_data
+				  = ISCSI_IMMEDIATE_DATA_NO;
+			}
+		}
+
+		if (!strncmp((char *)ptr, "MaxConnections=", 15)) {
+			if (iscsi_login_number(iscsi, (char *)ptr, 15,
+					       1, 65535, &value) != 0) {
+				pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
+					      pdu->private_data);
+				return -1;
+			}
+			iscsi->max_connections =
+			  MIN(value, ISCSI_OFFER_MAX_CONNECTIONS);
+		}
+
 		if (!strncmp((char *)ptr, "AuthMethod=", 11)) {
 			if (!strcmp((char *)ptr + 11, "CHAP")) {
 				iscsi->secneg_phase = ISCSI_LOGIN_SECNEG_PHASE_SELECT_ALGORITHM;
@@ -789,7 +1025,13 @@ iscsi_process_login_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 
 	if ((in->hdr[1] & ISCSI_PDU_LOGIN_TRANSIT)
 	&& (in->hdr[1] & ISCSI_PDU_LOGIN_NSG_FF) == ISCSI_PDU_LOGIN_NSG_FF) {
-		iscsi->is_loggedin = 1;
+		iscsi->is_loggedin   = 1;
+		iscsi->header_digest = iscsi->login_header_digest;
+		iscsi->data_digest   = iscsi->login_data_digest;
+		/* the target names the session in the final response */
+		if (iscsi->leader == NULL) {
+			iscsi->tsih = ntohs(*(uint16_t *)&in->hdr[14]);
+		}
 		pdu->callback(iscsi, SCSI_STATUS_GOOD, NULL, pdu->private_data);
 	} else {
 		if (iscsi_login_async(iscsi, pdu->callback, pdu->private_data) != 0) {
@@ -826,8 +1068,21 @@ iscsi_logout_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 	/* logout request has the immediate flag set */
 	iscsi_pdu_set_immediate(pdu);
 
-	/* flags : close the session */
-	iscsi_pdu_set_pduflags(pdu, 0x80);
+	/* cmdsn is not increased if Immediate delivery*/
+	iscsi_pdu_set_cmdsn(pdu, ISCSI_SESSION(iscsi)->cmdsn);
+	pdu->cmdsn = ISCSI_SESSION(iscsi)->cmdsn;
+
+	/* exp statsn */
+	iscsi_pdu_set_expstatsn(pdu, iscsi->statsn+1);
+
+	if (iscsi->leader == NULL) {
+		/* flags : close the session */
+		iscsi_pdu_set_pduflags(pdu, 0x80);
+	} else {
+		/* flags : close only this connection */
+		iscsi_pdu_set_pduflags(pdu, 0x81);
+		*(uint16_t *)&pdu->hdr[20] = htons(iscsi->cid);
+	}
 
 
 	pdu->callback     = cb;
@@ -0,0 +1,509 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * An event loop for driving many contexts from one thread.
+ *
+ * The sockets of all contexts are in one epoll set, edge triggered. Read
+ * interest is always on, iscsi_service() reads until the socket is empty.
+ * Write interest is only changed when the outqueue of a context goes from
+ * empty to non-empty and back, so a context that is idle costs nothing,
+ * neither a system call nor a pass through the loop.
+ *
+ * The sessions whose commands can time out are in a timer wheel of the
+ * loop as well, each at the first tick one of its commands may time out.
+ * The loop does not wait past the first of them, and only the sessions
+ * whose time has come are looked at.
+ *
+ * The eventfd of the submit queue of a session is in the set as well, with
+ * the lowest bit of the pointer to the context set to tell it apart from
+ * the socket.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stddef.h>
+#include <poll.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "slist.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#define ISCSI_LOOP_MAX_EVENTS	256
+
+#define ISCSI_LOOP_SUBMIT_TAG	((uintptr_t)1)
+
+struct iscsi_loop {
+	int epfd;
+
+	/* the contexts in the loop */
+	struct iscsi_context *contexts;
+	struct iscsi_context *contexts_tail;
+	int num_contexts;
+
+	/* events returned by the last epoll_wait(), a context that leaves
+	 * the loop while they are dispatched is cleared from the rest
+	 */
+	struct epoll_event events[ISCSI_LOOP_MAX_EVENTS];
+	int next_event;
+	int num_events;
+
+	/* the sessions by when their first command may time out. That may
+	 * be early as timers are not tracked when they stop.
+	 */
+	struct iscsi_timer_wheel timers;
+};
+
+struct iscsi_loop *
+iscsi_loop_create(void)
+{
+	struct iscsi_loop *loop;
+
+	loop = malloc(sizeof(struct iscsi_loop));
+	if (loop == NULL) {
+		return NULL;
+	}
+	bzero(loop, sizeof(struct iscsi_loop));
+
+	loop->epfd = epoll_create(ISCSI_LOOP_MAX_EVENTS);
+	if (loop->epfd == -1) {
+		free(loop);
+		return NULL;
+	}
+
+	return loop;
+}
+
+void
+iscsi_loop_destroy(struct iscsi_loop *loop)
+{
+	if (loop == NULL) {
+		return;
+	}
+
+	while (loop->contexts != NULL) {
+		iscsi_loop_remove(loop, loop->contexts);
+	}
+	close(loop->epfd);
+	free(loop);
+}
+
+/*
+ * Bring the registration of the socket of a context up to date: the socket
+ * itself when it has been replaced, else whether we want to write.
+ * With rearm the socket is modified even if the events are the same, so
+ * that we hear about it if it is writable already. Being edge triggered
+ * there would be no new event for that.
+ */
+void
+iscsi_loop_update(struct iscsi_context *iscsi, int rearm)
+{
+	struct iscsi_loop *loop = iscsi->loop;
+	struct epoll_event ev;
+	uint32_t events;
+	int fd;
+
+	/* the socket, or the ring that services it */
+	fd = iscsi_get_fd(iscsi);
+
+	events = EPOLLIN|EPOLLET;
+	if (iscsi_which_events(iscsi) & POLLOUT) {
+		events |= EPOLLOUT;
+	}
+
+	bzero(&ev, sizeof(ev));
+	ev.events   = events;
+	ev.data.ptr = iscsi;
+
+	if (fd != iscsi->loop_fd) {
+		/* a socket that has been closed has left the set already */
+		if (iscsi->loop_fd != -1) {
+			epoll_ctl(loop->epfd, EPOLL_CTL_DEL, iscsi->loop_fd, &ev);
+			iscsi->loop_fd = -1;
+		}
+		if (fd == -1) {
+			return;
+		}
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+			iscsi_set_error(iscsi, "Failed to add socket to the "
+					"event loop. Errno:%d", errno);
+			return;
+		}
+		iscsi->loop_fd     = fd;
+		iscsi->loop_events = events;
+		return;
+	}
+
+	if (fd == -1 || (events == iscsi->loop_events && !rearm)) {
+		return;
+	}
+
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) != 0) {
+		iscsi_set_error(iscsi, "Failed to update socket in the "
+				"event loop. Errno:%d", errno);
+		return;
+	}
+	iscsi->loop_events = events;
+}
+
+/*
+ * Add the eventfd of the submit queue of a context to the set, or with
+ * watch 0 remove it. It is level triggered, servicing the queue clears it.
+ */
+void
+iscsi_loop_watch_submit_queue(struct iscsi_context *iscsi, int watch)
+{
+	struct iscsi_loop *loop = iscsi->loop;
+	struct epoll_event ev;
+	void *tagged;
+	int i;
+
+	tagged = (void *)((uintptr_t)iscsi | ISCSI_LOOP_SUBMIT_TAG);
+
+	bzero(&ev, sizeof(ev));
+	ev.events   = EPOLLIN;
+	ev.data.ptr = tagged;
+
+	if (watch) {
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD,
+			      iscsi->submit_queue->fd, &ev) != 0) {
+			iscsi_set_error(iscsi, "Failed to add submit queue to "
+					"the event loop. Errno:%d", errno);
+		}
+		return;
+	}
+
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, iscsi->submit_queue->fd, &ev);
+	for (i = loop->next_event; i < loop->num_events; i++) {
+		if (loop->events[i].data.ptr == tagged) {
+			loop->events[i].data.ptr = NULL;
+		}
+	}
+}
+
+int
+iscsi_loop_add(struct iscsi_loop *loop, struct iscsi_context *iscsi,
+	       iscsi_command_cb cb, void *private_data)
+{
+	if (iscsi->loop != NULL) {
+		iscsi_set_error(iscsi, "Context is already in an event loop.");
+		return -1;
+	}
+
+	iscsi->loop        = loop;
+	iscsi->loop_cb     = cb;
+	iscsi->loop_data   = private_data;
+	iscsi->loop_fd     = -1;
+	iscsi->loop_events = 0;
+	iscsi->loop_timer.level = -1;
+	DLIST_ADD_END(&loop->contexts, &loop->contexts_tail, iscsi);
+	loop->num_contexts++;
+
+	iscsi_loop_update(iscsi, 0);
+	if (iscsi->submit_queue != NULL) {
+		iscsi_loop_watch_submit_queue(iscsi, 1);
+	}
+	/* commands that are in flight already */
+	if (iscsi->timers != NULL && iscsi->timers->count != 0) {
+		iscsi_loop_timer_armed(iscsi,
+				       iscsi_timer_next_tick(iscsi->timers));
+	}
+
+	return 0;
+}
+
+int
+iscsi_loop_remove(struct iscsi_loop *loop, struct iscsi_context *iscsi)
+{
+	struct epoll_event ev;
+	int i;
+
+	if (iscsi->loop != loop) {
+		iscsi_set_error(iscsi, "Context is not in this event loop.");
+		return -1;
+	}
+
+	if (iscsi->loop_fd != -1) {
+		bzero(&ev, sizeof(ev));
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, iscsi->loop_fd, &ev);
+		iscsi->loop_fd = -1;
+	}
+	if (iscsi->submit_queue != NULL) {
+		iscsi_loop_watch_submit_queue(iscsi, 0);
+	}
+	for (i = loop->next_event; i < loop->num_events; i++) {
+		if (loop->events[i].data.ptr == iscsi) {
+			loop->events[i].data.ptr = NULL;
+		}
+	}
+	iscsi_timer_remove(&loop->timers, &iscsi->loop_timer);
+
+	DLIST_REMOVE(&loop->contexts, &loop->contexts_tail, iscsi);
+	loop->num_contexts--;
+	iscsi->loop = NULL;
+
+	return 0;
+}
+
+/*
+ * A timer of the session of a context in the loop has been started, to
+ * expire at tick expires. The session is looked at by then.
+ */
+void
+iscsi_loop_timer_armed(struct iscsi_context *iscsi, uint64_t expires)
+{
+	struct iscsi_timer_wheel *wheel = &iscsi->loop->timers;
+
+	if (iscsi->loop_timer.level != -1) {
+		if (iscsi->loop_timer.expires <= expires) {
+			return;
+		}
+		iscsi_timer_remove(wheel, &iscsi->loop_timer);
+	}
+	if (wheel->count == 0) {
+		/* nothing to miss, skip the ticks the wheel has been idle */
+		wheel->now = iscsi_time_ms() / ISCSI_TIMER_TICK_MS;
+	}
+	iscsi_timer_add(wheel, &iscsi->loop_timer, expires);
+}
+
+static struct iscsi_context *
+iscsi_loop_timer_context(struct iscsi_timer *timer)
+{
+	return (struct iscsi_context *)((char *)timer
+		- offsetof(struct iscsi_context, loop_timer));
+}
+
+/*
+ * Service a context of the loop, taking it out of the loop when that fails.
+ */
+static void
+iscsi_loop_service(struct iscsi_loop *loop, struct iscsi_context *iscsi,
+		   int revents)
+{
+	iscsi_command_cb cb;
+	void *private_data;
+
+	if (iscsi_service(iscsi, revents) < 0) {
+		cb           = iscsi->loop_cb;
+		private_data = iscsi->loop_data;
+		iscsi_loop_remove(loop, iscsi);
+		if (cb != NULL) {
+			cb(iscsi, SCSI_STATUS_ERROR, NULL, private_data);
+		}
+		return;
+	}
+	/* a callback may have taken the context out of the loop */
+	if (iscsi->loop == loop) {
+		iscsi_loop_update(iscsi, 0);
+	}
+}
+
+/*
+ * Run the timers of the sessions whose time has come and put them back in
+ * the wheel for the next command that may time out, if there is one.
+ * A context that leaves the loop while this runs is no longer in the wheel.
+ * Returns the number of contexts that had commands time out.
+ */
+static int
+iscsi_loop_run_timers(struct iscsi_loop *loop)
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_timer *timer;
+	uint64_t now;
+	int count = 0;
+
+	now = iscsi_time_ms() / ISCSI_TIMER_TICK_MS;
+	while ((timer = iscsi_timer_expire_next(&loop->timers, now)) != NULL) {
+		iscsi = iscsi_loop_timer_context(timer);
+
+		if (iscsi->timers == NULL || iscsi->timers->count == 0) {
+			continue;
+		}
+		if (iscsi_next_timeout_ms(iscsi) == 0) {
+			iscsi_loop_service(loop, iscsi, 0);
+			count++;
+			if (iscsi->loop != loop) {
+				continue;
+			}
+		}
+		/* rearming while it was serviced put it back already */
+		if (iscsi->loop_timer.level == -1 && iscsi->timers->count != 0) {
+			iscsi_loop_timer_armed(iscsi,
+				iscsi_timer_next_tick(iscsi->timers));
+		}
+	}
+
+	return count;
+}
+
+int
+iscsi_loop_run_once(struct iscsi_loop *loop, int timeout_ms)
+{
+	struct iscsi_context *iscsi;
+	uint32_t events;
+	uint64_t now, deadline, next_timeout;
+	int revents, count;
+
+	now = iscsi_time_ms();
+	if (loop->timers.count != 0) {
+		next_timeout = iscsi_timer_next_tick(&loop->timers)
+			* ISCSI_TIMER_TICK_MS;
+		if (next_timeout <= now) {
+			timeout_ms = 0;
+		} else if (timeout_ms < 0
+			   || next_timeout - now < (uint64_t)timeout_ms) {
+			timeout_ms = next_timeout - now > INT_MAX
+				? INT_MAX : (int)(next_timeout - now);
+		}
+	}
+	deadline = now + timeout_ms;
+
+	for (;;) {
+		count = epoll_wait(loop->epfd, loop->events,
+				   ISCSI_LOOP_MAX_EVENTS, timeout_ms);
+		if (count >= 0 || errno != EINTR) {
+			break;
+		}
+		/* io_uring completes requests through task work, which
+		 * interrupts the wait, and closing a ring queues more of it.
+		 * The completions may still be on their way, so wait on for
+		 * the rest of the time rather than return empty handed.
+		 */
+		if (timeout_ms > 0) {
+			now = iscsi_time_ms();
+			timeout_ms = deadline > now ? (int)(deadline - now) : 0;
+		}
+	}
+	if (count < 0) {
+		return -1;
+	}
+
+	loop->num_events = count;
+	for (loop->next_event = 0; loop->next_event < loop->num_events; ) {
+		struct epoll_event *ev = &loop->events[loop->next_event++];
+
+		iscsi = ev->data.ptr;
+		if (iscsi == NULL) {
+			continue;
+		}
+		if ((uintptr_t)iscsi & ISCSI_LOOP_SUBMIT_TAG) {
+			iscsi = (struct iscsi_context *)
+				((uintptr_t)iscsi & ~ISCSI_LOOP_SUBMIT_TAG);
+			iscsi_service_submissions(iscsi);
+			continue;
+		}
+
+		events  = ev->events;
+		revents = 0;
+		if (events & EPOLLIN) {
+			revents |= POLLIN;
+		}
+		if (events & EPOLLOUT) {
+			revents |= POLLOUT;
+		}
+		if (events & EPOLLERR) {
+			revents |= POLLERR;
+		}
+		if (events & EPOLLHUP) {
+			revents |= POLLHUP;
+		}
+
+		iscsi_loop_service(loop, iscsi, revents);
+	}
+	loop->num_events = 0;
+	loop->next_event = 0;
+
+	if (loop->timers.count != 0) {
+		count += iscsi_loop_run_timers(loop);
+	}
+
+	return count;
+}
+
+int
+iscsi_loop_get_num_contexts(struct iscsi_loop *loop)
+{
+	return loop->num_contexts;
+}
+
+#else /* HAVE_SYS_EPOLL_H */
+
+struct iscsi_loop *
+iscsi_loop_create(void)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void
+iscsi_loop_destroy(struct iscsi_loop *loop _U_)
+{
+}
+
+void
+iscsi_loop_update(struct iscsi_context *iscsi _U_, int rearm _U_)
+{
+}
+
+void
+iscsi_loop_timer_armed(struct iscsi_context *iscsi _U_, uint64_t expires _U_)
+{
+}
+
+void
+iscsi_loop_watch_submit_queue(struct iscsi_context *iscsi _U_, int watch _U_)
+{
+}
+
+int
+iscsi_loop_add(struct iscsi_loop *loop _U_, struct iscsi_context *iscsi,
+	       iscsi_command_cb cb _U_, void *private_data _U_)
+{
+	iscsi_set_error(iscsi, "No event loop support on this platform.");
+	return -1;
+}
+
+int
+iscsi_loop_remove(struct iscsi_loop *loop _U_, struct iscsi_context *iscsi)
+{
+	iscsi_set_error(iscsi, "No event loop support on this platform.");
+	return -1;
+}
+
+int
+iscsi_loop_run_once(struct iscsi_loop *loop _U_, int timeout_ms _U_)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+iscsi_loop_get_num_contexts(struct iscsi_loop *loop _U_)
+{
+	return 0;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
@@ -0,0 +1,897 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+/* how often a command is reissued before the error goes to the caller */
+#define ISCSI_MPATH_MAX_RETRIES		8
+
+/* a fresh login reports a unit attention, how often to clear it */
+#define ISCSI_MPATH_MAX_TUR		4
+
+#define ISCSI_MPATH_RTPG_ALLOC_LEN	1024
+
+enum iscsi_mpath_path_state {
+	ISCSI_MPATH_PATH_ACTIVE = 0,
+	ISCSI_MPATH_PATH_FAILED = 1
+};
+
+struct iscsi_mpath_path {
+	struct iscsi_mpath *mp;
+	struct iscsi_context *iscsi;
+	char *portal;
+	enum iscsi_mpath_path_state state;
+
+	/* the target port group of the portal, -1 if not known */
+	int port_group;
+	enum scsi_alua_state alua_state;
+
+	int in_flight;
+};
+
+struct iscsi_mpath {
+	char *initiator_name;
+	char *target_name;
+	int lun;
+	enum iscsi_mpath_policy policy;
+	int isid_base;
+
+	struct iscsi_mpath_path **paths;
+	int num_paths;
+	int next_path;
+
+	/* the lun supports asymmetric access and reports port groups */
+	int tpgs;
+	int alua_refresh;
+	int rtpg_in_flight;
+
+	int destroying;
+	char *error_string;
+};
+
+struct iscsi_mpath_cmd {
+	struct iscsi_mpath *mp;
+	struct scsi_task *task;
+	iscsi_command_cb callback;
+	void *private_data;
+	int path;
+	int retries;
+	int keep_task;
+};
+
+static void
+iscsi_mpath_set_error(struct iscsi_mpath *mp, const char *error_string, ...)
+{
+	va_list ap;
+	char *str;
+
+	va_start(ap, error_string);
+	if (vasprintf(&str, error_string, ap) < 0) {
+		/* not much we can do here */
+		str = NULL;
+	}
+
+	free(mp->error_string);
+
+	mp->error_string = str;
+	va_end(ap);
+}
+
+const char *
+iscsi_mpath_get_error(struct iscsi_mpath *mp)
+{
+	return mp->error_string;
+}
+
+struct iscsi_mpath *
+iscsi_mpath_create(const char *initiator_name, const char *target_name,
+		   int lun)
+{
+	struct iscsi_mpath *mp;
+
+	mp = malloc(sizeof(struct iscsi_mpath));
+	if (mp == NULL) {
+		return NULL;
+	}
+
+	bzero(mp, sizeof(struct iscsi_mpath));
+
+	mp->initiator_name = strdup(initiator_name);
+	mp->target_name    = strdup(target_name);
+	if (mp->initiator_name == NULL || mp->target_name == NULL) {
+		free(mp->initiator_name);
+		free(mp->target_name);
+		free(mp);
+		return NULL;
+	}
+	mp->lun       = lun;
+	mp->policy    = ISCSI_MPATH_ROUND_ROBIN;
+	mp->isid_base = getpid() ^ time(NULL);
+
+	return mp;
+}
+
+int
+iscsi_mpath_set_policy(struct iscsi_mpath *mp, enum iscsi_mpath_policy policy)
+{
+	switch (policy) {
+	case ISCSI_MPATH_ROUND_ROBIN:
+	case ISCSI_MPATH_LEAST_QUEUE_DEPTH:
+		break;
+	default:
+		iscsi_mpath_set_error(mp, "Unknown multipath policy %d.",
+				      policy);
+		return -1;
+	}
+
+	mp->policy = policy;
+
+	return 0;
+}
+
+/*
+ * Tear down the session of a path. Commands in flight on it are cancelled,
+ * which reissues them on the remaining paths.
+ */
+static void
+iscsi_mpath_fail_path(struct iscsi_mpath_path *path)
+{
+	struct iscsi_context *iscsi = path->iscsi;
+
+	path->state = ISCSI_MPATH_PATH_FAILED;
+	if (iscsi == NULL) {
+		return;
+	}
+	path->iscsi = NULL;
+	iscsi_destroy_context(iscsi);
+}
+
+void
+iscsi_mpath_destroy(struct iscsi_mpath *mp)
+{
+	int i;
+
+	if (mp == NULL) {
+		return;
+	}
+
+	mp->destroying = 1;
+	for (i = 0; i < mp->num_paths; i++) {
+		iscsi_mpath_fail_path(mp->paths[i]);
+	}
+	for (i = 0; i < mp->num_paths; i++) {
+		free(mp->paths[i]->portal);
+		free(mp->paths[i]);
+	}
+	free(mp->paths);
+	free(mp->initiator_name);
+	free(mp->target_name);
+	free(mp->error_string);
+	free(mp);
+}
+
+static int
+iscsi_mpath_path_prio(struct iscsi_mpath_path *path)
+{
+	switch (path->alua_state) {
+	case SCSI_ALUA_ACTIVE_OPTIMIZED:
+		return 0;
+	case SCSI_ALUA_ACTIVE_NONOPTIMIZED:
+	case SCSI_ALUA_LBA_DEPENDENT:
+		return 1;
+	default:
+		/* standby and unavailable ports reject i/o, but may have
+		 * changed state since we last looked
+		 */
+		return 2;
+	}
+}
+
+/*
+ * Pick the path for the next command: among the logged in paths in the
+ * best asymmetric access state, the next one in turn or the one with the
+ * fewest commands in flight. Returns -1 if no path is usable.
+ */
+static int
+iscsi_mpath_select_path(struct iscsi_mpath *mp)
+{
+	struct iscsi_mpath_path *path;
+	int i, idx, best, best_prio, prio;
+
+	best      = -1;
+	best_prio = 3;
+	for (i = 0; i < mp->num_paths; i++) {
+		idx  = (mp->next_path + i) % mp->num_paths;
+		path = mp->paths[idx];
+		if (path->state != ISCSI_MPATH_PATH_ACTIVE
+		    || path->iscsi == NULL
+		    || !iscsi_is_logged_in(path->iscsi)) {
+			continue;
+		}
+		prio = iscsi_mpath_path_prio(path);
+		if (prio < best_prio
+		    || (prio == best_prio
+			&& mp->policy == ISCSI_MPATH_LEAST_QUEUE_DEPTH
+			&& path->in_flight < mp->paths[best]->in_flight)) {
+			best      = idx;
+			best_prio = prio;
+		}
+	}
+
+	if (best != -1 && mp->policy == ISCSI_MPATH_ROUND_ROBIN) {
+		mp->next_path = (best + 1) % mp->num_paths;
+	}
+
+	return best;
+}
+
+/*
+ * Take the asymmetric access state of each path from its port group.
+ */
+static void
+iscsi_mpath_apply_rtpg(struct iscsi_mpath *mp,
+		       struct scsi_report_target_port_groups *rtpg)
+{
+	int i, j;
+
+	for (i = 0; i < mp->num_paths; i++) {
+		for (j = 0; j < rtpg->num_groups; j++) {
+			if (rtpg->groups[j].port_group
+			    == mp->paths[i]->port_group) {
+				mp->paths[i]->alua_state =
+					rtpg->groups[j].alua_state;
+			}
+		}
+	}
+}
+
+static void
+iscsi_mpath_rtpg_cb(struct iscsi_context *iscsi _U_, int status,
+		    void *command_data, void *private_data)
+{
+	struct iscsi_mpath *mp = private_data;
+	struct scsi_task *task = command_data;
+	struct scsi_report_target_port_groups *rtpg;
+
+	mp->rtpg_in_flight = 0;
+
+	if (status != SCSI_STATUS_GOOD || task == NULL) {
+		/* try again on the next completion */
+		if (!mp->destroying) {
+			mp->alua_refresh = 1;
+		}
+		return;
+	}
+
+	rtpg = scsi_datain_unmarshall(task);
+	if (rtpg != NULL) {
+		iscsi_mpath_apply_rtpg(mp, rtpg);
+	}
+}
+
+/*
+ * Ask a usable path for the current port group states, in the background.
+ */
+static void
+iscsi_mpath_refresh_alua(struct iscsi_mpath *mp)
+{
+	struct iscsi_mpath_path *path;
+	int i;
+
+	if (!mp->tpgs || mp->destroying) {
+		mp->alua_refresh = 0;
+		return;
+	}
+	/* asked again once the one in flight completes */
+	if (mp->rtpg_in_flight) {
+		return;
+	}
+
+	for (i = 0; i < mp->num_paths; i++) {
+		path = mp->paths[i];
+		if (path->state != ISCSI_MPATH_PATH_ACTIVE
+		    || path->iscsi == NULL
+		    || !iscsi_is_logged_in(path->iscsi)) {
+			continue;
+		}
+		if (iscsi_report_target_port_groups_async(path->iscsi,
+				mp->lun, ISCSI_MPATH_RTPG_ALLOC_LEN,
+				iscsi_mpath_rtpg_cb, mp) != 0) {
+			continue;
+		}
+		mp->rtpg_in_flight = 1;
+		mp->alua_refresh   = 0;
+		return;
+	}
+}
+
+static void iscsi_mpath_cmd_cb(struct iscsi_context *iscsi, int status,
+			       void *command_data, void *private_data);
+
+/*
+ * Send the command on the best path. On failure the task has been freed.
+ */
+static int
+iscsi_mpath_send_cmd(struct iscsi_mpath_cmd *cmd, struct iscsi_data *data)
+{
+	struct iscsi_mpath *mp = cmd->mp;
+	struct iscsi_mpath_path *path;
+	int idx;
+
+	idx = iscsi_mpath_select_path(mp);
+	if (idx == -1) {
+		iscsi_mpath_set_error(mp, "No usable path to the target.");
+		scsi_free_scsi_task(cmd->task);
+		cmd->task = NULL;
+		return -1;
+	}
+	path = mp->paths[idx];
+
+	cmd->path = idx;
+	if (iscsi_scsi_command_async(path->iscsi, mp->lun, cmd->task,
+				     iscsi_mpath_cmd_cb, data, cmd) != 0) {
+		iscsi_mpath_set_error(mp, "Failed to send command on path "
+				      "%s: %s", path->portal,
+				      iscsi_get_error(path->iscsi));
+		cmd->task = NULL;
+		return -1;
+	}
+	path->in_flight++;
+
+	return 0;
+}
+
+/*
+ * Whether a failed command should be tried again, maybe on another path.
+ * Sense data that reports a port in a state that can not do i/o updates
+ * the state of the path.
+ */
+static int
+iscsi_mpath_should_retry(struct iscsi_mpath_path *path, int status,
+			 struct scsi_task *task)
+{
+	if (status == SCSI_STATUS_GOOD) {
+		return 0;
+	}
+	/* the session went away under the command */
+	if (task == NULL || path->state != ISCSI_MPATH_PATH_ACTIVE) {
+		return 1;
+	}
+	if (status != SCSI_STATUS_CHECK_CONDITION) {
+		return 0;
+	}
+
+	switch (task->sense.ascq) {
+	case SCSI_SENSE_ASCQ_ASYMMETRIC_ACCESS_TRANSITION:
+		path->alua_state = SCSI_ALUA_TRANSITIONING;
+		path->mp->alua_refresh = 1;
+		return task->sense.key == SCSI_SENSE_NOT_READY;
+	case SCSI_SENSE_ASCQ_TARGET_PORT_IN_STANDBY:
+		path->alua_state = SCSI_ALUA_STANDBY;
+		path->mp->alua_refresh = 1;
+		return task->sense.key == SCSI_SENSE_NOT_READY;
+	case SCSI_SENSE_ASCQ_TARGET_PORT_IN_UNAVAILABLE:
+		path->alua_state = SCSI_ALUA_UNAVAILABLE;
+		path->mp->alua_refresh = 1;
+		return task->sense.key == SCSI_SENSE_NOT_READY;
+	case SCSI_SENSE_ASCQ_ASYMMETRIC_ACCESS_STATE_CHANGED:
+		path->mp->alua_refresh = 1;
+		return task->sense.key == SCSI_SENSE_UNIT_ATTENTION;
+	}
+
+	return 0;
+}
+
+static void
+iscsi_mpath_cmd_cb(struct iscsi_context *iscsi, int status,
+		   void *command_data, void *private_data)
+{
+	struct iscsi_mpath_cmd *cmd = private_data;
+	struct iscsi_mpath *mp = cmd->mp;
+	struct iscsi_mpath_path *path = mp->paths[cmd->path];
+	struct scsi_task *task = cmd->task;
+
+	/* the task outlives the pdu so that it can be sent again */
+	iscsi_cbdata_steal_scsi_task(task);
+	path->in_flight--;
+
+	if (!mp->destroying && cmd->retries < ISCSI_MPATH_MAX_RETRIES
+	    && iscsi_mpath_should_retry(path, status, command_data)) {
+		cmd->retries++;
+
+		free(task->datain.data);
+		task->datain.data = NULL;
+		task->datain.size = 0;
+		task->status      = 0;
+		bzero(&task->sense, sizeof(task->sense));
+
+		if (iscsi_mpath_send_cmd(cmd, NULL) == 0) {
+			return;
+		}
+		task   = NULL;
+		status = SCSI_STATUS_ERROR;
+	}
+
+	if (status == SCSI_STATUS_CANCELLED) {
+		status = SCSI_STATUS_ERROR;
+	}
+	if (task != NULL) {
+		task->status = status;
+	}
+	cmd->callback(iscsi, status, task, cmd->private_data);
+	if (task != NULL && !cmd->keep_task) {
+		scsi_free_scsi_task(task);
+	}
+	free(cmd);
+}
+
+static int
+iscsi_mpath_queue_cmd(struct iscsi_mpath *mp, struct scsi_task *task,
+		      struct iscsi_data *data, iscsi_command_cb cb,
+		      void *private_data, int keep_task)
+{
+	struct iscsi_mpath_cmd *cmd;
+
+	cmd = malloc(sizeof(struct iscsi_mpath_cmd));
+	if (cmd == NULL) {
+		iscsi_mpath_set_error(mp, "Out-of-memory: Failed to allocate "
+				      "multipath command.");
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+
+	bzero(cmd, sizeof(struct iscsi_mpath_cmd));
+	cmd->mp           = mp;
+	cmd->task         = task;
+	cmd->callback     = cb;
+	cmd->private_data = private_data;
+	cmd->keep_task    = keep_task;
+
+	if (iscsi_mpath_send_cmd(cmd, data) != 0) {
+		free(cmd);
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+iscsi_mpath_scsi_command_async(struct iscsi_mpath *mp, struct scsi_task *task,
+			       struct iscsi_data *data, iscsi_command_cb cb,
+			       void *private_data)
+{
+	return iscsi_mpath_queue_cmd(mp, task, data, cb, private_data, 0);
+}
+
+int
+iscsi_mpath_get_num_paths(struct iscsi_mpath *mp)
+{
+	return mp->num_paths;
+}
+
+int
+iscsi_mpath_get_fd(struct iscsi_mpath *mp, int path)
+{
+	if (path < 0 || path >= mp->num_paths
+	    || mp->paths[path]->iscsi == NULL) {
+		return -1;
+	}
+
+	return iscsi_get_fd(mp->paths[path]->iscsi);
+}
+
+int
+iscsi_mpath_which_events(struct iscsi_mpath *mp, int path)
+{
+	if (path < 0 || path >= mp->num_paths
+	    || mp->paths[path]->iscsi == NULL) {
+		return 0;
+	}
+
+	return iscsi_which_events(mp->paths[path]->iscsi);
+}
+
+int
+iscsi_mpath_next_timeout_ms(struct iscsi_mpath *mp)
+{
+	int i, ms, timeout = -1;
+
+	for (i = 0; i < mp->num_paths; i++) {
+		if (mp->paths[i]->iscsi == NULL) {
+			continue;
+		}
+		ms = iscsi_next_timeout_ms(mp->paths[i]->iscsi);
+		if (ms >= 0 && (timeout < 0 || ms < timeout)) {
+			timeout = ms;
+		}
+	}
+
+	return timeout;
+}
+
+int
+iscsi_mpath_service(struct iscsi_mpath *mp, int path, int revents)
+{
+	struct iscsi_mpath_path *p;
+	int i;
+
+	if (path < 0 || path >= mp->num_paths) {
+		iscsi_mpath_set_error(mp, "No such path %d.", path);
+		return -1;
+	}
+	p = mp->paths[path];
+
+	if (p->iscsi != NULL) {
+		if (iscsi_service(p->iscsi, revents) < 0
+		    || p->state == ISCSI_MPATH_PATH_FAILED) {
+			iscsi_mpath_set_error(mp, "Path %s failed: %s",
+					      p->portal,
+					      iscsi_get_error(p->iscsi));
+			iscsi_mpath_fail_path(p);
+		}
+	}
+
+	if (mp->alua_refresh) {
+		iscsi_mpath_refresh_alua(mp);
+	}
+
+	for (i = 0; i < mp->num_paths; i++) {
+		if (mp->paths[i]->state == ISCSI_MPATH_PATH_ACTIVE) {
+			return 0;
+		}
+	}
+	iscsi_mpath_set_error(mp, "All paths to the target have failed.");
+
+	return -1;
+}
+
+/*
+ * Synchronous multipath calls
+ */
+struct iscsi_mpath_sync_state {
+	int finished;
+	struct scsi_task *task;
+};
+
+static void
+iscsi_mpath_event_loop(struct iscsi_mpath *mp,
+		       struct iscsi_mpath_sync_state *state)
+{
+	struct pollfd *pfd;
+	int *idx;
+	int i, count, ret;
+
+	pfd = malloc(sizeof(struct pollfd) * (mp->num_paths + 1));
+	idx = malloc(sizeof(int) * (mp->num_paths + 1));
+	if (pfd == NULL || idx == NULL) {
+		iscsi_mpath_set_error(mp, "Out-of-memory: Failed to allocate "
+				      "pollfds.");
+		free(pfd);
+		free(idx);
+		return;
+	}
+
+	while (state->finished == 0) {
+		count = 0;
+		for (i = 0; i < mp->num_paths; i++) {
+			if (iscsi_mpath_get_fd(mp, i) == -1) {
+				continue;
+			}
+			idx[count]        = i;
+			pfd[count].fd     = iscsi_mpath_get_fd(mp, i);
+			pfd[count].events = iscsi_mpath_which_events(mp, i);
+			count++;
+		}
+		if (count == 0) {
+			iscsi_mpath_set_error(mp, "No path left to service.");
+			break;
+		}
+
+		ret = poll(pfd, count, iscsi_mpath_next_timeout_ms(mp));
+		if (ret < 0) {
+			iscsi_mpath_set_error(mp, "Poll failed");
+			break;
+		}
+		for (i = 0; i < count; i++) {
+			/* a command has timed out, on one path or another */
+			if (pfd[i].revents == 0 && ret != 0) {
+				continue;
+			}
+			iscsi_mpath_service(mp, idx[i], pfd[i].revents);
+		}
+	}
+
+	free(pfd);
+	free(idx);
+}
+
+static void
+iscsi_mpath_sync_cb(struct iscsi_context *iscsi _U_, int status _U_,
+		    void *command_data, void *private_data)
+{
+	struct iscsi_mpath_sync_state *state = private_data;
+
+	state->finished = 1;
+	state->task     = command_data;
+}
+
+struct scsi_task *
+iscsi_mpath_scsi_command_sync(struct iscsi_mpath *mp, struct scsi_task *task,
+			      struct iscsi_data *data)
+{
+	struct iscsi_mpath_sync_state state;
+
+	bzero(&state, sizeof(state));
+
+	if (iscsi_mpath_queue_cmd(mp, task, data, iscsi_mpath_sync_cb,
+				  &state, 1) != 0) {
+		return NULL;
+	}
+
+	iscsi_mpath_event_loop(mp, &state);
+
+	return state.task;
+}
+
+static void
+iscsi_mpath_socket_cb(struct iscsi_context *iscsi _U_, int status,
+		      void *command_data _U_, void *private_data)
+{
+	struct iscsi_mpath_path *path = private_data;
+
+	if (status != SCSI_STATUS_GOOD) {
+		path->state = ISCSI_MPATH_PATH_FAILED;
+	}
+}
+
+/*
+ * The target port group of the port we are logged in to, from the device
+ * identification page.
+ */
+static int
+iscsi_mpath_probe_port_group(struct iscsi_mpath_path *path)
+{
+	struct scsi_task *task;
+	struct scsi_inquiry_device_identification *inq;
+	struct scsi_inquiry_device_designator *dev;
+
+	task = iscsi_inquiry_sync(path->iscsi, path->mp->lun, 1,
+				  SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION,
+				  255);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+	inq = scsi_datain_unmarshall(task);
+	if (inq == NULL) {
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+	for (dev = inq->designators; dev; dev = dev->next) {
+		if (dev->association == SCSI_ASSOCIATION_TARGET_PORT
+		    && dev->designator_type
+		       == SCSI_DESIGNATOR_TYPE_TARGET_PORT_GROUP
+		    && dev->designator_length >= 4) {
+			path->port_group = ntohs(*(uint16_t *)
+						 &dev->designator[2]);
+		}
+	}
+	scsi_free_scsi_task(task);
+
+	return 0;
+}
+
+/*
+ * Log the path in and find out which port group it belongs to.
+ */
+static int
+iscsi_mpath_connect_path(struct iscsi_mpath *mp, struct iscsi_mpath_path *path)
+{
+	struct iscsi_context *iscsi;
+	struct scsi_task *task;
+	struct scsi_inquiry_standard *inq;
+	int i;
+
+	iscsi = iscsi_create_context(mp->initiator_name);
+	if (iscsi == NULL) {
+		iscsi_mpath_set_error(mp, "Out-of-memory: Failed to create "
+				      "context.");
+		return -1;
+	}
+	path->iscsi = iscsi;
+
+	/* every path is a session of its own and needs its own isid */
+	iscsi_set_isid_random(iscsi, mp->isid_base++);
+
+	/* a failed path is not reconnected, its commands go to the others */
+	iscsi_set_reconnect_max_retries(iscsi, 0);
+	if (iscsi_set_targetname(iscsi, mp->target_name) != 0
+	    || iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0
+	    || iscsi_connect_sync(iscsi, path->portal) != 0) {
+		goto failed;
+	}
+
+	/* from here on a broken connection fails the path */
+	iscsi->socket_status_cb = iscsi_mpath_socket_cb;
+	iscsi->connect_data     = path;
+
+	if (iscsi_login_sync(iscsi) != 0) {
+		goto failed;
+	}
+
+	for (i = 0; i < ISCSI_MPATH_MAX_TUR; i++) {
+		task = iscsi_testunitready_sync(iscsi, mp->lun);
+		if (task == NULL) {
+			goto failed;
+		}
+		if (task->status == SCSI_STATUS_GOOD) {
+			scsi_free_scsi_task(task);
+			break;
+		}
+		scsi_free_scsi_task(task);
+	}
+
+	path->port_group = -1;
+	path->alua_state = SCSI_ALUA_ACTIVE_OPTIMIZED;
+
+	task = iscsi_inquiry_sync(iscsi, mp->lun, 0, 0, 64);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		scsi_free_scsi_task(task);
+		goto failed;
+	}
+	inq = scsi_datain_unmarshall(task);
+	if (inq != NULL && inq->tpgs != SCSI_INQUIRY_TPGS_NO_SUPPORT) {
+		mp->tpgs = 1;
+	}
+	scsi_free_scsi_task(task);
+
+	if (mp->tpgs && iscsi_mpath_probe_port_group(path) != 0) {
+		goto failed;
+	}
+
+	path->state = ISCSI_MPATH_PATH_ACTIVE;
+
+	return 0;
+
+failed:
+	iscsi_mpath_set_error(mp, "Failed to log in on path %s: %s",
+			      path->portal, iscsi_get_error(iscsi));
+	path->state = ISCSI_MPATH_PATH_FAILED;
+	path->iscsi = NULL;
+	iscsi_destroy_context(iscsi);
+
+	return -1;
+}
+
+int
+iscsi_mpath_update_alua_sync(struct iscsi_mpath *mp)
+{
+	struct iscsi_mpath_path *path;
+	struct scsi_task *task;
+	struct scsi_report_target_port_groups *rtpg;
+	int i;
+
+	if (!mp->tpgs) {
+		return 0;
+	}
+
+	for (i = 0; i < mp->num_paths; i++) {
+		path = mp->paths[i];
+		if (path->state != ISCSI_MPATH_PATH_ACTIVE
+		    || path->iscsi == NULL) {
+			continue;
+		}
+		task = iscsi_report_target_port_groups_sync(path->iscsi,
+				mp->lun, ISCSI_MPATH_RTPG_ALLOC_LEN);
+		if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+			scsi_free_scsi_task(task);
+			continue;
+		}
+		rtpg = scsi_datain_unmarshall(task);
+		if (rtpg == NULL) {
+			scsi_free_scsi_task(task);
+			continue;
+		}
+		iscsi_mpath_apply_rtpg(mp, rtpg);
+		scsi_free_scsi_task(task);
+		mp->alua_refresh = 0;
+		return 0;
+	}
+
+	iscsi_mpath_set_error(mp, "No path could report the target port "
+			      "groups.");
+	return -1;
+}
+
+int
+iscsi_mpath_add_portal_sync(struct iscsi_mpath *mp, const char *portal)
+{
+	struct iscsi_mpath_path *path, **paths;
+
+	path = malloc(sizeof(struct iscsi_mpath_path));
+	if (path == NULL) {
+		iscsi_mpath_set_error(mp, "Out-of-memory: Failed to allocate "
+				      "path.");
+		return -1;
+	}
+	bzero(path, sizeof(struct iscsi_mpath_path));
+	path->mp     = mp;
+	path->portal = strdup(portal);
+	paths = realloc(mp->paths, sizeof(struct iscsi_mpath_path *)
+			* (mp->num_paths + 1));
+	if (path->portal == NULL || paths == NULL) {
+		iscsi_mpath_set_error(mp, "Out-of-memory: Failed to allocate "
+				      "path.");
+		free(path->portal);
+		free(path);
+		if (paths != NULL) {
+			mp->paths = paths;
+		}
+		return -1;
+	}
+	mp->paths = paths;
+
+	if (iscsi_mpath_connect_path(mp, path) != 0) {
+		free(path->portal);
+		free(path);
+		return -1;
+	}
+	mp->paths[mp->num_paths++] = path;
+
+	return iscsi_mpath_update_alua_sync(mp);
+}
+
+int
+iscsi_mpath_reinstate_sync(struct iscsi_mpath *mp)
+{
+	struct iscsi_mpath_path *path;
+	int i, count = 0;
+
+	for (i = 0; i < mp->num_paths; i++) {
+		path = mp->paths[i];
+		if (path->state != ISCSI_MPATH_PATH_FAILED) {
+			count++;
+			continue;
+		}
+		/* a path that failed may still have its context around */
+		iscsi_mpath_fail_path(path);
+		if (iscsi_mpath_connect_path(mp, path) == 0) {
+			count++;
+		}
+	}
+
+	if (count > 0) {
+		iscsi_mpath_update_alua_sync(mp);
+	}
+
+	return count;
+}
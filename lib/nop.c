@@ -50,8 +50,8 @@ iscsi_nop_out_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 	iscsi_pdu_set_lun(pdu, 2);
 
 	/* cmdsn is not increased if Immediate delivery*/
-	iscsi_pdu_set_cmdsn(pdu, iscsi->cmdsn);
-	pdu->cmdsn = iscsi->cmdsn;
+	iscsi_pdu_set_cmdsn(pdu, ISCSI_SESSION(iscsi)->cmdsn);
+	pdu->cmdsn = ISCSI_SESSION(iscsi)->cmdsn;
 
 	pdu->callback     = cb;
 	pdu->private_data = private_data;
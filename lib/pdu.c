@@ -18,6 +18,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
+#include <limits.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include "iscsi.h"
@@ -29,39 +30,59 @@ struct iscsi_pdu *
 iscsi_allocate_pdu(struct iscsi_context *iscsi, enum iscsi_opcode opcode,
 		   enum iscsi_opcode response_opcode)
 {
+	struct iscsi_context *session = ISCSI_SESSION(iscsi);
 	struct iscsi_pdu *pdu;
 
-	pdu = malloc(sizeof(struct iscsi_pdu));
-	if (pdu == NULL) {
-		iscsi_set_error(iscsi, "failed to allocate pdu");
-		return NULL;
+	/* itts are unique across all connections of the session */
+	pdu = iscsi_allocate_pdu_with_itt_flags(iscsi, opcode, response_opcode,
+						session->itt, 0);
+	if (pdu != NULL) {
+		session->itt++;
 	}
-	bzero(pdu, sizeof(struct iscsi_pdu));
 
-	pdu->outdata.size = ISCSI_HEADER_SIZE;
-	pdu->outdata.data = malloc(pdu->outdata.size);
+	return pdu;
+}
 
-	if (pdu->outdata.data == NULL) {
-		iscsi_set_error(iscsi, "failed to allocate pdu header");
-		free(pdu);
-		return NULL;
+struct iscsi_pdu *
+iscsi_allocate_pdu_with_itt_flags(struct iscsi_context *iscsi,
+				  enum iscsi_opcode opcode,
+				  enum iscsi_opcode response_opcode,
+				  uint32_t itt, uint32_t flags)
+{
+	struct iscsi_pdu *pdu;
+
+	/* recycle a pdu from the freelist if there is one */
+	pdu = iscsi->free_pdus;
+	if (pdu != NULL) {
+		iscsi->free_pdus = pdu->next;
+		iscsi->free_pdu_count--;
+	} else {
+		pdu = malloc(sizeof(struct iscsi_pdu));
+		if (pdu == NULL) {
+			iscsi_set_error(iscsi, "failed to allocate pdu");
+			return NULL;
+		}
 	}
-	bzero(pdu->outdata.data, pdu->outdata.size);
+	bzero(pdu, sizeof(struct iscsi_pdu));
 
 	/* opcode */
-	pdu->outdata.data[0] = opcode;
+	pdu->hdr[0] = opcode;
 	pdu->response_opcode = response_opcode;
+	pdu->flags           = flags;
 
-	/* isid */
+	/* isid, tsih and cid */
 	if (opcode == ISCSI_PDU_LOGIN_REQUEST) {
-		memcpy(&pdu->outdata.data[8], &iscsi->isid[0], 6);
+		memcpy(&pdu->hdr[8], &iscsi->isid[0], 6);
+		*(uint16_t *)&pdu->hdr[14] = htons(iscsi->tsih);
+		*(uint16_t *)&pdu->hdr[20] = htons(iscsi->cid);
 	}
 
-	/* itt */
-	*(uint32_t *)&pdu->outdata.data[16] = htonl(iscsi->itt);
-	pdu->itt = iscsi->itt;
+	pdu->data_crc    = 0xffffffff;
+	pdu->timer.level = -1;
 
-	iscsi->itt++;
+	/* itt */
+	*(uint32_t *)&pdu->hdr[16] = htonl(itt);
+	pdu->itt = itt;
 
 	return pdu;
 }
@@ -74,6 +95,20 @@ iscsi_free_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 		return;
 	}
 
+	iscsi_timeout_disarm(iscsi, pdu);
+
+	if (pdu->dataout_count > 0) {
+		iscsi_cancel_data_out(iscsi, pdu);
+	}
+	if (pdu->cmd_pdu != NULL) {
+		pdu->cmd_pdu->dataout_count--;
+		pdu->cmd_pdu = NULL;
+	}
+	if (pdu->flags & ISCSI_PDU_IN_FLIGHT) {
+		iscsi->cmds_in_flight--;
+		iscsi->bytes_in_flight -= ntohl(*(uint32_t *)&pdu->hdr[20]);
+	}
+
 	free(pdu->outdata.data);
 	pdu->outdata.data = NULL;
 
@@ -85,9 +120,60 @@ iscsi_free_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 		pdu->scsi_cbdata = NULL;
 	}
 
+	if (iscsi->free_pdu_count < iscsi->free_pdu_max) {
+		pdu->next = iscsi->free_pdus;
+		iscsi->free_pdus = pdu;
+		iscsi->free_pdu_count++;
+		return;
+	}
+
 	free(pdu);
 }
 
+int
+iscsi_set_pdu_cache_size(struct iscsi_context *iscsi, int count)
+{
+	struct iscsi_pdu *pdu;
+
+	if (count < 0) {
+		iscsi_set_error(iscsi, "invalid pdu cache size %d", count);
+		return -1;
+	}
+
+	iscsi->free_pdu_max = count;
+
+	while (iscsi->free_pdu_count > count) {
+		pdu = iscsi->free_pdus;
+		iscsi->free_pdus = pdu->next;
+		iscsi->free_pdu_count--;
+		free(pdu);
+	}
+	while (iscsi->free_pdu_count < count) {
+		pdu = malloc(sizeof(struct iscsi_pdu));
+		if (pdu == NULL) {
+			iscsi_set_error(iscsi, "failed to allocate pdu");
+			return -1;
+		}
+		pdu->next = iscsi->free_pdus;
+		iscsi->free_pdus = pdu;
+		iscsi->free_pdu_count++;
+	}
+
+	return 0;
+}
+
+void
+iscsi_free_pdu_cache(struct iscsi_context *iscsi)
+{
+	struct iscsi_pdu *pdu;
+
+	while ((pdu = iscsi->free_pdus) != NULL) {
+		iscsi->free_pdus = pdu->next;
+		free(pdu);
+	}
+	iscsi->free_pdu_count = 0;
+}
+
 
 int
 iscsi_add_data(struct iscsi_context *iscsi, struct iscsi_data *data,
@@ -150,9 +236,108 @@ iscsi_pdu_add_data(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 		return -1;
 	}
 
+	/* keep the data digest up to date while the data is hot */
+	if (iscsi->data_digest != ISCSI_DATA_DIGEST_NONE) {
+		pdu->data_crc = crc32c_update(pdu->data_crc, dptr, dsize);
+		pdu->data_crc_len += dsize;
+	}
+
+	/* update data segment length */
+	*(uint32_t *)&pdu->hdr[4] = htonl(pdu->outdata.size);
+
+	return 0;
+}
+
+/*
+ * Use len bytes from offset in the data-out buffers of the task as the
+ * data segment of the pdu. The data is not copied, it is written to the
+ * socket straight from the application buffers.
+ */
+int
+iscsi_pdu_add_task_payload(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+			   struct scsi_task *task, int offset, int len)
+{
+	int available;
+
+	if (pdu == NULL) {
+		iscsi_set_error(iscsi, "trying to add payload to NULL pdu");
+		return -1;
+	}
+	if (pdu->outdata.size != 0) {
+		iscsi_set_error(iscsi, "trying to add task payload to a pdu "
+				"that already has data");
+		return -1;
+	}
+	if (offset < 0 || len <= 0 || offset > INT_MAX - len
+	    || scsi_task_get_data_out_buffer(task, offset + len - 1,
+					     &available) == NULL) {
+		iscsi_set_error(iscsi, "task payload offset:%d len:%d is "
+				"beyond the data-out buffers", offset, len);
+		return -1;
+	}
+
+	pdu->payload_task   = task;
+	pdu->payload_offset = offset;
+	pdu->payload_len    = len;
+
 	/* update data segment length */
-	*(uint32_t *)&pdu->outdata.data[4] = htonl(pdu->outdata.size
-						   - ISCSI_HEADER_SIZE);
+	*(uint32_t *)&pdu->hdr[4] = htonl(len);
+
+	return 0;
+}
+
+/*
+ * Remove the DATA-OUT pdus of a command that has completed from the
+ * outqueue. A pdu that is already partly written must still be finished,
+ * so its payload is copied away from the task that is about to go away.
+ */
+int
+iscsi_cancel_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	struct iscsi_pdu *dout, *next;
+
+	for (dout = iscsi->outqueue; dout && pdu->dataout_count > 0;
+	     dout = next) {
+		unsigned char *buf, *src;
+		int pos, available;
+
+		next = dout->next;
+		if (dout->cmd_pdu != pdu) {
+			continue;
+		}
+		if (dout->written == 0) {
+			DLIST_REMOVE(&iscsi->outqueue, &iscsi->outqueue_tail,
+				     dout);
+			iscsi_free_pdu(iscsi, dout);
+			continue;
+		}
+
+		buf = malloc((dout->payload_len + 3) & 0xfffffffc);
+		if (buf == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: failed to copy "
+					"the payload of a partly sent DATA-OUT");
+			return -1;
+		}
+		for (pos = 0; pos < dout->payload_len; pos += available) {
+			src = scsi_task_get_data_out_buffer(dout->payload_task,
+					dout->payload_offset + pos, &available);
+			if (available > dout->payload_len - pos) {
+				available = dout->payload_len - pos;
+			}
+			memcpy(buf + pos, src, available);
+		}
+		bzero(buf + pos, ((pos + 3) & 0xfffffffc) - pos);
+
+		/* same size on the wire, so written is still correct */
+		dout->outdata.data   = buf;
+		dout->outdata.size   = dout->payload_len;
+		dout->payload_task   = NULL;
+		dout->payload_offset = 0;
+		dout->payload_len    = 0;
+
+		dout->cmd_pdu = NULL;
+		pdu->dataout_count--;
+	}
 
 	return 0;
 }
@@ -168,14 +353,209 @@ iscsi_get_pdu_data_size(const unsigned char *hdr)
 	return size;
 }
 
+#define ISCSI_WAITPDU_HASH_MIN_SIZE	64
+
+/*
+ * PDUs that have been sent and are waiting for a reply are kept in a
+ * hash table indexed by ITT. ITTs are allocated sequentially so the low
+ * bits spread them evenly across the buckets, and the table is doubled
+ * whenever there are more pdus in flight than there are buckets.
+ */
+static void
+iscsi_waitpdu_grow(struct iscsi_context *iscsi)
+{
+	struct iscsi_pdu **table;
+	uint32_t size, i;
+
+	size = iscsi->waitpdu_size * 2;
+	if (size < ISCSI_WAITPDU_HASH_MIN_SIZE) {
+		size = ISCSI_WAITPDU_HASH_MIN_SIZE;
+	}
+
+	table = malloc(size * sizeof(struct iscsi_pdu *));
+	if (table == NULL) {
+		/* keep using the old table, just with longer chains */
+		return;
+	}
+	bzero(table, size * sizeof(struct iscsi_pdu *));
+
+	for (i = 0; i < iscsi->waitpdu_size; i++) {
+		struct iscsi_pdu *pdu;
+
+		while ((pdu = iscsi->waitpdu[i]) != NULL) {
+			iscsi->waitpdu[i] = pdu->hash_next;
+			pdu->hash_next = table[pdu->itt & (size - 1)];
+			table[pdu->itt & (size - 1)] = pdu;
+		}
+	}
+
+	free(iscsi->waitpdu);
+	iscsi->waitpdu      = table;
+	iscsi->waitpdu_size = size;
+}
+
+void
+iscsi_waitpdu_add(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	uint32_t i;
+
+	if (iscsi->waitpdu_count >= iscsi->waitpdu_size) {
+		iscsi_waitpdu_grow(iscsi);
+	}
+
+	i = pdu->itt & (iscsi->waitpdu_size - 1);
+	pdu->hash_next = iscsi->waitpdu[i];
+	iscsi->waitpdu[i] = pdu;
+	iscsi->waitpdu_count++;
+}
+
+void
+iscsi_waitpdu_remove(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	struct iscsi_pdu **p;
+
+	if (iscsi->waitpdu_size == 0) {
+		return;
+	}
+
+	p = &iscsi->waitpdu[pdu->itt & (iscsi->waitpdu_size - 1)];
+	for (; *p != NULL; p = &(*p)->hash_next) {
+		if (*p == pdu) {
+			*p = pdu->hash_next;
+			pdu->hash_next = NULL;
+			iscsi->waitpdu_count--;
+			return;
+		}
+	}
+}
+
+struct iscsi_pdu *
+iscsi_find_waitpdu(struct iscsi_context *iscsi, uint32_t itt)
+{
+	struct iscsi_pdu *pdu;
+
+	if (iscsi->waitpdu_size == 0) {
+		return NULL;
+	}
+
+	pdu = iscsi->waitpdu[itt & (iscsi->waitpdu_size - 1)];
+	for (; pdu; pdu = pdu->hash_next) {
+		if (pdu->itt == itt) {
+			return pdu;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns any pdu that is waiting for a reply, or NULL if there are none.
+ */
+struct iscsi_pdu *
+iscsi_first_waitpdu(struct iscsi_context *iscsi)
+{
+	uint32_t i;
+
+	if (iscsi->waitpdu_count == 0) {
+		return NULL;
+	}
+	for (i = 0; i < iscsi->waitpdu_size; i++) {
+		if (iscsi->waitpdu[i] != NULL) {
+			return iscsi->waitpdu[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Complete a pdu that the target will not reply to, or whose reply no
+ * longer matters, with status. A SCSI command may still be waiting to be
+ * sent, a pdu in the outqueue must not be partly written unless the
+ * connection is gone.
+ */
+void
+iscsi_terminate_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		    int status)
+{
+	struct iscsi_context *session = ISCSI_SESSION(iscsi);
+	struct iscsi_context *conn = pdu->conn;
+	struct scsi_task *task = NULL;
+
+	if (pdu->scsi_cbdata != NULL) {
+		task = pdu->scsi_cbdata->task;
+	}
+
+	if (conn == NULL) {
+		/* the command is held by the session */
+		if (session->is_reconnecting) {
+			DLIST_REMOVE(&session->reconnect_cmds,
+				     &session->reconnect_cmds_tail, pdu);
+		} else {
+			DLIST_REMOVE(&session->cmd_backlog,
+				     &session->cmd_backlog_tail, pdu);
+			session->cmd_backlog_count--;
+		}
+		conn = session;
+	} else if (iscsi_find_waitpdu(conn, pdu->itt) == pdu) {
+		iscsi_waitpdu_remove(conn, pdu);
+		/* DATA-IN may be on its way into the buffers of the task */
+		iscsi_incoming_release_task(conn, task);
+	} else {
+		DLIST_REMOVE(&conn->outqueue, &conn->outqueue_tail, pdu);
+	}
+
+	pdu->callback(conn, status, task, pdu->private_data);
+	iscsi_free_pdu(conn, pdu);
+}
+
+/*
+ * Every pdu from the target carries ExpCmdSN and MaxCmdSN at the same
+ * place. Track the window they describe, using serial number arithmetic,
+ * and send any commands that were held back once it opens.
+ */
+void
+iscsi_update_cmdsn_window(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
+{
+	uint32_t expcmdsn, maxcmdsn;
+
+	expcmdsn = ntohl(*(uint32_t *)&in->hdr[28]);
+	maxcmdsn = ntohl(*(uint32_t *)&in->hdr[32]);
+
+	/* a window that is smaller than empty is to be ignored */
+	if ((int32_t)(maxcmdsn - expcmdsn) < -1) {
+		return;
+	}
+
+	/* the window is session wide, whichever connection it came on */
+	iscsi = ISCSI_SESSION(iscsi);
+
+	/* take whatever the target says during login, after that the
+	 * values may only move forward
+	 */
+	if (iscsi->is_loggedin == 0
+	    || (int32_t)(expcmdsn - iscsi->expcmdsn) > 0) {
+		iscsi->expcmdsn = expcmdsn;
+	}
+	if (iscsi->is_loggedin == 0
+	    || (int32_t)(maxcmdsn - iscsi->maxcmdsn) > 0) {
+		iscsi->maxcmdsn = maxcmdsn;
+	}
+
+	if (iscsi->cmd_backlog != NULL) {
+		iscsi_send_cmd_backlog(iscsi);
+	}
+}
 
 int
 iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 {
 	uint32_t itt;
 	enum iscsi_opcode opcode;
+	enum iscsi_opcode expected_response;
 	struct iscsi_pdu *pdu;
 	uint8_t	ahslen;
+	int is_finished = 1;
 
 	opcode = in->hdr[0] & 0x3f;
 	ahslen = in->hdr[4];
@@ -186,95 +566,115 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 		return -1;
 	}
 
-	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
-		enum iscsi_opcode expected_response = pdu->response_opcode;
-		int is_finished = 1;
+	iscsi_update_cmdsn_window(iscsi, in);
 
-		if (pdu->itt != itt) {
-			continue;
-		}
+	pdu = iscsi_find_waitpdu(iscsi, itt);
+	if (pdu == NULL) {
+		return 0;
+	}
+	expected_response = pdu->response_opcode;
+
+	/* we have a special case with scsi-command opcodes,
+	 * they are replied to by either a scsi-response
+	 * or a data-in, or a combination of both.
+	 */
+	if (opcode == ISCSI_PDU_DATA_IN
+	    && expected_response == ISCSI_PDU_SCSI_RESPONSE) {
+		expected_response = ISCSI_PDU_DATA_IN;
+	}
+	if (opcode == ISCSI_PDU_R2T
+	    && expected_response == ISCSI_PDU_SCSI_RESPONSE) {
+		expected_response = ISCSI_PDU_R2T;
+	}
 
-		/* we have a special case with scsi-command opcodes,
-		 * they are replied to by either a scsi-response
-		 * or a data-in, or a combination of both.
-		 */
-		if (opcode == ISCSI_PDU_DATA_IN
-		    && expected_response == ISCSI_PDU_SCSI_RESPONSE) {
-			expected_response = ISCSI_PDU_DATA_IN;
+	if (opcode != expected_response) {
+		iscsi_set_error(iscsi, "Got wrong opcode back for "
+				"itt:%d  got:%d expected %d",
+				itt, opcode, pdu->response_opcode);
+		return -1;
+	}
+	switch (opcode) {
+	case ISCSI_PDU_LOGIN_RESPONSE:
+		if (iscsi_process_login_reply(iscsi, pdu, in) != 0) {
+			iscsi_waitpdu_remove(iscsi, pdu);
+			iscsi_free_pdu(iscsi, pdu);
+			iscsi_set_error(iscsi, "iscsi login reply "
+					"failed");
+			return -1;
 		}
-
-		if (opcode != expected_response) {
-			iscsi_set_error(iscsi, "Got wrong opcode back for "
-					"itt:%d  got:%d expected %d",
-					itt, opcode, pdu->response_opcode);
+		break;
+	case ISCSI_PDU_TEXT_RESPONSE:
+		if (iscsi_process_text_reply(iscsi, pdu, in) != 0) {
+			iscsi_waitpdu_remove(iscsi, pdu);
+			iscsi_free_pdu(iscsi, pdu);
+			iscsi_set_error(iscsi, "iscsi text reply "
+					"failed");
 			return -1;
 		}
-		switch (opcode) {
-		case ISCSI_PDU_LOGIN_RESPONSE:
-			if (iscsi_process_login_reply(iscsi, pdu, in) != 0) {
-				SLIST_REMOVE(&iscsi->waitpdu, pdu);
-				iscsi_free_pdu(iscsi, pdu);
-				iscsi_set_error(iscsi, "iscsi login reply "
-						"failed");
-				return -1;
-			}
-			break;
-		case ISCSI_PDU_TEXT_RESPONSE:
-			if (iscsi_process_text_reply(iscsi, pdu, in) != 0) {
-				SLIST_REMOVE(&iscsi->waitpdu, pdu);
-				iscsi_free_pdu(iscsi, pdu);
-				iscsi_set_error(iscsi, "iscsi text reply "
-						"failed");
-				return -1;
-			}
-			break;
-		case ISCSI_PDU_LOGOUT_RESPONSE:
-			if (iscsi_process_logout_reply(iscsi, pdu, in) != 0) {
-				SLIST_REMOVE(&iscsi->waitpdu, pdu);
-				iscsi_free_pdu(iscsi, pdu);
-				iscsi_set_error(iscsi, "iscsi logout reply "
-						"failed");
-				return -1;
-			}
-			break;
-		case ISCSI_PDU_SCSI_RESPONSE:
-			if (iscsi_process_scsi_reply(iscsi, pdu, in) != 0) {
-				SLIST_REMOVE(&iscsi->waitpdu, pdu);
-				iscsi_free_pdu(iscsi, pdu);
-				iscsi_set_error(iscsi, "iscsi response reply "
-						"failed");
-				return -1;
-			}
-			break;
-		case ISCSI_PDU_DATA_IN:
-			if (iscsi_process_scsi_data_in(iscsi, pdu, in,
-						       &is_finished) != 0) {
-				SLIST_REMOVE(&iscsi->waitpdu, pdu);
-				iscsi_free_pdu(iscsi, pdu);
-				iscsi_set_error(iscsi, "iscsi data in "
-						"failed");
-				return -1;
-			}
-			break;
-		case ISCSI_PDU_NOP_IN:
-			if (iscsi_process_nop_out_reply(iscsi, pdu, in) != 0) {
-				SLIST_REMOVE(&iscsi->waitpdu, pdu);
-				iscsi_free_pdu(iscsi, pdu);
-				iscsi_set_error(iscsi, "iscsi nop-in failed");
-				return -1;
-			}
-			break;
-		default:
-			iscsi_set_error(iscsi, "Dont know how to handle "
-					"opcode %d", opcode);
+		break;
+	case ISCSI_PDU_LOGOUT_RESPONSE:
+		if (iscsi_process_logout_reply(iscsi, pdu, in) != 0) {
+			iscsi_waitpdu_remove(iscsi, pdu);
+			iscsi_free_pdu(iscsi, pdu);
+			iscsi_set_error(iscsi, "iscsi logout reply "
+					"failed");
 			return -1;
 		}
-
-		if (is_finished) {
-			SLIST_REMOVE(&iscsi->waitpdu, pdu);
+		break;
+	case ISCSI_PDU_SCSI_RESPONSE:
+		if (iscsi_process_scsi_reply(iscsi, pdu, in) != 0) {
+			iscsi_waitpdu_remove(iscsi, pdu);
 			iscsi_free_pdu(iscsi, pdu);
+			iscsi_set_error(iscsi, "iscsi response reply "
+					"failed");
+			return -1;
 		}
-		return 0;
+		break;
+	case ISCSI_PDU_DATA_IN:
+		if (iscsi_process_scsi_data_in(iscsi, pdu, in,
+					       &is_finished) != 0) {
+			iscsi_waitpdu_remove(iscsi, pdu);
+			iscsi_free_pdu(iscsi, pdu);
+			iscsi_set_error(iscsi, "iscsi data in "
+					"failed");
+			return -1;
+		}
+		break;
+	case ISCSI_PDU_R2T:
+		if (iscsi_process_r2t(iscsi, pdu, in) != 0) {
+			iscsi_waitpdu_remove(iscsi, pdu);
+			iscsi_free_pdu(iscsi, pdu);
+			iscsi_set_error(iscsi, "iscsi r2t failed");
+			return -1;
+		}
+		is_finished = 0;
+		break;
+	case ISCSI_PDU_NOP_IN:
+		if (iscsi_process_nop_out_reply(iscsi, pdu, in) != 0) {
+			iscsi_waitpdu_remove(iscsi, pdu);
+			iscsi_free_pdu(iscsi, pdu);
+			iscsi_set_error(iscsi, "iscsi nop-in failed");
+			return -1;
+		}
+		break;
+	case ISCSI_PDU_SCSI_TASK_MANAGEMENT_RESPONSE:
+		if (iscsi_process_task_mgmt_reply(iscsi, pdu, in) != 0) {
+			iscsi_waitpdu_remove(iscsi, pdu);
+			iscsi_free_pdu(iscsi, pdu);
+			iscsi_set_error(iscsi, "iscsi task management reply "
+					"failed");
+			return -1;
+		}
+		break;
+	default:
+		iscsi_set_error(iscsi, "Dont know how to handle "
+				"opcode %d", opcode);
+		return -1;
+	}
+
+	if (is_finished) {
+		iscsi_waitpdu_remove(iscsi, pdu);
+		iscsi_free_pdu(iscsi, pdu);
 	}
 
 	return 0;
@@ -283,48 +683,60 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 void
 iscsi_pdu_set_pduflags(struct iscsi_pdu *pdu, unsigned char flags)
 {
-	pdu->outdata.data[1] = flags;
+	pdu->hdr[1] = flags;
 }
 
 void
 iscsi_pdu_set_immediate(struct iscsi_pdu *pdu)
 {
-	pdu->outdata.data[0] |= ISCSI_PDU_IMMEDIATE;
+	pdu->hdr[0] |= ISCSI_PDU_IMMEDIATE;
 }
 
 void
 iscsi_pdu_set_ttt(struct iscsi_pdu *pdu, uint32_t ttt)
 {
-	*(uint32_t *)&pdu->outdata.data[20] = htonl(ttt);
+	*(uint32_t *)&pdu->hdr[20] = htonl(ttt);
 }
 
 void
 iscsi_pdu_set_cmdsn(struct iscsi_pdu *pdu, uint32_t cmdsn)
 {
-	*(uint32_t *)&pdu->outdata.data[24] = htonl(cmdsn);
+	*(uint32_t *)&pdu->hdr[24] = htonl(cmdsn);
 }
 
 void
 iscsi_pdu_set_expstatsn(struct iscsi_pdu *pdu, uint32_t expstatsnsn)
 {
-	*(uint32_t *)&pdu->outdata.data[28] = htonl(expstatsnsn);
+	*(uint32_t *)&pdu->hdr[28] = htonl(expstatsnsn);
 }
 
 void
 iscsi_pdu_set_cdb(struct iscsi_pdu *pdu, struct scsi_task *task)
 {
-	bzero(&pdu->outdata.data[32], 16);
-	memcpy(&pdu->outdata.data[32], task->cdb, task->cdb_size);
+	bzero(&pdu->hdr[32], 16);
+	memcpy(&pdu->hdr[32], task->cdb, task->cdb_size);
 }
 
 void
 iscsi_pdu_set_lun(struct iscsi_pdu *pdu, uint32_t lun)
 {
-	pdu->outdata.data[9] = lun;
+	pdu->hdr[9] = lun;
 }
 
 void
 iscsi_pdu_set_expxferlen(struct iscsi_pdu *pdu, uint32_t expxferlen)
 {
-	*(uint32_t *)&pdu->outdata.data[20] = htonl(expxferlen);
+	*(uint32_t *)&pdu->hdr[20] = htonl(expxferlen);
+}
+
+void
+iscsi_pdu_set_datasn(struct iscsi_pdu *pdu, uint32_t datasn)
+{
+	*(uint32_t *)&pdu->hdr[36] = htonl(datasn);
+}
+
+void
+iscsi_pdu_set_bufferoffset(struct iscsi_pdu *pdu, uint32_t bufferoffset)
+{
+	*(uint32_t *)&pdu->hdr[40] = htonl(bufferoffset);
 }
@@ -0,0 +1,408 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * A pool of sessions to one lun, each serviced by a thread of its own.
+ *
+ * Every session, a shard, lives in an iscsi_loop of its own on its own
+ * thread and is fed through its submit queue. A command goes to the shard
+ * of the cpu it is submitted on, so the threads of one cpu only ever share
+ * the queue of their shard and nothing is locked. The thread of a shard is
+ * kept on the cpus that submit to it where the platform allows.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#ifdef HAVE_SCHED_GETCPU
+#include <sched.h>
+#endif
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+struct iscsi_pool_shard {
+	struct iscsi_pool *pool;
+	int index;
+	struct iscsi_context *iscsi;
+	struct iscsi_loop *loop;
+	pthread_t thread;
+	int running;
+
+	/* set by the thread of the shard when the session has failed, new
+	 * commands then go to the other shards
+	 */
+	int failed;
+	int stop;
+};
+
+struct iscsi_pool {
+	char *initiator_name;
+	char *target_name;
+	int lun;
+	int isid_base;
+
+	struct iscsi_pool_shard *shards;
+	int num_shards;
+
+	char *error_string;
+};
+
+static void
+iscsi_pool_set_error(struct iscsi_pool *pool, const char *error_string, ...)
+{
+	va_list ap;
+	char *str;
+
+	va_start(ap, error_string);
+	if (vasprintf(&str, error_string, ap) < 0) {
+		/* not much we can do here */
+		str = NULL;
+	}
+
+	free(pool->error_string);
+
+	pool->error_string = str;
+	va_end(ap);
+}
+
+const char *
+iscsi_pool_get_error(struct iscsi_pool *pool)
+{
+	return pool->error_string;
+}
+
+static int
+iscsi_pool_num_cpus(void)
+{
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_CONF);
+	return n > 0 ? (int)n : 1;
+}
+
+struct iscsi_pool *
+iscsi_pool_create(const char *initiator_name, const char *target_name,
+		  int lun, int num_sessions)
+{
+	struct iscsi_pool *pool;
+
+	pool = malloc(sizeof(struct iscsi_pool));
+	if (pool == NULL) {
+		return NULL;
+	}
+
+	bzero(pool, sizeof(struct iscsi_pool));
+
+	if (num_sessions <= 0) {
+		num_sessions = iscsi_pool_num_cpus();
+	}
+
+	pool->initiator_name = strdup(initiator_name);
+	pool->target_name    = strdup(target_name);
+	pool->shards = malloc(sizeof(struct iscsi_pool_shard) * num_sessions);
+	if (pool->initiator_name == NULL || pool->target_name == NULL
+	    || pool->shards == NULL) {
+		free(pool->initiator_name);
+		free(pool->target_name);
+		free(pool->shards);
+		free(pool);
+		return NULL;
+	}
+	bzero(pool->shards, sizeof(struct iscsi_pool_shard) * num_sessions);
+	pool->num_shards = num_sessions;
+	pool->lun        = lun;
+	pool->isid_base  = getpid() ^ time(NULL);
+
+	return pool;
+}
+
+/*
+ * The eventfd of the submit queue doubles as the doorbell of the thread.
+ */
+static void
+iscsi_pool_wake_shard(struct iscsi_pool_shard *shard)
+{
+	uint64_t one = 1;
+
+	if (write(iscsi_get_submit_fd(shard->iscsi), &one, sizeof(one)) == -1) {
+		return;
+	}
+}
+
+static void
+iscsi_pool_shard_cb(struct iscsi_context *iscsi _U_, int status _U_,
+		    void *command_data _U_, void *private_data)
+{
+	struct iscsi_pool_shard *shard = private_data;
+
+	/* the session could not be recovered and has left the loop */
+	__atomic_store_n(&shard->failed, 1, __ATOMIC_RELEASE);
+}
+
+static void *
+iscsi_pool_shard_thread(void *private_data)
+{
+	struct iscsi_pool_shard *shard = private_data;
+	struct pollfd pfd;
+
+	while (!__atomic_load_n(&shard->stop, __ATOMIC_ACQUIRE)) {
+		if (!shard->failed) {
+			iscsi_loop_run_once(shard->loop, -1);
+			continue;
+		}
+		/* commands that were routed here before the shard failed
+		 * are completed with SCSI_STATUS_ERROR
+		 */
+		pfd.fd      = iscsi_get_submit_fd(shard->iscsi);
+		pfd.events  = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, -1) > 0) {
+			iscsi_service_submissions(shard->iscsi);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Keep the thread of a shard on the cpus that submit to it.
+ */
+static void
+iscsi_pool_set_affinity(struct iscsi_pool_shard *shard)
+{
+#ifdef HAVE_SCHED_GETCPU
+	cpu_set_t cpus;
+	int cpu, num_cpus;
+
+	num_cpus = iscsi_pool_num_cpus();
+	if (num_cpus > CPU_SETSIZE) {
+		num_cpus = CPU_SETSIZE;
+	}
+
+	CPU_ZERO(&cpus);
+	for (cpu = shard->index; cpu < num_cpus;
+	     cpu += shard->pool->num_shards) {
+		CPU_SET(cpu, &cpus);
+	}
+	if (CPU_COUNT(&cpus) == 0) {
+		return;
+	}
+
+	/* cpus we are not allowed on fail this, the thread then runs
+	 * wherever the scheduler puts it
+	 */
+	pthread_setaffinity_np(shard->thread, sizeof(cpus), &cpus);
+#else
+	(void)shard;
+#endif
+}
+
+static int
+iscsi_pool_connect_shard(struct iscsi_pool *pool,
+			 struct iscsi_pool_shard *shard, const char *portal)
+{
+	struct iscsi_context *iscsi;
+
+	iscsi = iscsi_create_context(pool->initiator_name);
+	if (iscsi == NULL) {
+		iscsi_pool_set_error(pool, "Out-of-memory: Failed to create "
+				     "context.");
+		return -1;
+	}
+	shard->iscsi = iscsi;
+
+	/* every shard is a session of its own and needs its own isid */
+	iscsi_set_isid_random(iscsi, pool->isid_base + shard->index);
+
+	if (iscsi_set_targetname(iscsi, pool->target_name) != 0
+	    || iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0
+	    || iscsi_full_connect_sync(iscsi, portal, pool->lun) != 0
+	    || iscsi_set_submit_queue(iscsi, 1) != 0) {
+		goto failed;
+	}
+
+	shard->loop = iscsi_loop_create();
+	if (shard->loop == NULL) {
+		iscsi_set_error(iscsi, "Failed to create event loop. "
+				"Errno:%d", errno);
+		goto failed;
+	}
+	if (iscsi_loop_add(shard->loop, iscsi, iscsi_pool_shard_cb,
+			   shard) != 0) {
+		goto failed;
+	}
+
+	/* from here on the context belongs to the thread */
+	if (pthread_create(&shard->thread, NULL, iscsi_pool_shard_thread,
+			   shard) != 0) {
+		iscsi_set_error(iscsi, "Failed to create thread.");
+		goto failed;
+	}
+	shard->running = 1;
+	iscsi_pool_set_affinity(shard);
+
+	return 0;
+
+failed:
+	iscsi_pool_set_error(pool, "Failed to log in session %d: %s",
+			     shard->index, iscsi_get_error(iscsi));
+	iscsi_destroy_context(iscsi);
+	shard->iscsi = NULL;
+	iscsi_loop_destroy(shard->loop);
+	shard->loop = NULL;
+
+	return -1;
+}
+
+static void
+iscsi_pool_disconnect(struct iscsi_pool *pool)
+{
+	struct iscsi_pool_shard *shard;
+	int i;
+
+	for (i = 0; i < pool->num_shards; i++) {
+		shard = &pool->shards[i];
+		if (shard->running) {
+			__atomic_store_n(&shard->stop, 1, __ATOMIC_RELEASE);
+			iscsi_pool_wake_shard(shard);
+		}
+	}
+	for (i = 0; i < pool->num_shards; i++) {
+		shard = &pool->shards[i];
+		if (shard->running) {
+			pthread_join(shard->thread, NULL);
+			shard->running = 0;
+		}
+		/* the threads are gone, the contexts are ours again */
+		if (shard->iscsi != NULL) {
+			iscsi_logout_sync(shard->iscsi);
+			iscsi_destroy_context(shard->iscsi);
+			shard->iscsi = NULL;
+		}
+		iscsi_loop_destroy(shard->loop);
+		shard->loop   = NULL;
+		shard->failed = 0;
+		shard->stop   = 0;
+	}
+}
+
+int
+iscsi_pool_connect_sync(struct iscsi_pool *pool, const char *portal)
+{
+	int i;
+
+	if (pool->shards[0].iscsi != NULL) {
+		iscsi_pool_set_error(pool, "Pool is already connected.");
+		return -1;
+	}
+
+	for (i = 0; i < pool->num_shards; i++) {
+		pool->shards[i].pool  = pool;
+		pool->shards[i].index = i;
+		if (iscsi_pool_connect_shard(pool, &pool->shards[i],
+					     portal) != 0) {
+			iscsi_pool_disconnect(pool);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void
+iscsi_pool_destroy(struct iscsi_pool *pool)
+{
+	if (pool == NULL) {
+		return;
+	}
+
+	iscsi_pool_disconnect(pool);
+	free(pool->shards);
+	free(pool->initiator_name);
+	free(pool->target_name);
+	free(pool->error_string);
+	free(pool);
+}
+
+int
+iscsi_pool_get_num_sessions(struct iscsi_pool *pool)
+{
+	return pool->num_shards;
+}
+
+#ifndef HAVE_SCHED_GETCPU
+/* without the cpu, every thread sticks to the shard it is given first */
+static __thread int iscsi_pool_thread_cpu = -1;
+static int iscsi_pool_next_cpu;
+#endif
+
+static int
+iscsi_pool_current_cpu(void)
+{
+#ifdef HAVE_SCHED_GETCPU
+	int cpu;
+
+	cpu = sched_getcpu();
+	return cpu < 0 ? 0 : cpu;
+#else
+	if (iscsi_pool_thread_cpu == -1) {
+		iscsi_pool_thread_cpu = __atomic_fetch_add(&iscsi_pool_next_cpu,
+							   1,
+							   __ATOMIC_RELAXED)
+			& INT32_MAX;
+	}
+	return iscsi_pool_thread_cpu;
+#endif
+}
+
+int
+iscsi_pool_scsi_command_submit(struct iscsi_pool *pool,
+			       struct scsi_task *task, struct iscsi_data *data,
+			       iscsi_command_cb cb, void *private_data,
+			       struct iscsi_completion_queue *cq)
+{
+	struct iscsi_pool_shard *shard;
+	int first, i;
+
+	first = iscsi_pool_current_cpu() % pool->num_shards;
+	for (i = 0; i < pool->num_shards; i++) {
+		shard = &pool->shards[(first + i) % pool->num_shards];
+		if (shard->iscsi == NULL
+		    || __atomic_load_n(&shard->failed, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+		return iscsi_scsi_command_submit(shard->iscsi, pool->lun, task,
+						 cb, data, private_data, cq);
+	}
+
+	scsi_free_scsi_task(task);
+	errno = EIO;
+	return -1;
+}
@@ -17,18 +17,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
 #include "scsi-lowlevel.h"
-
-struct iscsi_scsi_cbdata {
-	struct iscsi_scsi_cbdata *prev, *next;
-	iscsi_command_cb          callback;
-	void                     *private_data;
-	struct scsi_task         *task;
-};
+#include "slist.h"
 
 void
 iscsi_free_scsi_cbdata(struct iscsi_scsi_cbdata *scsi_cbdata)
@@ -40,7 +36,6 @@ iscsi_free_scsi_cbdata(struct iscsi_scsi_cbdata *scsi_cbdata)
 		scsi_free_scsi_task(scsi_cbdata->task);
 		scsi_cbdata->task = NULL;
 	}
-	free(scsi_cbdata);
 }
 
 void
@@ -52,6 +47,26 @@ iscsi_cbdata_steal_scsi_task(struct scsi_task *task)
 	if (scsi_cbdata != NULL) {
 		scsi_cbdata->task = NULL;
 	}
+	/* the cbdata lives in the pdu, which is about to be recycled */
+	scsi_set_task_private_ptr(task, NULL);
+}
+
+/*
+ * Returns the pdu that a task was issued with, or NULL if it is not in
+ * flight.
+ */
+struct iscsi_pdu *
+iscsi_task_pdu(struct scsi_task *task)
+{
+	struct iscsi_scsi_cbdata *scsi_cbdata =
+	  scsi_get_task_private_ptr(task);
+
+	if (scsi_cbdata == NULL) {
+		return NULL;
+	}
+
+	return (struct iscsi_pdu *)((char *)scsi_cbdata
+				    - offsetof(struct iscsi_pdu, cbdata));
 }
 
 static void
@@ -71,6 +86,11 @@ iscsi_scsi_response_cb(struct iscsi_context *iscsi, int status,
 		scsi_cbdata->callback(iscsi, SCSI_STATUS_CHECK_CONDITION, task,
 				      scsi_cbdata->private_data);
 		return;
+	case SCSI_STATUS_TIMEOUT:
+	case SCSI_STATUS_CANCELLED:
+		scsi_cbdata->callback(iscsi, status, task,
+				      scsi_cbdata->private_data);
+		return;
 	default:
 		iscsi_set_error(iscsi, "Cant handle  scsi status %d yet.",
 				status);
@@ -79,6 +99,160 @@ iscsi_scsi_response_cb(struct iscsi_context *iscsi, int status,
 	}
 }
 
+/*
+ * Queue len bytes of write data from offset as a sequence of DATA-OUT pdus
+ * no larger than the target accepts, each referring to the data-out
+ * buffers of the task. ttt is 0xffffffff for unsolicited data.
+ */
+static int
+iscsi_send_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		    uint32_t ttt, uint32_t offset, uint32_t len)
+{
+	struct scsi_task *task = pdu->scsi_cbdata->task;
+	uint32_t datasn, max_len, dlen;
+
+	max_len = iscsi->target_max_recv_data_segment_length;
+	if (iscsi->target_max_recv_data_segment_length <= 0) {
+		max_len = ISCSI_DEFAULT_MAX_RECV_DATA_SEGMENT_LENGTH;
+	}
+
+	for (datasn = 0; len > 0; datasn++) {
+		struct iscsi_pdu *dout;
+
+		dlen = MIN(len, max_len);
+
+		dout = iscsi_allocate_pdu_with_itt_flags(iscsi,
+				ISCSI_PDU_DATA_OUT, ISCSI_PDU_NO_PDU,
+				pdu->itt, ISCSI_PDU_DELETE_WHEN_SENT);
+		if (dout == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory, Failed to "
+					"allocate data-out pdu.");
+			return -1;
+		}
+
+		if (dlen == len) {
+			iscsi_pdu_set_pduflags(dout, ISCSI_PDU_DATA_FINAL);
+		}
+		memcpy(&dout->hdr[8], &pdu->hdr[8], 8);
+		iscsi_pdu_set_ttt(dout, ttt);
+		iscsi_pdu_set_expstatsn(dout, iscsi->statsn+1);
+		iscsi_pdu_set_datasn(dout, datasn);
+		iscsi_pdu_set_bufferoffset(dout, offset);
+
+		if (iscsi_pdu_add_task_payload(iscsi, dout, task, offset, dlen)
+		    != 0) {
+			iscsi_free_pdu(iscsi, dout);
+			return -1;
+		}
+
+		dout->cmd_pdu = pdu;
+		pdu->dataout_count++;
+
+		if (iscsi_queue_pdu(iscsi, dout) != 0) {
+			iscsi_free_pdu(iscsi, dout);
+			return -1;
+		}
+
+		offset += dlen;
+		len    -= dlen;
+	}
+
+	return 0;
+}
+
+/*
+ * Pick the connection of the session to send a command on: the logged in
+ * connection with the fewest bytes in flight, then the fewest commands.
+ */
+static struct iscsi_context *
+iscsi_select_connection(struct iscsi_context *session, struct iscsi_pdu *pdu)
+{
+	struct iscsi_context *conn, *best = NULL;
+
+	for (conn = session->connections; conn; conn = conn->next_connection) {
+		if (!conn->is_loggedin || conn->fd == -1) {
+			continue;
+		}
+		if (pdu->payload_len
+		    > conn->target_max_recv_data_segment_length) {
+			continue;
+		}
+		if (best == NULL
+		    || conn->bytes_in_flight < best->bytes_in_flight
+		    || (conn->bytes_in_flight == best->bytes_in_flight
+			&& conn->cmds_in_flight < best->cmds_in_flight)) {
+			best = conn;
+		}
+	}
+
+	return best != NULL ? best : session;
+}
+
+/*
+ * The largest immediate data that every connection of the session accepts.
+ */
+static int
+iscsi_session_max_recv_data_segment_length(struct iscsi_context *session)
+{
+	struct iscsi_context *conn;
+	int len = session->target_max_recv_data_segment_length;
+
+	for (conn = session->connections; conn; conn = conn->next_connection) {
+		if (conn->is_loggedin) {
+			len = MIN(len,
+				  conn->target_max_recv_data_segment_length);
+		}
+	}
+
+	return len;
+}
+
+/*
+ * Assign the next session wide cmdsn to a command and queue it for sending
+ * on connection iscsi, followed by the unsolicited part of its first burst
+ * if there is one.
+ */
+static int
+iscsi_queue_scsi_command(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	struct iscsi_context *session = ISCSI_SESSION(iscsi);
+	struct scsi_task *task = pdu->scsi_cbdata->task;
+	uint32_t burst;
+
+	/* cmdsn */
+	iscsi_pdu_set_cmdsn(pdu, session->cmdsn);
+	pdu->cmdsn = session->cmdsn;
+
+	/* exp statsn */
+	iscsi_pdu_set_expstatsn(pdu, iscsi->statsn+1);
+
+	if (iscsi_queue_pdu(iscsi, pdu) != 0) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to queue iscsi "
+				"scsi pdu.");
+		return -1;
+	}
+
+	/* the command is not final if unsolicited DATA-OUT follows */
+	if (!(pdu->hdr[1] & ISCSI_PDU_SCSI_FINAL)) {
+		burst = MIN((uint32_t)task->expxferlen,
+			    (uint32_t)iscsi->first_burst_length);
+		if (iscsi_send_data_out(iscsi, pdu, 0xffffffff,
+					pdu->payload_len,
+					burst - pdu->payload_len) != 0) {
+			DLIST_REMOVE(&iscsi->outqueue, &iscsi->outqueue_tail,
+				     pdu);
+			iscsi_cancel_data_out(iscsi, pdu);
+			return -1;
+		}
+	}
+	session->cmdsn++;
+
+	pdu->flags |= ISCSI_PDU_IN_FLIGHT;
+	iscsi->cmds_in_flight++;
+	iscsi->bytes_in_flight += task->expxferlen;
+
+	return 0;
+}
 
 int
 iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
@@ -87,7 +261,10 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 {
 	struct iscsi_pdu *pdu;
 	struct iscsi_scsi_cbdata *scsi_cbdata;
-	int flags;
+	int flags, burst, len, timeout;
+
+	/* commands belong to the session, the connection is picked later */
+	iscsi = ISCSI_SESSION(iscsi);
 
 	if (iscsi->session_type != ISCSI_SESSION_NORMAL) {
 		iscsi_set_error(iscsi, "Trying to send command on "
@@ -96,37 +273,30 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 		return -1;
 	}
 
-	if (iscsi->is_loggedin == 0) {
+	if (iscsi->is_loggedin == 0 && iscsi->is_reconnecting == 0) {
 		iscsi_set_error(iscsi, "Trying to send command while "
 				"not logged in.");
 		scsi_free_scsi_task(task);
 		return -1;
 	}
 
-	scsi_cbdata = malloc(sizeof(struct iscsi_scsi_cbdata));
-	if (scsi_cbdata == NULL) {
-		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
-				"scsi cbdata.");
-		scsi_free_scsi_task(task);
-		return -1;
-	}
-	bzero(scsi_cbdata, sizeof(struct iscsi_scsi_cbdata));
-	scsi_cbdata->task         = task;
-	scsi_cbdata->callback     = cb;
-	scsi_cbdata->private_data = private_data;
-
-	scsi_set_task_private_ptr(task, scsi_cbdata);
-
 	pdu = iscsi_allocate_pdu(iscsi, ISCSI_PDU_SCSI_REQUEST,
 				 ISCSI_PDU_SCSI_RESPONSE);
 	if (pdu == NULL) {
 		iscsi_set_error(iscsi, "Out-of-memory, Failed to allocate "
 				"scsi pdu.");
-		iscsi_free_scsi_cbdata(scsi_cbdata);
+		scsi_free_scsi_task(task);
 		return -1;
 	}
+
+	scsi_cbdata = &pdu->cbdata;
+	scsi_cbdata->task         = task;
+	scsi_cbdata->callback     = cb;
+	scsi_cbdata->private_data = private_data;
 	pdu->scsi_cbdata = scsi_cbdata;
 
+	scsi_set_task_private_ptr(task, scsi_cbdata);
+
 	/* flags */
 	flags = ISCSI_PDU_SCSI_FINAL|ISCSI_PDU_SCSI_ATTR_SIMPLE;
 	switch (task->xfer_dir) {
@@ -137,28 +307,55 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 		break;
 	case SCSI_XFER_WRITE:
 		flags |= ISCSI_PDU_SCSI_WRITE;
-		if (data == NULL) {
+		/* write data is sent straight from the data-out buffers
+		 * of the task.
+		 */
+		if (data != NULL) {
+			if (data->size != task->expxferlen) {
+				iscsi_set_error(iscsi, "Data size:%d is not "
+						"same as expected data "
+						"transfer length:%d.",
+						data->size, task->expxferlen);
+				iscsi_free_pdu(iscsi, pdu);
+				return -1;
+			}
+			if (scsi_task_copy_data_out_buffer(task, data->size,
+							   data->data) != 0) {
+				iscsi_set_error(iscsi, "Out-of-memory: Failed "
+						"to copy data-out buffer.");
+				iscsi_free_pdu(iscsi, pdu);
+				return -1;
+			}
+		}
+		if (task->expxferlen > 0 && task->out_buffers == NULL) {
 			iscsi_set_error(iscsi, "DATA-OUT command but data "
 					"== NULL.");
 			iscsi_free_pdu(iscsi, pdu);
 			return -1;
 		}
-		if (data->size != task->expxferlen) {
-			iscsi_set_error(iscsi, "Data size:%d is not same as "
-					"expected data transfer "
-					"length:%d.", data->size,
-					task->expxferlen);
-			iscsi_free_pdu(iscsi, pdu);
-			return -1;
-		}
-		if (iscsi_pdu_add_data(iscsi, pdu, data->data, data->size)
-		    != 0) {
-			iscsi_set_error(iscsi, "Out-of-memory: Failed to "
-					"add outdata to the pdu.");
-			iscsi_free_pdu(iscsi, pdu);
-			return -1;
+		if (task->expxferlen == 0) {
+			break;
 		}
 
+		/* the first burst can go without waiting for an R2T, as
+		 * much as fits in the command pdu as immediate data and
+		 * the rest as unsolicited DATA-OUT.
+		 */
+		burst = MIN(task->expxferlen, iscsi->first_burst_length);
+		if (iscsi->immediate_data == ISCSI_IMMEDIATE_DATA_YES) {
+			len = MIN(burst,
+				  iscsi_session_max_recv_data_segment_length(
+					iscsi));
+			if (iscsi_pdu_add_task_payload(iscsi, pdu, task, 0,
+						       len) != 0) {
+				iscsi_free_pdu(iscsi, pdu);
+				return -1;
+			}
+		}
+		if (iscsi->initial_r2t == ISCSI_INITIAL_R2T_NO
+		    && pdu->payload_len < burst) {
+			flags &= ~ISCSI_PDU_SCSI_FINAL;
+		}
 		break;
 	}
 	iscsi_pdu_set_pduflags(pdu, flags);
@@ -169,23 +366,41 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 	/* expxferlen */
 	iscsi_pdu_set_expxferlen(pdu, task->expxferlen);
 
-	/* cmdsn */
-	iscsi_pdu_set_cmdsn(pdu, iscsi->cmdsn);
-	pdu->cmdsn = iscsi->cmdsn;
-	iscsi->cmdsn++;
-
-	/* exp statsn */
-	iscsi_pdu_set_expstatsn(pdu, iscsi->statsn+1);
-
 	/* cdb */
 	iscsi_pdu_set_cdb(pdu, task);
 
 	pdu->callback     = iscsi_scsi_response_cb;
 	pdu->private_data = scsi_cbdata;
 
-	if (iscsi_queue_pdu(iscsi, pdu) != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: failed to queue iscsi "
-				"scsi pdu.");
+	/* the clock runs from now, waiting in the backlog counts too */
+	timeout = task->timeout != 0 ? task->timeout : iscsi->timeout;
+	if (timeout > 0 && iscsi_timeout_arm(iscsi, pdu, timeout) != 0) {
+		iscsi_free_pdu(iscsi, pdu);
+		return -1;
+	}
+
+	/* while the connection is recovered, new commands wait behind the
+	 * ones that were in flight when it failed.
+	 */
+	if (iscsi->is_reconnecting) {
+		DLIST_ADD_END(&iscsi->reconnect_cmds,
+			      &iscsi->reconnect_cmds_tail, pdu);
+		return 0;
+	}
+
+	/* hold the command back if the target can not take it yet, the
+	 * cmdsn is assigned when it is actually sent.
+	 */
+	if (iscsi->cmd_backlog != NULL
+	    || (int32_t)(iscsi->cmdsn - iscsi->maxcmdsn) > 0) {
+		DLIST_ADD_END(&iscsi->cmd_backlog, &iscsi->cmd_backlog_tail,
+			      pdu);
+		iscsi->cmd_backlog_count++;
+		return 0;
+	}
+
+	if (iscsi_queue_scsi_command(iscsi_select_connection(iscsi, pdu),
+				     pdu) != 0) {
 		iscsi_free_pdu(iscsi, pdu);
 		return -1;
 	}
@@ -193,12 +408,134 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 	return 0;
 }
 
+/*
+ * Send as many of the held back commands as the cmdsn window allows.
+ */
+void
+iscsi_send_cmd_backlog(struct iscsi_context *iscsi)
+{
+	struct iscsi_pdu *pdu;
+
+	while ((pdu = iscsi->cmd_backlog) != NULL
+	       && (int32_t)(iscsi->cmdsn - iscsi->maxcmdsn) <= 0) {
+		DLIST_REMOVE(&iscsi->cmd_backlog, &iscsi->cmd_backlog_tail,
+			     pdu);
+		iscsi->cmd_backlog_count--;
+
+		if (iscsi_queue_scsi_command(iscsi_select_connection(iscsi,
+								     pdu),
+					     pdu) != 0) {
+			pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
+				      pdu->private_data);
+			iscsi_free_pdu(iscsi, pdu);
+		}
+	}
+}
+
+/*
+ * A command that is sent again after a reconnect reports to the application
+ * through this, so the unit attention that the new I_T nexus reports can be
+ * hidden the same way iscsi_full_connect_async() hides it.
+ */
+struct iscsi_reissue_cbdata {
+	iscsi_command_cb callback;
+	void *private_data;
+	int lun;
+	int retries;
+};
+
+static void
+iscsi_reissue_cb(struct iscsi_context *iscsi, int status,
+		 void *command_data, void *private_data)
+{
+	struct iscsi_reissue_cbdata *rc = private_data;
+	struct scsi_task *task = command_data;
+
+	if (status == SCSI_STATUS_CHECK_CONDITION
+	    && task->sense.key == SCSI_SENSE_UNIT_ATTENTION
+	    && task->sense.ascq == SCSI_SENSE_ASCQ_BUS_RESET
+	    && rc->retries-- > 0) {
+		iscsi_cbdata_steal_scsi_task(task);
+		free(task->datain.data);
+		task->datain.data = NULL;
+		task->datain.size = 0;
+		if (iscsi_scsi_command_async(iscsi, rc->lun, task,
+					     iscsi_reissue_cb, NULL, rc) == 0) {
+			return;
+		}
+		rc->callback(iscsi, SCSI_STATUS_ERROR, NULL, rc->private_data);
+		free(rc);
+		return;
+	}
+
+	rc->callback(iscsi, status, command_data, rc->private_data);
+	free(rc);
+}
+
+/*
+ * Send a command that was queued or in flight when the connection failed
+ * again, as a new task with a fresh itt and cmdsn. The pdu is rebuilt from
+ * the task since the parameters of the new login may differ.
+ */
+int
+iscsi_scsi_command_reissue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	struct iscsi_scsi_cbdata *scsi_cbdata = pdu->scsi_cbdata;
+	struct iscsi_reissue_cbdata *rc;
+	struct scsi_task *task;
+	uint64_t expires = 0;
+	int lun;
+
+	/* iscsi_pdu_set_lun() only sets the second byte */
+	lun = pdu->hdr[9];
+
+	if (scsi_cbdata->callback == iscsi_reissue_cb) {
+		/* this command has been through a reconnect before */
+		rc = scsi_cbdata->private_data;
+	} else {
+		rc = malloc(sizeof(struct iscsi_reissue_cbdata));
+		if (rc == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: Failed to "
+					"allocate reissue cbdata.");
+			pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
+				      pdu->private_data);
+			iscsi_free_pdu(iscsi, pdu);
+			return -1;
+		}
+		rc->callback     = scsi_cbdata->callback;
+		rc->private_data = scsi_cbdata->private_data;
+		rc->lun          = lun;
+	}
+	rc->retries = ISCSI_REISSUE_MAX_RETRIES;
+
+	if (pdu->timer.level != -1) {
+		expires = pdu->timer.expires;
+	}
+
+	task = scsi_cbdata->task;
+	iscsi_cbdata_steal_scsi_task(task);
+	iscsi_free_pdu(iscsi, pdu);
+
+	if (iscsi_scsi_command_async(iscsi, lun, task, iscsi_reissue_cb,
+				     NULL, rc) != 0) {
+		rc->callback(iscsi, SCSI_STATUS_ERROR, NULL, rc->private_data);
+		free(rc);
+		return -1;
+	}
+
+	/* the reconnect does not buy the command more time */
+	if (expires != 0) {
+		iscsi_timeout_arm_at(iscsi, iscsi_task_pdu(task), expires);
+	}
+
+	return 0;
+}
 
 int
 iscsi_process_scsi_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 			 struct iscsi_in_pdu *in)
 {
-	int statsn, flags, response, status;
+	int statsn, flags, response, status, sense_len;
 	struct iscsi_scsi_cbdata *scsi_cbdata = pdu->scsi_cbdata;
 	struct scsi_task *task = scsi_cbdata->task;
 
@@ -227,6 +564,13 @@ iscsi_process_scsi_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 
 	status = in->hdr[3];
 
+	/* the target will not ask for any more data for this command */
+	if (iscsi_cancel_data_out(iscsi, pdu) != 0) {
+		pdu->callback(iscsi, SCSI_STATUS_ERROR, task,
+			      pdu->private_data);
+		return -1;
+	}
+
 	switch (status) {
 	case SCSI_STATUS_GOOD:
 		task->datain.data = pdu->indata.data;
@@ -244,13 +588,18 @@ iscsi_process_scsi_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 		if (task->datain.data == NULL) {
 			iscsi_set_error(iscsi, "failed to allocate blob for "
 					"sense data");
+			task->datain.size = 0;
 		}
 		memcpy(task->datain.data, in->data, task->datain.size);
 
-		task->sense.error_type = task->datain.data[2] & 0x7f;
-		task->sense.key        = task->datain.data[4] & 0x0f;
-		task->sense.ascq       = ntohs(*(uint16_t *)
-					       &(task->datain.data[14]));
+		/* the sense data follows a two byte length */
+		if (task->datain.size >= 2) {
+			sense_len = ntohs(*(uint16_t *)&task->datain.data[0]);
+			scsi_parse_sense_data(&task->sense,
+					      &task->datain.data[2],
+					      MIN(sense_len,
+						  task->datain.size - 2));
+		}
 
 		iscsi_set_error(iscsi, "SENSE KEY:%s(%d) ASCQ:%s(0x%04x)",
 				scsi_sense_key_str(task->sense.key),
@@ -271,6 +620,55 @@ iscsi_process_scsi_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	return 0;
 }
 
+/*
+ * If this DATA-IN belongs to a task that has its own data-in buffers,
+ * return the task so the payload can be read straight into them.
+ */
+struct scsi_task *
+iscsi_get_data_in_task(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
+{
+	struct iscsi_pdu *pdu;
+	struct scsi_task *task;
+	uint32_t itt, offset;
+	int dsl, available;
+
+	if ((in->hdr[0] & 0x3f) != ISCSI_PDU_DATA_IN) {
+		return NULL;
+	}
+
+	itt = ntohl(*(uint32_t *)&in->hdr[16]);
+	pdu = iscsi_find_waitpdu(iscsi, itt);
+	if (pdu == NULL || pdu->scsi_cbdata == NULL) {
+		return NULL;
+	}
+
+	task = pdu->scsi_cbdata->task;
+	if (task == NULL || task->in_buffers == NULL) {
+		return NULL;
+	}
+
+	/* the offset comes from the target, it must not take us outside
+	 * of what we asked for
+	 */
+	dsl    = ntohl(*(uint32_t *)&in->hdr[4])&0x00ffffff;
+	offset = ntohl(*(uint32_t *)&in->hdr[40]);
+	if (task->expxferlen < 0 || offset > (uint32_t)task->expxferlen
+	    || (uint32_t)dsl > task->expxferlen - offset) {
+		iscsi_set_error(iscsi, "DATA-IN offset:%u len:%d is beyond the "
+				"expected data transfer length:%d.", offset,
+				dsl, task->expxferlen);
+		return NULL;
+	}
+	if (dsl > 0 && scsi_task_get_data_in_buffer(task, offset + dsl - 1,
+						    &available) == NULL) {
+		iscsi_set_error(iscsi, "DATA-IN offset:%u len:%d is beyond the "
+				"data-in buffers of the task.", offset, dsl);
+		return NULL;
+	}
+
+	return task;
+}
+
 int
 iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 			   struct iscsi_in_pdu *in, int *is_finished)
@@ -295,13 +693,23 @@ iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	}
 	dsl = ntohl(*(uint32_t *)&in->hdr[4])&0x00ffffff;
 
-	if (iscsi_add_data(iscsi, &pdu->indata,
-			   in->data, dsl, 0)
-	    != 0) {
-		iscsi_set_error(iscsi, "Out-of-memory: failed to add data "
-				"to pdu in buffer.");
+	/* if the task has its own buffers the data is already in place */
+	if (task->in_buffers != NULL && dsl > 0 && in->task == NULL) {
+		iscsi_set_error(iscsi, "DATA-IN did not fit in the data-in "
+				"buffers of the task.");
+		pdu->callback(iscsi, SCSI_STATUS_ERROR, task,
+			      pdu->private_data);
 		return -1;
 	}
+	if (task->in_buffers == NULL && dsl > 0) {
+		if (iscsi_add_data(iscsi, &pdu->indata,
+				   in->data, dsl, 0)
+		    != 0) {
+			iscsi_set_error(iscsi, "Out-of-memory: failed to add "
+					"data to pdu in buffer.");
+			return -1;
+		}
+	}
 
 
 	if ((flags&ISCSI_PDU_DATA_FINAL) == 0) {
@@ -320,6 +728,11 @@ iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	 * the s-bit set, so invoke the callback.
 	 */
 	status = in->hdr[3];
+	if (iscsi_cancel_data_out(iscsi, pdu) != 0) {
+		pdu->callback(iscsi, SCSI_STATUS_ERROR, task,
+			      pdu->private_data);
+		return -1;
+	}
 	task->datain.data = pdu->indata.data;
 	task->datain.size = pdu->indata.size;
 
@@ -332,6 +745,49 @@ iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 }
 
 
+/*
+ * The target is ready for desired_len bytes of write data from offset.
+ * Queue that as a sequence of DATA-OUT pdus no larger than the target
+ * accepts, each referring to the data-out buffers of the task.
+ */
+int
+iscsi_process_r2t(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		  struct iscsi_in_pdu *in)
+{
+	struct iscsi_scsi_cbdata *scsi_cbdata = pdu->scsi_cbdata;
+	struct scsi_task *task = scsi_cbdata->task;
+	uint32_t ttt, offset, desired_len;
+	int available;
+
+	ttt         = ntohl(*(uint32_t *)&in->hdr[20]);
+	offset      = ntohl(*(uint32_t *)&in->hdr[40]);
+	desired_len = ntohl(*(uint32_t *)&in->hdr[44]);
+
+	/* the offset and length come from the target, they must stay within
+	 * the data we are writing before any DATA-OUT is built from them
+	 */
+	if (desired_len == 0 || desired_len > (uint32_t)iscsi->max_burst_length
+	    || task->expxferlen <= 0
+	    || offset >= (uint32_t)task->expxferlen
+	    || desired_len > task->expxferlen - offset
+	    || scsi_task_get_data_out_buffer(task, offset + desired_len - 1,
+					     &available) == NULL) {
+		iscsi_set_error(iscsi, "Invalid R2T for offset:%u len:%u of "
+				"a %d byte write.", offset, desired_len,
+				task->expxferlen);
+		pdu->callback(iscsi, SCSI_STATUS_ERROR, task,
+			      pdu->private_data);
+		return -1;
+	}
+
+	if (iscsi_send_data_out(iscsi, pdu, ttt, offset, desired_len) != 0) {
+		pdu->callback(iscsi, SCSI_STATUS_ERROR, task,
+			      pdu->private_data);
+		return -1;
+	}
+
+	return 0;
+}
 
 
 /*
@@ -405,6 +861,52 @@ iscsi_inquiry_async(struct iscsi_context *iscsi, int lun, int evpd,
 	return ret;
 }
 
+/*
+ * Returns the total length of an iovec array.
+ */
+static int
+iscsi_iov_length(struct iovec *iov, int niov)
+{
+	int i, len;
+
+	for (i = 0, len = 0; i < niov; i++) {
+		len += iov[i].iov_len;
+	}
+
+	return len;
+}
+
+/*
+ * Add the buffers described by iov as the data-in or data-out buffers
+ * of the task, depending on its transfer direction.
+ */
+static int
+iscsi_task_add_iov(struct iscsi_context *iscsi, struct scsi_task *task,
+		   struct iovec *iov, int niov)
+{
+	int i, ret;
+
+	for (i = 0; i < niov; i++) {
+		if (iov[i].iov_len == 0) {
+			continue;
+		}
+		if (task->xfer_dir == SCSI_XFER_READ) {
+			ret = scsi_task_add_data_in_buffer(task,
+					iov[i].iov_len, iov[i].iov_base);
+		} else {
+			ret = scsi_task_add_data_out_buffer(task,
+					iov[i].iov_len, iov[i].iov_base);
+		}
+		if (ret != 0) {
+			iscsi_set_error(iscsi, "Out-of-memory: Failed to add "
+					"iovec buffer to task.");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 int
 iscsi_readcapacity10_async(struct iscsi_context *iscsi, int lun, int lba,
 			   int pmi, iscsi_command_cb cb, void *private_data)
@@ -450,9 +952,41 @@ iscsi_read10_async(struct iscsi_context *iscsi, int lun, int lba,
 	return ret;
 }
 
-
 int
-iscsi_write10_async(struct iscsi_context *iscsi, int lun, unsigned char *data,
+iscsi_read10_iov_async(struct iscsi_context *iscsi, int lun, int lba,
+		       struct iovec *iov, int niov, int blocksize,
+		       iscsi_command_cb cb, void *private_data)
+{
+	struct scsi_task *task;
+	int datalen, ret;
+
+	datalen = iscsi_iov_length(iov, niov);
+	if (datalen % blocksize != 0) {
+		iscsi_set_error(iscsi, "Datalen:%d is not a multiple of "
+				"the blocksize:%d.", datalen, blocksize);
+		return -1;
+	}
+
+	task = scsi_cdb_read10(lba, datalen, blocksize);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"read10 cdb.");
+		return -1;
+	}
+
+	if (iscsi_task_add_iov(iscsi, task, iov, niov) != 0) {
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+
+	ret = iscsi_scsi_command_async(iscsi, lun, task, cb, NULL,
+				       private_data);
+
+	return ret;
+}
+
+int
+iscsi_write10_async(struct iscsi_context *iscsi, int lun, unsigned char *data,
 		    int datalen, int lba, int fua, int fuanv, int blocksize,
 		    iscsi_command_cb cb, void *private_data)
 {
@@ -482,6 +1016,183 @@ iscsi_write10_async(struct iscsi_context *iscsi, int lun, unsigned char *data,
 	return ret;
 }
 
+int
+iscsi_write10_iov_async(struct iscsi_context *iscsi, int lun,
+			struct iovec *iov, int niov, int lba, int fua,
+			int fuanv, int blocksize,
+			iscsi_command_cb cb, void *private_data)
+{
+	struct scsi_task *task;
+	int datalen, ret;
+
+	datalen = iscsi_iov_length(iov, niov);
+	if (datalen == 0 || datalen % blocksize != 0) {
+		iscsi_set_error(iscsi, "Datalen:%d is not a multiple of the "
+				"blocksize:%d.", datalen, blocksize);
+		return -1;
+	}
+
+	task = scsi_cdb_write10(lba, datalen, fua, fuanv, blocksize);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"write10 cdb.");
+		return -1;
+	}
+
+	if (iscsi_task_add_iov(iscsi, task, iov, niov) != 0) {
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+
+	ret = iscsi_scsi_command_async(iscsi, lun, task, cb, NULL,
+				       private_data);
+
+	return ret;
+}
+
+int
+iscsi_readcapacity16_async(struct iscsi_context *iscsi, int lun,
+			   iscsi_command_cb cb, void *private_data)
+{
+	struct scsi_task *task;
+	int ret;
+
+	task = scsi_cdb_readcapacity16();
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"readcapacity16 cdb.");
+		return -1;
+	}
+	ret = iscsi_scsi_command_async(iscsi, lun, task, cb, NULL,
+				       private_data);
+
+	return ret;
+}
+
+int
+iscsi_read16_async(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		   int datalen, int blocksize,
+		   iscsi_command_cb cb, void *private_data)
+{
+	struct scsi_task *task;
+	int ret;
+
+	if (datalen % blocksize != 0) {
+		iscsi_set_error(iscsi, "Datalen:%d is not a multiple of "
+				"the blocksize:%d.", datalen, blocksize);
+		return -1;
+	}
+
+	task = scsi_cdb_read16(lba, datalen, blocksize);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"read16 cdb.");
+		return -1;
+	}
+	ret = iscsi_scsi_command_async(iscsi, lun, task, cb, NULL,
+				       private_data);
+
+	return ret;
+}
+
+int
+iscsi_read16_iov_async(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		       struct iovec *iov, int niov, int blocksize,
+		       iscsi_command_cb cb, void *private_data)
+{
+	struct scsi_task *task;
+	int datalen, ret;
+
+	datalen = iscsi_iov_length(iov, niov);
+	if (datalen % blocksize != 0) {
+		iscsi_set_error(iscsi, "Datalen:%d is not a multiple of "
+				"the blocksize:%d.", datalen, blocksize);
+		return -1;
+	}
+
+	task = scsi_cdb_read16(lba, datalen, blocksize);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"read16 cdb.");
+		return -1;
+	}
+
+	if (iscsi_task_add_iov(iscsi, task, iov, niov) != 0) {
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+
+	ret = iscsi_scsi_command_async(iscsi, lun, task, cb, NULL,
+				       private_data);
+
+	return ret;
+}
+
+int
+iscsi_write16_async(struct iscsi_context *iscsi, int lun, unsigned char *data,
+		    int datalen, uint64_t lba, int fua, int fuanv,
+		    int blocksize, iscsi_command_cb cb, void *private_data)
+{
+	struct scsi_task *task;
+	struct iscsi_data outdata;
+	int ret;
+
+	if (datalen % blocksize != 0) {
+		iscsi_set_error(iscsi, "Datalen:%d is not a multiple of the "
+				"blocksize:%d.", datalen, blocksize);
+		return -1;
+	}
+
+	task = scsi_cdb_write16(lba, datalen, fua, fuanv, blocksize);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"write16 cdb.");
+		return -1;
+	}
+
+	outdata.data = data;
+	outdata.size = datalen;
+
+	ret = iscsi_scsi_command_async(iscsi, lun, task, cb, &outdata,
+				       private_data);
+
+	return ret;
+}
+
+int
+iscsi_write16_iov_async(struct iscsi_context *iscsi, int lun,
+			struct iovec *iov, int niov, uint64_t lba, int fua,
+			int fuanv, int blocksize,
+			iscsi_command_cb cb, void *private_data)
+{
+	struct scsi_task *task;
+	int datalen, ret;
+
+	datalen = iscsi_iov_length(iov, niov);
+	if (datalen == 0 || datalen % blocksize != 0) {
+		iscsi_set_error(iscsi, "Datalen:%d is not a multiple of the "
+				"blocksize:%d.", datalen, blocksize);
+		return -1;
+	}
+
+	task = scsi_cdb_write16(lba, datalen, fua, fuanv, blocksize);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"write16 cdb.");
+		return -1;
+	}
+
+	if (iscsi_task_add_iov(iscsi, task, iov, niov) != 0) {
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+
+	ret = iscsi_scsi_command_async(iscsi, lun, task, cb, NULL,
+				       private_data);
+
+	return ret;
+}
+
 int
 iscsi_modesense6_async(struct iscsi_context *iscsi, int lun, int dbd, int pc,
 		       int page_code, int sub_page_code,
@@ -525,3 +1236,567 @@ iscsi_synchronizecache10_async(struct iscsi_context *iscsi, int lun, int lba,
 	return ret;
 }
 
+int
+iscsi_compareandwrite_async(struct iscsi_context *iscsi, int lun,
+			    unsigned char *verify_data,
+			    unsigned char *write_data, int datalen,
+			    uint64_t lba, int fua, int blocksize,
+			    iscsi_command_cb cb, void *private_data)
+{
+	struct scsi_task *task;
+	int ret;
+
+	if (datalen <= 0 || datalen % blocksize != 0
+	    || datalen / blocksize > 255) {
+		iscsi_set_error(iscsi, "Invalid compareandwrite datalen:%d "
+				"blocksize:%d.", datalen, blocksize);
+		return -1;
+	}
+
+	task = scsi_cdb_compareandwrite(lba, 2 * datalen, blocksize, 0, 0,
+					fua, 0);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"compareandwrite cdb.");
+		return -1;
+	}
+
+	/* the payload is the verify blocks followed by the write blocks */
+	if (scsi_task_copy_data_out_buffer(task, datalen, verify_data) != 0
+	    || scsi_task_copy_data_out_buffer(task, datalen,
+					      write_data) != 0) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to copy "
+				"compareandwrite data.");
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+
+	ret = iscsi_scsi_command_async(iscsi, lun, task, cb, NULL,
+				       private_data);
+
+	return ret;
+}
+
+int
+iscsi_extended_copy_async(struct iscsi_context *iscsi, int lun, int list_id,
+			  struct scsi_copy_target *targets, int num_targets,
+			  struct scsi_copy_segment *segments,
+			  int num_segments, iscsi_command_cb cb,
+			  void *private_data)
+{
+	struct scsi_task *task;
+	int ret;
+
+	task = scsi_cdb_extended_copy(list_id, targets, num_targets,
+				      segments, num_segments);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Failed to create extended copy cdb "
+				"for %d targets and %d segments.",
+				num_targets, num_segments);
+		return -1;
+	}
+	ret = iscsi_scsi_command_async(iscsi, lun, task, cb, NULL,
+				       private_data);
+
+	return ret;
+}
+
+int
+iscsi_receive_copy_results_async(struct iscsi_context *iscsi, int lun,
+				 int sa, int list_id, int alloc_len,
+				 iscsi_command_cb cb, void *private_data)
+{
+	struct scsi_task *task;
+	int ret;
+
+	task = scsi_cdb_receive_copy_results(sa, list_id, alloc_len);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"receive copy results cdb.");
+		return -1;
+	}
+	ret = iscsi_scsi_command_async(iscsi, lun, task, cb, NULL,
+				       private_data);
+
+	return ret;
+}
+
+int
+iscsi_report_target_port_groups_async(struct iscsi_context *iscsi, int lun,
+				      int alloc_len, iscsi_command_cb cb,
+				      void *private_data)
+{
+	struct scsi_task *task;
+	int ret;
+
+	task = scsi_cdb_report_target_port_groups(alloc_len);
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"report target port groups cdb.");
+		return -1;
+	}
+	ret = iscsi_scsi_command_async(iscsi, lun, task, cb, NULL,
+				       private_data);
+
+	return ret;
+}
+
+/*
+ * UNMAP and WRITESAME requests larger than the target block limits are
+ * sent as a sequence of commands, each one issued from the callback of
+ * the previous one, with a single callback to the application at the end.
+ */
+struct iscsi_range_cbdata {
+	/* while it waits for the block limits of the lun */
+	struct iscsi_range_cbdata *next, *prev;
+
+	iscsi_command_cb callback;
+	void *private_data;
+	int lun;
+	int opcode;
+	int anchor;
+	int unmap;
+
+	/* unmap: list[pos] is the next range, of which done blocks are sent */
+	struct unmap_list *list;
+	int list_len;
+	int pos;
+	uint32_t done;
+	struct unmap_list *cmd_list;
+	int max_descriptors;
+	uint32_t max_lba_count;
+
+	/* writesame: what remains to be written */
+	uint64_t lba;
+	uint64_t num_blocks;
+	uint32_t max_blocks;
+	unsigned char *data;
+	int datalen;
+};
+
+static void
+iscsi_free_range_cbdata(struct iscsi_range_cbdata *range)
+{
+	free(range->list);
+	free(range->cmd_list);
+	free(range->data);
+	free(range);
+}
+
+static int
+iscsi_range_finished(struct iscsi_range_cbdata *range)
+{
+	if (range->opcode == SCSI_OPCODE_UNMAP) {
+		return range->pos == range->list_len;
+	}
+	return range->num_blocks == 0;
+}
+
+static void iscsi_range_cb(struct iscsi_context *iscsi, int status,
+			   void *command_data, void *private_data);
+
+static int
+iscsi_range_send_next(struct iscsi_context *iscsi,
+		      struct iscsi_range_cbdata *range)
+{
+	struct scsi_task *task;
+	struct iscsi_data outdata;
+	uint32_t num, budget;
+	int n;
+
+	if (range->opcode == SCSI_OPCODE_UNMAP) {
+		n = 0;
+		budget = range->max_lba_count;
+		while (range->pos < range->list_len
+		       && n < range->max_descriptors && budget > 0) {
+			struct unmap_list *r = &range->list[range->pos];
+
+			num = MIN(r->num - range->done, budget);
+			range->cmd_list[n].lba = r->lba + range->done;
+			range->cmd_list[n].num = num;
+			n++;
+			budget      -= num;
+			range->done += num;
+			if (range->done == r->num) {
+				range->pos++;
+				range->done = 0;
+			}
+		}
+
+		task = scsi_cdb_unmap(range->anchor, 0, range->cmd_list, n);
+		if (task == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: Failed to "
+					"create unmap cdb.");
+			return -1;
+		}
+		return iscsi_scsi_command_async(iscsi, range->lun, task,
+						iscsi_range_cb, NULL, range);
+	}
+
+	num = MIN(range->num_blocks, range->max_blocks);
+	if (range->opcode == SCSI_OPCODE_WRITE_SAME10) {
+		task = scsi_cdb_writesame10(0, range->anchor, range->unmap,
+					    range->lba, 0, num,
+					    range->datalen);
+	} else {
+		task = scsi_cdb_writesame16(0, range->anchor, range->unmap,
+					    range->lba, 0, num,
+					    range->datalen);
+	}
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"writesame cdb.");
+		return -1;
+	}
+	range->lba        += num;
+	range->num_blocks -= num;
+
+	outdata.data = range->data;
+	outdata.size = range->datalen;
+
+	return iscsi_scsi_command_async(iscsi, range->lun, task,
+					iscsi_range_cb, &outdata, range);
+}
+
+static void
+iscsi_range_cb(struct iscsi_context *iscsi, int status,
+	       void *command_data, void *private_data)
+{
+	struct iscsi_range_cbdata *range = private_data;
+
+	if (status == SCSI_STATUS_GOOD && !iscsi_range_finished(range)) {
+		if (iscsi_range_send_next(iscsi, range) == 0) {
+			return;
+		}
+		status = SCSI_STATUS_ERROR;
+	}
+
+	range->callback(iscsi, status, command_data, range->private_data);
+	iscsi_free_range_cbdata(range);
+}
+
+void
+iscsi_apply_block_limits(const struct scsi_inquiry_block_limits *bl,
+			 uint32_t *unmap_max_lba_count,
+			 uint32_t *unmap_max_descriptors,
+			 uint32_t *write_same_max_length)
+{
+	/* 0 means the target did not report a limit */
+	*unmap_max_lba_count = ISCSI_UNMAP_MAX_LBA_COUNT;
+	if (bl->max_unmap_lba_count != 0) {
+		*unmap_max_lba_count = bl->max_unmap_lba_count;
+	}
+
+	*unmap_max_descriptors = ISCSI_UNMAP_MAX_DESCRIPTORS;
+	if (bl->max_unmap_block_descriptor_count != 0
+	    && bl->max_unmap_block_descriptor_count
+	       < ISCSI_UNMAP_MAX_DESCRIPTORS) {
+		*unmap_max_descriptors = bl->max_unmap_block_descriptor_count;
+	}
+
+	*write_same_max_length = ISCSI_WRITE_SAME_MAX_LENGTH;
+	if (bl->max_write_same_length != 0
+	    && bl->max_write_same_length < ISCSI_WRITE_SAME_MAX_LENGTH) {
+		*write_same_max_length = bl->max_write_same_length;
+	}
+}
+
+void
+iscsi_free_lun_limits(struct iscsi_context *iscsi)
+{
+	struct iscsi_lun_limits *limits;
+
+	while ((limits = iscsi->lun_limits) != NULL) {
+		iscsi->lun_limits = limits->next;
+		free(limits);
+	}
+}
+
+/*
+ * Split the request by the limits and send the first command of it.
+ */
+static int
+iscsi_range_start(struct iscsi_context *iscsi,
+		  struct iscsi_range_cbdata *range,
+		  uint32_t unmap_max_lba_count, uint32_t unmap_max_descriptors,
+		  uint32_t write_same_max_length)
+{
+	if (range->opcode == SCSI_OPCODE_UNMAP) {
+		range->max_descriptors = unmap_max_descriptors;
+		range->max_lba_count   = unmap_max_lba_count;
+		range->cmd_list = malloc(range->max_descriptors
+					 * sizeof(struct unmap_list));
+		if (range->cmd_list == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: Failed to "
+					"allocate unmap state.");
+			return -1;
+		}
+	} else {
+		range->max_blocks = write_same_max_length;
+		if (range->opcode == SCSI_OPCODE_WRITE_SAME10) {
+			range->max_blocks = MIN(range->max_blocks, 0xffff);
+		}
+	}
+
+	return iscsi_range_send_next(iscsi, range);
+}
+
+static void
+iscsi_lun_limits_cb(struct iscsi_context *iscsi, int status,
+		    void *command_data, void *private_data)
+{
+	struct iscsi_context *session = ISCSI_SESSION(iscsi);
+	struct iscsi_lun_limits *limits = private_data;
+	struct iscsi_lun_limits **l;
+	struct scsi_inquiry_block_limits *bl;
+	struct iscsi_range_cbdata *range;
+
+	/* a target that does not have the page is only split by what
+	 * fits in the cdb and the parameter list
+	 */
+	if (status == SCSI_STATUS_GOOD
+	    || status == SCSI_STATUS_CHECK_CONDITION) {
+		limits->unmap_max_lba_count   = ISCSI_UNMAP_MAX_LBA_COUNT;
+		limits->unmap_max_descriptors = ISCSI_UNMAP_MAX_DESCRIPTORS;
+		limits->write_same_max_length = ISCSI_WRITE_SAME_MAX_LENGTH;
+		bl = status == SCSI_STATUS_GOOD
+			? scsi_datain_unmarshall(command_data) : NULL;
+		if (bl != NULL) {
+			iscsi_apply_block_limits(bl,
+				&limits->unmap_max_lba_count,
+				&limits->unmap_max_descriptors,
+				&limits->write_same_max_length);
+		}
+		limits->fetched = 1;
+	} else if (status != SCSI_STATUS_CANCELLED) {
+		status = SCSI_STATUS_ERROR;
+	}
+
+	while ((range = limits->waiting) != NULL) {
+		DLIST_REMOVE(&limits->waiting, &limits->waiting_tail, range);
+		if (!limits->fetched) {
+			range->callback(iscsi, status, NULL,
+					range->private_data);
+			iscsi_free_range_cbdata(range);
+			continue;
+		}
+		if (iscsi_range_start(iscsi, range,
+				      limits->unmap_max_lba_count,
+				      limits->unmap_max_descriptors,
+				      limits->write_same_max_length) != 0) {
+			range->callback(iscsi, SCSI_STATUS_ERROR, NULL,
+					range->private_data);
+			iscsi_free_range_cbdata(range);
+		}
+	}
+
+	/* the connection went away, try again with the next request */
+	if (!limits->fetched) {
+		for (l = &session->lun_limits; *l != NULL; l = &(*l)->next) {
+			if (*l == limits) {
+				*l = limits->next;
+				break;
+			}
+		}
+		free(limits);
+	}
+}
+
+/*
+ * Send the request once the block limits of the lun are known, reading
+ * them from the target first if this is the first request to the lun.
+ * iscsi_set_block_limits() sets limits for every lun instead.
+ */
+static int
+iscsi_range_submit(struct iscsi_context *iscsi,
+		   struct iscsi_range_cbdata *range)
+{
+	struct iscsi_context *session = ISCSI_SESSION(iscsi);
+	struct iscsi_lun_limits *limits;
+
+	if (session->block_limits_set) {
+		return iscsi_range_start(iscsi, range,
+					 session->unmap_max_lba_count,
+					 session->unmap_max_descriptors,
+					 session->write_same_max_length);
+	}
+
+	for (limits = session->lun_limits; limits != NULL;
+	     limits = limits->next) {
+		if (limits->lun == range->lun) {
+			break;
+		}
+	}
+	if (limits == NULL) {
+		limits = malloc(sizeof(struct iscsi_lun_limits));
+		if (limits == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: Failed to "
+					"allocate block limits.");
+			return -1;
+		}
+		bzero(limits, sizeof(struct iscsi_lun_limits));
+		limits->lun = range->lun;
+		if (iscsi_inquiry_async(iscsi, range->lun, 1,
+					SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS,
+					64, iscsi_lun_limits_cb,
+					limits) != 0) {
+			free(limits);
+			return -1;
+		}
+		limits->next = session->lun_limits;
+		session->lun_limits = limits;
+	}
+
+	if (!limits->fetched) {
+		DLIST_ADD_END(&limits->waiting, &limits->waiting_tail, range);
+		return 0;
+	}
+
+	return iscsi_range_start(iscsi, range,
+				 limits->unmap_max_lba_count,
+				 limits->unmap_max_descriptors,
+				 limits->write_same_max_length);
+}
+
+int
+iscsi_unmap_async(struct iscsi_context *iscsi, int lun, int anchor,
+		  struct unmap_list *list, int list_len,
+		  iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_range_cbdata *range;
+	int i;
+
+	if (list == NULL || list_len < 1) {
+		iscsi_set_error(iscsi, "Empty unmap list.");
+		return -1;
+	}
+
+	range = malloc(sizeof(struct iscsi_range_cbdata));
+	if (range == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"unmap state.");
+		return -1;
+	}
+	bzero(range, sizeof(struct iscsi_range_cbdata));
+	range->callback        = cb;
+	range->private_data    = private_data;
+	range->lun             = lun;
+	range->opcode          = SCSI_OPCODE_UNMAP;
+	range->anchor          = anchor;
+
+	range->list = malloc(list_len * sizeof(struct unmap_list));
+	if (range->list == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"unmap state.");
+		iscsi_free_range_cbdata(range);
+		return -1;
+	}
+	/* empty ranges are no-ops, leave them out */
+	for (i = 0; i < list_len; i++) {
+		if (list[i].num != 0) {
+			range->list[range->list_len++] = list[i];
+		}
+	}
+	if (range->list_len == 0) {
+		iscsi_set_error(iscsi, "Empty unmap list.");
+		iscsi_free_range_cbdata(range);
+		return -1;
+	}
+
+	if (iscsi_range_submit(iscsi, range) != 0) {
+		iscsi_free_range_cbdata(range);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+iscsi_writesame_async(struct iscsi_context *iscsi, int lun, int opcode,
+		      unsigned char *data, int datalen, uint64_t lba,
+		      uint64_t num_blocks, int anchor, int unmap,
+		      iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_range_cbdata *range;
+
+	if (datalen <= 0 || num_blocks == 0) {
+		/* zero blocks would mean all the way to the end of the lun */
+		iscsi_set_error(iscsi, "Invalid writesame of %d bytes to %llu "
+				"blocks.", datalen,
+				(unsigned long long)num_blocks);
+		return -1;
+	}
+
+	range = malloc(sizeof(struct iscsi_range_cbdata));
+	if (range == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"writesame state.");
+		return -1;
+	}
+	bzero(range, sizeof(struct iscsi_range_cbdata));
+	range->callback     = cb;
+	range->private_data = private_data;
+	range->lun          = lun;
+	range->opcode       = opcode;
+	range->anchor       = anchor;
+	range->unmap        = unmap;
+	range->lba          = lba;
+	range->num_blocks   = num_blocks;
+
+	range->datalen = datalen;
+	range->data    = malloc(datalen);
+	if (range->data == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"writesame state.");
+		iscsi_free_range_cbdata(range);
+		return -1;
+	}
+	if (data != NULL) {
+		memcpy(range->data, data, datalen);
+	} else {
+		bzero(range->data, datalen);
+	}
+
+	if (iscsi_range_submit(iscsi, range) != 0) {
+		iscsi_free_range_cbdata(range);
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+iscsi_writesame10_async(struct iscsi_context *iscsi, int lun,
+			unsigned char *data, int datalen, int lba,
+			int num_blocks, int anchor, int unmap,
+			iscsi_command_cb cb, void *private_data)
+{
+	if (num_blocks < 0) {
+		iscsi_set_error(iscsi, "Invalid writesame10 of %d blocks.",
+				num_blocks);
+		return -1;
+	}
+	/* the commands it is split into can not address beyond 2^32 */
+	if ((uint64_t)(uint32_t)lba + num_blocks > 0x100000000ULL) {
+		iscsi_set_error(iscsi, "Invalid writesame10 of %d blocks "
+				"from lba %u beyond lba 0xffffffff.",
+				num_blocks, (uint32_t)lba);
+		return -1;
+	}
+
+	return iscsi_writesame_async(iscsi, lun, SCSI_OPCODE_WRITE_SAME10,
+				     data, datalen, (uint32_t)lba, num_blocks,
+				     anchor, unmap, cb, private_data);
+}
+
+int
+iscsi_writesame16_async(struct iscsi_context *iscsi, int lun,
+			unsigned char *data, int datalen, uint64_t lba,
+			uint64_t num_blocks, int anchor, int unmap,
+			iscsi_command_cb cb, void *private_data)
+{
+	return iscsi_writesame_async(iscsi, lun, SCSI_OPCODE_WRITE_SAME16,
+				     data, datalen, lba, num_blocks,
+				     anchor, unmap, cb, private_data);
+}
+
@@ -68,6 +68,84 @@ scsi_malloc(struct scsi_task *task, size_t size)
 	return mem->ptr;
 }
 
+/*
+ * 64 bit fields in cdbs and data-in are big endian
+ */
+static void
+scsi_set_uint64(unsigned char *c, uint64_t v)
+{
+	*(uint32_t *)&c[0] = htonl(v >> 32);
+	*(uint32_t *)&c[4] = htonl(v & 0xffffffff);
+}
+
+static uint64_t
+scsi_get_uint64(const unsigned char *c)
+{
+	uint64_t v;
+
+	v   = ntohl(*(const uint32_t *)&c[0]);
+	v <<= 32;
+	v  |= ntohl(*(const uint32_t *)&c[4]);
+
+	return v;
+}
+
+void
+scsi_parse_sense_data(struct scsi_sense *sense, const unsigned char *sb,
+		      int len)
+{
+	int pos;
+
+	bzero(sense, sizeof(struct scsi_sense));
+	if (len < 1) {
+		return;
+	}
+	sense->error_type = sb[0] & 0x7f;
+
+	switch (sense->error_type) {
+	case 0x70:
+	case 0x71:
+		/* fixed format */
+		if (len >= 3) {
+			sense->key = sb[2] & 0x0f;
+		}
+		if (len >= 14) {
+			sense->ascq = ntohs(*(const uint16_t *)&sb[12]);
+		}
+		if ((sb[0] & 0x80) && len >= 7) {
+			sense->info_valid  = 1;
+			sense->information = ntohl(*(const uint32_t *)&sb[3]);
+		}
+		break;
+	case 0x72:
+	case 0x73:
+		/* descriptor format */
+		if (len >= 4) {
+			sense->key  = sb[1] & 0x0f;
+			sense->ascq = ntohs(*(const uint16_t *)&sb[2]);
+		}
+		/* the additional length and the descriptors follow the
+		 * 8 byte header
+		 */
+		if (len < 8) {
+			break;
+		}
+		if (len > 8 + sb[7]) {
+			len = 8 + sb[7];
+		}
+		for (pos = 8; pos + 2 <= len; pos += sb[pos + 1] + 2) {
+			/* the information descriptor */
+			if (sb[pos] == 0x00 && pos + 12 <= len
+			    && (sb[pos + 2] & 0x80)) {
+				sense->info_valid  = 1;
+				sense->information =
+					scsi_get_uint64(&sb[pos + 4]);
+			}
+		}
+		break;
+	}
+}
+
 struct value_string {
        int value;
        const char *string;
@@ -92,6 +170,8 @@ scsi_sense_key_str(int key)
 		 "ILLEGAL_REQUEST"},
 		{SCSI_SENSE_UNIT_ATTENTION,
 		 "UNIT_ATTENTION"},
+		{SCSI_SENSE_MISCOMPARE,
+		 "MISCOMPARE"},
 	       {0, NULL}
 	};
 
@@ -102,12 +182,22 @@ const char *
 scsi_sense_ascq_str(int ascq)
 {
 	struct value_string ascqs[] = {
+		{SCSI_SENSE_ASCQ_MISCOMPARE_DURING_VERIFY,
+		 "MISCOMPARE_DURING_VERIFY"},
 		{SCSI_SENSE_ASCQ_INVALID_FIELD_IN_CDB,
 		 "INVALID_FIELD_IN_CDB"},
 		{SCSI_SENSE_ASCQ_LOGICAL_UNIT_NOT_SUPPORTED,
 		 "LOGICAL_UNIT_NOT_SUPPORTED"},
 		{SCSI_SENSE_ASCQ_BUS_RESET,
 		 "BUS_RESET"},
+		{SCSI_SENSE_ASCQ_ASYMMETRIC_ACCESS_TRANSITION,
+		 "ASYMMETRIC_ACCESS_TRANSITION"},
+		{SCSI_SENSE_ASCQ_TARGET_PORT_IN_STANDBY,
+		 "TARGET_PORT_IN_STANDBY"},
+		{SCSI_SENSE_ASCQ_TARGET_PORT_IN_UNAVAILABLE,
+		 "TARGET_PORT_IN_UNAVAILABLE"},
+		{SCSI_SENSE_ASCQ_ASYMMETRIC_ACCESS_STATE_CHANGED,
+		 "ASYMMETRIC_ACCESS_STATE_CHANGED"},
 	       {0, NULL}
 	};
 
@@ -283,6 +373,73 @@ scsi_readcapacity10_datain_unmarshall(struct scsi_task *task)
 
 
 
+/*
+ * READCAPACITY16
+ */
+struct scsi_task *
+scsi_cdb_readcapacity16(void)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	bzero(task, sizeof(struct scsi_task));
+	task->cdb[0]   = SCSI_OPCODE_SERVICE_ACTION_IN;
+	task->cdb[1]   = SCSI_READCAPACITY16;
+
+	*(uint32_t *)&task->cdb[10] = htonl(32);
+
+	task->cdb_size = 16;
+	task->xfer_dir = SCSI_XFER_READ;
+	task->expxferlen = 32;
+
+	return task;
+}
+
+/*
+ * parse the data in blob and calcualte the size of a full
+ * readcapacity16 datain structure
+ */
+static int
+scsi_readcapacity16_datain_getfullsize(struct scsi_task *task _U_)
+{
+	return 32;
+}
+
+/*
+ * unmarshall the data in blob for readcapacity16 into a structure
+ */
+static struct scsi_readcapacity16 *
+scsi_readcapacity16_datain_unmarshall(struct scsi_task *task)
+{
+	struct scsi_readcapacity16 *rc16;
+
+	if (task->datain.size < 32) {
+		return NULL;
+	}
+	rc16 = scsi_malloc(task, sizeof(struct scsi_readcapacity16));
+	if (rc16 == NULL) {
+		return NULL;
+	}
+
+	rc16->returned_lba = scsi_get_uint64(&task->datain.data[0]);
+	rc16->block_length = ntohl(*(uint32_t *)&(task->datain.data[8]));
+	rc16->p_type       = (task->datain.data[12] >> 1) & 0x07;
+	rc16->prot_en      = task->datain.data[12] & 0x01;
+	rc16->p_i_exp      = (task->datain.data[13] >> 4) & 0x0f;
+	rc16->lbppbe       = task->datain.data[13] & 0x0f;
+	rc16->lbpme        = !!(task->datain.data[14] & 0x80);
+	rc16->lbprz        = !!(task->datain.data[14] & 0x40);
+	rc16->lalba        = ntohs(*(uint16_t *)&(task->datain.data[14]))
+			     & 0x3fff;
+
+	return rc16;
+}
+
+
 /*
  * INQUIRY
  */
@@ -335,6 +492,8 @@ scsi_inquiry_datain_getfullsize(struct scsi_task *task)
 		return task->datain.data[3] + 4;
 	case SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION:
 	     return ntohs(*(uint16_t *)&task->datain.data[2]) + 4;
+	case SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS:
+		return ntohs(*(uint16_t *)&task->datain.data[2]) + 4;
 	case SCSI_INQUIRY_PAGECODE_BLOCK_DEVICE_CHARACTERISTICS:
 		return task->datain.data[3] + 4;
 	default:
@@ -499,6 +658,44 @@ scsi_inquiry_datain_unmarshall(struct scsi_task *task)
 						   &task->datain.data[4]);
 		return inq;
 	}
+	if (task->params.inquiry.page_code
+		   == SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS) {
+		struct scsi_inquiry_block_limits *inq;
+
+		/* the page is 0x3c bytes, anything shorter is an old target */
+		if (task->datain.size < 0x3c) {
+			return NULL;
+		}
+		inq = scsi_malloc(task,
+		      sizeof(struct scsi_inquiry_block_limits));
+		if (inq == NULL) {
+			return NULL;
+		}
+		inq->periperal_qualifier   = (task->datain.data[0]>>5)&0x07;
+		inq->periperal_device_type = task->datain.data[0]&0x1f;
+		inq->pagecode              = task->datain.data[1];
+
+		inq->max_compare_and_write_length = task->datain.data[5];
+		inq->optimal_transfer_length_granularity =
+			ntohs(*(uint16_t *)&task->datain.data[6]);
+		inq->max_transfer_length   = ntohl(*(uint32_t *)
+						   &task->datain.data[8]);
+		inq->optimal_transfer_length = ntohl(*(uint32_t *)
+						   &task->datain.data[12]);
+		inq->max_unmap_lba_count   = ntohl(*(uint32_t *)
+						   &task->datain.data[20]);
+		inq->max_unmap_block_descriptor_count = ntohl(*(uint32_t *)
+						   &task->datain.data[24]);
+		inq->optimal_unmap_granularity = ntohl(*(uint32_t *)
+						   &task->datain.data[28]);
+		inq->ugavalid              = !!(task->datain.data[32]&0x80);
+		inq->unmap_granularity_alignment = ntohl(*(uint32_t *)
+						   &task->datain.data[32])
+						   & 0x7fffffff;
+		inq->max_write_same_length = scsi_get_uint64(
+						   &task->datain.data[36]);
+		return inq;
+	}
 
 	return NULL;
 }
@@ -563,6 +760,65 @@ scsi_cdb_write10(int lba, int xferlen, int fua, int fuanv, int blocksize)
 }
 
 
+/*
+ * READ16
+ */
+struct scsi_task *
+scsi_cdb_read16(uint64_t lba, int xferlen, int blocksize)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	bzero(task, sizeof(struct scsi_task));
+	task->cdb[0]   = SCSI_OPCODE_READ16;
+
+	scsi_set_uint64(&task->cdb[2], lba);
+	*(uint32_t *)&task->cdb[10] = htonl(xferlen/blocksize);
+
+	task->cdb_size = 16;
+	task->xfer_dir = SCSI_XFER_READ;
+	task->expxferlen = xferlen;
+
+	return task;
+}
+
+/*
+ * WRITE16
+ */
+struct scsi_task *
+scsi_cdb_write16(uint64_t lba, int xferlen, int fua, int fuanv, int blocksize)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	bzero(task, sizeof(struct scsi_task));
+	task->cdb[0]   = SCSI_OPCODE_WRITE16;
+
+	if (fua) {
+		task->cdb[1] |= 0x08;
+	}
+	if (fuanv) {
+		task->cdb[1] |= 0x02;
+	}
+
+	scsi_set_uint64(&task->cdb[2], lba);
+	*(uint32_t *)&task->cdb[10] = htonl(xferlen/blocksize);
+
+	task->cdb_size = 16;
+	task->xfer_dir = SCSI_XFER_WRITE;
+	task->expxferlen = xferlen;
+
+	return task;
+}
+
 
 /*
  * MODESENSE6
@@ -648,6 +904,486 @@ scsi_cdb_synchronizecache10(int lba, int num_blocks, int syncnv, int immed)
 	return task;
 }
 
+/*
+ * COMPARE AND WRITE
+ */
+struct scsi_task *
+scsi_cdb_compareandwrite(uint64_t lba, int xferlen, int blocksize,
+			 int wrprotect, int dpo, int fua, int group)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	bzero(task, sizeof(struct scsi_task));
+	task->cdb[0]   = SCSI_OPCODE_COMPARE_AND_WRITE;
+
+	task->cdb[1] = (wrprotect & 0x07) << 5;
+	if (dpo) {
+		task->cdb[1] |= 0x10;
+	}
+	if (fua) {
+		task->cdb[1] |= 0x08;
+	}
+	scsi_set_uint64(&task->cdb[2], lba);
+	task->cdb[13] = xferlen / blocksize / 2;
+	task->cdb[14] = group & 0x1f;
+
+	task->cdb_size   = 16;
+	task->xfer_dir   = SCSI_XFER_WRITE;
+	task->expxferlen = xferlen;
+
+	return task;
+}
+
+/*
+ * EXTENDED COPY
+ */
+struct scsi_task *
+scsi_cdb_extended_copy(int list_id, struct scsi_copy_target *targets,
+		       int num_targets, struct scsi_copy_segment *segments,
+		       int num_segments)
+{
+	struct scsi_task *task;
+	unsigned char *data, *d;
+	int i, xferlen;
+
+	if (num_targets < 1 || num_segments < 1) {
+		return NULL;
+	}
+	for (i = 0; i < num_targets; i++) {
+		if (targets[i].designator == NULL
+		    || targets[i].designator->designator_length > 16) {
+			return NULL;
+		}
+	}
+	for (i = 0; i < num_segments; i++) {
+		if (segments[i].num_blocks < 0
+		    || segments[i].num_blocks > 0xffff) {
+			return NULL;
+		}
+	}
+	xferlen = 16 + num_targets * 32 + num_segments * 28;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	bzero(task, sizeof(struct scsi_task));
+	task->cdb[0]   = SCSI_OPCODE_EXTENDED_COPY;
+
+	*(uint32_t *)&task->cdb[10] = htonl(xferlen);
+
+	task->cdb_size   = 16;
+	task->xfer_dir   = SCSI_XFER_WRITE;
+	task->expxferlen = xferlen;
+
+	data = scsi_malloc(task, xferlen);
+	if (data == NULL) {
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+
+	/* parameter list header */
+	data[0] = list_id;
+	*(uint16_t *)&data[2] = htons(num_targets * 32);
+	*(uint32_t *)&data[8] = htonl(num_segments * 28);
+
+	/* identification descriptor copy target descriptors */
+	d = &data[16];
+	for (i = 0; i < num_targets; i++, d += 32) {
+		struct scsi_inquiry_device_designator *dev;
+
+		dev  = targets[i].designator;
+		d[0] = SCSI_COPY_TARGET_IDENTIFICATION;
+		d[1] = SCSI_INQUIRY_PERIPHERAL_DEVICE_TYPE_DIRECT_ACCESS;
+		d[4] = dev->code_set;
+		d[5] = (dev->association << 4) | dev->designator_type;
+		d[7] = dev->designator_length;
+		memcpy(&d[8], dev->designator, dev->designator_length);
+		d[29] = (targets[i].block_length >> 16) & 0xff;
+		d[30] = (targets[i].block_length >>  8) & 0xff;
+		d[31] =  targets[i].block_length        & 0xff;
+	}
+
+	/* block device to block device segment descriptors */
+	for (i = 0; i < num_segments; i++, d += 28) {
+		d[0] = SCSI_COPY_SEGMENT_BLOCK_TO_BLOCK;
+		*(uint16_t *)&d[2]  = htons(0x18);
+		*(uint16_t *)&d[4]  = htons(segments[i].src_index);
+		*(uint16_t *)&d[6]  = htons(segments[i].dst_index);
+		*(uint16_t *)&d[10] = htons(segments[i].num_blocks);
+		scsi_set_uint64(&d[12], segments[i].src_lba);
+		scsi_set_uint64(&d[20], segments[i].dst_lba);
+	}
+
+	if (scsi_task_add_data_out_buffer(task, xferlen, data) != 0) {
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+
+	return task;
+}
+
+/*
+ * RECEIVE COPY RESULTS
+ */
+struct scsi_task *
+scsi_cdb_receive_copy_results(enum scsi_copy_results_sa sa, int list_id,
+			      int alloc_len)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	bzero(task, sizeof(struct scsi_task));
+	task->cdb[0]   = SCSI_OPCODE_RECEIVE_COPY_RESULTS;
+
+	task->cdb[1] = sa & 0x1f;
+	task->cdb[2] = list_id;
+	*(uint32_t *)&task->cdb[10] = htonl(alloc_len);
+
+	task->cdb_size   = 16;
+	task->xfer_dir   = SCSI_XFER_READ;
+	task->expxferlen = alloc_len;
+
+	return task;
+}
+
+/*
+ * parse the data in blob and calcualte the size of a full
+ * receive copy results datain structure
+ */
+static int
+scsi_receive_copy_results_datain_getfullsize(struct scsi_task *task)
+{
+	if (task->datain.size < 4) {
+		return -1;
+	}
+	return ntohl(*(uint32_t *)&task->datain.data[0]) + 4;
+}
+
+/*
+ * unmarshall the data in blob for receive copy results into a structure
+ */
+static void *
+scsi_receive_copy_results_datain_unmarshall(struct scsi_task *task)
+{
+	unsigned char *data = task->datain.data;
+
+	switch (task->cdb[1] & 0x1f) {
+	case SCSI_COPY_RESULTS_COPY_STATUS: {
+		struct scsi_copy_results_copy_status *cs;
+
+		if (task->datain.size < 12) {
+			return NULL;
+		}
+		cs = scsi_malloc(task,
+			sizeof(struct scsi_copy_results_copy_status));
+		if (cs == NULL) {
+			return NULL;
+		}
+		cs->hdd                  = !!(data[4] & 0x80);
+		cs->copy_manager_status  = data[4] & 0x7f;
+		cs->segments_processed   = ntohs(*(uint16_t *)&data[5]);
+		cs->transfer_count_units = data[7];
+		cs->transfer_count       = ntohl(*(uint32_t *)&data[8]);
+		return cs;
+	}
+	case SCSI_COPY_RESULTS_OPERATING_PARAMETERS: {
+		struct scsi_copy_results_op_params *op;
+		int len;
+
+		if (task->datain.size < 44) {
+			return NULL;
+		}
+		op = scsi_malloc(task,
+			sizeof(struct scsi_copy_results_op_params));
+		if (op == NULL) {
+			return NULL;
+		}
+		op->snlid                  = !!(data[4] & 0x01);
+		op->max_target_desc_count  = ntohs(*(uint16_t *)&data[8]);
+		op->max_segment_desc_count = ntohs(*(uint16_t *)&data[10]);
+		op->max_desc_list_length   = ntohl(*(uint32_t *)&data[12]);
+		op->max_segment_length     = ntohl(*(uint32_t *)&data[16]);
+		op->max_inline_data_length = ntohl(*(uint32_t *)&data[20]);
+		op->held_data_limit        = ntohl(*(uint32_t *)&data[24]);
+		op->max_stream_device_transfer_size =
+					     ntohl(*(uint32_t *)&data[28]);
+		op->total_concurrent_copies = ntohs(*(uint16_t *)&data[34]);
+		op->max_concurrent_copies   = data[36];
+		op->data_segment_granularity = data[37];
+		op->inline_data_granularity  = data[38];
+		op->held_data_granularity    = data[39];
+
+		len = data[43];
+		if (len > task->datain.size - 44) {
+			len = task->datain.size - 44;
+		}
+		op->num_desc_type_codes = len;
+		op->desc_type_codes = scsi_malloc(task, len + 1);
+		if (op->desc_type_codes == NULL) {
+			return NULL;
+		}
+		memcpy(op->desc_type_codes, &data[44], len);
+		return op;
+	}
+	}
+	return NULL;
+}
+
+/*
+ * REPORT TARGET PORT GROUPS
+ */
+struct scsi_task *
+scsi_cdb_report_target_port_groups(int alloc_len)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	bzero(task, sizeof(struct scsi_task));
+	task->cdb[0]   = SCSI_OPCODE_MAINTENANCE_IN;
+
+	task->cdb[1] = SCSI_REPORT_TARGET_PORT_GROUPS;
+	*(uint32_t *)&task->cdb[6] = htonl(alloc_len);
+
+	task->cdb_size   = 12;
+	task->xfer_dir   = SCSI_XFER_READ;
+	task->expxferlen = alloc_len;
+
+	return task;
+}
+
+/*
+ * parse the data in blob and calcualte the size of a full
+ * report target port groups datain structure
+ */
+static int
+scsi_report_target_port_groups_datain_getfullsize(struct scsi_task *task)
+{
+	if (task->datain.size < 4) {
+		return -1;
+	}
+	return ntohl(*(uint32_t *)&task->datain.data[0]) + 4;
+}
+
+/*
+ * unmarshall the data in blob for report target port groups into a
+ * structure
+ */
+static struct scsi_report_target_port_groups *
+scsi_report_target_port_groups_datain_unmarshall(struct scsi_task *task)
+{
+	struct scsi_report_target_port_groups *rtpg;
+	unsigned char *data = task->datain.data;
+	int len, pos, i, num_ports;
+
+	if (task->datain.size < 4) {
+		return NULL;
+	}
+	len = ntohl(*(uint32_t *)&data[0]) + 4;
+	if (len > task->datain.size) {
+		len = task->datain.size;
+	}
+
+	rtpg = scsi_malloc(task, sizeof(struct scsi_report_target_port_groups));
+	if (rtpg == NULL) {
+		return NULL;
+	}
+
+	/* count the complete descriptors first */
+	for (pos = 4; pos + 8 <= len; pos += 8 + data[pos + 7] * 4) {
+		if (pos + 8 + data[pos + 7] * 4 > len) {
+			break;
+		}
+		rtpg->num_groups++;
+	}
+
+	rtpg->groups = scsi_malloc(task, sizeof(struct scsi_target_port_group)
+				   * (rtpg->num_groups + 1));
+	if (rtpg->groups == NULL) {
+		return NULL;
+	}
+
+	for (i = 0, pos = 4; i < rtpg->num_groups; i++) {
+		struct scsi_target_port_group *tpg = &rtpg->groups[i];
+		int j;
+
+		tpg->pref             = !!(data[pos] & 0x80);
+		tpg->alua_state       = data[pos] & 0x0f;
+		tpg->supported_states = data[pos + 1];
+		tpg->port_group       = ntohs(*(uint16_t *)&data[pos + 2]);
+		tpg->status_code      = data[pos + 5];
+
+		num_ports = data[pos + 7];
+		tpg->num_ports = num_ports;
+		tpg->ports = scsi_malloc(task, sizeof(uint16_t)
+					 * (num_ports + 1));
+		if (tpg->ports == NULL) {
+			return NULL;
+		}
+		for (j = 0; j < num_ports; j++) {
+			tpg->ports[j] = ntohs(*(uint16_t *)
+					      &data[pos + 8 + j * 4 + 2]);
+		}
+		pos += 8 + num_ports * 4;
+	}
+
+	return rtpg;
+}
+
+const char *
+scsi_alua_state_to_str(int state)
+{
+	struct value_string states[] = {
+		{SCSI_ALUA_ACTIVE_OPTIMIZED,    "ACTIVE_OPTIMIZED"},
+		{SCSI_ALUA_ACTIVE_NONOPTIMIZED, "ACTIVE_NONOPTIMIZED"},
+		{SCSI_ALUA_STANDBY,             "STANDBY"},
+		{SCSI_ALUA_UNAVAILABLE,         "UNAVAILABLE"},
+		{SCSI_ALUA_LBA_DEPENDENT,       "LBA_DEPENDENT"},
+		{SCSI_ALUA_OFFLINE,             "OFFLINE"},
+		{SCSI_ALUA_TRANSITIONING,       "TRANSITIONING"},
+	       {0, NULL}
+	};
+
+	return value_string_find(states, state);
+}
+
+/*
+ * UNMAP
+ */
+struct scsi_task *
+scsi_cdb_unmap(int anchor, int group, struct unmap_list *list, int list_len)
+{
+	struct scsi_task *task;
+	unsigned char *data;
+	int i, xferlen;
+
+	/* the parameter list length is a 16 bit field */
+	if (list_len < 1 || list_len > (0xffff - 8) / 16) {
+		return NULL;
+	}
+	xferlen = 8 + list_len * 16;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	bzero(task, sizeof(struct scsi_task));
+	task->cdb[0]   = SCSI_OPCODE_UNMAP;
+
+	if (anchor) {
+		task->cdb[1] |= 0x01;
+	}
+	task->cdb[6] = group & 0x1f;
+	*(uint16_t *)&task->cdb[7] = htons(xferlen);
+
+	task->cdb_size   = 10;
+	task->xfer_dir   = SCSI_XFER_WRITE;
+	task->expxferlen = xferlen;
+
+	data = scsi_malloc(task, xferlen);
+	if (data == NULL) {
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+	*(uint16_t *)&data[0] = htons(xferlen - 2);
+	*(uint16_t *)&data[2] = htons(list_len * 16);
+	for (i = 0; i < list_len; i++) {
+		scsi_set_uint64(&data[8 + 16 * i], list[i].lba);
+		*(uint32_t *)&data[8 + 16 * i + 8] = htonl(list[i].num);
+	}
+	if (scsi_task_add_data_out_buffer(task, xferlen, data) != 0) {
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+
+	return task;
+}
+
+/*
+ * WRITESAME10
+ */
+struct scsi_task *
+scsi_cdb_writesame10(int wrprotect, int anchor, int unmap, int lba,
+		     int group, int num_blocks, int datalen)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	bzero(task, sizeof(struct scsi_task));
+	task->cdb[0]   = SCSI_OPCODE_WRITE_SAME10;
+
+	task->cdb[1] = (wrprotect & 0x07) << 5;
+	if (anchor) {
+		task->cdb[1] |= 0x10;
+	}
+	if (unmap) {
+		task->cdb[1] |= 0x08;
+	}
+	*(uint32_t *)&task->cdb[2] = htonl(lba);
+	task->cdb[6] = group & 0x1f;
+	*(uint16_t *)&task->cdb[7] = htons(num_blocks);
+
+	task->cdb_size   = 10;
+	task->xfer_dir   = SCSI_XFER_WRITE;
+	task->expxferlen = datalen;
+
+	return task;
+}
+
+/*
+ * WRITESAME16
+ */
+struct scsi_task *
+scsi_cdb_writesame16(int wrprotect, int anchor, int unmap, uint64_t lba,
+		     int group, uint32_t num_blocks, int datalen)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	bzero(task, sizeof(struct scsi_task));
+	task->cdb[0]   = SCSI_OPCODE_WRITE_SAME16;
+
+	task->cdb[1] = (wrprotect & 0x07) << 5;
+	if (anchor) {
+		task->cdb[1] |= 0x10;
+	}
+	if (unmap) {
+		task->cdb[1] |= 0x08;
+	}
+	scsi_set_uint64(&task->cdb[2], lba);
+	*(uint32_t *)&task->cdb[10] = htonl(num_blocks);
+	task->cdb[14] = group & 0x1f;
+
+	task->cdb_size   = 16;
+	task->xfer_dir   = SCSI_XFER_WRITE;
+	task->expxferlen = datalen;
+
+	return task;
+}
+
 
 
 int
@@ -663,9 +1399,26 @@ scsi_datain_getfullsize(struct scsi_task *task)
 	case SCSI_OPCODE_READCAPACITY10:
 		return scsi_readcapacity10_datain_getfullsize(task);
 	case SCSI_OPCODE_SYNCHRONIZECACHE10:
+	case SCSI_OPCODE_WRITE_SAME10:
+	case SCSI_OPCODE_UNMAP:
+	case SCSI_OPCODE_WRITE_SAME16:
+	case SCSI_OPCODE_COMPARE_AND_WRITE:
+	case SCSI_OPCODE_EXTENDED_COPY:
 		return 0;
+	case SCSI_OPCODE_RECEIVE_COPY_RESULTS:
+		return scsi_receive_copy_results_datain_getfullsize(task);
+	case SCSI_OPCODE_SERVICE_ACTION_IN:
+		if ((task->cdb[1] & 0x1f) == SCSI_READCAPACITY16) {
+			return scsi_readcapacity16_datain_getfullsize(task);
+		}
+		return -1;
 	case SCSI_OPCODE_REPORTLUNS:
 		return scsi_reportluns_datain_getfullsize(task);
+	case SCSI_OPCODE_MAINTENANCE_IN:
+		if ((task->cdb[1] & 0x1f) == SCSI_REPORT_TARGET_PORT_GROUPS) {
+			return scsi_report_target_port_groups_datain_getfullsize(task);
+		}
+		return -1;
 	}
 	return -1;
 }
@@ -681,9 +1434,26 @@ scsi_datain_unmarshall(struct scsi_task *task)
 	case SCSI_OPCODE_READCAPACITY10:
 		return scsi_readcapacity10_datain_unmarshall(task);
 	case SCSI_OPCODE_SYNCHRONIZECACHE10:
+	case SCSI_OPCODE_WRITE_SAME10:
+	case SCSI_OPCODE_UNMAP:
+	case SCSI_OPCODE_WRITE_SAME16:
+	case SCSI_OPCODE_COMPARE_AND_WRITE:
+	case SCSI_OPCODE_EXTENDED_COPY:
+		return NULL;
+	case SCSI_OPCODE_RECEIVE_COPY_RESULTS:
+		return scsi_receive_copy_results_datain_unmarshall(task);
+	case SCSI_OPCODE_SERVICE_ACTION_IN:
+		if ((task->cdb[1] & 0x1f) == SCSI_READCAPACITY16) {
+			return scsi_readcapacity16_datain_unmarshall(task);
+		}
 		return NULL;
 	case SCSI_OPCODE_REPORTLUNS:
 		return scsi_reportluns_datain_unmarshall(task);
+	case SCSI_OPCODE_MAINTENANCE_IN:
+		if ((task->cdb[1] & 0x1f) == SCSI_REPORT_TARGET_PORT_GROUPS) {
+			return scsi_report_target_port_groups_datain_unmarshall(task);
+		}
+		return NULL;
 	}
 	return NULL;
 }
@@ -776,6 +1546,8 @@ scsi_inquiry_pagecode_to_str(int pagecode)
 		return "UNIT_SERIAL_NUMBER";
 	case SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION:
 		return "DEVICE_IDENTIFICATION";
+	case SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS:
+		return "BLOCK_LIMITS";
 	case SCSI_INQUIRY_PAGECODE_BLOCK_DEVICE_CHARACTERISTICS:
 		return "BLOCK_DEVICE_CHARACTERISTICS";
 	}
@@ -863,6 +1635,127 @@ scsi_designator_type_to_str(int type)
 	return "unknown";
 }
 
+int
+scsi_task_add_data_in_buffer(struct scsi_task *task, int len,
+			     unsigned char *buf)
+{
+	struct scsi_data_buffer *data_buf;
+
+	if (len <= 0) {
+		return -1;
+	}
+
+	data_buf = scsi_malloc(task, sizeof(struct scsi_data_buffer));
+	if (data_buf == NULL) {
+		return -1;
+	}
+
+	data_buf->len  = len;
+	data_buf->data = buf;
+
+	SLIST_ADD_END(&task->in_buffers, data_buf);
+
+	return 0;
+}
+
+unsigned char *
+scsi_task_get_data_in_buffer(struct scsi_task *task, int pos, int *available)
+{
+	struct scsi_data_buffer *data_buf;
+
+	if (pos < 0) {
+		*available = 0;
+		return NULL;
+	}
+
+	for (data_buf = task->in_buffers; data_buf; data_buf = data_buf->next) {
+		if (pos < data_buf->len) {
+			*available = data_buf->len - pos;
+			return &data_buf->data[pos];
+		}
+		pos -= data_buf->len;
+	}
+
+	*available = 0;
+	return NULL;
+}
+
+int
+scsi_task_add_data_out_buffer(struct scsi_task *task, int len,
+			      unsigned char *buf)
+{
+	struct scsi_data_buffer *data_buf;
+
+	if (len <= 0) {
+		return -1;
+	}
+
+	data_buf = scsi_malloc(task, sizeof(struct scsi_data_buffer));
+	if (data_buf == NULL) {
+		return -1;
+	}
+
+	data_buf->len  = len;
+	data_buf->data = buf;
+
+	SLIST_ADD_END(&task->out_buffers, data_buf);
+
+	return 0;
+}
+
+/*
+ * Like scsi_task_add_data_out_buffer() but the data is copied into memory
+ * that is owned by the task, so the caller may reuse buf straight away.
+ */
+int
+scsi_task_copy_data_out_buffer(struct scsi_task *task, int len,
+			       const unsigned char *buf)
+{
+	struct scsi_allocated_memory *mem;
+
+	if (len <= 0) {
+		return -1;
+	}
+
+	/* not scsi_malloc(), there is no point zeroing what we overwrite */
+	mem = malloc(sizeof(struct scsi_allocated_memory));
+	if (mem == NULL) {
+		return -1;
+	}
+	bzero(mem, sizeof(struct scsi_allocated_memory));
+	mem->ptr = malloc(len);
+	if (mem->ptr == NULL) {
+		free(mem);
+		return -1;
+	}
+	memcpy(mem->ptr, buf, len);
+	SLIST_ADD(&task->mem, mem);
+
+	return scsi_task_add_data_out_buffer(task, len, mem->ptr);
+}
+
+unsigned char *
+scsi_task_get_data_out_buffer(struct scsi_task *task, int pos, int *available)
+{
+	struct scsi_data_buffer *data_buf;
+
+	if (pos < 0) {
+		*available = 0;
+		return NULL;
+	}
+
+	for (data_buf = task->out_buffers; data_buf; data_buf = data_buf->next) {
+		if (pos < data_buf->len) {
+			*available = data_buf->len - pos;
+			return &data_buf->data[pos];
+		}
+		pos -= data_buf->len;
+	}
+
+	*available = 0;
+	return NULL;
+}
+
 void
 scsi_set_task_private_ptr(struct scsi_task *task, void *ptr)
 {
@@ -26,10 +26,13 @@
 #include <netinet/in.h>
 #include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
+#include "scsi-lowlevel.h"
 #include "slist.h"
 
 static void set_nonblocking(int fd)
@@ -123,6 +126,19 @@ iscsi_connect_async(struct iscsi_context *iscsi, const char *portal,
 
 	}
 
+	/* remember where we went, to come back if the connection fails */
+	if (iscsi->portal != portal) {
+		free(iscsi->portal);
+		iscsi->portal = strdup(portal);
+		if (iscsi->portal == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: "
+					"Failed to strdup portal address.");
+			close(iscsi->fd);
+			iscsi->fd = -1;
+			return -1;
+		}
+	}
+
 	iscsi->socket_status_cb  = cb;
 	iscsi->connect_data      = private_data;
 
@@ -137,28 +153,52 @@ iscsi_connect_async(struct iscsi_context *iscsi, const char *portal,
 		return -1;
 	}
 
+	if (iscsi->loop != NULL) {
+		iscsi_loop_update(iscsi, 0);
+	}
+
 	return 0;
 }
 
 int
 iscsi_disconnect(struct iscsi_context *iscsi)
 {
+	int fd;
+
 	if (iscsi->fd == -1) {
 		iscsi_set_error(iscsi, "Trying to disconnect "
 				"but not connected");
 		return -1;
 	}
 
-	close(iscsi->fd);
+	fd = iscsi->fd;
 	iscsi->fd  = -1;
 	iscsi->is_connected = 0;
 
+	/* take the socket out of the event loop before the number can be
+	 * reused
+	 */
+	if (iscsi->loop != NULL) {
+		iscsi_loop_update(iscsi, 0);
+	}
+	if (iscsi->uring != NULL) {
+		iscsi_uring_stop(iscsi, fd);
+	}
+	close(fd);
+
+	/* anything left in the receive buffer belongs to the old connection */
+	iscsi->rxbuf_pos = 0;
+	iscsi->rxbuf_len = 0;
+
 	return 0;
 }
 
 int
 iscsi_get_fd(struct iscsi_context *iscsi)
 {
+	if (iscsi->fd != -1 && iscsi->uring != NULL) {
+		return iscsi_uring_get_fd(iscsi);
+	}
 	return iscsi->fd;
 }
 
@@ -167,6 +207,10 @@ iscsi_which_events(struct iscsi_context *iscsi)
 {
 	int events = POLLIN;
 
+	if (iscsi->uring != NULL) {
+		return iscsi_uring_which_events(iscsi);
+	}
+
 	if (iscsi->is_connected == 0) {
 		events |= POLLOUT;
 	}
@@ -177,91 +221,532 @@ iscsi_which_events(struct iscsi_context *iscsi)
 	return events;
 }
 
+/*
+ * Returns where the next bytes of the pdu that is being received should be
+ * stored, and how many contiguous bytes fit there.
+ * *len is 0 once the pdu is complete.
+ */
 static int
-iscsi_read_from_socket(struct iscsi_context *iscsi)
+iscsi_in_pdu_dest(struct iscsi_context *iscsi, struct iscsi_in_pdu *in,
+		  unsigned char **buf, ssize_t *len)
+{
+	ssize_t data_size;
+
+	/* first we must read the header, including any digests */
+	if (in->hdr_pos < ISCSI_HEADER_SIZE) {
+		*buf = &in->hdr[in->hdr_pos];
+		*len = ISCSI_HEADER_SIZE - in->hdr_pos;
+		return 0;
+	}
+
+	data_size = iscsi_get_pdu_data_size(&in->hdr[0]);
+	if (in->data_pos >= data_size) {
+		/* the data digest trails the padded data segment */
+		if (data_size > 0 && iscsi->data_digest != ISCSI_DATA_DIGEST_NONE
+		    && in->digest_pos < ISCSI_DIGEST_SIZE) {
+			*buf = &in->data_digest[in->digest_pos];
+			*len = ISCSI_DIGEST_SIZE - in->digest_pos;
+			return 0;
+		}
+		*buf = NULL;
+		*len = 0;
+		return 0;
+	}
+
+	if (in->data == NULL && in->task == NULL) {
+		in->task = iscsi_get_data_in_task(iscsi, in);
+	}
+	if (in->data == NULL && in->task == NULL) {
+		in->data = malloc(data_size);
+		if (in->data == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: failed to malloc iscsi_in_pdu->data(%d)", (int)data_size);
+			return -1;
+		}
+	}
+
+	if (in->task != NULL) {
+		uint32_t offset;
+		int dsl, available;
+
+		/* read straight into the application buffers and
+		 * put any padding in the scratch area
+		 */
+		dsl    = ntohl(*(uint32_t *)&in->hdr[4])&0x00ffffff;
+		offset = ntohl(*(uint32_t *)&in->hdr[40]);
+		if (in->data_pos < dsl) {
+			*buf = scsi_task_get_data_in_buffer(in->task,
+					offset + in->data_pos,
+					&available);
+			*len = dsl - in->data_pos;
+			if (*len > available) {
+				*len = available;
+			}
+		} else {
+			*buf = &in->pad[in->data_pos - dsl];
+			*len = data_size - in->data_pos;
+		}
+	} else {
+		*buf = &in->data[in->data_pos];
+		*len = data_size - in->data_pos;
+	}
+
+	return 0;
+}
+
+static uint32_t
+iscsi_get_digest(const unsigned char *digest)
+{
+	return digest[0] | (digest[1] << 8) | (digest[2] << 16)
+		| ((uint32_t)digest[3] << 24);
+}
+
+static int
+iscsi_verify_header_digest(struct iscsi_context *iscsi,
+			   struct iscsi_in_pdu *in)
+{
+	uint32_t crc;
+
+	if (iscsi->header_digest == ISCSI_HEADER_DIGEST_NONE) {
+		return 0;
+	}
+
+	crc = crc32c((char *)in->hdr, ISCSI_RAW_HEADER_SIZE);
+	if (crc != iscsi_get_digest(&in->hdr[ISCSI_RAW_HEADER_SIZE])) {
+		iscsi_set_error(iscsi, "header digest mismatch, got 0x%08x "
+				"expected 0x%08x",
+				iscsi_get_digest(&in->hdr[ISCSI_RAW_HEADER_SIZE]),
+				crc);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+iscsi_verify_data_digest(struct iscsi_context *iscsi,
+			 struct iscsi_in_pdu *in)
+{
+	uint32_t crc;
+
+	if (iscsi->data_digest == ISCSI_DATA_DIGEST_NONE
+	    || in->data_pos == 0) {
+		return 0;
+	}
+
+	crc = in->data_crc ^ 0xffffffff;
+	if (crc != iscsi_get_digest(in->data_digest)) {
+		iscsi_set_error(iscsi, "data digest mismatch for itt:0x%08x, "
+				"got 0x%08x expected 0x%08x",
+				ntohl(*(uint32_t *)&in->hdr[16]),
+				iscsi_get_digest(in->data_digest), crc);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+iscsi_process_inqueue(struct iscsi_context *iscsi)
+{
+	while (iscsi->inqueue != NULL) {
+		struct iscsi_in_pdu *in = iscsi->inqueue;
+
+		if (iscsi_process_pdu(iscsi, in) != 0) {
+			return -1;
+		}
+		DLIST_REMOVE(&iscsi->inqueue, &iscsi->inqueue_tail, in);
+		iscsi_free_iscsi_in_pdu(in);
+	}
+
+	return 0;
+}
+
+/*
+ * Find where the next bytes that arrive belong: in the pdu being received,
+ * or, once that is complete, in the next one. Every pdu that completes on
+ * the way is processed. *len is 0 if the connection was closed by one of
+ * the callbacks.
+ */
+static int
+iscsi_incoming_dest(struct iscsi_context *iscsi, struct iscsi_in_pdu **inp,
+		    unsigned char **buf, ssize_t *len)
 {
 	struct iscsi_in_pdu *in;
-	ssize_t data_size, count;
 
-	if (iscsi->incoming == NULL) {
-		iscsi->incoming = malloc(sizeof(struct iscsi_in_pdu));
+	while (iscsi->fd != -1) {
 		if (iscsi->incoming == NULL) {
-			iscsi_set_error(iscsi, "Out-of-memory: failed to malloc iscsi_in_pdu");
+			iscsi->incoming = malloc(sizeof(struct iscsi_in_pdu));
+			if (iscsi->incoming == NULL) {
+				iscsi_set_error(iscsi, "Out-of-memory: failed to malloc iscsi_in_pdu");
+				return -1;
+			}
+			bzero(iscsi->incoming, sizeof(struct iscsi_in_pdu));
+			iscsi->incoming->data_crc = 0xffffffff;
+		}
+		in = iscsi->incoming;
+
+		if (iscsi_in_pdu_dest(iscsi, in, buf, len) != 0) {
+			return -1;
+		}
+		if (*len != 0) {
+			*inp = in;
+			return 0;
+		}
+
+		/* we have the whole pdu */
+		if (iscsi_verify_data_digest(iscsi, in) != 0) {
+			return -1;
+		}
+		DLIST_ADD_END(&iscsi->inqueue, &iscsi->inqueue_tail, in);
+		iscsi->incoming = NULL;
+
+		if (iscsi_process_inqueue(iscsi) != 0) {
 			return -1;
 		}
-		bzero(iscsi->incoming, sizeof(struct iscsi_in_pdu));
 	}
-	in = iscsi->incoming;
 
-	/* first we must read the header, including any digests */
+	*inp = NULL;
+	*buf = NULL;
+	*len = 0;
+	return 0;
+}
+
+/*
+ * Account for count bytes that have been stored where iscsi_incoming_dest()
+ * said.
+ */
+static int
+iscsi_incoming_advance(struct iscsi_context *iscsi, struct iscsi_in_pdu *in,
+		       unsigned char *buf, ssize_t count)
+{
 	if (in->hdr_pos < ISCSI_HEADER_SIZE) {
-		count = read(iscsi->fd, &in->hdr[in->hdr_pos], ISCSI_HEADER_SIZE - in->hdr_pos);
-		if (count < 0) {
-			if (errno == EINTR) {
-				return 0;
-			}
-			iscsi_set_error(iscsi, "read from socket failed, "
-				"errno:%d", errno);
+		in->hdr_pos += count;
+		if (in->hdr_pos == ISCSI_HEADER_SIZE
+		    && iscsi_verify_header_digest(iscsi, in) != 0) {
+			return -1;
+		}
+	} else if (in->data_pos < iscsi_get_pdu_data_size(in->hdr)) {
+		/* digest the data while it is still in the cache */
+		if (iscsi->data_digest != ISCSI_DATA_DIGEST_NONE) {
+			in->data_crc = crc32c_update(in->data_crc, buf, count);
+		}
+		in->data_pos += count;
+	} else {
+		in->digest_pos += count;
+	}
+
+	return 0;
+}
+
+/*
+ * A task is about to go away while DATA-IN for it may be half way read
+ * straight into its buffers. The rest of that payload is read into a
+ * buffer of its own and dropped with the pdu, whose command is gone.
+ */
+void
+iscsi_incoming_release_task(struct iscsi_context *iscsi,
+			    struct scsi_task *task)
+{
+	if (task != NULL && iscsi->incoming != NULL
+	    && iscsi->incoming->task == task) {
+		iscsi->incoming->task = NULL;
+	}
+}
+
+/*
+ * Parse len bytes that were received on the connection.
+ */
+int
+iscsi_process_received(struct iscsi_context *iscsi, const unsigned char *data,
+		       ssize_t len)
+{
+	struct iscsi_in_pdu *in;
+	unsigned char *buf;
+	ssize_t count;
+
+	while (len > 0) {
+		if (iscsi_incoming_dest(iscsi, &in, &buf, &count) != 0) {
 			return -1;
 		}
 		if (count == 0) {
 			return 0;
 		}
-		in->hdr_pos += count;
+		if (count > len) {
+			count = len;
+		}
+		memcpy(buf, data, count);
+		if (iscsi_incoming_advance(iscsi, in, buf, count) != 0) {
+			return -1;
+		}
+		data += count;
+		len  -= count;
 	}
 
-	if (in->hdr_pos < ISCSI_HEADER_SIZE) {
-		/* we dont have the full header yet, so return */
-		return 0;
-	}
+	/* process the pdu that ended with the data */
+	return iscsi_incoming_dest(iscsi, &in, &buf, &count);
+}
 
-	data_size = iscsi_get_pdu_data_size(&in->hdr[0]);
-	if (data_size != 0) {
-		if (in->data == NULL) {
-			in->data = malloc(data_size);
-			if (in->data == NULL) {
-				iscsi_set_error(iscsi, "Out-of-memory: failed to malloc iscsi_in_pdu->data(%d)", (int)data_size);
-				return -1;
-			}
+/*
+ * Read everything that is available on the socket.
+ * Data is read into a large receive buffer and as many pdus as it holds
+ * are parsed out of it before the next read, so a burst of small replies
+ * is completed with a single read() call. When the receive buffer is
+ * empty and a large payload is outstanding, the payload is read straight
+ * into its destination instead.
+ */
+static int
+iscsi_read_from_socket(struct iscsi_context *iscsi)
+{
+	struct iscsi_in_pdu *in;
+	unsigned char *buf;
+	ssize_t len, count;
+
+	if (iscsi->rxbuf == NULL) {
+		iscsi->rxbuf = malloc(ISCSI_RX_BUFFER_SIZE);
+		if (iscsi->rxbuf == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: failed to malloc receive buffer");
+			return -1;
 		}
+		iscsi->rxbuf_pos = 0;
+		iscsi->rxbuf_len = 0;
+	}
 
-		count = read(iscsi->fd, &in->data[in->data_pos], data_size - in->data_pos);
-		if (count < 0) {
-			if (errno == EINTR) {
-				return 0;
-			}
-			iscsi_set_error(iscsi, "read from socket failed, "
-				"errno:%d", errno);
+	for (;;) {
+		if (iscsi_incoming_dest(iscsi, &in, &buf, &len) != 0) {
 			return -1;
 		}
-		if (count == 0) {
+		if (len == 0) {
 			return 0;
 		}
-		in->data_pos += count;
+
+		if (iscsi->rxbuf_pos < iscsi->rxbuf_len) {
+			count = iscsi->rxbuf_len - iscsi->rxbuf_pos;
+			if (count > len) {
+				count = len;
+			}
+			memcpy(buf, &iscsi->rxbuf[iscsi->rxbuf_pos], count);
+			iscsi->rxbuf_pos += count;
+		} else if (in->hdr_pos >= ISCSI_HEADER_SIZE
+			   && len >= ISCSI_RX_DIRECT_SIZE) {
+			count = read(iscsi->fd, buf, len);
+			if (count <= 0) {
+				break;
+			}
+		} else {
+			iscsi->rxbuf_pos = 0;
+			iscsi->rxbuf_len = 0;
+			count = read(iscsi->fd, iscsi->rxbuf,
+				     ISCSI_RX_BUFFER_SIZE);
+			if (count <= 0) {
+				break;
+			}
+			iscsi->rxbuf_len = count;
+			continue;
+		}
+
+		if (iscsi_incoming_advance(iscsi, in, buf, count) != 0) {
+			return -1;
+		}
 	}
 
-	if (in->data_pos < data_size) {
+	if (count == 0) {
+		iscsi_set_error(iscsi, "connection closed by the target");
+		return -1;
+	}
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
 		return 0;
 	}
+	iscsi_set_error(iscsi, "read from socket failed, errno:%d", errno);
+	return -1;
+}
 
-	SLIST_ADD_END(&iscsi->inqueue, in);
-	iscsi->incoming = NULL;
+/*
+ * Describe the part of the pdu that has not been written yet as an iovec:
+ * the header, any data in outdata, the task payload straight from the
+ * application buffers, the padding and finally the data digest.
+ * Returns the number of iovec entries used and the number of bytes
+ * they cover in *len.
+ */
+static int
+iscsi_pdu_to_iov(struct iscsi_pdu *pdu, struct iovec *iov, int max,
+		 ssize_t *len)
+{
+	static unsigned char zero_pad[4];
+	int niov = 0;
+	int pos = pdu->written;
+	int outsize, padsize;
+
+	*len = 0;
+
+	if (pos < pdu->hdr_size) {
+		iov[niov].iov_base = pdu->hdr + pos;
+		iov[niov].iov_len  = pdu->hdr_size - pos;
+		*len += iov[niov].iov_len;
+		niov++;
+		pos = pdu->hdr_size;
+	}
+	pos -= pdu->hdr_size;
 
+	outsize = (pdu->outdata.size + 3) & 0xfffffffc;
+	if (pos < outsize) {
+		if (niov == max) {
+			return niov;
+		}
+		iov[niov].iov_base = pdu->outdata.data + pos;
+		iov[niov].iov_len  = outsize - pos;
+		*len += iov[niov].iov_len;
+		niov++;
+		pos = outsize;
+	}
+	pos -= outsize;
 
-	while (iscsi->inqueue != NULL) {
-		struct iscsi_in_pdu *in = iscsi->inqueue;
+	while (niov < max && pos < pdu->payload_len) {
+		unsigned char *buf;
+		int available;
 
-		if (iscsi_process_pdu(iscsi, in) != 0) {
-			return -1;
+		buf = scsi_task_get_data_out_buffer(pdu->payload_task,
+				pdu->payload_offset + pos, &available);
+		if (buf == NULL) {
+			return niov;
 		}
-		SLIST_REMOVE(&iscsi->inqueue, in);
-		iscsi_free_iscsi_in_pdu(in);
+		if (available > pdu->payload_len - pos) {
+			available = pdu->payload_len - pos;
+		}
+		iov[niov].iov_base = buf;
+		iov[niov].iov_len  = available;
+		*len += available;
+		niov++;
+		pos += available;
 	}
+	if (pos < pdu->payload_len) {
+		return niov;
+	}
+	pos -= pdu->payload_len;
 
+	padsize = ((pdu->payload_len + 3) & 0xfffffffc) - pdu->payload_len;
+	if (pos < padsize) {
+		if (niov == max) {
+			return niov;
+		}
+		iov[niov].iov_base = &zero_pad[pos];
+		iov[niov].iov_len  = padsize - pos;
+		*len += iov[niov].iov_len;
+		niov++;
+		pos = padsize;
+	}
+	pos -= padsize;
 
-	return 0;
+	if (pos < pdu->data_digest_size) {
+		if (niov == max) {
+			return niov;
+		}
+		iov[niov].iov_base = &pdu->data_digest[pos];
+		iov[niov].iov_len  = pdu->data_digest_size - pos;
+		*len += iov[niov].iov_len;
+		niov++;
+	}
+
+	return niov;
+}
+
+static ssize_t
+iscsi_pdu_total_size(struct iscsi_pdu *pdu)
+{
+	return pdu->hdr_size
+		+ ((pdu->outdata.size + 3) & 0xfffffffc)
+		+ ((pdu->payload_len + 3) & 0xfffffffc)
+		+ pdu->data_digest_size;
+}
+
+/*
+ * Describe the head of the outqueue as an iovec, at most max_bytes bytes in
+ * at most max_iov buffers.
+ * Returns the number of iovec entries used and the number of bytes they
+ * cover in *bytes.
+ */
+int
+iscsi_outqueue_gather(struct iscsi_context *iscsi, struct iovec *iov,
+		      int max_iov, ssize_t max_bytes, ssize_t *bytes)
+{
+	struct iscsi_pdu *pdu;
+	ssize_t len;
+	int i, n, niov;
+
+	*bytes = 0;
+	niov   = 0;
+	for (pdu = iscsi->outqueue; pdu != NULL; pdu = pdu->next) {
+		if (niov >= max_iov || *bytes >= max_bytes) {
+			break;
+		}
+		n = iscsi_pdu_to_iov(pdu, &iov[niov], max_iov - niov, &len);
+		if (n == 0) {
+			break;
+		}
+		niov   += n;
+		*bytes += len;
+		if (pdu->written + len < iscsi_pdu_total_size(pdu)) {
+			/* out of iovecs in the middle of this pdu */
+			break;
+		}
+	}
+	if (niov == 0) {
+		iscsi_set_error(iscsi, "pdu payload is not covered "
+				"by the data-out buffers");
+		return -1;
+	}
+
+	/* trim the batch down to the byte limit */
+	for (i = 0, len = 0; i < niov; i++) {
+		if (len + (ssize_t)iov[i].iov_len >= max_bytes) {
+			iov[i].iov_len = max_bytes - len;
+			niov = i + 1;
+			break;
+		}
+		len += iov[i].iov_len;
+	}
+	if (*bytes > max_bytes) {
+		*bytes = max_bytes;
+	}
+
+	return niov;
 }
 
+/*
+ * The first count bytes of what iscsi_outqueue_gather() described have
+ * been sent.
+ */
+void
+iscsi_outqueue_written(struct iscsi_context *iscsi, ssize_t count)
+{
+	struct iscsi_pdu *pdu;
+
+	/* move every pdu that is now fully written to waitpdu,
+	 * or free it if no reply is expected.
+	 */
+	while ((pdu = iscsi->outqueue) != NULL && count > 0) {
+		ssize_t left = iscsi_pdu_total_size(pdu) - pdu->written;
+
+		if (count < left) {
+			pdu->written += count;
+			break;
+		}
+		count -= left;
+		pdu->written += left;
+		DLIST_REMOVE(&iscsi->outqueue, &iscsi->outqueue_tail, pdu);
+		iscsi->tx_pdus++;
+		if (pdu->flags & ISCSI_PDU_DELETE_WHEN_SENT) {
+			iscsi_free_pdu(iscsi, pdu);
+			continue;
+		}
+		iscsi_waitpdu_add(iscsi, pdu);
+	}
+}
+
+/*
+ * Write as much of the outqueue as the socket accepts.
+ * Consecutive pdus are gathered into a single sendmsg() call, up to
+ * tx_batch_bytes bytes in tx_batch_iov buffers.
+ */
 static int
 iscsi_write_to_socket(struct iscsi_context *iscsi)
 {
@@ -272,16 +757,36 @@ iscsi_write_to_socket(struct iscsi_context *iscsi)
 		return -1;
 	}
 
+	if (iscsi->tx_iov == NULL) {
+		iscsi->tx_iov = malloc(iscsi->tx_batch_iov
+				       * sizeof(struct iovec));
+		if (iscsi->tx_iov == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: failed to "
+					"malloc transmit iovec");
+			return -1;
+		}
+	}
+
 	while (iscsi->outqueue != NULL) {
-		ssize_t total;
+		struct msghdr msg;
+		ssize_t bytes;
+		int niov;
+
+		niov = iscsi_outqueue_gather(iscsi, iscsi->tx_iov,
+					     iscsi->tx_batch_iov,
+					     iscsi->tx_batch_bytes, &bytes);
+		if (niov < 0) {
+			return -1;
+		}
 
-		total = iscsi->outqueue->outdata.size;
-		total = (total + 3) & 0xfffffffc;
+		bzero(&msg, sizeof(msg));
+		msg.msg_iov    = iscsi->tx_iov;
+		msg.msg_iovlen = niov;
 
-		count = write(iscsi->fd,
-			      iscsi->outqueue->outdata.data
-			      + iscsi->outqueue->written,
-			      total - iscsi->outqueue->written);
+		/* a connection the target has closed is an error to
+		 * report, not a reason to kill the process with SIGPIPE
+		 */
+		count = sendmsg(iscsi->fd, &msg, MSG_NOSIGNAL);
 		if (count == -1) {
 			if (errno == EAGAIN || errno == EWOULDBLOCK) {
 				return 0;
@@ -290,56 +795,153 @@ iscsi_write_to_socket(struct iscsi_context *iscsi)
 					"socket :%d", errno);
 			return -1;
 		}
+		iscsi->tx_syscalls++;
 
-		iscsi->outqueue->written += count;
-		if (iscsi->outqueue->written == total) {
-			struct iscsi_pdu *pdu = iscsi->outqueue;
+		iscsi_outqueue_written(iscsi, count);
 
-			SLIST_REMOVE(&iscsi->outqueue, pdu);
-			SLIST_ADD_END(&iscsi->waitpdu, pdu);
+		if (count < bytes) {
+			/* the socket is full */
+			return 0;
 		}
 	}
 	return 0;
 }
 
+/*
+ * The connection has failed. Recover it if the reconnect policy allows,
+ * else tell the application.
+ */
+static int
+iscsi_connection_failed(struct iscsi_context *iscsi, int notify)
+{
+	if (iscsi->is_reconnecting) {
+		/* if we give up now the application must hear about it */
+		notify = 1;
+	}
+	if (iscsi_reconnect(iscsi) == 0) {
+		return 0;
+	}
+	if (notify && iscsi->socket_status_cb != NULL) {
+		iscsi_command_cb cb = iscsi->socket_status_cb;
+
+		/* the connection is lost, this is the last it hears of it */
+		iscsi->socket_status_cb = NULL;
+		cb(iscsi, SCSI_STATUS_ERROR, NULL, iscsi->connect_data);
+	}
+	return -1;
+}
+
 int
 iscsi_service(struct iscsi_context *iscsi, int revents)
 {
 	if (revents & POLLERR) {
 		iscsi_set_error(iscsi, "iscsi_service: POLLERR, "
 				"socket error.");
-		iscsi->socket_status_cb(iscsi, SCSI_STATUS_ERROR, NULL,
-					iscsi->connect_data);
-		return -1;
+		return iscsi_connection_failed(iscsi, 1);
 	}
 	if (revents & POLLHUP) {
 		iscsi_set_error(iscsi, "iscsi_service: POLLHUP, "
 				"socket error.");
-		iscsi->socket_status_cb(iscsi, SCSI_STATUS_ERROR, NULL,
-					iscsi->connect_data);
-		return -1;
+		return iscsi_connection_failed(iscsi, 1);
 	}
 
 	if (iscsi->is_connected == 0 && iscsi->fd != -1 && revents&POLLOUT) {
 		iscsi->is_connected = 1;
-		iscsi->socket_status_cb(iscsi, SCSI_STATUS_GOOD, NULL,
-					iscsi->connect_data);
-		return 0;
+		if (iscsi->want_uring) {
+			/* if we can not, read() and write() will do */
+			iscsi_uring_start(iscsi);
+		}
+		if (iscsi->socket_status_cb != NULL) {
+			iscsi->socket_status_cb(iscsi, SCSI_STATUS_GOOD, NULL,
+						iscsi->connect_data);
+		}
+	} else if (iscsi->uring != NULL) {
+		if (iscsi_uring_service(iscsi) != 0) {
+			return iscsi_connection_failed(iscsi, 0);
+		}
+	} else {
+		if (revents & POLLOUT && iscsi->outqueue != NULL) {
+			if (iscsi_write_to_socket(iscsi) != 0) {
+				return iscsi_connection_failed(iscsi, 0);
+			}
+		}
+		if (revents & POLLIN) {
+			if (iscsi_read_from_socket(iscsi) != 0) {
+				return iscsi_connection_failed(iscsi, 0);
+			}
+		}
 	}
 
-	if (revents & POLLOUT && iscsi->outqueue != NULL) {
-		if (iscsi_write_to_socket(iscsi) != 0) {
+	/* commands that have run out of time, on any connection of the
+	 * session
+	 */
+	iscsi_timeout_run(iscsi);
+	if (iscsi->timed_out) {
+		iscsi->timed_out = 0;
+		if (iscsi_connection_failed(iscsi, 0) != 0) {
+			iscsi_timeout_connection_lost(iscsi);
 			return -1;
 		}
+		return 0;
 	}
-	if (revents & POLLIN) {
-		if (iscsi_read_from_socket(iscsi) != 0)
-			return -1;
+
+	/* an attempt to reconnect that failed half way closes the socket,
+	 * the next one is scheduled once we are done with it.
+	 */
+	if (iscsi->is_reconnecting && iscsi->fd == -1) {
+		return iscsi_connection_failed(iscsi, 1);
 	}
 
 	return 0;
 }
 
+/*
+ * Compute the data digest over the data segment and its padding.
+ * Data in outdata has already been digested as it was added to the pdu,
+ * a task payload is digested here as it is never copied.
+ */
+static void
+iscsi_pdu_set_data_digest(struct iscsi_pdu *pdu)
+{
+	static unsigned char zero_pad[4];
+	uint32_t crc;
+	int dlen, pos;
+
+	dlen = pdu->outdata.size;
+	if (dlen + pdu->payload_len == 0) {
+		return;
+	}
+
+	crc = pdu->data_crc;
+	if (pdu->data_crc_len != dlen) {
+		crc = crc32c_update(0xffffffff, pdu->outdata.data, dlen);
+	}
+	for (pos = 0; pos < pdu->payload_len; ) {
+		unsigned char *buf;
+		int available;
+
+		buf = scsi_task_get_data_out_buffer(pdu->payload_task,
+				pdu->payload_offset + pos, &available);
+		if (buf == NULL) {
+			break;
+		}
+		if (available > pdu->payload_len - pos) {
+			available = pdu->payload_len - pos;
+		}
+		crc = crc32c_update(crc, buf, available);
+		pos += available;
+	}
+	dlen += pdu->payload_len;
+	crc = crc32c_update(crc, zero_pad, ((dlen + 3) & 0xfffffffc) - dlen);
+	crc ^= 0xffffffff;
+
+	pdu->data_digest[3] = (crc >> 24)&0xff;
+	pdu->data_digest[2] = (crc >> 16)&0xff;
+	pdu->data_digest[1] = (crc >>  8)&0xff;
+	pdu->data_digest[0] = (crc)      &0xff;
+	pdu->data_digest_size = ISCSI_DIGEST_SIZE;
+}
+
 int
 iscsi_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 {
@@ -348,25 +950,42 @@ iscsi_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 		return -1;
 	}
 
+	pdu->hdr_size = ISCSI_HEADER_SIZE;
 	if (iscsi->header_digest != ISCSI_HEADER_DIGEST_NONE) {
 		unsigned long crc;
 
-		if (pdu->outdata.size < ISCSI_RAW_HEADER_SIZE + 4) {
-			iscsi_set_error(iscsi, "PDU too small (%d) to contain header digest",
-					pdu->outdata.size);
+		crc = crc32c((char *)pdu->hdr, ISCSI_RAW_HEADER_SIZE);
+
+		pdu->hdr[ISCSI_RAW_HEADER_SIZE+3] = (crc >> 24)&0xff;
+		pdu->hdr[ISCSI_RAW_HEADER_SIZE+2] = (crc >> 16)&0xff;
+		pdu->hdr[ISCSI_RAW_HEADER_SIZE+1] = (crc >>  8)&0xff;
+		pdu->hdr[ISCSI_RAW_HEADER_SIZE+0] = (crc)      &0xff;
+	}
+
+	if (iscsi->data_digest != ISCSI_DATA_DIGEST_NONE) {
+		iscsi_pdu_set_data_digest(pdu);
+	}
+
+	/* anything but a SCSI command, whose timer runs from when it is
+	 * issued, is timed from here
+	 */
+	if (pdu->scsi_cbdata == NULL
+	    && !(pdu->flags & ISCSI_PDU_DELETE_WHEN_SENT)
+	    && ISCSI_SESSION(iscsi)->timeout > 0) {
+		if (iscsi_timeout_arm(iscsi, pdu,
+				      ISCSI_SESSION(iscsi)->timeout) != 0) {
 			return -1;
 		}
+	}
 
-		crc = crc32c((char *)pdu->outdata.data, ISCSI_RAW_HEADER_SIZE);
+	pdu->conn = iscsi;
+	DLIST_ADD_END(&iscsi->outqueue, &iscsi->outqueue_tail, pdu);
 
-		pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+3] = (crc >> 24)&0xff;
-		pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+2] = (crc >> 16)&0xff;
-		pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+1] = (crc >>  8)&0xff;
-		pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+0] = (crc)      &0xff;
+	/* the outqueue was empty, the event loop must now wait for POLLOUT */
+	if (iscsi->loop != NULL && iscsi->outqueue == pdu) {
+		iscsi_loop_update(iscsi, 1);
 	}
 
-	SLIST_ADD_END(&iscsi->outqueue, pdu);
-
 	return 0;
 }
 
@@ -0,0 +1,373 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Submitting SCSI commands from threads other than the one that services
+ * the context.
+ *
+ * Any number of threads push onto a list with compare and swap. The
+ * service thread takes the whole list at once with an exchange, so there
+ * is no ABA problem, and reverses it into the order of submission. Only
+ * the thread that finds the list empty writes to the eventfd that the
+ * service thread polls, so a burst of submissions costs one wake up.
+ *
+ * Completions go back the same way, through a completion queue that is
+ * serviced by the thread that wants to see them.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+struct iscsi_submission {
+	struct iscsi_submission *next;
+
+	int lun;
+	struct scsi_task *task;
+	struct iscsi_data data;
+	int has_data;
+	iscsi_command_cb cb;
+	void *private_data;
+
+	/* where the command completes, NULL for the service thread */
+	struct iscsi_completion_queue *cq;
+	struct iscsi_context *iscsi;
+	int status;
+	void *command_data;
+};
+
+struct iscsi_completion_queue {
+	struct iscsi_submit_queue queue;
+};
+
+static int
+iscsi_submit_queue_init(struct iscsi_submit_queue *q)
+{
+	q->head = NULL;
+#ifdef HAVE_SYS_EVENTFD_H
+	q->fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+#else
+	errno = ENOSYS;
+	q->fd = -1;
+#endif
+
+	return q->fd == -1 ? -1 : 0;
+}
+
+/*
+ * Push an entry onto the queue, from any thread.
+ */
+static void
+iscsi_submit_queue_push(struct iscsi_submit_queue *q,
+			struct iscsi_submission *sub)
+{
+	struct iscsi_submission *head;
+	uint64_t one = 1;
+
+	head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	do {
+		sub->next = head;
+	} while (!__atomic_compare_exchange_n(&q->head, &head, sub, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+
+	/* the consumer has been woken up already if the queue was not empty,
+	 * and the counter of an eventfd does not overflow in practice.
+	 */
+	if (head == NULL && write(q->fd, &one, sizeof(one)) == -1) {
+		return;
+	}
+}
+
+/*
+ * Take every entry off the queue, in the order they were pushed.
+ */
+static struct iscsi_submission *
+iscsi_submit_queue_take(struct iscsi_submit_queue *q)
+{
+	struct iscsi_submission *sub, *next, *list = NULL;
+	uint64_t count;
+
+	/* the wake up is cleared before the entries are taken, an entry that
+	 * is pushed after that finds the queue empty and wakes us up again.
+	 */
+	if (read(q->fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		return NULL;
+	}
+
+	sub = __atomic_exchange_n(&q->head, NULL, __ATOMIC_ACQUIRE);
+	while (sub != NULL) {
+		next      = sub->next;
+		sub->next = list;
+		list      = sub;
+		sub       = next;
+	}
+
+	return list;
+}
+
+/*
+ * Complete a command, on the service thread or by handing it to its
+ * completion queue. The task is freed after the callback, as it is for
+ * iscsi_scsi_command_async().
+ */
+static void
+iscsi_submission_complete(struct iscsi_context *iscsi,
+			  struct iscsi_submission *sub, int status,
+			  void *command_data)
+{
+	sub->iscsi        = iscsi;
+	sub->status       = status;
+	sub->command_data = command_data;
+
+	if (sub->cq != NULL) {
+		iscsi_submit_queue_push(&sub->cq->queue, sub);
+		return;
+	}
+
+	sub->cb(iscsi, status, command_data, sub->private_data);
+	if (sub->task != NULL) {
+		scsi_free_scsi_task(sub->task);
+	}
+	free(sub);
+}
+
+static void
+iscsi_submission_cb(struct iscsi_context *iscsi, int status,
+		    void *command_data, void *private_data)
+{
+	struct iscsi_submission *sub = private_data;
+
+	/* the pdu is recycled when we return, the task is freed with the
+	 * submission instead so that it can be handed to another thread.
+	 */
+	iscsi_cbdata_steal_scsi_task(sub->task);
+	iscsi_submission_complete(iscsi, sub, status, command_data);
+}
+
+int
+iscsi_set_submit_queue(struct iscsi_context *iscsi, int enable)
+{
+	struct iscsi_submit_queue *q;
+	struct iscsi_submission *sub, *next;
+
+	iscsi = ISCSI_SESSION(iscsi);
+
+	if (enable) {
+		if (iscsi->submit_queue != NULL) {
+			return 0;
+		}
+		q = malloc(sizeof(struct iscsi_submit_queue));
+		if (q == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: Failed to "
+					"allocate submit queue.");
+			return -1;
+		}
+		if (iscsi_submit_queue_init(q) != 0) {
+			iscsi_set_error(iscsi, "Failed to create eventfd for "
+					"the submit queue. Errno:%d", errno);
+			free(q);
+			return -1;
+		}
+		iscsi->submit_queue = q;
+		if (iscsi->loop != NULL) {
+			iscsi_loop_watch_submit_queue(iscsi, 1);
+		}
+		return 0;
+	}
+
+	q = iscsi->submit_queue;
+	if (q == NULL) {
+		return 0;
+	}
+	if (iscsi->loop != NULL) {
+		iscsi_loop_watch_submit_queue(iscsi, 0);
+	}
+	iscsi->submit_queue = NULL;
+
+	/* commands that were submitted but never sent */
+	for (sub = iscsi_submit_queue_take(q); sub; sub = next) {
+		next = sub->next;
+		iscsi_submission_complete(iscsi, sub, SCSI_STATUS_CANCELLED,
+					  NULL);
+	}
+	close(q->fd);
+	free(q);
+
+	return 0;
+}
+
+int
+iscsi_get_submit_fd(struct iscsi_context *iscsi)
+{
+	iscsi = ISCSI_SESSION(iscsi);
+
+	if (iscsi->submit_queue == NULL) {
+		return -1;
+	}
+	return iscsi->submit_queue->fd;
+}
+
+int
+iscsi_scsi_command_submit(struct iscsi_context *iscsi, int lun,
+			  struct scsi_task *task, iscsi_command_cb cb,
+			  struct iscsi_data *data, void *private_data,
+			  struct iscsi_completion_queue *cq)
+{
+	struct iscsi_submit_queue *q;
+	struct iscsi_submission *sub;
+
+	/* no iscsi_set_error() here, we are not on the service thread */
+	q = ISCSI_SESSION(iscsi)->submit_queue;
+	if (q == NULL) {
+		scsi_free_scsi_task(task);
+		errno = EINVAL;
+		return -1;
+	}
+
+	sub = malloc(sizeof(struct iscsi_submission));
+	if (sub == NULL) {
+		scsi_free_scsi_task(task);
+		errno = ENOMEM;
+		return -1;
+	}
+	bzero(sub, sizeof(struct iscsi_submission));
+
+	sub->lun          = lun;
+	sub->task         = task;
+	sub->cb           = cb;
+	sub->private_data = private_data;
+	sub->cq           = cq;
+	if (data != NULL) {
+		sub->data     = *data;
+		sub->has_data = 1;
+	}
+
+	iscsi_submit_queue_push(q, sub);
+
+	return 0;
+}
+
+int
+iscsi_service_submissions(struct iscsi_context *iscsi)
+{
+	struct iscsi_submission *sub, *next;
+	int count = 0;
+
+	iscsi = ISCSI_SESSION(iscsi);
+
+	if (iscsi->submit_queue == NULL) {
+		iscsi_set_error(iscsi, "Context has no submit queue.");
+		return -1;
+	}
+
+	/* the whole batch goes into the outqueue before anything is written,
+	 * so it leaves in as few system calls as the connection allows.
+	 */
+	sub = iscsi_submit_queue_take(iscsi->submit_queue);
+	for (; sub; sub = next) {
+		next = sub->next;
+		count++;
+
+		if (iscsi_scsi_command_async(iscsi, sub->lun, sub->task,
+					     iscsi_submission_cb,
+					     sub->has_data ? &sub->data : NULL,
+					     sub) != 0) {
+			/* the task has been freed already */
+			sub->task = NULL;
+			iscsi_submission_complete(iscsi, sub,
+						  SCSI_STATUS_ERROR, NULL);
+		}
+	}
+
+	return count;
+}
+
+struct iscsi_completion_queue *
+iscsi_create_completion_queue(void)
+{
+	struct iscsi_completion_queue *cq;
+
+	cq = malloc(sizeof(struct iscsi_completion_queue));
+	if (cq == NULL) {
+		return NULL;
+	}
+
+	if (iscsi_submit_queue_init(&cq->queue) != 0) {
+		free(cq);
+		return NULL;
+	}
+
+	return cq;
+}
+
+void
+iscsi_destroy_completion_queue(struct iscsi_completion_queue *cq)
+{
+	struct iscsi_submission *sub, *next;
+
+	if (cq == NULL) {
+		return;
+	}
+
+	/* completions that were never serviced */
+	for (sub = iscsi_submit_queue_take(&cq->queue); sub; sub = next) {
+		next = sub->next;
+		if (sub->task != NULL) {
+			scsi_free_scsi_task(sub->task);
+		}
+		free(sub);
+	}
+	close(cq->queue.fd);
+	free(cq);
+}
+
+int
+iscsi_completion_queue_get_fd(struct iscsi_completion_queue *cq)
+{
+	return cq->queue.fd;
+}
+
+int
+iscsi_completion_queue_service(struct iscsi_completion_queue *cq)
+{
+	struct iscsi_submission *sub, *next;
+	int count = 0;
+
+	for (sub = iscsi_submit_queue_take(&cq->queue); sub; sub = next) {
+		next = sub->next;
+		count++;
+
+		sub->cb(sub->iscsi, sub->status, sub->command_data,
+			sub->private_data);
+		if (sub->task != NULL) {
+			scsi_free_scsi_task(sub->task);
+		}
+		free(sub);
+	}
+
+	return count;
+}
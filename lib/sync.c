@@ -33,24 +33,69 @@ struct iscsi_sync_state {
        int status;
 };
 
+/*
+ * Services every connection of the session, a command may have been sent on
+ * any of them.
+ */
 static void
 event_loop(struct iscsi_context *iscsi, struct scsi_sync_state *state)
 {
-	struct pollfd pfd;
+	struct pollfd pfd[ISCSI_OFFER_MAX_CONNECTIONS + 1];
+	struct iscsi_context *conns[ISCSI_OFFER_MAX_CONNECTIONS + 1];
+	struct iscsi_context *conn;
+	int i, count, ret;
 
 	while (state->finished == 0) {
-		pfd.fd = iscsi_get_fd(iscsi);
-		pfd.events = iscsi_which_events(iscsi);
+		count = 0;
+		for (conn = ISCSI_SESSION(iscsi)->connections;
+		     conn && count < ISCSI_OFFER_MAX_CONNECTIONS;
+		     conn = conn->next_connection) {
+			if (iscsi_get_fd(conn) == -1) {
+				continue;
+			}
+			conns[count]      = conn;
+			pfd[count].fd     = iscsi_get_fd(conn);
+			pfd[count].events = iscsi_which_events(conn);
+			count++;
+		}
+		/* other threads may keep submitting while we wait */
+		if (iscsi_get_submit_fd(iscsi) != -1) {
+			conns[count]      = NULL;
+			pfd[count].fd     = iscsi_get_submit_fd(iscsi);
+			pfd[count].events = POLLIN;
+			count++;
+		}
 
-		if (poll(&pfd, 1, -1) < 0) {
+		ret = poll(pfd, count, iscsi_next_timeout_ms(iscsi));
+		if (ret < 0) {
 			iscsi_set_error(iscsi, "Poll failed");
 			return;
 		}
-		if (iscsi_service(iscsi, pfd.revents) < 0) {
-			iscsi_set_error(iscsi,
-					"iscsi_service failed with : %s",
-					iscsi_get_error(iscsi));
-			return;
+		if (ret == 0) {
+			/* a command has timed out */
+			conn = ISCSI_SESSION(iscsi);
+			if (iscsi_service(conn, 0) < 0) {
+				iscsi_set_error(iscsi,
+						"iscsi_service failed with : %s",
+						iscsi_get_error(conn));
+				return;
+			}
+			continue;
+		}
+		for (i = 0; i < count; i++) {
+			if (pfd[i].revents == 0) {
+				continue;
+			}
+			if (conns[i] == NULL) {
+				iscsi_service_submissions(iscsi);
+				continue;
+			}
+			if (iscsi_service(conns[i], pfd[i].revents) < 0) {
+				iscsi_set_error(iscsi,
+						"iscsi_service failed with : %s",
+						iscsi_get_error(conns[i]));
+				return;
+			}
 		}
 	}
 }
@@ -85,6 +130,12 @@ iscsi_connect_sync(struct iscsi_context *iscsi, const char *portal)
 
 	event_loop(iscsi, (struct scsi_sync_state *)&state);
 
+	/* state goes away with this stack frame, a later failure of the
+	 * connection has no one to tell
+	 */
+	iscsi->socket_status_cb = NULL;
+	iscsi->connect_data     = NULL;
+
 	return state.status;
 }
 
@@ -106,6 +157,10 @@ iscsi_full_connect_sync(struct iscsi_context *iscsi,
 
 	event_loop(iscsi, (struct scsi_sync_state *)&state);
 
+	/* as for iscsi_connect_sync() */
+	iscsi->socket_status_cb = NULL;
+	iscsi->connect_data     = NULL;
+
 	return state.status;
 }
 
@@ -260,6 +315,212 @@ iscsi_synchronizecache10_sync(struct iscsi_context *iscsi, int lun, int lba,
 	return state.task;
 }
 
+struct scsi_task *
+iscsi_compareandwrite_sync(struct iscsi_context *iscsi, int lun,
+			   unsigned char *verify_data,
+			   unsigned char *write_data, int datalen,
+			   uint64_t lba, int fua, int blocksize)
+{
+	struct scsi_sync_state state;
+
+	bzero(&state, sizeof(state));
+
+	if (iscsi_compareandwrite_async(iscsi, lun, verify_data, write_data,
+					datalen, lba, fua, blocksize,
+					scsi_sync_cb, &state) != 0) {
+		iscsi_set_error(iscsi,
+				"Failed to send CompareAndWrite command");
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
+struct scsi_task *
+iscsi_extended_copy_sync(struct iscsi_context *iscsi, int lun, int list_id,
+			 struct scsi_copy_target *targets, int num_targets,
+			 struct scsi_copy_segment *segments,
+			 int num_segments)
+{
+	struct scsi_sync_state state;
+
+	bzero(&state, sizeof(state));
+
+	if (iscsi_extended_copy_async(iscsi, lun, list_id, targets,
+				      num_targets, segments, num_segments,
+				      scsi_sync_cb, &state) != 0) {
+		iscsi_set_error(iscsi,
+				"Failed to send ExtendedCopy command");
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
+struct scsi_task *
+iscsi_receive_copy_results_sync(struct iscsi_context *iscsi, int lun, int sa,
+				int list_id, int alloc_len)
+{
+	struct scsi_sync_state state;
+
+	bzero(&state, sizeof(state));
+
+	if (iscsi_receive_copy_results_async(iscsi, lun, sa, list_id,
+					     alloc_len, scsi_sync_cb,
+					     &state) != 0) {
+		iscsi_set_error(iscsi,
+				"Failed to send ReceiveCopyResults command");
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
+struct scsi_task *
+iscsi_report_target_port_groups_sync(struct iscsi_context *iscsi, int lun,
+				     int alloc_len)
+{
+	struct scsi_sync_state state;
+
+	bzero(&state, sizeof(state));
+
+	if (iscsi_report_target_port_groups_async(iscsi, lun, alloc_len,
+						  scsi_sync_cb, &state) != 0) {
+		iscsi_set_error(iscsi,
+				"Failed to send ReportTargetPortGroups command");
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
+struct scsi_task *
+iscsi_unmap_sync(struct iscsi_context *iscsi, int lun, int anchor,
+		 struct unmap_list *list, int list_len)
+{
+	struct scsi_sync_state state;
+
+	bzero(&state, sizeof(state));
+
+	if (iscsi_unmap_async(iscsi, lun, anchor, list, list_len,
+			      scsi_sync_cb, &state) != 0) {
+		iscsi_set_error(iscsi, "Failed to send Unmap command");
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
+struct scsi_task *
+iscsi_writesame10_sync(struct iscsi_context *iscsi, int lun,
+		       unsigned char *data, int datalen, int lba,
+		       int num_blocks, int anchor, int unmap)
+{
+	struct scsi_sync_state state;
+
+	bzero(&state, sizeof(state));
+
+	if (iscsi_writesame10_async(iscsi, lun, data, datalen, lba,
+				    num_blocks, anchor, unmap,
+				    scsi_sync_cb, &state) != 0) {
+		iscsi_set_error(iscsi, "Failed to send WriteSame10 command");
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
+struct scsi_task *
+iscsi_writesame16_sync(struct iscsi_context *iscsi, int lun,
+		       unsigned char *data, int datalen, uint64_t lba,
+		       uint64_t num_blocks, int anchor, int unmap)
+{
+	struct scsi_sync_state state;
+
+	bzero(&state, sizeof(state));
+
+	if (iscsi_writesame16_async(iscsi, lun, data, datalen, lba,
+				    num_blocks, anchor, unmap,
+				    scsi_sync_cb, &state) != 0) {
+		iscsi_set_error(iscsi, "Failed to send WriteSame16 command");
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
+struct scsi_task *
+iscsi_readcapacity16_sync(struct iscsi_context *iscsi, int lun)
+{
+	struct scsi_sync_state state;
+
+	bzero(&state, sizeof(state));
+
+	if (iscsi_readcapacity16_async(iscsi, lun,
+				       scsi_sync_cb, &state) != 0) {
+		iscsi_set_error(iscsi,
+				"Failed to send ReadCapacity16 command");
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
+struct scsi_task *
+iscsi_read16_sync(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		  int datalen, int blocksize)
+{
+	struct scsi_sync_state state;
+
+	bzero(&state, sizeof(state));
+
+	if (iscsi_read16_async(iscsi, lun, lba, datalen, blocksize,
+			       scsi_sync_cb, &state) != 0) {
+		iscsi_set_error(iscsi, "Failed to send Read16 command");
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
+struct scsi_task *
+iscsi_write16_sync(struct iscsi_context *iscsi, int lun, unsigned char *data,
+		   int datalen, uint64_t lba, int fua, int fuanv,
+		   int blocksize)
+{
+	struct scsi_sync_state state;
+
+	bzero(&state, sizeof(state));
+
+	if (iscsi_write16_async(iscsi, lun, data, datalen, lba, fua, fuanv,
+				blocksize, scsi_sync_cb, &state) != 0) {
+		iscsi_set_error(iscsi, "Failed to send Write16 command");
+		return NULL;
+	}
+
+	event_loop(iscsi, &state);
+
+	return state.task;
+}
+
 struct scsi_task *
 iscsi_scsi_command_sync(struct iscsi_context *iscsi, int lun,
 			struct scsi_task *task, struct iscsi_data *data)
@@ -0,0 +1,206 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <arpa/inet.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+int
+iscsi_task_mgmt_async(struct iscsi_context *iscsi, int lun,
+		      enum iscsi_task_mgmt_funcs function,
+		      uint32_t ritt, uint32_t rcmdsn,
+		      iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_pdu *pdu;
+
+	if (iscsi->is_loggedin == 0) {
+		iscsi_set_error(iscsi, "trying to send task management "
+				"request while not logged in");
+		return -1;
+	}
+	if (iscsi->session_type != ISCSI_SESSION_NORMAL) {
+		iscsi_set_error(iscsi, "Trying to send task management "
+				"request on discovery session.");
+		return -1;
+	}
+
+	pdu = iscsi_allocate_pdu(iscsi, ISCSI_PDU_SCSI_TASK_MANAGEMENT_REQUEST,
+				 ISCSI_PDU_SCSI_TASK_MANAGEMENT_RESPONSE);
+	if (pdu == NULL) {
+		iscsi_set_error(iscsi, "Failed to allocate task management "
+				"pdu");
+		return -1;
+	}
+
+	/* immediate flag */
+	iscsi_pdu_set_immediate(pdu);
+
+	/* flags */
+	iscsi_pdu_set_pduflags(pdu, 0x80 | function);
+
+	/* lun */
+	iscsi_pdu_set_lun(pdu, lun);
+
+	/* referenced task tag */
+	*(uint32_t *)&pdu->hdr[20] = htonl(ritt);
+
+	/* cmdsn is not increased if Immediate delivery*/
+	iscsi_pdu_set_cmdsn(pdu, ISCSI_SESSION(iscsi)->cmdsn);
+	pdu->cmdsn = ISCSI_SESSION(iscsi)->cmdsn;
+
+	/* exp statsn */
+	iscsi_pdu_set_expstatsn(pdu, iscsi->statsn+1);
+
+	/* refcmdsn */
+	*(uint32_t *)&pdu->hdr[32] = htonl(rcmdsn);
+
+	pdu->callback     = cb;
+	pdu->private_data = private_data;
+
+	if (iscsi_queue_pdu(iscsi, pdu) != 0) {
+		iscsi_set_error(iscsi, "failed to queue iscsi task management "
+				"pdu");
+		iscsi_free_pdu(iscsi, pdu);
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+iscsi_task_mgmt_abort_task_async(struct iscsi_context *iscsi,
+				 struct scsi_task *task,
+				 iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_pdu *pdu;
+
+	pdu = iscsi_task_pdu(task);
+	if (pdu == NULL || pdu->conn == NULL) {
+		iscsi_set_error(iscsi, "Task has not been sent to the "
+				"target");
+		return -1;
+	}
+
+	/* the task is allegiant to the connection it was sent on,
+	 * iscsi_pdu_set_lun() only sets the second byte
+	 */
+	return iscsi_task_mgmt_async(pdu->conn, pdu->hdr[9],
+				     ISCSI_TM_ABORT_TASK, pdu->itt,
+				     pdu->cmdsn, cb, private_data);
+}
+
+/*
+ * Returns a command on the connection that was sent before the task
+ * management request and that the request applies to.
+ */
+static struct iscsi_pdu *
+iscsi_task_mgmt_find_affected(struct iscsi_context *conn,
+			      struct iscsi_pdu *pdu)
+{
+	struct iscsi_pdu *cmd;
+	int function = pdu->hdr[1] & 0x7f;
+	uint32_t i;
+
+	for (i = 0; i < conn->waitpdu_size; i++) {
+		for (cmd = conn->waitpdu[i]; cmd; cmd = cmd->hash_next) {
+			if (cmd->scsi_cbdata == NULL
+			    || (int32_t)(cmd->cmdsn - pdu->cmdsn) >= 0) {
+				continue;
+			}
+			if (function == ISCSI_TM_TARGET_WARM_RESET
+			    || function == ISCSI_TM_TARGET_COLD_RESET
+			    || cmd->hdr[9] == pdu->hdr[9]) {
+				return cmd;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * The target sends no reply for a task it has aborted. Complete the
+ * commands that the request applies to, on every connection of the
+ * session.
+ */
+static void
+iscsi_task_mgmt_terminate(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	struct iscsi_context *conn;
+	struct iscsi_pdu *cmd;
+
+	conn = ISCSI_SESSION(iscsi)->connections;
+	for (; conn; conn = conn->next_connection) {
+		while ((cmd = iscsi_task_mgmt_find_affected(conn, pdu))
+		       != NULL) {
+			iscsi_terminate_pdu(conn, cmd,
+					    cmd->flags & ISCSI_PDU_TIMED_OUT
+					    ? SCSI_STATUS_TIMEOUT
+					    : SCSI_STATUS_CANCELLED);
+		}
+	}
+}
+
+int
+iscsi_process_task_mgmt_reply(struct iscsi_context *iscsi,
+			      struct iscsi_pdu *pdu, struct iscsi_in_pdu *in)
+{
+	struct iscsi_pdu *cmd;
+	uint32_t response;
+	int statsn;
+
+	statsn = ntohl(*(uint32_t *)&in->hdr[24]);
+	if (statsn > (int)iscsi->statsn) {
+		iscsi->statsn = statsn;
+	}
+
+	response = in->hdr[2];
+
+	switch (pdu->hdr[1] & 0x7f) {
+	case ISCSI_TM_ABORT_TASK:
+		if (response != ISCSI_TMR_FUNC_COMPLETE
+		    && response != ISCSI_TMR_TASK_DOES_NOT_EXIST) {
+			break;
+		}
+		cmd = iscsi_find_waitpdu(iscsi,
+					 ntohl(*(uint32_t *)&pdu->hdr[20]));
+		if (cmd != NULL && cmd->scsi_cbdata != NULL) {
+			iscsi_set_error(iscsi, "SCSI command aborted");
+			iscsi_terminate_pdu(iscsi, cmd,
+					    cmd->flags & ISCSI_PDU_TIMED_OUT
+					    ? SCSI_STATUS_TIMEOUT
+					    : SCSI_STATUS_CANCELLED);
+		}
+		break;
+	case ISCSI_TM_ABORT_TASK_SET:
+	case ISCSI_TM_CLEAR_TASK_SET:
+	case ISCSI_TM_LUN_RESET:
+	case ISCSI_TM_TARGET_WARM_RESET:
+	case ISCSI_TM_TARGET_COLD_RESET:
+		if (response == ISCSI_TMR_FUNC_COMPLETE) {
+			iscsi_set_error(iscsi, "SCSI command aborted");
+			iscsi_task_mgmt_terminate(iscsi, pdu);
+		}
+		break;
+	}
+
+	pdu->callback(iscsi, SCSI_STATUS_GOOD, &response, pdu->private_data);
+
+	return 0;
+}
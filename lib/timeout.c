@@ -0,0 +1,519 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Command timeouts.
+ *
+ * Every pdu that waits for a reply has a timer in the wheel of its session,
+ * and so does the next attempt to reconnect.
+ * The wheel is run from iscsi_service(), and iscsi_next_timeout_ms() tells
+ * the application how long it may wait for events before it has to call
+ * iscsi_service() again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <limits.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+uint64_t
+iscsi_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * How many slots after from the first slot that is in use is, wrapping
+ * around. in_use must not be 0.
+ */
+static int
+iscsi_timer_slot_distance(uint64_t in_use, int from)
+{
+	if (from != 0) {
+		in_use = (in_use >> from)
+			| (in_use << (ISCSI_TIMER_SLOTS - from));
+	}
+
+	return __builtin_ctzll(in_use);
+}
+
+void
+iscsi_timer_add(struct iscsi_timer_wheel *wheel, struct iscsi_timer *timer,
+		uint64_t expires)
+{
+	uint64_t pos, delta;
+	int level, shift;
+
+	timer->expires = expires;
+
+	/* a timer that is due already goes in the current slot */
+	pos   = expires < wheel->now ? wheel->now : expires;
+	delta = pos - wheel->now;
+	for (level = 0; level < ISCSI_TIMER_LEVELS - 1; level++) {
+		if (delta < 1ULL << (ISCSI_TIMER_SLOT_BITS * (level + 1))) {
+			break;
+		}
+	}
+	/* beyond the range of the wheel, park it in the last slot and place
+	 * it again when that is reached
+	 */
+	if (delta >= 1ULL << (ISCSI_TIMER_SLOT_BITS * ISCSI_TIMER_LEVELS)) {
+		pos = wheel->now
+			+ (1ULL << (ISCSI_TIMER_SLOT_BITS * ISCSI_TIMER_LEVELS))
+			- 1;
+	}
+	shift = ISCSI_TIMER_SLOT_BITS * level;
+
+	timer->level = level;
+	timer->slot  = (pos >> shift) & (ISCSI_TIMER_SLOTS - 1);
+	DLIST_ADD_END(&wheel->slots[level][timer->slot],
+		      &wheel->slots_tail[level][timer->slot], timer);
+	wheel->in_use[level] |= 1ULL << timer->slot;
+	wheel->count++;
+}
+
+void
+iscsi_timer_remove(struct iscsi_timer_wheel *wheel, struct iscsi_timer *timer)
+{
+	int level = timer->level;
+	int slot  = timer->slot;
+
+	if (level == -1) {
+		return;
+	}
+
+	DLIST_REMOVE(&wheel->slots[level][slot],
+		     &wheel->slots_tail[level][slot], timer);
+	if (wheel->slots[level][slot] == NULL) {
+		wheel->in_use[level] &= ~(1ULL << slot);
+	}
+	timer->level = -1;
+	wheel->count--;
+}
+
+/*
+ * Returns the first tick at which the wheel has something to do: expire
+ * a timer in level 0 or move the timers of a slot of a higher level down.
+ */
+uint64_t
+iscsi_timer_next_tick(struct iscsi_timer_wheel *wheel)
+{
+	uint64_t next = UINT64_MAX, tick, base;
+	int level, shift, slot;
+
+	if (wheel->in_use[0] != 0) {
+		slot = wheel->now & (ISCSI_TIMER_SLOTS - 1);
+		if (wheel->in_use[0] & (1ULL << slot)) {
+			return wheel->now;
+		}
+		next = wheel->now + 1
+			+ iscsi_timer_slot_distance(wheel->in_use[0],
+				(slot + 1) & (ISCSI_TIMER_SLOTS - 1));
+	}
+
+	for (level = 1; level < ISCSI_TIMER_LEVELS; level++) {
+		if (wheel->in_use[level] == 0) {
+			continue;
+		}
+		shift = ISCSI_TIMER_SLOT_BITS * level;
+		base  = wheel->now >> shift;
+		slot  = base & (ISCSI_TIMER_SLOTS - 1);
+		tick  = (base + 1
+			 + iscsi_timer_slot_distance(wheel->in_use[level],
+				(slot + 1) & (ISCSI_TIMER_SLOTS - 1))) << shift;
+		if (tick < next) {
+			next = tick;
+		}
+	}
+
+	return next;
+}
+
+/*
+ * Returns a timer that is due at tick now, after taking it out of the
+ * wheel, or NULL if there are none left. The wheel skips ticks that have
+ * nothing to do, so a wheel that has been idle for long catches up in a
+ * few steps.
+ */
+struct iscsi_timer *
+iscsi_timer_expire_next(struct iscsi_timer_wheel *wheel, uint64_t now)
+{
+	struct iscsi_timer *timer;
+	uint64_t next;
+	int level, shift, slot;
+
+	for (;;) {
+		slot = wheel->now & (ISCSI_TIMER_SLOTS - 1);
+		if (wheel->in_use[0] & (1ULL << slot)) {
+			timer = wheel->slots[0][slot];
+			iscsi_timer_remove(wheel, timer);
+			return timer;
+		}
+		if (wheel->now >= now) {
+			return NULL;
+		}
+
+		next = iscsi_timer_next_tick(wheel);
+		if (next > now) {
+			wheel->now = now;
+			return NULL;
+		}
+		wheel->now = next;
+
+		/* move the timers of the slots whose time has come down to
+		 * where they belong now
+		 */
+		for (level = 1; level < ISCSI_TIMER_LEVELS; level++) {
+			shift = ISCSI_TIMER_SLOT_BITS * level;
+			if (next & ((1ULL << shift) - 1)) {
+				break;
+			}
+			slot = (next >> shift) & (ISCSI_TIMER_SLOTS - 1);
+			while ((timer = wheel->slots[level][slot]) != NULL) {
+				iscsi_timer_remove(wheel, timer);
+				iscsi_timer_add(wheel, timer, timer->expires);
+			}
+		}
+	}
+}
+
+static struct iscsi_pdu *
+iscsi_timer_pdu(struct iscsi_timer *timer)
+{
+	return (struct iscsi_pdu *)((char *)timer
+				    - offsetof(struct iscsi_pdu, timer));
+}
+
+/*
+ * Make sure the session has a wheel that is up to date with now, before a
+ * timer is added to it.
+ */
+static int
+iscsi_timer_wheel_prepare(struct iscsi_context *iscsi, uint64_t now)
+{
+	struct iscsi_context *session = ISCSI_SESSION(iscsi);
+
+	if (session->timers == NULL) {
+		session->timers = malloc(sizeof(struct iscsi_timer_wheel));
+		if (session->timers == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: failed to "
+					"allocate timer wheel");
+			return -1;
+		}
+		bzero(session->timers, sizeof(struct iscsi_timer_wheel));
+	}
+
+	if (session->timers->count == 0) {
+		/* nothing to miss, skip the ticks the wheel has been idle */
+		session->timers->now = now / ISCSI_TIMER_TICK_MS;
+	}
+
+	return 0;
+}
+
+/*
+ * Start the timer of a pdu, timeout milliseconds from now.
+ */
+int
+iscsi_timeout_arm(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		  int timeout)
+{
+	uint64_t now;
+
+	now = iscsi_time_ms();
+	if (iscsi_timer_wheel_prepare(iscsi, now) != 0) {
+		return -1;
+	}
+
+	iscsi_timeout_arm_at(iscsi, pdu, (now + timeout + ISCSI_TIMER_TICK_MS - 1)
+			     / ISCSI_TIMER_TICK_MS);
+
+	return 0;
+}
+
+/*
+ * Start, or restart, the timer of a pdu to expire at a tick.
+ * The wheel of the session must exist.
+ */
+void
+iscsi_timeout_arm_at(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		     uint64_t expires)
+{
+	struct iscsi_context *session = ISCSI_SESSION(iscsi);
+
+	iscsi_timer_remove(session->timers, &pdu->timer);
+	iscsi_timer_add(session->timers, &pdu->timer, expires);
+
+	if (session->loop != NULL) {
+		iscsi_loop_timer_armed(session, expires);
+	}
+}
+
+void
+iscsi_timeout_disarm(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	if (pdu->timer.level != -1) {
+		iscsi_timer_remove(ISCSI_SESSION(iscsi)->timers, &pdu->timer);
+	}
+}
+
+/*
+ * Start the timer of the next attempt to reconnect, delay milliseconds
+ * from now.
+ */
+int
+iscsi_timeout_arm_reconnect(struct iscsi_context *iscsi, int delay)
+{
+	uint64_t now, expires;
+
+	now = iscsi_time_ms();
+	if (iscsi_timer_wheel_prepare(iscsi, now) != 0) {
+		return -1;
+	}
+
+	expires = (now + delay + ISCSI_TIMER_TICK_MS - 1) / ISCSI_TIMER_TICK_MS;
+	iscsi_timer_remove(iscsi->timers, &iscsi->reconnect_timer);
+	iscsi_timer_add(iscsi->timers, &iscsi->reconnect_timer, expires);
+
+	if (iscsi->loop != NULL) {
+		iscsi_loop_timer_armed(iscsi, expires);
+	}
+
+	return 0;
+}
+
+/*
+ * Give up on a connection that has a pdu that timed out. iscsi_service()
+ * fails the connection the next time it is called for it, the shutdown
+ * makes sure that is soon if it is not the connection being serviced now.
+ */
+static void
+iscsi_timeout_drop_connection(struct iscsi_context *conn)
+{
+	if (conn->timed_out) {
+		return;
+	}
+	conn->timed_out = 1;
+	if (conn->fd != -1) {
+		shutdown(conn->fd, SHUT_RDWR);
+	}
+}
+
+static void
+iscsi_timeout_abort_cb(struct iscsi_context *iscsi, int status,
+		       void *command_data, void *private_data _U_)
+{
+	uint32_t response;
+
+	/* a task management request that fails or times out takes the
+	 * connection with it
+	 */
+	if (status != SCSI_STATUS_GOOD) {
+		return;
+	}
+
+	/* on success the command has been completed with the reply */
+	response = *(uint32_t *)command_data;
+	if (response != ISCSI_TMR_FUNC_COMPLETE
+	    && response != ISCSI_TMR_TASK_DOES_NOT_EXIST) {
+		iscsi_set_error(iscsi, "Target did not abort a SCSI command "
+				"that timed out, response %u", response);
+		iscsi_timeout_drop_connection(iscsi);
+	}
+}
+
+static void
+iscsi_timeout_expired(struct iscsi_context *session, struct iscsi_pdu *pdu)
+{
+	struct iscsi_context *conn = pdu->conn;
+
+	/* not sent yet, or stranded on a connection that is gone */
+	if (conn == NULL || conn->fd == -1) {
+		iscsi_set_error(conn != NULL ? conn : session,
+				"Command timed out before it was sent");
+		iscsi_terminate_pdu(session, pdu, SCSI_STATUS_TIMEOUT);
+		return;
+	}
+
+	pdu->flags |= ISCSI_PDU_TIMED_OUT;
+
+	/* a login, logout, text or nop that is not answered, or a command
+	 * that could not even be written, means the connection is stuck
+	 */
+	if (pdu->scsi_cbdata == NULL) {
+		iscsi_set_error(conn, "Timed out waiting for a reply to "
+				"opcode 0x%02x", pdu->hdr[0] & 0x3f);
+		iscsi_timeout_drop_connection(conn);
+		return;
+	}
+	if (iscsi_find_waitpdu(conn, pdu->itt) != pdu) {
+		iscsi_set_error(conn, "Timed out sending a SCSI command");
+		iscsi_timeout_drop_connection(conn);
+		return;
+	}
+
+	switch (session->timeout_action) {
+	case ISCSI_TIMEOUT_FAIL:
+		/* any reply that still comes is for an unknown itt and is
+		 * dropped
+		 */
+		iscsi_set_error(conn, "SCSI command timed out");
+		iscsi_terminate_pdu(conn, pdu, SCSI_STATUS_TIMEOUT);
+		break;
+	case ISCSI_TIMEOUT_ABORT_TASK:
+		/* iscsi_pdu_set_lun() only sets the second byte */
+		if (iscsi_task_mgmt_async(conn, pdu->hdr[9],
+					  ISCSI_TM_ABORT_TASK, pdu->itt,
+					  pdu->cmdsn, iscsi_timeout_abort_cb,
+					  NULL) != 0) {
+			iscsi_timeout_drop_connection(conn);
+		}
+		break;
+	case ISCSI_TIMEOUT_RECONNECT:
+		iscsi_set_error(conn, "SCSI command timed out");
+		iscsi_timeout_drop_connection(conn);
+		break;
+	}
+}
+
+/*
+ * Act on every timer of the session that has expired.
+ */
+void
+iscsi_timeout_run(struct iscsi_context *iscsi)
+{
+	struct iscsi_context *session = ISCSI_SESSION(iscsi);
+	struct iscsi_timer *timer;
+	uint64_t now;
+
+	if (session->timers == NULL || session->timers->count == 0) {
+		return;
+	}
+
+	now = iscsi_time_ms() / ISCSI_TIMER_TICK_MS;
+	while ((timer = iscsi_timer_expire_next(session->timers, now))
+	       != NULL) {
+		if (timer == &session->reconnect_timer) {
+			iscsi_reconnect_timer_expired(session);
+			continue;
+		}
+		iscsi_timeout_expired(session, iscsi_timer_pdu(timer));
+	}
+}
+
+static struct iscsi_pdu *
+iscsi_find_timed_out_pdu(struct iscsi_context *iscsi)
+{
+	struct iscsi_pdu *pdu;
+	uint32_t i;
+
+	for (pdu = iscsi->outqueue; pdu; pdu = pdu->next) {
+		if (pdu->flags & ISCSI_PDU_TIMED_OUT) {
+			return pdu;
+		}
+	}
+	for (i = 0; i < iscsi->waitpdu_size; i++) {
+		for (pdu = iscsi->waitpdu[i]; pdu; pdu = pdu->hash_next) {
+			if (pdu->flags & ISCSI_PDU_TIMED_OUT) {
+				return pdu;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * A connection that was given up on because of a timeout can not be
+ * recovered. Close it and fail the pdus that timed out, the others fail
+ * when their own time comes.
+ */
+void
+iscsi_timeout_connection_lost(struct iscsi_context *iscsi)
+{
+	struct iscsi_pdu *pdu;
+
+	if (iscsi->fd != -1) {
+		iscsi_disconnect(iscsi);
+	}
+	while ((pdu = iscsi_find_timed_out_pdu(iscsi)) != NULL) {
+		iscsi_terminate_pdu(iscsi, pdu, SCSI_STATUS_TIMEOUT);
+	}
+}
+
+int
+iscsi_set_timeout(struct iscsi_context *iscsi, int timeout)
+{
+	if (timeout < 0) {
+		iscsi_set_error(iscsi, "invalid timeout %d", timeout);
+		return -1;
+	}
+
+	ISCSI_SESSION(iscsi)->timeout = timeout;
+
+	return 0;
+}
+
+int
+iscsi_set_timeout_action(struct iscsi_context *iscsi,
+			 enum iscsi_timeout_action action)
+{
+	switch (action) {
+	case ISCSI_TIMEOUT_FAIL:
+	case ISCSI_TIMEOUT_ABORT_TASK:
+	case ISCSI_TIMEOUT_RECONNECT:
+		break;
+	default:
+		iscsi_set_error(iscsi, "invalid timeout action %d", action);
+		return -1;
+	}
+
+	ISCSI_SESSION(iscsi)->timeout_action = action;
+
+	return 0;
+}
+
+int
+iscsi_next_timeout_ms(struct iscsi_context *iscsi)
+{
+	struct iscsi_timer_wheel *wheel = ISCSI_SESSION(iscsi)->timers;
+	uint64_t when, now;
+
+	if (wheel == NULL || wheel->count == 0) {
+		return -1;
+	}
+
+	when = iscsi_timer_next_tick(wheel) * ISCSI_TIMER_TICK_MS;
+	now  = iscsi_time_ms();
+	if (when <= now) {
+		return 0;
+	}
+	if (when - now > INT_MAX) {
+		return INT_MAX;
+	}
+
+	return when - now;
+}
@@ -0,0 +1,630 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Servicing a connection through io_uring instead of read() and write().
+ *
+ * A single multishot recv stays armed on the socket and the kernel picks
+ * a buffer from a ring of provided buffers for every chunk it receives.
+ * The outqueue is copied into a few send buffers, which are sent with one
+ * chain of linked sends. The next chain is only submitted once the last
+ * one has completed, so the byte stream stays in order. A pdu is done with
+ * as soon as it is copied, exactly like after sendmsg().
+ *
+ * The application polls the fd of the ring instead of the socket. It is
+ * readable when there are completions to reap and writable when there is
+ * something to submit, and every iscsi_service() makes at most one
+ * io_uring_enter() call for all of it.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#include "iscsi.h"
+#include "iscsi-private.h"
+
+/* multishot recv and provided buffer rings came last, in linux 6.0 */
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_RECV_MULTISHOT)
+
+#define ISCSI_URING_ENTRIES		16
+#define ISCSI_URING_RX_BUFFERS		16
+#define ISCSI_URING_RX_BUFFER_SIZE	(64*1024)
+#define ISCSI_URING_TX_BUFFERS		4
+
+/* what a completion is for */
+#define ISCSI_URING_RECV		0
+#define ISCSI_URING_SEND		1
+
+struct iscsi_uring {
+	int fd;
+
+	void *rings;
+	size_t rings_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_pending;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	struct io_uring_cqe *cqes;
+	unsigned cq_mask;
+
+	/* the provided buffers the recv picks from */
+	struct io_uring_buf_ring *br;
+	unsigned short br_tail;
+	unsigned char *rx_bufs;
+	int recv_armed;
+
+	/* the send buffers and the chain they are in while it is sent */
+	unsigned char *tx_bufs;
+	int tx_buf_size;
+	int tx_len[ISCSI_URING_TX_BUFFERS];
+	int tx_inflight;
+	struct iovec tx_iov[ISCSI_TX_BATCH_IOV];
+
+	/* set while received data is parsed, the connection may be closed
+	 * under us and the ring must then be freed once we are done
+	 */
+	int busy;
+	int dead;
+};
+
+static int
+iscsi_uring_enter(struct iscsi_uring *r, unsigned to_submit,
+		  unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static struct io_uring_sqe *
+iscsi_uring_get_sqe(struct iscsi_uring *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, index;
+
+	tail = *r->sq_tail + r->sq_pending;
+	if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)
+	    >= r->sq_entries) {
+		return NULL;
+	}
+
+	index = tail & r->sq_mask;
+	sqe = &r->sqes[index];
+	bzero(sqe, sizeof(struct io_uring_sqe));
+	r->sq_array[index] = index;
+	r->sq_pending++;
+
+	return sqe;
+}
+
+/*
+ * Submit what has been queued, and wait for min_complete completions.
+ * What the kernel does not take now stays in the ring for the next time.
+ */
+static int
+iscsi_uring_submit(struct iscsi_uring *r, unsigned min_complete)
+{
+	unsigned tail;
+
+	tail = *r->sq_tail + r->sq_pending;
+	__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+	r->sq_pending = 0;
+
+	if (iscsi_uring_enter(r, tail - __atomic_load_n(r->sq_head,
+							 __ATOMIC_ACQUIRE),
+			      min_complete,
+			      min_complete ? IORING_ENTER_GETEVENTS : 0) < 0
+	    && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+iscsi_uring_unsubmitted(struct iscsi_uring *r)
+{
+	return r->sq_pending > 0
+		|| *r->sq_tail != __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static void
+iscsi_uring_provide_buffer(struct iscsi_uring *r, int bid)
+{
+	struct io_uring_buf *buf;
+
+	/* the first buffer shares its space with the tail of the ring,
+	 * so it is filled in field by field
+	 */
+	buf = &r->br->bufs[r->br_tail & (ISCSI_URING_RX_BUFFERS - 1)];
+	buf->addr = (unsigned long)&r->rx_bufs[bid * ISCSI_URING_RX_BUFFER_SIZE];
+	buf->len  = ISCSI_URING_RX_BUFFER_SIZE;
+	buf->bid  = bid;
+	r->br_tail++;
+	__atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+static int
+iscsi_uring_arm_recv(struct iscsi_uring *r, int fd)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = iscsi_uring_get_sqe(r);
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->opcode    = IORING_OP_RECV;
+	sqe->fd        = fd;
+	sqe->ioprio    = IORING_RECV_MULTISHOT;
+	sqe->flags     = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = ISCSI_URING_RECV;
+	r->recv_armed  = 1;
+
+	return 0;
+}
+
+static void
+iscsi_uring_free(struct iscsi_uring *r)
+{
+	if (r->fd != -1) {
+		close(r->fd);
+	}
+	if (r->sqes != NULL) {
+		munmap(r->sqes, r->sqes_size);
+	}
+	if (r->rings != NULL) {
+		munmap(r->rings, r->rings_size);
+	}
+	free(r->br);
+	free(r->rx_bufs);
+	free(r->tx_bufs);
+	free(r);
+}
+
+/*
+ * Wait for everything that is still in the kernel to complete, then free
+ * the ring. The socket must have been shut down so they all complete.
+ */
+static void
+iscsi_uring_drain(struct iscsi_uring *r)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head;
+
+	while (r->recv_armed || r->tx_inflight > 0) {
+		head = *r->cq_head;
+		if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			if (iscsi_uring_enter(r, 0, 1, IORING_ENTER_GETEVENTS)
+			    < 0 && errno != EINTR) {
+				break;
+			}
+			continue;
+		}
+		cqe = &r->cqes[head & r->cq_mask];
+		if (cqe->user_data == ISCSI_URING_RECV) {
+			if (!(cqe->flags & IORING_CQE_F_MORE)) {
+				r->recv_armed = 0;
+			}
+		} else {
+			r->tx_inflight--;
+		}
+		__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	}
+	iscsi_uring_free(r);
+}
+
+/*
+ * Set up a ring for the connection that has just been established.
+ * Returns -1 if io_uring can not be used here, the connection then stays
+ * on read() and write().
+ */
+int
+iscsi_uring_start(struct iscsi_context *iscsi)
+{
+	struct iscsi_uring *r;
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	struct io_uring_cqe *cqe;
+	unsigned char *ptr;
+	int i;
+
+	r = malloc(sizeof(struct iscsi_uring));
+	if (r == NULL) {
+		return -1;
+	}
+	bzero(r, sizeof(struct iscsi_uring));
+
+	bzero(&p, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, ISCSI_URING_ENTRIES, &p);
+	if (r->fd == -1) {
+		free(r);
+		return -1;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		goto failed;
+	}
+
+	r->rings_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	if (r->rings_size < p.cq_off.cqes
+	    + p.cq_entries * sizeof(struct io_uring_cqe)) {
+		r->rings_size = p.cq_off.cqes
+			+ p.cq_entries * sizeof(struct io_uring_cqe);
+	}
+	ptr = mmap(NULL, r->rings_size, PROT_READ|PROT_WRITE,
+		   MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED) {
+		goto failed;
+	}
+	r->rings = ptr;
+
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto failed;
+	}
+
+	r->sq_head    = (unsigned *)(ptr + p.sq_off.head);
+	r->sq_tail    = (unsigned *)(ptr + p.sq_off.tail);
+	r->sq_array   = (unsigned *)(ptr + p.sq_off.array);
+	r->sq_mask    = *(unsigned *)(ptr + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->cq_head    = (unsigned *)(ptr + p.cq_off.head);
+	r->cq_tail    = (unsigned *)(ptr + p.cq_off.tail);
+	r->cqes       = (struct io_uring_cqe *)(ptr + p.cq_off.cqes);
+	r->cq_mask    = *(unsigned *)(ptr + p.cq_off.ring_mask);
+
+	/* the buffer ring must be page aligned */
+	if (posix_memalign((void **)&r->br, sysconf(_SC_PAGESIZE),
+			   ISCSI_URING_RX_BUFFERS
+			   * sizeof(struct io_uring_buf)) != 0) {
+		r->br = NULL;
+		goto failed;
+	}
+	bzero(r->br, ISCSI_URING_RX_BUFFERS * sizeof(struct io_uring_buf));
+	r->rx_bufs = malloc(ISCSI_URING_RX_BUFFERS
+			    * ISCSI_URING_RX_BUFFER_SIZE);
+	if (r->rx_bufs == NULL) {
+		goto failed;
+	}
+
+	bzero(&reg, sizeof(reg));
+	reg.ring_addr    = (unsigned long)r->br;
+	reg.ring_entries = ISCSI_URING_RX_BUFFERS;
+	reg.bgid         = 0;
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+		    &reg, 1) != 0) {
+		goto failed;
+	}
+	for (i = 0; i < ISCSI_URING_RX_BUFFERS; i++) {
+		iscsi_uring_provide_buffer(r, i);
+	}
+
+	r->tx_buf_size = iscsi->tx_batch_bytes;
+	r->tx_bufs = malloc(ISCSI_URING_TX_BUFFERS * r->tx_buf_size);
+	if (r->tx_bufs == NULL) {
+		goto failed;
+	}
+
+	if (iscsi_uring_arm_recv(r, iscsi->fd) != 0
+	    || iscsi_uring_submit(r, 0) != 0) {
+		goto failed;
+	}
+
+	/* a kernel without multishot recv fails it straight away, and as
+	 * the target has nothing to say before we log in nothing is lost
+	 */
+	if (*r->cq_head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &r->cqes[*r->cq_head & r->cq_mask];
+		if (cqe->res == -EINVAL) {
+			goto failed;
+		}
+	}
+
+	iscsi->uring = r;
+
+	return 0;
+
+failed:
+	iscsi_uring_free(r);
+	return -1;
+}
+
+/*
+ * The connection is closed, which completes everything in the kernel.
+ */
+void
+iscsi_uring_stop(struct iscsi_context *iscsi, int fd)
+{
+	struct iscsi_uring *r = iscsi->uring;
+
+	iscsi->uring = NULL;
+	shutdown(fd, SHUT_RDWR);
+
+	if (r->busy) {
+		r->dead = 1;
+		return;
+	}
+	iscsi_uring_drain(r);
+}
+
+int
+iscsi_uring_get_fd(struct iscsi_context *iscsi)
+{
+	return iscsi->uring->fd;
+}
+
+int
+iscsi_uring_which_events(struct iscsi_context *iscsi)
+{
+	int events = POLLIN;
+
+	if (iscsi->outqueue != NULL && iscsi->uring->tx_inflight == 0) {
+		events |= POLLOUT;
+	}
+	return events;
+}
+
+/*
+ * Copy as much of the outqueue as fits into the send buffers and send
+ * them as one chain.
+ */
+static int
+iscsi_uring_send(struct iscsi_context *iscsi, struct iscsi_uring *r)
+{
+	struct io_uring_sqe *sqe, *last = NULL;
+	unsigned char *buf;
+	ssize_t bytes;
+	int i, j, niov;
+
+	for (i = 0; i < ISCSI_URING_TX_BUFFERS && iscsi->outqueue != NULL;
+	     i++) {
+		buf = &r->tx_bufs[i * r->tx_buf_size];
+		r->tx_len[i] = 0;
+		while (iscsi->outqueue != NULL
+		       && r->tx_len[i] < r->tx_buf_size) {
+			niov = iscsi_outqueue_gather(iscsi, r->tx_iov,
+					ISCSI_TX_BATCH_IOV,
+					r->tx_buf_size - r->tx_len[i], &bytes);
+			if (niov < 0) {
+				return -1;
+			}
+			for (j = 0; j < niov; j++) {
+				memcpy(&buf[r->tx_len[i]], r->tx_iov[j].iov_base,
+				       r->tx_iov[j].iov_len);
+				r->tx_len[i] += r->tx_iov[j].iov_len;
+			}
+			iscsi_outqueue_written(iscsi, bytes);
+		}
+
+		sqe = iscsi_uring_get_sqe(r);
+		if (sqe == NULL) {
+			iscsi_set_error(iscsi, "io_uring submission queue "
+					"is full");
+			return -1;
+		}
+		sqe->opcode    = IORING_OP_SEND;
+		sqe->fd        = iscsi->fd;
+		sqe->addr      = (unsigned long)buf;
+		sqe->len       = r->tx_len[i];
+		/* the sends of a chain are in order and each is completed
+		 * before the next, or the rest of the chain fails
+		 */
+		sqe->msg_flags = MSG_NOSIGNAL|MSG_WAITALL;
+		sqe->user_data = ISCSI_URING_SEND | (i << 1);
+		if (last != NULL) {
+			last->flags |= IOSQE_IO_LINK;
+		}
+		last = sqe;
+		r->tx_inflight++;
+	}
+	iscsi->tx_syscalls++;
+
+	return 0;
+}
+
+static int
+iscsi_uring_reap(struct iscsi_context *iscsi, struct iscsi_uring *r)
+{
+	struct io_uring_cqe *cqe;
+	uint64_t user_data;
+	unsigned head, flags;
+	int res, bid, ret;
+
+	for (;;) {
+		head = *r->cq_head;
+		if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			return 0;
+		}
+		cqe = &r->cqes[head & r->cq_mask];
+		user_data = cqe->user_data;
+		res       = cqe->res;
+		flags     = cqe->flags;
+		__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+		if ((user_data & 1) == ISCSI_URING_SEND) {
+			r->tx_inflight--;
+			if (res < 0) {
+				iscsi_set_error(iscsi, "Error when writing to "
+						"socket :%d", -res);
+				return -1;
+			}
+			if (res != r->tx_len[user_data >> 1]) {
+				iscsi_set_error(iscsi, "short write to socket "
+						"%d of %d bytes", res,
+						r->tx_len[user_data >> 1]);
+				return -1;
+			}
+			continue;
+		}
+
+		if (!(flags & IORING_CQE_F_MORE)) {
+			r->recv_armed = 0;
+		}
+		if (res == -ENOBUFS) {
+			/* we were too slow to give the buffers back, the recv
+			 * is armed again once they are
+			 */
+			continue;
+		}
+		if (res < 0) {
+			iscsi_set_error(iscsi, "read from socket failed, "
+					"errno:%d", -res);
+			return -1;
+		}
+		if (res == 0) {
+			iscsi_set_error(iscsi, "connection closed by the "
+					"target");
+			return -1;
+		}
+
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		r->busy = 1;
+		ret = iscsi_process_received(iscsi,
+			&r->rx_bufs[bid * ISCSI_URING_RX_BUFFER_SIZE], res);
+		r->busy = 0;
+		if (r->dead) {
+			/* the connection was closed by one of the callbacks */
+			iscsi_uring_drain(r);
+			return ret;
+		}
+		iscsi_uring_provide_buffer(r, bid);
+		if (ret != 0) {
+			return -1;
+		}
+	}
+}
+
+int
+iscsi_set_io_uring(struct iscsi_context *iscsi, int enable)
+{
+	iscsi->want_uring = enable;
+	return 0;
+}
+
+int
+iscsi_get_io_uring(struct iscsi_context *iscsi)
+{
+	return iscsi->uring != NULL;
+}
+
+int
+iscsi_uring_service(struct iscsi_context *iscsi)
+{
+	struct iscsi_uring *r = iscsi->uring;
+
+	for (;;) {
+		if (iscsi_uring_reap(iscsi, r) != 0) {
+			return -1;
+		}
+		if (iscsi->uring != r) {
+			return 0;
+		}
+
+		if (!r->recv_armed
+		    && iscsi_uring_arm_recv(r, iscsi->fd) != 0) {
+			iscsi_set_error(iscsi, "io_uring submission queue "
+					"is full");
+			return -1;
+		}
+		if (iscsi->outqueue != NULL && r->tx_inflight == 0) {
+			if (iscsi_uring_send(iscsi, r) != 0) {
+				return -1;
+			}
+		}
+		if (!iscsi_uring_unsubmitted(r)) {
+			return 0;
+		}
+		if (iscsi_uring_submit(r, 0) != 0) {
+			iscsi_set_error(iscsi, "io_uring_enter failed, "
+					"errno:%d", errno);
+			return -1;
+		}
+		/* sends to a socket with room complete while they are
+		 * submitted, reap them now rather than after another wakeup
+		 */
+	}
+}
+
+#else /* HAVE_LINUX_IO_URING_H */
+
+int
+iscsi_set_io_uring(struct iscsi_context *iscsi, int enable)
+{
+	if (enable) {
+		iscsi_set_error(iscsi, "libiscsi was built without io_uring");
+		return -1;
+	}
+	return 0;
+}
+
+int
+iscsi_get_io_uring(struct iscsi_context *iscsi _U_)
+{
+	return 0;
+}
+
+int
+iscsi_uring_start(struct iscsi_context *iscsi _U_)
+{
+	return -1;
+}
+
+void
+iscsi_uring_stop(struct iscsi_context *iscsi _U_, int fd _U_)
+{
+}
+
+int
+iscsi_uring_get_fd(struct iscsi_context *iscsi _U_)
+{
+	return -1;
+}
+
+int
+iscsi_uring_which_events(struct iscsi_context *iscsi _U_)
+{
+	return 0;
+}
+
+int
+iscsi_uring_service(struct iscsi_context *iscsi _U_)
+{
+	return -1;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
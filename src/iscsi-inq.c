@@ -32,6 +32,21 @@ void inquiry_block_device_characteristics(struct scsi_inquiry_block_device_chara
 	printf("Medium Rotation Rate:%dRPM\n", inq->medium_rotation_rate);	
 }
 
+void inquiry_block_limits(struct scsi_inquiry_block_limits *inq)
+{
+	printf("Maximum Compare And Write Length:%d\n", inq->max_compare_and_write_length);
+	printf("Optimal Transfer Length Granularity:%d\n", inq->optimal_transfer_length_granularity);
+	printf("Maximum Transfer Length:%u\n", inq->max_transfer_length);
+	printf("Optimal Transfer Length:%u\n", inq->optimal_transfer_length);
+	printf("Maximum Unmap LBA Count:%u\n", inq->max_unmap_lba_count);
+	printf("Maximum Unmap Block Descriptor Count:%u\n", inq->max_unmap_block_descriptor_count);
+	printf("Optimal Unmap Granularity:%u\n", inq->optimal_unmap_granularity);
+	if (inq->ugavalid) {
+		printf("Unmap Granularity Alignment:%u\n", inq->unmap_granularity_alignment);
+	}
+	printf("Maximum Write Same Length:%llu\n", (unsigned long long)inq->max_write_same_length);
+}
+
 void inquiry_device_identification(struct scsi_inquiry_device_identification *inq)
 {
 	struct scsi_inquiry_device_designator *dev;
@@ -139,6 +154,9 @@ void do_inquiry(struct iscsi_context *iscsi, int lun, int evpd, int pc)
 		case SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION:
 			inquiry_device_identification(inq);
 			break;
+		case SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS:
+			inquiry_block_limits(inq);
+			break;
 		case SCSI_INQUIRY_PAGECODE_BLOCK_DEVICE_CHARACTERISTICS:
 			inquiry_block_device_characteristics(inq);
 			break;
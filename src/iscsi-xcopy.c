@@ -0,0 +1,399 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <popt.h>
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+/* size of each read/write when the copy goes through this host */
+#define HOST_COPY_SIZE (1024*1024)
+
+char *initiator = "iqn.2010-11.ronnie:iscsi-xcopy";
+
+struct xcopy_lun {
+	struct iscsi_context *iscsi;
+	struct iscsi_url *url;
+	uint64_t num_blocks;
+	int block_size;
+	struct scsi_task *id_task;
+	struct scsi_inquiry_device_designator *designator;
+};
+
+void open_lun(const char *url, struct xcopy_lun *xl)
+{
+	struct scsi_task *task;
+
+	xl->iscsi = iscsi_create_context(initiator);
+	if (xl->iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		exit(10);
+	}
+
+	xl->url = iscsi_parse_full_url(xl->iscsi, url);
+	if (xl->url == NULL) {
+		fprintf(stderr, "Failed to parse URL : %s %s\n", url, iscsi_get_error(xl->iscsi));
+		exit(10);
+	}
+
+	iscsi_set_targetname(xl->iscsi, xl->url->target);
+	iscsi_set_session_type(xl->iscsi, ISCSI_SESSION_NORMAL);
+	iscsi_set_header_digest(xl->iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
+
+	if (xl->url->user != NULL) {
+		if (iscsi_set_initiator_username_pwd(xl->iscsi, xl->url->user, xl->url->passwd) != 0) {
+			fprintf(stderr, "Failed to set initiator username and password\n");
+			exit(10);
+		}
+	}
+
+	if (iscsi_full_connect_sync(xl->iscsi, xl->url->portal, xl->url->lun) != 0) {
+		fprintf(stderr, "Failed to log in to target %s\n", iscsi_get_error(xl->iscsi));
+		exit(10);
+	}
+
+	task = iscsi_readcapacity16_sync(xl->iscsi, xl->url->lun);
+	if (task != NULL && task->status == SCSI_STATUS_GOOD) {
+		struct scsi_readcapacity16 *rc16;
+
+		rc16 = scsi_datain_unmarshall(task);
+		if (rc16 == NULL) {
+			fprintf(stderr, "failed to unmarshall readcapacity16 data\n");
+			exit(10);
+		}
+		xl->num_blocks = rc16->returned_lba + 1;
+		xl->block_size = rc16->block_length;
+	} else {
+		struct scsi_readcapacity10 *rc10;
+
+		if (task != NULL) {
+			scsi_free_scsi_task(task);
+		}
+		task = iscsi_readcapacity10_sync(xl->iscsi, xl->url->lun, 0, 0);
+		if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+			fprintf(stderr, "failed to send readcapacity command : %s\n", iscsi_get_error(xl->iscsi));
+			exit(10);
+		}
+		rc10 = scsi_datain_unmarshall(task);
+		if (rc10 == NULL) {
+			fprintf(stderr, "failed to unmarshall readcapacity10 data\n");
+			exit(10);
+		}
+		xl->num_blocks = (uint64_t)rc10->lba + 1;
+		xl->block_size = rc10->block_size;
+	}
+	scsi_free_scsi_task(task);
+}
+
+void close_lun(struct xcopy_lun *xl)
+{
+	if (xl->id_task != NULL) {
+		scsi_free_scsi_task(xl->id_task);
+	}
+	iscsi_destroy_url(xl->url);
+	iscsi_logout_sync(xl->iscsi);
+	iscsi_destroy_context(xl->iscsi);
+}
+
+/*
+ * Find a designator for the lun that fits in a copy target descriptor,
+ * preferring NAA.
+ */
+int find_designator(struct xcopy_lun *xl)
+{
+	struct scsi_inquiry_device_identification *inq;
+	struct scsi_inquiry_device_designator *dev;
+	int full_size;
+
+	xl->id_task = iscsi_inquiry_sync(xl->iscsi, xl->url->lun, 1, SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION, 255);
+	if (xl->id_task == NULL || xl->id_task->status != SCSI_STATUS_GOOD) {
+		return -1;
+	}
+	full_size = scsi_datain_getfullsize(xl->id_task);
+	if (full_size > xl->id_task->datain.size) {
+		scsi_free_scsi_task(xl->id_task);
+		xl->id_task = iscsi_inquiry_sync(xl->iscsi, xl->url->lun, 1, SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION, full_size);
+		if (xl->id_task == NULL || xl->id_task->status != SCSI_STATUS_GOOD) {
+			return -1;
+		}
+	}
+
+	inq = scsi_datain_unmarshall(xl->id_task);
+	if (inq == NULL) {
+		return -1;
+	}
+
+	for (dev = inq->designators; dev; dev = dev->next) {
+		if (dev->association != SCSI_ASSOCIATION_LOGICAL_UNIT) {
+			continue;
+		}
+		if (dev->designator_length > 16) {
+			continue;
+		}
+		switch (dev->designator_type) {
+		case SCSI_DESIGNATOR_TYPE_NAA:
+			xl->designator = dev;
+			return 0;
+		case SCSI_DESIGNATOR_TYPE_EUI_64:
+		case SCSI_DESIGNATOR_TYPE_T10_VENDORT_ID:
+			if (xl->designator == NULL) {
+				xl->designator = dev;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	return xl->designator != NULL ? 0 : -1;
+}
+
+/*
+ * Ask the copy manager what it supports. Returns the maximum number of
+ * segments per command and in max_blocks the maximum blocks per segment,
+ * or 0 if the copy manager can not do a block to block copy for us.
+ */
+int xcopy_limits(struct xcopy_lun *dst, int *max_blocks)
+{
+	struct scsi_task *task;
+	struct scsi_copy_results_op_params *op;
+	int i, has_segment = 0, has_target = 0, max_segments;
+
+	task = iscsi_receive_copy_results_sync(dst->iscsi, dst->url->lun, SCSI_COPY_RESULTS_OPERATING_PARAMETERS, 0, 1024);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		if (task != NULL) {
+			scsi_free_scsi_task(task);
+		}
+		return 0;
+	}
+
+	op = scsi_datain_unmarshall(task);
+	if (op == NULL) {
+		scsi_free_scsi_task(task);
+		return 0;
+	}
+
+	for (i = 0; i < op->num_desc_type_codes; i++) {
+		if (op->desc_type_codes[i] == SCSI_COPY_SEGMENT_BLOCK_TO_BLOCK) {
+			has_segment = 1;
+		}
+		if (op->desc_type_codes[i] == SCSI_COPY_TARGET_IDENTIFICATION) {
+			has_target = 1;
+		}
+	}
+	if (!has_segment || !has_target || op->max_target_desc_count < 2) {
+		scsi_free_scsi_task(task);
+		return 0;
+	}
+
+	*max_blocks = 0xffff;
+	if (op->max_segment_length != 0 && op->max_segment_length / dst->block_size < (uint32_t)*max_blocks) {
+		*max_blocks = op->max_segment_length / dst->block_size;
+	}
+
+	max_segments = op->max_segment_desc_count;
+	if (op->max_desc_list_length != 0 && max_segments > (int)(op->max_desc_list_length - 2 * 32) / 28) {
+		max_segments = (op->max_desc_list_length - 2 * 32) / 28;
+	}
+	scsi_free_scsi_task(task);
+
+	if (*max_blocks < 1 || max_segments < 1) {
+		return 0;
+	}
+	return max_segments;
+}
+
+/*
+ * Copy as much as possible with EXTENDED COPY sent to the destination lun.
+ * Returns the number of blocks copied.
+ */
+uint64_t xcopy(struct xcopy_lun *src, struct xcopy_lun *dst, uint64_t src_lba, uint64_t dst_lba, uint64_t num_blocks)
+{
+	struct scsi_copy_target targets[2];
+	struct scsi_copy_segment *segments;
+	struct scsi_task *task;
+	uint64_t done = 0;
+	int max_segments, max_blocks, n;
+
+	if (find_designator(src) != 0 || find_designator(dst) != 0) {
+		return 0;
+	}
+	max_segments = xcopy_limits(dst, &max_blocks);
+	if (max_segments == 0) {
+		return 0;
+	}
+
+	segments = malloc(max_segments * sizeof(struct scsi_copy_segment));
+	if (segments == NULL) {
+		fprintf(stderr, "Failed to allocate segment descriptors\n");
+		exit(10);
+	}
+
+	targets[0].designator   = src->designator;
+	targets[0].block_length = src->block_size;
+	targets[1].designator   = dst->designator;
+	targets[1].block_length = dst->block_size;
+
+	while (done < num_blocks) {
+		for (n = 0; n < max_segments && done < num_blocks; n++) {
+			segments[n].src_index  = 0;
+			segments[n].dst_index  = 1;
+			segments[n].num_blocks = max_blocks;
+			if (num_blocks - done < (uint64_t)max_blocks) {
+				segments[n].num_blocks = num_blocks - done;
+			}
+			segments[n].src_lba    = src_lba + done;
+			segments[n].dst_lba    = dst_lba + done;
+			done += segments[n].num_blocks;
+		}
+
+		task = iscsi_extended_copy_sync(dst->iscsi, dst->url->lun, 0, targets, 2, segments, n);
+		if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+			fprintf(stderr, "EXTENDED COPY failed : %s\n", iscsi_get_error(dst->iscsi));
+			if (task != NULL) {
+				scsi_free_scsi_task(task);
+			}
+			/* the segments of the failed command are not done */
+			while (n-- > 0) {
+				done -= segments[n].num_blocks;
+			}
+			break;
+		}
+		scsi_free_scsi_task(task);
+	}
+
+	free(segments);
+	return done;
+}
+
+void host_copy(struct xcopy_lun *src, struct xcopy_lun *dst, uint64_t src_lba, uint64_t dst_lba, uint64_t num_blocks)
+{
+	struct scsi_task *rtask, *wtask;
+	uint64_t chunk = HOST_COPY_SIZE / src->block_size;
+	int len;
+
+	while (num_blocks > 0) {
+		if (chunk > num_blocks) {
+			chunk = num_blocks;
+		}
+		len = chunk * src->block_size;
+
+		rtask = iscsi_read16_sync(src->iscsi, src->url->lun, src_lba, len, src->block_size);
+		if (rtask == NULL || rtask->status != SCSI_STATUS_GOOD || rtask->datain.size != len) {
+			fprintf(stderr, "READ16 of lba %llu failed : %s\n", (unsigned long long)src_lba, iscsi_get_error(src->iscsi));
+			exit(10);
+		}
+		wtask = iscsi_write16_sync(dst->iscsi, dst->url->lun, rtask->datain.data, len, dst_lba, 0, 0, dst->block_size);
+		if (wtask == NULL || wtask->status != SCSI_STATUS_GOOD) {
+			fprintf(stderr, "WRITE16 of lba %llu failed : %s\n", (unsigned long long)dst_lba, iscsi_get_error(dst->iscsi));
+			exit(10);
+		}
+		scsi_free_scsi_task(rtask);
+		scsi_free_scsi_task(wtask);
+
+		src_lba    += chunk;
+		dst_lba    += chunk;
+		num_blocks -= chunk;
+	}
+}
+
+int main(int argc, const char *argv[])
+{
+	poptContext pc;
+	const char **extra_argv;
+	const char *src_url = NULL, *dst_url = NULL;
+	struct xcopy_lun src, dst;
+	char *src_lba_str = NULL, *dst_lba_str = NULL, *blocks_str = NULL;
+	uint64_t src_lba = 0, dst_lba = 0, num_blocks, done = 0;
+	int no_xcopy = 0;
+	int res;
+
+	struct poptOption popt_options[] = {
+		POPT_AUTOHELP
+		{ "initiator-name", 'i', POPT_ARG_STRING, &initiator, 0, "Initiatorname to use", "iqn-name" },
+		{ "src-lba", 's', POPT_ARG_STRING, &src_lba_str, 0, "First block to copy from", "lba" },
+		{ "dst-lba", 'd', POPT_ARG_STRING, &dst_lba_str, 0, "First block to copy to", "lba" },
+		{ "blocks", 'b', POPT_ARG_STRING, &blocks_str, 0, "Number of blocks to copy, default is the rest of the source lun", "count" },
+		{ "no-xcopy", 'n', POPT_ARG_NONE, &no_xcopy, 0, "Copy through this host instead of using EXTENDED COPY", NULL },
+		POPT_TABLEEND
+	};
+
+	pc = poptGetContext(argv[0], argc, argv, popt_options, POPT_CONTEXT_POSIXMEHARDER);
+	if ((res = poptGetNextOpt(pc)) < -1) {
+		fprintf(stderr, "Failed to parse option : %s %s\n",
+			poptBadOption(pc, 0), poptStrerror(res));
+		exit(10);
+	}
+	extra_argv = poptGetArgs(pc);
+	if (extra_argv && extra_argv[0] && extra_argv[1]) {
+		src_url = extra_argv[0];
+		dst_url = extra_argv[1];
+	}
+	poptFreeContext(pc);
+
+	if (src_url == NULL || dst_url == NULL) {
+		fprintf(stderr, "You must specify the source and destination URLs\n");
+		fprintf(stderr, "   iscsi://[<username>[%%<password>]@]<host>[:<port>]/<target-iqn>/<lun>\n");
+		exit(10);
+	}
+	if (src_lba_str != NULL) {
+		src_lba = strtoull(src_lba_str, NULL, 0);
+	}
+	if (dst_lba_str != NULL) {
+		dst_lba = strtoull(dst_lba_str, NULL, 0);
+	}
+
+	bzero(&src, sizeof(src));
+	bzero(&dst, sizeof(dst));
+	open_lun(src_url, &src);
+	open_lun(dst_url, &dst);
+
+	if (src.block_size != dst.block_size) {
+		fprintf(stderr, "Source blocksize %d differs from destination blocksize %d\n", src.block_size, dst.block_size);
+		exit(10);
+	}
+	if (src_lba >= src.num_blocks) {
+		fprintf(stderr, "Source lba is beyond the end of the lun\n");
+		exit(10);
+	}
+	num_blocks = src.num_blocks - src_lba;
+	if (blocks_str != NULL) {
+		num_blocks = strtoull(blocks_str, NULL, 0);
+	}
+	if (src_lba + num_blocks > src.num_blocks || dst_lba + num_blocks > dst.num_blocks) {
+		fprintf(stderr, "Copy of %llu blocks does not fit in the luns\n", (unsigned long long)num_blocks);
+		exit(10);
+	}
+
+	if (!no_xcopy) {
+		done = xcopy(&src, &dst, src_lba, dst_lba, num_blocks);
+	}
+	if (done < num_blocks) {
+		host_copy(&src, &dst, src_lba + done, dst_lba + done, num_blocks - done);
+	}
+
+	printf("Copied %llu blocks, %llu with EXTENDED COPY and %llu through this host\n",
+	       (unsigned long long)num_blocks, (unsigned long long)done,
+	       (unsigned long long)(num_blocks - done));
+
+	close_lun(&src);
+	close_lun(&dst);
+	return 0;
+}